@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2023, jpn
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef a41c9611_85f7_4a29_9ab5_3ce460a332e6
+#define a41c9611_85f7_4a29_9ab5_3ce460a332e6
+
+/*
+ * checksum.h
+ * CRC32 and Adler32 checksums (the implementation is selected at runtime
+ * according to the cpu features).
+ *
+ * Usage:
+ * crc32 = CHECKSUM_CRC32INIT;
+ * do {
+ *     crc32 = checksum_crc32(crc32, data, size);
+ * } while (...more data);
+ * CHECKSUM_CRC32FINALIZE(crc32);
+ *
+ * adler = CHECKSUM_ADLERINIT;
+ * do {
+ *     adler = checksum_adler32(adler, data, size);
+ * } while (...more data);
+ */
+
+#include <ctoolbox/ctoolbox.h>
+#include <jdeflateconfig.h>
+
+
+#define CHECKSUM_CRC32INIT 0xffffffffUL
+#define CHECKSUM_ADLERINIT 1UL
+
+#define CHECKSUM_CRC32FINALIZE(CRC) ((CRC) = (CRC) ^ 0xffffffffUL)
+
+
+/*
+ * Updates a running crc32 value (not finalized). */
+uint32 checksum_crc32(uint32 crc, const uint8* data, uintxx size);
+
+/*
+ * Updates a running adler32 value. */
+uint32 checksum_adler32(uint32 adler, const uint8* data, uintxx size);
+
+/*
+ * Returns the (finalized) crc32 of the concatenation of two blocks given the
+ * finalized crc32 of each block and the size of the second one. */
+uint32 checksum_crc32combine(uint32 crc1, uint32 crc2, uint64 size2);
+
+/*
+ * Returns the adler32 of the concatenation of two blocks given the adler32
+ * of each block and the size of the second one. */
+uint32 checksum_adler32combine(uint32 adler1, uint32 adler2, uint64 size2);
+
+
+#endif
@@ -60,6 +60,22 @@ typedef enum {
 } eDEFLTFlush;
 
 
+/* Strategies (see deflator_setstrategy) */
+typedef enum {
+	DEFLT_SDEFAULT = 0,
+	DEFLT_SHUFFMAN = 1,
+	DEFLT_SRLE     = 2,
+	DEFLT_SFAST    = 3
+} eDEFLTStrategy;
+
+
+/* Match finders (see deflator_setmatchfinder) */
+typedef enum {
+	DEFLT_MFDEFAULT = 0,
+	DEFLT_MFTREE    = 1
+} eDEFLTMatchFinder;
+
+
 /* Error codes */
 typedef enum {
 	DEFLT_EBADSTATE = 1,
@@ -92,9 +108,33 @@ typedef struct TDeflator TDeflator;
 
 
 /*
- * */
+ * Creates a new deflator, the level goes from 0 to 12 (levels 10 to 12 use
+ * an optimal parser, they are much slower). */
 TDeflator* deflator_create(uintxx level, TAllocator* allocator);
 
+/*
+ * Creates a new deflator with a smaller window or hash table to save memory.
+ * The window size is 1 << wbits (9 to 15) and the hash table has 1 << hbits
+ * entries (8 to 16), zero means the default (15 and wbits + 1). The buffers
+ * of the deflator shrink with the window. Returns NULL if a parameter is not
+ * valid. */
+TDeflator* deflator_createex(uintxx level, uintxx wbits, uintxx hbits,
+	TAllocator* allocator);
+
+/*
+ * Returns the size of the memory block needed to create a deflator in place
+ * (zero if a parameter is not valid, see deflator_createex). */
+uintxx deflator_memsize(uintxx level, uintxx wbits, uintxx hbits);
+
+/*
+ * Creates a deflator inside the given block (it doesn't need to be aligned,
+ * every buffer is placed at a cache line boundary), nothing else is
+ * allocated. Returns NULL if the block is smaller than deflator_memsize.
+ * deflator_destroy is optional, the block belongs to the caller. A reset to a
+ * level that needs more memory fails with DEFLT_EOOM. */
+TDeflator* deflator_createinplace(uintxx level, uintxx wbits, uintxx hbits,
+	void* memory, uintxx size);
+
 /*
  * */
 void deflator_destroy(TDeflator*);
@@ -123,6 +163,114 @@ eDEFLTResult deflator_deflate(TDeflator*, eDEFLTFlush flush);
  * */
 void deflator_setdctnr(TDeflator*, uint8* dict, uintxx size);
 
+
+/* Prepared dictionary */
+typedef struct TDEFLTDctnr TDEFLTDctnr;
+
+/*
+ * Prepares a dictionary for deflators with the same level, wbits and hbits
+ * (see deflator_createex), the dictionary is hashed once and setting it is a
+ * copy. It can be shared by any number of deflators (it is read only).
+ * Returns NULL on error. */
+TDEFLTDctnr* deflator_dctnrcreate(uintxx level, uintxx wbits, uintxx hbits,
+	const uint8* dict, uintxx size, TAllocator* allocator);
+
+/*
+ * */
+void deflator_dctnrdestroy(TDEFLTDctnr*);
+
+/*
+ * Same as deflator_setdctnr with a prepared dictionary, it must be called
+ * before the first deflate call. The deflator parameters must match the ones
+ * used to create the dictionary. After a reset that follows a stream of up
+ * to 8KB (levels 1 to 9 without DEFLT_SFAST) the dictionary is still in
+ * place and setting it again only compares its bytes. */
+void deflator_setpdctnr(TDeflator*, const TDEFLTDctnr*);
+
+
+/* Custom Huffman codes */
+typedef struct TDEFLTCodes TDEFLTCodes;
+
+/*
+ * Builds a set of Huffman codes from the symbols of a compressed sample, the
+ * symbols that are not in the sample get long codes. Returns NULL on
+ * error. */
+TDEFLTCodes* deflator_codescreate(uintxx level, const uint8* sample,
+	uintxx size, TAllocator* allocator);
+
+/*
+ * */
+void deflator_codesdestroy(TDEFLTCodes*);
+
+/*
+ * Sets the codes used by the deflator instead of the static codes (small
+ * blocks and level 1), a block uses them if they take less bits (their trees
+ * are encoded once). A block that takes about as many bits per symbol as
+ * the sample doesn't build its own codes. The codes are kept after a reset,
+ * NULL removes them. It must be called before the first deflate call, the
+ * codes can be shared by any number of deflators. */
+void deflator_setcodes(TDeflator*, const TDEFLTCodes* codes);
+
+/*
+ * Sets the parser used with any level but 0 (eDEFLTStrategy). DEFLT_SHUFFMAN
+ * only emits literals, DEFLT_SRLE only looks for matches at distance one and
+ * DEFLT_SFAST is a greedy parser that probes a single hash entry of 4 bytes
+ * (there are no chains). The level still sets the memory and dynamic codes
+ * are also tried at level 1. DEFLT_SHUFFMAN and DEFLT_SRLE only count the
+ * symbols and write them from the window, their blocks are not split (they
+ * end when the lz buffer of the level could not hold them). The strategy is
+ * kept after a reset, it must be set before the first deflate call. */
+void deflator_setstrategy(TDeflator*, uintxx strategy);
+
+/*
+ * Sets the match finder of levels 8 and 9 (eDEFLTMatchFinder). DEFLT_MFTREE
+ * replaces the hash chains with the binary tree of levels 10 to 12, it's
+ * faster and a bit better on binary data but slower on text and on runs of
+ * the same bytes. The tree is allocated here (it's not counted by
+ * deflator_memsize) and prepared dictionaries only work with the default
+ * match finder. It's kept after a reset, it must be set before the first
+ * deflate call. */
+void deflator_setmatchfinder(TDeflator*, uintxx finder);
+
+
+/* Statistics */
+struct TDEFLTStats {
+	/* blocks by type: stored, static, dynamic and custom codes */
+	uint64 blocks[4];
+
+	/* lz tokens and bytes covered by matches */
+	uint64 literals;
+	uint64 matches;
+	uint64 matchbytes;
+
+	/* positions visited by the match finder (hash chain or tree) */
+	uint64 chainsteps;
+
+	/* dynamic blocks that kept the codes of the last block */
+	uint64 reusedcodes;
+};
+
+typedef struct TDEFLTStats TDEFLTStats;
+
+/*
+ * Copies the statistics since the last reset. The counters are only compiled
+ * if the library was built with JDEFLATE_STATS, otherwise the struct is
+ * zeroed and the function returns 0. */
+uintxx deflator_getstats(TDeflator*, TDEFLTStats* stats);
+
+/*
+ * Returns an upper bound of the compressed size of size bytes (state can be
+ * NULL). */
+uintxx deflator_bound(TDeflator*, uintxx size);
+
+/*
+ * Compresses the whole source buffer in a single call, the state is reset
+ * first. Returns DEFLT_OK on success (deflator_tgtend gives the compressed
+ * size) or DEFLT_TGTEXHSTD if the target buffer is too small. If tsize is at
+ * least deflator_bound(ssize) the output never runs out. */
+eDEFLTResult deflator_compressbuffer(TDeflator*, const uint8* source,
+	uintxx ssize, uint8* target, uintxx tsize);
+
 /*
  * */
 void deflator_reset(TDeflator*, uintxx level);
@@ -48,7 +48,8 @@ typedef enum {
 	INFLT_OK        = 0,
 	INFLT_SRCEXHSTD = 1,
 	INFLT_TGTEXHSTD = 2,
-	INFLT_ERROR     = 3
+	INFLT_ERROR     = 3,
+	INFLT_BLOCKEND  = 4
 } eINFLTResult;
 
 
@@ -92,6 +93,22 @@ typedef struct TInflator TInflator;
  * */
 TInflator* inflator_create(TAllocator* allocator);
 
+/*
+ * Creates a new inflator with a window of 1 << wbits bytes (9 to 15, zero
+ * for 15). The stream must not refer to data further back than the window
+ * (INFLT_EFAROFFSET). Returns NULL if wbits is not valid. */
+TInflator* inflator_createex(uintxx wbits, TAllocator* allocator);
+
+/*
+ * Returns the size of the memory block needed to create an inflator in place
+ * (zero if wbits is not valid). */
+uintxx inflator_memsize(uintxx wbits);
+
+/*
+ * Creates an inflator inside the given block (see deflator_createinplace).
+ * Returns NULL if the block is smaller than inflator_memsize. */
+TInflator* inflator_createinplace(uintxx wbits, void* memory, uintxx size);
+
 /*
  * */
 void inflator_destroy(TInflator*);
@@ -120,6 +137,76 @@ eINFLTResult inflator_inflate(TInflator*, uintxx final);
  * */
 void inflator_setdctnr(TInflator*, uint8* dict, uintxx size);
 
+/*
+ * Declares that the target buffer will hold the whole output, it must be
+ * called after a reset and before inflator_setdctnr or the first call to
+ * inflator_inflate. The input can still be given in pieces but the target is
+ * set only once, back references are resolved directly in it and the window
+ * buffer is never reserved or updated. A stream that doesn't fit the target
+ * can't be resumed (INFLT_TGTEXHSTD), so the output size must be known
+ * (e.g. the gzip ISIZE). */
+void inflator_setnowindow(TInflator*);
+
+/*
+ * Same as inflator_inflate but it also returns INFLT_BLOCKEND each time a
+ * block ends (unless it's the last one), the next call decodes the next
+ * block. */
+eINFLTResult inflator_inflateblock(TInflator*, uintxx final);
+
+/*
+ * Returns the number of bits read from the input but not consumed yet and
+ * stores them in value (at the end of a block it's never more than 24).
+ * Together with the input position and the last 32KB of output this allows
+ * to resume the decoding at a block boundary (see inflator_setbits). */
+uintxx inflator_getbits(TInflator*, uintxx* value);
+
+/*
+ * Primes the decoder with count bits (up to 24) taken from value, it must be
+ * called after a reset (and optionally inflator_setdctnr) and before the
+ * first call to inflator_inflate, the next input must start at the byte that
+ * follows them. */
+void inflator_setbits(TInflator*, uintxx count, uintxx value);
+
+/*
+ * Returns true if the decoder stopped between two blocks, at a byte boundary
+ * and with all the input consumed (the next input must start with a block
+ * header). */
+bool inflator_atblockend(TInflator*);
+
+
+/* Statistics */
+struct TINFLTStats {
+	/* blocks by type: stored, static and dynamic */
+	uint64 blocks[3];
+
+	/* output of the stored blocks, and of the compressed blocks by the fast
+	 * decoder (large buffers) and the resumable one (buffer ends) */
+	uint64 storedbytes;
+	uint64 fastbytes;
+	uint64 slowbytes;
+
+	/* dynamic blocks that had the same code lengths as the last one (the
+	 * decoding tables were not built again) */
+	uint64 reusedtables;
+};
+
+typedef struct TINFLTStats TINFLTStats;
+
+/*
+ * Copies the statistics since the last reset. The counters are only compiled
+ * if the library was built with JDEFLATE_STATS, otherwise the struct is
+ * zeroed and the function returns 0. */
+uintxx inflator_getstats(TInflator*, TINFLTStats* stats);
+
+/*
+ * Decompresses a whole deflate stream in a single call, the state is reset
+ * first (it works as inflator_setnowindow, no window is used). Returns
+ * INFLT_OK on success (inflator_tgtend gives the decompressed size and
+ * inflator_srcend the size of the stream), INFLT_TGTEXHSTD if the target
+ * buffer is too small or INFLT_ERROR. */
+eINFLTResult inflator_decompressbuffer(TInflator*, const uint8* source,
+	uintxx ssize, uint8* target, uintxx tsize);
+
 /*
  * */
 void inflator_reset(TInflator*);
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2023, jpn
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef c61f2b8e_5d3a_47e0_a9b4_e20d7c13f5a8
+#define c61f2b8e_5d3a_47e0_a9b4_e20d7c13f5a8
+
+/*
+ * zbatch.h
+ * Compression and decompression of many small independent buffers in a
+ * single call. Each item is a whole raw deflate stream, a single deflator (or
+ * inflator) is created for the batch (one for each task in parallel mode)
+ * and only reset between the items. A small item only clears the entries of
+ * the match finder it has used (a prepared dictionary is not set again with
+ * levels 1 to 9), and the inflator resolves the back references in the
+ * target (no window is used).
+ *
+ * Usage:
+ * items[i].source = message; items[i].ssize = size;
+ * items[i].target = buffer;  items[i].tsize = deflator_bound(NULL, size);
+ * ...
+ * failed = zbatch_compress(items, count, 6, NULL, NULL);
+ */
+
+#include <ctoolbox/ctoolbox.h>
+#include "deflator.h"
+#include "inflator.h"
+#include "zstrm.h"
+
+
+/* */
+struct TZBatchItem {
+	/* input and output buffers */
+	const uint8* source;
+	uintxx ssize;
+	uint8* target;
+	uintxx tsize;
+
+	/* results: the size of the output and the error (eZSTRMError) */
+	uintxx size;
+	uintxx error;
+};
+
+typedef struct TZBatchItem TZBatchItem;
+
+
+/* */
+struct TZBatchOptions {
+	/* dictionary shared by all the items (none if dsize is zero), for the
+	 * compression it's prepared once for the batch, pdctnr can be given
+	 * instead to reuse one between batches (created with the same level and
+	 * the default window and hash bits) */
+	const uint8* dict;
+	uintxx dsize;
+	const TDEFLTDctnr* pdctnr;
+
+	/* the items are split in up to ntasks slices of similar size, each one
+	 * with its own state, that are run by fn (see TZStrmTaskFn). If fn is
+	 * NULL the batch is processed in the calling thread */
+	uintxx ntasks;
+	TZStrmTaskFn taskfn;
+	void* payload;
+};
+
+typedef struct TZBatchOptions TZBatchOptions;
+
+
+/*
+ * Compresses each item source into its target with the given level (the
+ * options can be NULL). The item error is ZSTRM_EBUFFERFULL if the target is
+ * too small (a target of deflator_bound bytes is always enough). The states
+ * are created in the calling thread, so the allocator is only used there.
+ * Returns the number of items that failed. */
+uintxx zbatch_compress(TZBatchItem* items, uintxx count, uintxx level,
+	const TZBatchOptions* options, TAllocator* allocator);
+
+/*
+ * Decompresses each item source into its target, the error is
+ * ZSTRM_EBUFFERFULL if the target is too small and ZSTRM_EBADDATA if the
+ * stream is not valid (or it's incomplete). Returns the number of items that
+ * failed. */
+uintxx zbatch_decompress(TZBatchItem* items, uintxx count,
+	const TZBatchOptions* options, TAllocator* allocator);
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2023, jpn
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef a3d7e5c1_0b6f_4e2a_9c41_7f18d2b90e6a
+#define a3d7e5c1_0b6f_4e2a_9c41_7f18d2b90e6a
+
+/*
+ * zfile.h
+ * Whole file compression and decompression. The source file is mapped in
+ * memory and given to the one-shot functions of zstrm (or pushed to an async
+ * stream), so there is no IO callback and no copy to the stream buffers. The
+ * target is mapped too when it's a regular file and the output size is known
+ * (the gzip tail has it), otherwise the output is written as it's decoded.
+ *
+ * Usage:
+ * error = zfile_compress("data.bin", "data.bin.gz", ZSTRM_GZIP, 6, NULL);
+ * ...
+ * error = zfile_decompress("data.bin.gz", "data.bin", ZSTRM_AUTO, NULL);
+ *
+ * These functions are only available on POSIX systems (elsewhere they
+ * return ZSTRM_EINCORRECTUSE).
+ */
+
+#include <ctoolbox/ctoolbox.h>
+#include "zstrm.h"
+
+
+/*
+ * Compresses the file descriptor sfd into tfd, the flags are the stream type
+ * (see zstrm_create, the mode is implied). The target is written from its
+ * current offset, a regular file at offset zero is mapped and truncated to
+ * the compressed size. Sources that can't be mapped (pipes) are read in
+ * chunks. On error a regular target is truncated back to the offset it had.
+ * Returns ZSTRM_OK or the error (eZSTRMError). */
+uintxx zfile_compressfd(int sfd, int tfd, uintxx flags, uintxx level,
+	TAllocator* allocator);
+
+/*
+ * Decompresses the file descriptor sfd into tfd, the target is handled as in
+ * zfile_compressfd. When the mapped output turns out to be too small (the
+ * size stored in the gzip tail is modulo 2^32 and it's only the last member
+ * one) the target is truncated and the stream mode is used instead, the
+ * target is not mapped if the stored size is larger than the source can
+ * hold. */
+uintxx zfile_decompressfd(int sfd, int tfd, uintxx flags,
+	TAllocator* allocator);
+
+/*
+ * Same as above but the files are given by path, the target is created or
+ * truncated. */
+uintxx zfile_compress(const char* spath, const char* tpath, uintxx flags,
+	uintxx level, TAllocator* allocator);
+uintxx zfile_decompress(const char* spath, const char* tpath, uintxx flags,
+	TAllocator* allocator);
+
+#endif
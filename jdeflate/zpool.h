@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2023, jpn
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef e93b0558_fdc4_4aeb_b7d5_40676daf9678
+#define e93b0558_fdc4_4aeb_b7d5_40676daf9678
+
+/*
+ * zpool.h
+ * Pools of reusable deflators, inflators and streams (the pool can be used
+ * from several threads at the same time).
+ *
+ * Usage:
+ * pool = zpool_create(ZPOOL_DEFLATOR, 0, level, NULL, 64, NULL);
+ * ...
+ * deflator = zpool_acquire(pool);
+ * ...use the deflator
+ * zpool_release(pool, deflator);
+ */
+
+#include <ctoolbox/ctoolbox.h>
+#include "deflator.h"
+#include "inflator.h"
+#include "zstrm.h"
+
+
+/* Object type */
+typedef enum {
+	ZPOOL_DEFLATOR = 1,
+	ZPOOL_INFLATOR = 2,
+	ZPOOL_ZSTRM    = 3
+} eZPoolType;
+
+
+/* */
+struct TZPool {
+	uintxx otype;  /* eZPoolType */
+
+	/* maximum number of idle objects and number of them in the pool (it
+	 * can be outdated if other threads are using the pool) */
+	uintxx capacity;
+	uintxx count;
+};
+
+typedef struct TZPool TZPool;
+
+
+/*
+ * Creates a new pool of objects of the given type. The flags, the level and
+ * the options are the parameters used to create the objects (see
+ * deflator_create and zstrm_createex, the flags and the options are only
+ * used by the streams), up to capacity idle objects are kept. The allocator
+ * is used for the pool and its objects, so it must also be thread safe when
+ * the pool is shared. */
+TZPool* zpool_create(eZPoolType otype, uintxx flags, uintxx level,
+	const TZStrmOptions* options, uintxx capacity, TAllocator* allocator);
+
+/*
+ * Destroys the pool and its idle objects (the objects acquired from it must
+ * be released first or destroyed by the caller). */
+void zpool_destroy(TZPool*);
+
+/*
+ * Creates objects until there are at least count idle objects in the pool
+ * (or capacity). Returns false if the objects can't be created. */
+bool zpool_prewarm(TZPool*, uintxx count);
+
+/*
+ * Returns an idle object ready to be used, a new one is created if the pool
+ * is empty (NULL if it can't be created). */
+void* zpool_acquire(TZPool*);
+
+/*
+ * Returns an object to the pool. The object is reset with the parameters of
+ * the pool (so a deflator gets the level of the pool back) and it's kept if
+ * there is room, otherwise it's destroyed. The settings of the borrower that
+ * survive a reset are cleared too (the custom codes, the strategy and the
+ * match finder of a deflator), for streams the settings made with
+ * zstrm_setparallel are kept. */
+void zpool_release(TZPool*, void* object);
+
+#endif
@@ -38,7 +38,11 @@ typedef enum {
 	ZSTRM_DFLT = 0x04,
 	ZSTRM_ZLIB = 0x08,
 	ZSTRM_GZIP = 0x10,
-	ZSTRM_AUTO = ZSTRM_DFLT | ZSTRM_ZLIB | ZSTRM_GZIP
+	ZSTRM_AUTO = ZSTRM_DFLT | ZSTRM_ZLIB | ZSTRM_GZIP,
+
+	/* blocked gzip, members of up to 64KB with the block size in the extra
+	 * field (it's read as gzip) */
+	ZSTRM_BGZF = 0x40
 } eZSTRMType;
 
 
@@ -58,7 +62,8 @@ typedef enum {
 	ZSTRM_EDEFLATE       = 6,
 	ZSTRM_EMISSINGDICT   = 7,
 	ZSTRM_EINCORRECTDICT = 8,
-	ZSTRM_EINCORRECTUSE  = 9
+	ZSTRM_EINCORRECTUSE  = 9,
+	ZSTRM_EBUFFERFULL    = 10
 } eZSTRMError;
 
 
@@ -72,12 +77,33 @@ typedef enum {
 } eZSTRMState;
 
 
+/* IO state (async mode) */
+typedef enum {
+	ZSTRM_IOREADY  = 0,
+	ZSTRM_IOINPUT  = 1,
+	ZSTRM_IOOUTPUT = 2
+} eZSTRMIOState;
+
+
 /*
  * IO function prototype.
  * Return value must be the number of bytes written or readed to the buffer
  * (zero if there is no more input avaible or -1 if there is an error). */
 typedef intxx (*TZStrmIOFn)(uint8* buffer, uintxx size, void* payload);
 
+/*
+ * Task runner prototype (used by the parallel mode).
+ * It must call task(tasks[i]) for each i in [0, count), in any order and
+ * possibly at the same time, and return once all of them are done. */
+typedef void (*TZStrmTaskFn)(void (*task)(void*), void** tasks, uintxx count,
+	void* payload);
+
+/*
+ * Seek function prototype (used by zstrm_seek).
+ * It must move the input to the given offset of the compressed stream and
+ * return zero on success. */
+typedef intxx (*TZStrmSeekFn)(uint64 offset, void* payload);
+
 
 /* */
 struct TZStrm {
@@ -103,6 +129,17 @@ struct TZStrm {
 	uintxx total;
 	uintxx result;
 
+	/* window size (in bits) and hash table size of the deflator */
+	uintxx wbits;
+	uintxx hbits;
+
+	/* deflator strategy (eDEFLTStrategy) */
+	uintxx strategy;
+
+	/* concatenated gzip members are decoded as a single stream, this is the
+	 * index of the current one (read mode, not updated in parallel mode) */
+	uintxx member;
+
 	struct TDeflator* defltr;
 	struct TInflator* infltr;
 
@@ -112,7 +149,29 @@ struct TZStrm {
 	/* IO callback parameter */
 	void* payload;
 
+	/* IO callback calls and bytes transferred (see zstrm_getstats) */
+	uint64 iocalls;
+	uint64 iobytes;
+
+	/* parallel mode */
+	struct TZStrmPMode* pmode;
+
+	/* async mode (see zstrm_setasync) */
+	struct TZStrmAsync* async;
+
+	/* read-ahead mode (see zstrm_setreadahead) */
+	struct TZStrmRAhead* rahead;
+
+	/* random access index being built, offset of the source buffer in the
+	 * compressed stream (read mode) or compressed size written so far (BGZF
+	 * write mode), and offset of the current gzip member */
+	struct TZStrmIndex* index;
+	uint64 sbase;
+	uint64 mbase;
+
 	/* buffers */
+	uintxx sbsize;
+	uintxx tbsize;
 	uint8* source;
 	uint8* target;
 	uint8* sbgn;
@@ -127,10 +186,89 @@ struct TZStrm {
 typedef struct TZStrm TZStrm;
 
 
+/* Stream options */
+struct TZStrmOptions {
+	/* size of the source and target buffers (zero for the default size of
+	 * 8KB, the maximum is 64MB) */
+	uintxx sbsize;
+	uintxx tbsize;
+
+	/* window size of the deflator or inflator and hash table size of the
+	 * deflator (see deflator_createex, zero for the default). In write mode
+	 * the zlib header has the window size, in read mode a zlib stream with a
+	 * larger window is not accepted */
+	uintxx wbits;
+	uintxx hbits;
+
+	/* deflator strategy, write mode only (see deflator_setstrategy, zero is
+	 * the parser of the level) */
+	uintxx strategy;
+};
+
+typedef struct TZStrmOptions TZStrmOptions;
+
+
+/* Random access index checkpoint */
+struct TZStrmIndexEntry {
+	uint64 coffset;  /* offset of the next byte in the compressed stream */
+	uint64 uoffset;  /* offset in the uncompressed data */
+
+	/* pending bits of the previous bytes */
+	uintxx bits;
+	uint32 value;
+
+	/* uncompressed data that precedes the checkpoint (up to 32KB) */
+	uintxx wsize;
+	uint8* window;
+};
+
+/* Random access index */
+struct TZStrmIndex {
+	uintxx stype;   /* eZSTRMType */
+	uintxx span;
+	uint64 total;   /* uncompressed size (once the stream has been read) */
+
+	/* checkpoints (in order) */
+	uintxx count;
+	uintxx capacity;
+	struct TZStrmIndexEntry* entries;
+
+	/* builder state */
+	uint64 last;
+	uintxx wcount;
+	uintxx wend;
+	uint8* window;
+
+	/* custom allocator */
+	struct TAllocator* allocator;
+};
+
+typedef struct TZStrmIndex TZStrmIndex;
+
+
 /*
- * Creates a new stream. */
+ * Creates a new stream (the compression level goes from 0 to 12). */
 TZStrm* zstrm_create(uintxx flags, uintxx level, TAllocator* allocator);
 
+/*
+ * Creates a new stream with the given options (options can be NULL), the
+ * buffers are allocated using the allocator. */
+TZStrm* zstrm_createex(uintxx flags, uintxx level, const TZStrmOptions*,
+	TAllocator* allocator);
+
+/*
+ * Returns the size of the memory block needed to create a stream in place
+ * (zero if the flags or the level are not valid). */
+uintxx zstrm_memsize(uintxx flags, uintxx level, const TZStrmOptions*);
+
+/*
+ * Creates a stream inside the given block, the deflator or inflator and the
+ * buffers included (see deflator_createinplace). Returns NULL if the block is
+ * smaller than zstrm_memsize. The parallel mode also takes its memory from
+ * the block, so it must be larger to use it. */
+TZStrm* zstrm_createinplace(uintxx flags, uintxx level, const TZStrmOptions*,
+	void* memory, uintxx size);
+
 /*
  * */
 void zstrm_destroy(TZStrm*);
@@ -143,10 +281,83 @@ void zstrm_reset(TZStrm*);
  * */
 void zstrm_setiofn(TZStrm*, TZStrmIOFn fn, void* payload);
 
+/*
+ * Async mode, it's used instead of zstrm_setiofn (the stream never calls an
+ * IO function, so it never blocks). The buffers are owned by the caller and
+ * given to the stream with zstrm_push, up to 16 at the same time, so the
+ * next reads or writes can be in flight while the stream works.
+ *
+ * In read mode the pushed buffers hold the compressed input (they are decoded
+ * in place) and a push of size zero marks the end of the input. zstrm_r
+ * and zstrm_rpeek return less data when the queued input runs out (see
+ * zstrm_iostate), the decoding resumes at the same point after the next
+ * push. A header (or a tail and the next gzip header) is parsed once it's
+ * complete, if it doesn't fit in the queue the error is ZSTRM_EBUFFERFULL.
+ *
+ * In write mode the pushed buffers are empty and receive the compressed
+ * output. While the output waits for a buffer (ZSTRM_IOOUTPUT) zstrm_w
+ * accepts less data, a push copies the output to the new buffer and goes on
+ * with the pending work. A sync flush is done when zstrm_iostate returns
+ * ZSTRM_IOREADY, and zstrm_flush(final) must be called again until the state
+ * is ZSTRM_END.
+ *
+ * The parallel mode, the BGZF write mode and the random access functions are
+ * not supported. */
+void zstrm_setasync(TZStrm*);
+
+/*
+ * Queues a buffer (async mode). Returns false if there are already 16
+ * buffers in the stream (zstrm_pop returns the used ones). */
+bool zstrm_push(TZStrm*, void* buffer, uintxx size);
+
+/*
+ * Returns the oldest buffer the stream has finished with (in push order) and
+ * stores its size: the pushed size in read mode (every byte was consumed, or
+ * the stream ended) and the number of bytes written in write mode (the
+ * buffer is full, or it's the last one of a flush). Returns NULL if there is
+ * none. */
+void* zstrm_pop(TZStrm*, uintxx* size);
+
+/*
+ * Returns ZSTRM_IOINPUT if the last read stopped because the queued input
+ * was consumed, ZSTRM_IOOUTPUT if there is output waiting for a buffer (or
+ * a flush to finish), or ZSTRM_IOREADY (eZSTRMIOState). */
+uintxx zstrm_iostate(TZStrm*);
+
 /*
  * */
 void zstrm_setdctn(TZStrm*, uint8* dict, uintxx size);
 
+/*
+ * Enables the parallel mode. In write mode the input is split in chunks of
+ * chunksize bytes (zero for the default size), and up to ntasks chunks are
+ * compressed at the same time, each chunk is primed with the last 32KB of
+ * the previous one and terminated with a sync point, so the output is still
+ * a single stream. If fn is NULL the chunks are compressed in sequence.
+ *
+ * In read mode the input is split at sync points (empty stored blocks) and
+ * gzip member headers in segments of at least chunksize bytes, and up to
+ * ntasks segments are decoded at the same time. A segment that refers to the
+ * data of the previous one is decoded again in order with the previous 32KB
+ * of output. Dictionaries are not supported in this mode.
+ *
+ * It must be called before zstrm_setiofn, a ntasks value of zero disables
+ * the parallel mode. */
+void zstrm_setparallel(TZStrm*, uintxx ntasks, uintxx chunksize,
+	TZStrmTaskFn fn, void* payload);
+
+/*
+ * Enables the read-ahead mode (read mode). The source and target buffers are
+ * doubled, and each chunk is decoded while the next source buffer is read
+ * (the IO function is called from the task runner) and the checksums of the
+ * previous chunk are computed, so the IO latency and the checksums overlap
+ * the decoding of a single stream. If fn is NULL the jobs run in sequence.
+ *
+ * It must be called before zstrm_setiofn, it can't be used with the
+ * parallel mode, the async mode or the random access functions. */
+void zstrm_setreadahead(TZStrm*, bool enable, TZStrmTaskFn fn,
+	void* payload);
+
 /*
  *  */
 void zstrm_flush(TZStrm*, bool final);
@@ -156,8 +367,104 @@ void zstrm_flush(TZStrm*, bool final);
 uintxx zstrm_r(TZStrm*,       void* buffer, uintxx size);
 uintxx zstrm_w(TZStrm*, const void* buffer, uintxx size);
 
+/*
+ * Zero copy reading. Returns a pointer to the decoded data inside the
+ * internal buffer and stores its size (zero at the end of the stream or on
+ * error), the consumed bytes must be marked with zstrm_rcommit. The pointer
+ * is valid until the next call to zstrm_rpeek or zstrm_r. The data returned
+ * by a call always belongs to a single gzip member (see member). */
+const uint8* zstrm_rpeek(TZStrm*, uintxx* size);
+void zstrm_rcommit(TZStrm*, uintxx size);
+
+/*
+ * Zero copy writing. Returns a pointer to the free space of the internal
+ * buffer and stores its size, the bytes written there must be marked with
+ * zstrm_wcommit. The pointer is valid until the next call to zstrm_wpeek,
+ * zstrm_w or zstrm_flush. */
+uint8* zstrm_wpeek(TZStrm*, uintxx* size);
+void zstrm_wcommit(TZStrm*, uintxx size);
+
+/*
+ * One-shot compression (write mode only). Compresses the whole source buffer
+ * in a single call, including the header and the tail of the stream type.
+ * Returns the size of the compressed data or zero on error (the target buffer
+ * is too small if the error is ZSTRM_EBUFFERFULL). If tsize is at least
+ * zstrm_bound(ssize) the output never runs out. */
+uintxx zstrm_bound(TZStrm*, uintxx size);
+uintxx zstrm_compressbuffer(TZStrm*, const uint8* source, uintxx ssize,
+	uint8* target, uintxx tsize);
+
+/*
+ * One-shot decompression (read mode only). Decompresses a whole stream in a
+ * single call, the stream is reset first. Returns the size of the
+ * decompressed data or zero on error. */
+uintxx zstrm_decompressbuffer(TZStrm*, const uint8* source, uintxx ssize,
+	uint8* target, uintxx tsize);
+
+/*
+ * Random access index. The index is filled while the stream is read, with a
+ * checkpoint at the start of the data and then one every span bytes (zero
+ * for the default size of 1MB) of uncompressed data or more, since they can
+ * only be placed at block boundaries. Only gzip, zlib or raw deflate streams
+ * without dictionary are supported.
+ *
+ * zstrm_setindex must be called after zstrm_setiofn and before the first
+ * read (read mode, not in the parallel mode) or write (BGZF write mode, where
+ * the checkpoints are placed at block starts), the index is detached by
+ * zstrm_reset or zstrm_seek. */
+TZStrmIndex* zstrm_indexcreate(uintxx span, TAllocator* allocator);
+void zstrm_indexdestroy(TZStrmIndex*);
+
+void zstrm_setindex(TZStrm*, TZStrmIndex*);
+
+/*
+ * Saves or loads an index using the given IO function (the windows are
+ * compressed). The saving returns false on error, the loading returns NULL if
+ * the data is not a valid index. */
+bool zstrm_indexsave(TZStrmIndex*, TZStrmIOFn fn, void* payload);
+TZStrmIndex* zstrm_indexload(TZStrmIOFn fn, void* payload,
+	TAllocator* allocator);
+
+/*
+ * Moves the stream to the given offset of the uncompressed data, the input
+ * is moved (using fn with the stream IO payload) to the offset of the nearest
+ * checkpoint and the data up to the offset is decoded and discarded. The
+ * checksums are not verified after a seek. Returns false on error. */
+bool zstrm_seek(TZStrm*, const TZStrmIndex*, uint64 offset, TZStrmSeekFn fn);
+
+/*
+ * BGZF virtual offsets (read mode, not in the parallel mode): the offset of
+ * the current gzip member in the compressed stream << 16 | the offset in its
+ * uncompressed data. They are valid for any gzip stream with members of up to
+ * 64KB of data, except after a zstrm_seek until the next member starts.
+ * zstrm_seekvoffset moves the input to the member (using fn with the stream
+ * IO payload) and skips the data before the offset. */
+uint64 zstrm_getvoffset(TZStrm*);
+bool zstrm_seekvoffset(TZStrm*, uint64 voffset, TZStrmSeekFn fn);
+
 /*
  * */
 uintxx zstrm_getstate(TZStrm*, uintxx* error);
 
+
+/* Statistics */
+struct TZStrmStats {
+	/* IO callback calls and bytes read or written */
+	uint64 iocalls;
+	uint64 iobytes;
+
+	/* deflator (write mode) or inflator (read mode) counters */
+	TDEFLTStats deflator;
+	TINFLTStats inflator;
+};
+
+typedef struct TZStrmStats TZStrmStats;
+
+/*
+ * Copies the statistics since the last reset (in parallel mode the tasks have
+ * their own coders, so only the IO counters are filled). The counters are
+ * only compiled if the library was built with JDEFLATE_STATS, otherwise the
+ * struct is zeroed and the function returns 0. */
+uintxx zstrm_getstats(TZStrm*, TZStrmStats* stats);
+
 #endif
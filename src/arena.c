@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2023, jpn
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "arena.h"
+
+
+struct TArena {
+	struct TAllocator allocator;
+
+	/* free part of the block */
+	uint8* next;
+	uint8* end;
+};
+
+
+uintxx
+arena_overhead(void)
+{
+	return ARENA_ROUNDUP(sizeof(struct TArena)) + (ARENA_ALIGNMENT - 1);
+}
+
+static void*
+arenareserve(void* user, uintxx size)
+{
+	struct TArena* arena;
+	uint8* memory;
+
+	arena = user;
+	size = ARENA_ROUNDUP(size);
+	if (size > (uintxx) (arena->end - arena->next)) {
+		return NULL;
+	}
+	memory = arena->next;
+	arena->next += size;
+	return memory;
+}
+
+static void
+arenarelease(void* user, void* memory)
+{
+	(void) user;
+	(void) memory;
+}
+
+TAllocator*
+arena_create(void* memory, uintxx size)
+{
+	struct TArena* arena;
+	uintxx padding;
+	uint8* end;
+	uint8* i;
+
+	if (memory == NULL || size < arena_overhead()) {
+		return NULL;
+	}
+	end = ((uint8*) memory) + size;
+
+	padding = (ARENA_ALIGNMENT - ((uintxx) memory & (ARENA_ALIGNMENT - 1)));
+	padding = padding & (ARENA_ALIGNMENT - 1);
+	arena = (struct TArena*) (((uint8*) memory) + padding);
+
+	/* the fields of the allocator we don't use are left empty */
+	for (i = (uint8*) arena; i < (uint8*) (arena + 1); i++) {
+		i[0] = 0;
+	}
+	arena->allocator.reserve = arenareserve;
+	arena->allocator.release = arenarelease;
+	arena->allocator.user    = arena;
+
+	arena->next = ((uint8*) arena) + ARENA_ROUNDUP(sizeof(struct TArena));
+	arena->end  = end;
+	return &arena->allocator;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2023, jpn
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef a7d41e6b_3c95_4f0a_8e2d_91b6c5f03e74
+#define a7d41e6b_3c95_4f0a_8e2d_91b6c5f03e74
+
+/*
+ * arena.h
+ * Bump allocator over a block given by the user, used by the in-place
+ * constructors (private header, it's not installed). */
+
+#include <ctoolbox/ctoolbox.h>
+
+
+/* every allocation starts at a cache line */
+#define ARENA_ALIGNMENT 64
+
+#define ARENA_ROUNDUP(N) \
+	(((uintxx) (N) + (ARENA_ALIGNMENT - 1)) & ~((uintxx) ARENA_ALIGNMENT - 1))
+
+
+/*
+ * Returns the memory used by the arena itself (including the padding needed
+ * when the block is not aligned), the size of a block is this plus the
+ * rounded size (ARENA_ROUNDUP) of each allocation. */
+uintxx arena_overhead(void);
+
+/*
+ * Creates an allocator that takes its memory from the given block (NULL if
+ * the block is too small). Releasing memory does nothing, the block belongs
+ * to the user. */
+TAllocator* arena_create(void* memory, uintxx size);
+
+#endif
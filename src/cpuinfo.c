@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2023, jpn
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cpuinfo.h"
+
+
+#if defined(CPUINFO_X86) && !defined(JDEFLATE_NOCPUDISPATCH)
+	#define CPUINFO_CPUID
+#endif
+
+#if defined(CPUINFO_CPUID)
+	#if defined(__MSVC__)
+		#include <intrin.h>
+	#else
+		#include <cpuid.h>
+	#endif
+#endif
+
+
+#if defined(CPUINFO_CPUID)
+
+CTB_INLINE void
+cpuid(uint32 r[4], uint32 leaf)
+{
+#if defined(__MSVC__)
+	int info[4];
+
+	__cpuidex(info, (int) leaf, 0);
+	r[0] = (uint32) info[0];
+	r[1] = (uint32) info[1];
+	r[2] = (uint32) info[2];
+	r[3] = (uint32) info[3];
+#else
+	__cpuid_count(leaf, 0, r[0], r[1], r[2], r[3]);
+#endif
+}
+
+CTB_INLINE uint32
+getxcr0(void)
+{
+#if defined(__MSVC__)
+	return (uint32) _xgetbv(0);
+#else
+	uint32 a;
+	uint32 d;
+
+	__asm__ __volatile__ ("xgetbv" : "=a" (a), "=d" (d) : "c" (0));
+	return a;
+#endif
+}
+
+static uintxx
+detectfeatures(void)
+{
+	uint32 r[4];
+	uint32 maxleaf;
+	uintxx features;
+	uintxx ymm;
+
+	cpuid(r, 0);
+	maxleaf = r[0];
+	if (maxleaf < 1)
+		return 0;
+
+	features = 0;
+	cpuid(r, 1);
+	if (r[2] & (1UL << 0x09)) features |= CPU_SSSE3;
+	if (r[2] & (1UL << 0x13)) features |= CPU_SSE41;
+	if (r[2] & (1UL << 0x01)) features |= CPU_PCLMUL;
+
+	if (maxleaf < 7)
+		return features;
+
+	/* osxsave and avx, the os must save the ymm registers */
+	ymm = 0;
+	if ((r[2] & (1UL << 0x1b)) && (r[2] & (1UL << 0x1c))) {
+		ymm = (getxcr0() & 0x06) == 0x06;
+	}
+
+	cpuid(r, 7);
+	if (ymm && (r[1] & (1UL << 0x05))) features |= CPU_AVX2;
+	if (r[1] & (1UL << 0x08)) features |= CPU_BMI2;
+	return features;
+}
+
+#else
+
+static uintxx
+detectfeatures(void)
+{
+	uintxx features;
+
+	features = 0;
+#if defined(__SSSE3__)
+	features |= CPU_SSSE3;
+#endif
+#if defined(__SSE4_1__)
+	features |= CPU_SSE41;
+#endif
+#if defined(__PCLMUL__)
+	features |= CPU_PCLMUL;
+#endif
+#if defined(__AVX2__)
+	features |= CPU_AVX2;
+#endif
+#if defined(__BMI2__)
+	features |= CPU_BMI2;
+#endif
+	return features;
+}
+
+#endif
+
+
+/* several threads can write the same value here */
+static volatile uintxx cpufeatures;
+static volatile uintxx cpuready;
+
+uintxx
+cpuinfo_getfeatures(void)
+{
+	if (CTB_UNLIKELY(cpuready == 0)) {
+		cpufeatures = detectfeatures();
+		cpuready = 1;
+	}
+	return cpufeatures;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2023, jpn
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef f3a0c2d1_6b8e_4c57_9d1a_7e2b54c08a93
+#define f3a0c2d1_6b8e_4c57_9d1a_7e2b54c08a93
+
+/*
+ * cpuinfo.h
+ * Runtime detection of the cpu features used to select the specialized
+ * variants of the hot loops (private header, it's not installed). */
+
+#include <ctoolbox/ctoolbox.h>
+#include <jdeflateconfig.h>
+
+
+/* supported architectures */
+#if defined(__x86_64__) || defined(__i386__)
+	#if defined(__GNUC__) || defined(__clang__)
+		#define CPUINFO_X86
+	#endif
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86)
+	#if defined(__MSVC__)
+		#define CPUINFO_X86
+	#endif
+#endif
+
+
+/* compiles a function for the given features, the variants that depend only
+ * on the code generation (not on intrinsics) need it */
+#if defined(__GNUC__) || defined(__clang__)
+	#define CPUINFO_TARGET(T) __attribute__((target(T)))
+	#define CPUINFO_HASTARGET
+#else
+	#define CPUINFO_TARGET(T)
+#endif
+
+
+/* features */
+#define CPU_SSSE3  0x01
+#define CPU_SSE41  0x02
+#define CPU_PCLMUL 0x04
+#define CPU_AVX2   0x08
+#define CPU_BMI2   0x10
+
+
+/*
+ * Returns the features (CPU_*) of the running cpu, they are detected (using
+ * cpuid) on the first call. If the library was built without the runtime
+ * dispatch (JDEFLATE_NOCPUDISPATCH) only the features enabled by the compiler
+ * flags are reported. */
+uintxx cpuinfo_getfeatures(void);
+
+#endif
@@ -16,6 +16,8 @@
 
 #include <jdeflate/deflator.h>
 #include <ctoolbox/memory.h>
+#include "cpuinfo.h"
+#include "arena.h"
 
 
 #if defined(AUTOINCLUDE_1)
@@ -33,17 +35,57 @@
 #define DEFLT_CMAXSYMBOL 19
 
 #define WNDWBITS 15
-#define WNDWSIZE 32768
 
-/* cache size */
-#define SMASK ((WNDWSIZE << 1) - 1)
-#define HMASK ((WNDWSIZE << 1) - 1)
+/* smallest window and range of the hash table size (in bits) */
+#define MINWNDWBITS 9
+#define MINHASHBITS 8
+#define MAXHASHBITS 16
+
+/* cache size of the 3 bytes hash (the others are set at creation) */
+#define H3MASK 0x3fff
+
+/* vector compare for the match length (both are part of the baseline of the
+ * 64 bit targets) */
+#if defined(__SSE2__) || defined(_M_X64)
+	#define DEFLT_SSE2
+	#include <emmintrin.h>
+	#if defined(__MSVC__)
+		#include <intrin.h>
+	#endif
+#endif
+
+#if defined(__ARM_NEON) && (defined(__aarch64__) || defined(_M_ARM64))
+	#if !CTB_IS_BIGENDIAN
+		#define DEFLT_NEON
+		#include <arm_neon.h>
+	#endif
+#endif
 
 /* number of literals (including end of block), match symbols and precodes */
 #define MAXLTCODES 257
 #define MAXLZCODES 32
 #define MAXPCCODES 19
 
+/* optimal parser chunk size and match list size */
+#define OPCHUNKSZ   0x4000
+#define OPMATCHESSZ (OPCHUNKSZ << 2)
+#define OPMAXMATCHES 16
+
+/* number of observation types of the block split check */
+#define SPLITNOBS 10
+
+/* size of the trees of a dynamic block header (they take less than 300
+ * bytes) */
+#define MAXHEADERSZ 0x200
+
+
+/* hot path counters (see deflator_getstats) */
+#if defined(JDEFLATE_STATS)
+	#define STATSADD(FIELD, N) (PRVT->stats.FIELD += (N))
+#else
+	#define STATSADD(FIELD, N) ((void) 0)
+#endif
+
 
 /* private stuff */
 struct TDEFLTPrvt {
@@ -86,9 +128,25 @@ struct TDEFLTPrvt {
 	/* offset */
 	uint16 base;
 
-	/* cache */
+	/* window size (set at creation) */
+	uintxx wndwbits;
+	uintxx wndwsize;
+
+	/* cache and its masks, the chain holds two windows */
 	uint16* hlist;
 	uint16* chain;
+	uintxx hmask;
+	uintxx smask;
+
+	/* the cache only has entries of the positions in the window (it was not
+	 * moved and there was no sync flush since the last clear), so a reset
+	 * can clear those alone */
+	uintxx cacheok;
+
+	/* size of the prepared dictionary of the stream, and of the one a reset
+	 * has left in the window and the cache (see deflator_setpdctnr) */
+	uintxx dctnrsize;
+	uintxx dctnrkept;
 
 	/* match search parameters */
 	uintxx nicematch;
@@ -96,6 +154,29 @@ struct TDEFLTPrvt {
 	uintxx maxchain;
 	uintxx mininsert;
 
+	/* parser that replaces the one of the level (eDEFLTStrategy) */
+	uintxx strategy;
+
+	/* match finder of the lazy levels (eDEFLTMatchFinder) */
+	uintxx mfinder;
+
+	/* use the binary tree match finder, and number of positions before the
+	 * cursor that are not in the tree yet */
+	uintxx usetree;
+	uintxx tpending;
+
+	/* optimal parser iterations */
+	uintxx oppasses;
+
+	/* custom codes (see deflator_setcodes) and if the current block uses
+	 * them */
+	const struct TDEFLTCodes* codes;
+	uintxx usecodes;
+
+	/* the frequencies of every block are added to this (used to build custom
+	 * codes from a sample) */
+	struct TDEFLTCodes* sampling;
+
 	/* lz token and literal buffer */
 	uint16* lzlist;
 	uint16* lzlistend;
@@ -109,12 +190,25 @@ struct TDEFLTPrvt {
 	/* token index */
 	uint16* zptr;
 
+	/* next position of the lz buffer where the block split is checked */
+	uint16* zcheck;
+
+	/* position of the first byte of the block in the window buffer (it is
+	 * negative if the byte was moved out) and the block size */
+	intxx  bstart;
+	uintxx bsize;
+
+	/* huffman only and run length blocks: position of the first byte that
+	 * is not in the lz buffer and the entries its symbols take */
+	uintxx rstart;
+	uintxx rentries;
+
+#if defined(JDEFLATE_STATS)
+	struct TDEFLTStats stats;
+#endif
+
 	/* used for any level greater than 0 */
 	struct TDEFLTExtra {
-		/* chache table */
-		uint16 chain[SMASK + 1];
-		uint16 hlist[HMASK + 1];
-
 		/* to count the frequencies (literals-lengths, distaces, precodes) */
 		uintxx lfrqs[DEFLT_LMAXSYMBOL];
 		uintxx dfrqs[DEFLT_DMAXSYMBOL];
@@ -123,12 +217,32 @@ struct TDEFLTPrvt {
 		uintxx dmax;
 		uintxx cmax;
 
+		/* observations, frequencies and estimated cost (zero if it was
+		 * not computed) of the block at the last split check */
+		uintxx sobs[SPLITNOBS];
+		uintxx slfrqs[DEFLT_LMAXSYMBOL];
+		uintxx sdfrqs[DEFLT_DMAXSYMBOL];
+		uintxx scost;
+
 		/* to get the symbols sorted by frequency */
 		uintxx smap[DEFLT_LMAXSYMBOL];
 
 		/* working array used to build the code lengths */
 		uintxx clns[DEFLT_LMAXSYMBOL];
 
+		/* trees of the last codes built, as precode symbols that end with
+		 * 0xffff */
+		uintxx ltree[DEFLT_LMAXSYMBOL];
+		uintxx dtree[DEFLT_DMAXSYMBOL];
+
+		/* the last codes can be kept by the next blocks (see selectblock),
+		 * the size of their trees and the size without extra bits and
+		 * number of symbols of the block they were built for */
+		uintxx reuseok;
+		uintxx tbits;
+		uintxx rbits;
+		uintxx rcount;
+
 		/* literal and precodes codes */
 		struct THCode1 {
 			uint8  bitlen;
@@ -152,9 +266,103 @@ struct TDEFLTPrvt {
 		struct THCode1* littable;
 		struct THCode2* lnstable;
 		struct THCode2* dsttable;
+
+		/* the cache tables are placed after this struct */
 	}
 	*extra;
 
+	/* binary tree match finder, each position is a node with the smaller
+	 * string in chain and the larger one in rnodes */
+	struct TDEFLTTree {
+		/* placed after this struct */
+		uint16* rnodes;
+
+		/* last position of each 3 bytes hash (used by the optimal parser) */
+		uint16 hlist3[H3MASK + 1];
+	}
+	*btree;
+
+	/* used by the optimal parser (levels 10 to 12, with the binary tree
+	 * match finder) */
+	struct TDEFLTOParser {
+		/* cost to reach each position of the chunk and the step used */
+		uint32 costs[OPCHUNKSZ + 1];
+		uint16 lengths[OPCHUNKSZ + 1];
+		uint16 offsets[OPCHUNKSZ + 1];
+
+		/* best path found (length | offset << 16, in reverse order) */
+		uint32 steps[OPCHUNKSZ + 1];
+
+		/* matches found at each position (sorted by length) */
+		uint32 mindex[OPCHUNKSZ + 1];
+		struct TOPMatch {
+			uint16 length;
+			uint16 offset;
+		}
+		matches[OPMATCHESSZ];
+
+		/* cost model (in bits, extra bits included) */
+		uint8  lcosts[DEFLT_LMAXSYMBOL];
+		uint16 dcosts[DEFLT_DMAXSYMBOL];
+		uint16 mcosts[258 + 1];  /* by match length */
+
+		/* frequencies used to build the cost model */
+		uintxx lfrqs[DEFLT_LMAXSYMBOL];
+		uintxx dfrqs[DEFLT_DMAXSYMBOL];
+	}
+	*oparser;
+
+	/* custom allocator */
+	struct TAllocator* allocator;
+};
+
+/* prepared dictionary, the cache entries of every position are recorded so
+ * setting it is just a copy */
+struct TDEFLTDctnr {
+	/* deflator parameters */
+	uintxx level;
+	uintxx wndwbits;
+	uintxx hmask;
+
+	uintxx size;
+	uintxx tpending;
+
+	/* for each position the hash table index and its final value, and the
+	 * chain entry (the tree nodes and the 3 bytes hash entries are only used
+	 * with the binary tree) */
+	uint16* hindex;
+	uint16* hvalue;
+	uint16* chain;
+	uint16* rnodes;
+	uint16* h3index;
+	uint16* h3value;
+
+	/* dictionary bytes */
+	uint8* data;
+
+	/* custom allocator */
+	struct TAllocator* allocator;
+};
+
+/* custom codes, reused by every block that gets smaller with them */
+struct TDEFLTCodes {
+	struct THCode1 litcodes[MAXLTCODES];
+	struct THCode2 lnscodes[MAXLZCODES];
+	struct THCode2 dstcodes[MAXLZCODES];
+
+	/* encoded trees of the block header and its size in bits */
+	uintxx hbits;
+	uint8  header[MAXHEADERSZ];
+
+	/* frequencies of the sample */
+	uintxx lfrqs[DEFLT_LMAXSYMBOL];
+	uintxx dfrqs[DEFLT_DMAXSYMBOL];
+
+	/* size in bits (without extra bits) and number of symbols of the sample
+	 * with these codes */
+	uintxx sbits;
+	uintxx scount;
+
 	/* custom allocator */
 	struct TAllocator* allocator;
 };
@@ -168,31 +376,83 @@ struct TDEFLTPrvt {
 #define BUILDMEMINFO(A, B) (((A) << 0x08) | ((B) << 0x00))
 
 CTB_INLINE uintxx
-getmeminfo(uintxx level)
+getmeminfo(uintxx level, uintxx wbits)
 {
+	uintxx a;
+	uintxx b;
+
 	switch (level) {
 		case 0:
-			return BUILDMEMINFO(WNDWBITS + 1, 0x00);
+			a = 1; b = 0x00; break;
 		case 1:
-			return BUILDMEMINFO(WNDWBITS + 1, 0x0e);
+			a = 1; b = 0x0e; break;
 		case 2:
 		case 3:
 		case 4:
-			return BUILDMEMINFO(WNDWBITS + 1, 0x0f);
+			a = 1; b = 0x0f; break;
 		case 5:
 		case 6:
 		case 7:
-			return BUILDMEMINFO(WNDWBITS + 2, 0x0f);
+			a = 2; b = 0x0f; break;
 		case 8:
 		case 9:
-			return BUILDMEMINFO(WNDWBITS + 2, 0x10);
+		case 10:
+		case 11:
+		case 12:
+			a = 2; b = 0x10; break;
+		default:
+			return 0;
 	}
-	return 0;
+
+	/* the buffers shrink with the window, but the window buffer must hold a
+	 * whole stored block (level 0) or a chunk of the optimal parser and its
+	 * lookahead, and the blocks must take at least 8KB of input (see
+	 * deflator_bound) */
+	a += wbits;
+	switch (level) {
+		case 0:
+		case 10:
+		case 11:
+		case 12:
+			if (a < 15)
+				a = 15;
+			break;
+		default:
+			if (a < 13)
+				a = 13;
+	}
+	if (b) {
+		b -= WNDWBITS - wbits;
+		if (b < 0x0e)
+			b = 0x0e;
+	}
+	return BUILDMEMINFO(a, b);
 }
 
 #undef BUILDMEMINFO
 
+/* checks the window and hash table sizes, and sets the defaults */
+CTB_INLINE bool
+checkbits(uintxx* wbits, uintxx* hbits)
+{
+	if (wbits[0] == 0) {
+		wbits[0] = WNDWBITS;
+	}
+	if (wbits[0] < MINWNDWBITS || wbits[0] > WNDWBITS) {
+		return 0;
+	}
+
+	if (hbits[0] == 0) {
+		hbits[0] = wbits[0] + 1;
+	}
+	if (hbits[0] < MINHASHBITS || hbits[0] > MAXHASHBITS) {
+		return 0;
+	}
+	return 1;
+}
+
 #define GETWNBFFSZ(M) ((uintxx) 1L << (((M) >> 0x08) & 0xff))
+#define SETMASK(B) (((uintxx) 1L << (B)) - 1)
 #define GETLZBFFSZ(M) ((uintxx) 1L << (((M) >> 0x00) & 0xff))
 
 #define PRVT ((struct TDEFLTPrvt*) state)
@@ -205,7 +465,11 @@ setparameters(struct TDeflator* state, uintxx level)
 	uintxx nice;
 	uintxx lazy;
 	uintxx chain;
+	uintxx pass;
+	uintxx tree;
 
+	pass = 0;
+	tree = 0;
 	switch (level) {
 		case 0: nice =   0; good =  0; lazy =   0; chain =    0; break;
 		case 1: nice =   3; good =  3; lazy =   3; chain =    1; break;
@@ -217,13 +481,37 @@ setparameters(struct TDeflator* state, uintxx level)
 		case 7: nice =  64; good = 16; lazy =  64; chain =  128; break;
 		case 8: nice = 128; good = 32; lazy = 128; chain = 1024; break;
 		case 9: nice = 258; good = 64; lazy = 258; chain = 4096; break;
+
+		/* optimal parser, with the binary tree match finder (chain is the
+		 * search depth) */
+		case 10:
+			nice = 128; good = 128; lazy = 0; chain = 128; tree = 1;
+			pass = 2;
+			break;
+		case 11:
+			nice = 258; good = 258; lazy = 0; chain = 128; tree = 1;
+			pass = 3;
+			break;
+		case 12:
+			nice = 258; good = 258; lazy = 0; chain = 256; tree = 1;
+			pass = 5;
+			break;
 		default:
 			return;
 	}
+
+	/* the lazy parser can take the tree too (see deflator_setmatchfinder),
+	 * a deeper search doesn't pay with it */
+	if (PRVT->mfinder == DEFLT_MFTREE && level >= 8 && tree == 0) {
+		chain = 32;
+		tree  = 1;
+	}
 	PRVT->goodmatch = good;
 	PRVT->nicematch = nice;
 	PRVT->mininsert = lazy;
 	PRVT->maxchain  = chain;
+	PRVT->oppasses  = pass;
+	PRVT->usetree   = tree;
 }
 
 CTB_INLINE void*
@@ -245,13 +533,19 @@ _release(struct TDEFLTPrvt* p, void* memory)
 	CTB_RELEASE(memory);
 }
 
+/* size of the extra struct with the cache tables, and of the tree */
+#define CACHESIZE(H, S) \
+	(sizeof(struct TDEFLTExtra) + ((H) + (S) + 2) * sizeof(uint16))
+#define TREESIZE(S) \
+	(sizeof(struct TDEFLTTree) + ((S) + 1) * sizeof(uint16))
+
 CTB_INLINE uintxx
 allocateprvt(TDeflator* state)
 {
 	uintxx i;
 	struct TDEFLTExtra* extra;
 
-	extra = _reserve(PRVT, sizeof(struct TDEFLTExtra));
+	extra = _reserve(PRVT, CACHESIZE(PRVT->hmask, PRVT->smask));
 	if (extra == NULL) {
 		return 0;
 	}
@@ -262,8 +556,8 @@ allocateprvt(TDeflator* state)
 		extra->dstcodes[i] = sdstcodes[i];
 	}
 
-	PRVT->hlist = extra->hlist;
-	PRVT->chain = extra->chain;
+	PRVT->hlist = (uint16*) (extra + 1);
+	PRVT->chain = PRVT->hlist + PRVT->hmask + 1;
 
 	PRVT->extra = extra;
 	return 1;
@@ -309,7 +603,7 @@ allocatemem(TDeflator* state, uintxx meminfo)
 		PRVT->wnsize = wsize;
 	}
 	PRVT->windowend  = PRVT->window = buffer;
-	PRVT->windowend += wsize;
+	PRVT->windowend += wsize - WNDNGUARDSZ;
 
 	buffer = PRVT->lzlist;
 	if (PRVT->lzsize < bsize) {
@@ -335,11 +629,65 @@ allocatemem(TDeflator* state, uintxx meminfo)
 			}
 		}
 	}
+
+	if (PRVT->usetree) {
+		if (PRVT->btree == NULL) {
+			PRVT->btree = _reserve(PRVT, TREESIZE(PRVT->smask));
+			if (PRVT->btree == NULL) {
+				return 0;
+			}
+			PRVT->btree->rnodes = (uint16*) (PRVT->btree + 1);
+		}
+	}
+
+	if (PRVT->level >= 10) {
+		if (PRVT->oparser == NULL) {
+			PRVT->oparser = _reserve(PRVT, sizeof(struct TDEFLTOParser));
+			if (PRVT->oparser == NULL) {
+				return 0;
+			}
+		}
+	}
 	return 1;
 }
 
+uintxx
+deflator_memsize(uintxx level, uintxx wbits, uintxx hbits)
+{
+	uintxx meminfo;
+	uintxx bsize;
+	uintxx total;
+
+	if (checkbits(&wbits, &hbits) == 0) {
+		return 0;
+	}
+	meminfo = getmeminfo(level, wbits);
+	if (meminfo == 0) {
+		return 0;
+	}
+	bsize = GETLZBFFSZ(meminfo);
+	if (bsize == 1)
+		bsize--;
+
+	total = arena_overhead() + ARENA_ROUNDUP(sizeof(struct TDEFLTPrvt));
+	total += ARENA_ROUNDUP(GETWNBFFSZ(meminfo) + WNDNGUARDSZ);
+	total += ARENA_ROUNDUP(bsize * sizeof(uint16));
+	if (level) {
+		total += ARENA_ROUNDUP(CACHESIZE(SETMASK(hbits), SETMASK(wbits + 1)));
+	}
+
+	/* binary tree match finder (see setparameters) */
+	if (level >= 10) {
+		total += ARENA_ROUNDUP(TREESIZE(SETMASK(wbits + 1)));
+		total += ARENA_ROUNDUP(sizeof(struct TDEFLTOParser));
+	}
+	return total;
+}
+
 
 #undef WNDNGUARDSZ
+#undef CACHESIZE
+#undef TREESIZE
 
 #undef GETWINBFFSZ
 #undef GETTKNBFFSZ
@@ -350,13 +698,23 @@ allocatemem(TDeflator* state, uintxx meminfo)
 
 TDeflator*
 deflator_create(uintxx level, TAllocator* allocator)
+{
+	return deflator_createex(level, 0, 0, allocator);
+}
+
+TDeflator*
+deflator_createex(uintxx level, uintxx wbits, uintxx hbits,
+	TAllocator* allocator)
 {
 	struct TDeflator* state;
 
-	if (level >= 10) {
+	if (level > 12) {
 		/* invalid level */
 		return NULL;
 	}
+	if (checkbits(&wbits, &hbits) == 0) {
+		return NULL;
+	}
 
 	if (allocator) {
 		state = allocator->reserve(allocator->user, sizeof(struct TDEFLTPrvt));
@@ -373,6 +731,22 @@ deflator_create(uintxx level, TAllocator* allocator)
 	PRVT->lzlist = NULL;
 	PRVT->wnsize = PRVT->lzsize = 0;
 	PRVT->extra  = NULL;
+	PRVT->oparser = NULL;
+	PRVT->btree   = NULL;
+	PRVT->cacheok = 0;
+	PRVT->dctnrsize = 0;
+	PRVT->dctnrkept = 0;
+
+	PRVT->codes    = NULL;
+	PRVT->usecodes = 0;
+	PRVT->sampling = NULL;
+	PRVT->strategy = DEFLT_SDEFAULT;
+	PRVT->mfinder  = DEFLT_MFDEFAULT;
+
+	PRVT->wndwbits = wbits;
+	PRVT->wndwsize = (uintxx) 1 << wbits;
+	PRVT->hmask = SETMASK(hbits);
+	PRVT->smask = SETMASK(wbits + 1);
 
 	deflator_reset(state, level);
 	if (state->error) {
@@ -382,23 +756,80 @@ deflator_create(uintxx level, TAllocator* allocator)
 	return state;
 }
 
+TDeflator*
+deflator_createinplace(uintxx level, uintxx wbits, uintxx hbits,
+	void* memory, uintxx size)
+{
+	TAllocator* allocator;
+	uintxx n;
+
+	/* an aligned block can be a bit smaller, but the size must not depend
+	 * on the address */
+	n = deflator_memsize(level, wbits, hbits);
+	if (n == 0 || size < n) {
+		return NULL;
+	}
+
+	allocator = arena_create(memory, size);
+	if (allocator == NULL) {
+		return NULL;
+	}
+	return deflator_createex(level, wbits, hbits, allocator);
+}
+
 static void
 resetcache(struct TDeflator* state)
 {
 	uintxx i;
 	uintxx j;
 
-	j = SMASK + 1;
+	j = PRVT->smask + 1;
 	for (i = 0; j > i; i++) {
 		PRVT->chain[i] = 0;
 	}
 
-	j = HMASK + 1;
+	j = PRVT->hmask + 1;
 	for (i = 0; j > i; i++) {
 		PRVT->hlist[i] = 0;
 	}
+
+	if (PRVT->usetree) {
+		j = PRVT->smask + 1;
+		for (i = 0; j > i; i++) {
+			PRVT->btree->rnodes[i] = 0;
+		}
+
+		j = H3MASK + 1;
+		for (i = 0; j > i; i++) {
+			PRVT->btree->hlist3[i] = 0;
+		}
+	}
+	PRVT->cacheok = 1;
+}
+
+/* clears the dictionary a reset has kept when the stream doesn't set it */
+static void
+dropdctnr(struct TDeflator* state)
+{
+	uint8* buffer;
+	uint8* end;
+
+	resetcache(state);
+
+	buffer = PRVT->window;
+	end = buffer + PRVT->dctnrkept;
+	while (buffer < end) {
+		*buffer++ = 0;
+	}
+	PRVT->dctnrkept = 0;
 }
 
+/* largest window span cleared entry by entry */
+#define MAXPARTIALRESET 0x2000
+
+static void resetwindowcache(struct TDeflator* state);
+static void undowindowcache(struct TDeflator* state, uintxx start);
+
 CTB_INLINE void
 resetfreqs(TDeflator* state)
 {
@@ -417,23 +848,62 @@ void
 deflator_reset(TDeflator* state, uintxx level)
 {
 	uintxx meminfo;
+	uintxx partial;
+	uintxx keep;
 	uint8* buffer;
 	uint8* end;
 	CTB_ASSERT(state);
 
-	meminfo = getmeminfo(level);
+	meminfo = getmeminfo(level, PRVT->wndwbits);
 	if (meminfo == 0) {
 		/* invalid level */
 		SETERROR(DEFLT_ELEVEL);
 		goto L_ERROR;
 	}
 
+	/* after a small stream with the same level we only need to clear the
+	 * entries it has used, a prepared dictionary is kept for the next one */
+	partial = 0;
+	keep = 0;
+	if (PRVT->cacheok && PRVT->level == level) {
+		uintxx limit;
+		uintxx n;
+
+		if (PRVT->used == 0 && PRVT->dctnrkept) {
+			/* it was not used since the last reset */
+			PRVT->wend = PRVT->window + PRVT->dctnrkept;
+			PRVT->dctnrsize = PRVT->dctnrkept;
+		}
+
+		limit = MAXPARTIALRESET;
+		if (limit > PRVT->wndwsize) {
+			limit = PRVT->wndwsize;
+		}
+		n = (uintxx) (PRVT->wend - PRVT->window);
+
+		/* the insertions of the stream can be undone if it has not wrapped
+		 * the chain (the tree nodes are relinked and the fast parser doesn't
+		 * fill the chain) */
+		if (PRVT->usetree == 0 && PRVT->strategy != DEFLT_SFAST &&
+			n <= PRVT->smask + 1) {
+			keep = PRVT->dctnrsize;
+		}
+		if (n - keep <= limit) {
+			partial = 1;
+		}
+		else {
+			keep = 0;
+		}
+	}
+	PRVT->dctnrsize = 0;
+	PRVT->dctnrkept = keep;
+
 	PRVT->level = level;
+	setparameters(state, level);
 	if (allocatemem(state, meminfo) == 0) {
 		SETERROR(DEFLT_EOOM);
 		goto L_ERROR;
 	}
-	setparameters(state, level);
 
 	state->state = 0;
 	state->flush = 0;
@@ -460,18 +930,42 @@ deflator_reset(TDeflator* state, uintxx level)
 	PRVT->bbuffer = 0;
 	PRVT->bcount  = 0;
 
+#if defined(JDEFLATE_STATS)
+	PRVT->stats = (struct TDEFLTStats) {0};
+#endif
+
 	if (PRVT->level) {
 		PRVT->base   = 0;
 		PRVT->cursor = 0;
+		PRVT->tpending = 0;
+		PRVT->bstart = 0;
+		PRVT->bsize  = 0;
+		PRVT->rstart = 0;
+		PRVT->rentries = 0;
 
 		PRVT->zend = PRVT->lzlist;
 		PRVT->zptr = PRVT->lzlist;
-		resetcache(state);
+		PRVT->extra->reuseok = 0;
+		if (keep) {
+			undowindowcache(state, keep);
+		}
+		else {
+			if (partial)
+				resetwindowcache(state);
+			else
+				resetcache(state);
+		}
 	}
 
 	/* we don't need this */
 	buffer = PRVT->window;
-	for (end = buffer + PRVT->wnsize; buffer < end;) {
+	end = buffer + PRVT->wnsize;
+	if (partial) {
+		/* the rest was not used */
+		buffer += keep;
+		end = PRVT->wend;
+	}
+	while (buffer < end) {
 		*buffer++ = 0;
 		*buffer++ = 0;
 		*buffer++ = 0;
@@ -501,6 +995,12 @@ deflator_destroy(TDeflator* state)
 	if (PRVT->extra) {
 		_release(PRVT, PRVT->extra);
 	}
+	if (PRVT->oparser) {
+		_release(PRVT, PRVT->oparser);
+	}
+	if (PRVT->btree) {
+		_release(PRVT, PRVT->btree);
+	}
 	_release(PRVT, state);
 }
 
@@ -577,6 +1077,7 @@ endstream(struct TDeflator* state)
 				putbits(state, 0, 1);
 			}
 			putbits(state, 0, 2);
+			STATSADD(blocks[0], 1);
 
 			PRVT->blockinit++;
 		}
@@ -604,6 +1105,7 @@ endstream(struct TDeflator* state)
 	}
 
 	PRVT->blockinit = 0;
+	PRVT->substate  = 0;
 	PRVT->aux1 = 0;
 	return 0;
 }
@@ -612,6 +1114,8 @@ endstream(struct TDeflator* state)
 static uintxx compress0(struct TDeflator* state);
 static uintxx compress1(struct TDeflator* state);
 static uintxx compress2(struct TDeflator* state);
+static uintxx compress3(struct TDeflator* state);
+static uintxx compress4(struct TDeflator* state);
 
 static uintxx flushblck(struct TDeflator* state);
 
@@ -624,29 +1128,47 @@ deflator_deflate(TDeflator* state, eDEFLTFlush flush)
 	if (flush && (state->flush == 0 || state->flush == DEFLT_FLUSH)) {
 		state->flush = flush;
 	}
+	if (flush == DEFLT_FLUSH) {
+		/* the last positions get hashed before the next bytes arrive */
+		PRVT->cacheok = 0;
+	}
 
+	if (CTB_UNLIKELY(PRVT->dctnrkept) && PRVT->used == 0) {
+		dropdctnr(state);
+	}
 	PRVT->used = 1;
 	for (;;) {
 		switch (state->state) {
 			case 0: {
-				switch (PRVT->level) {
-					case 0:
-						/* flush is handled by this function */
-						r = compress0(state);
-						if (r == 0) {
-							SETSTATE(2);
-							continue;
-						}
-						return r;
-					case 1:
-					case 2:
-					case 3:
-					case 4:
-						r = compress1(state);
-						break;
-					default:  /* 5 6 7 8 9 */
-						r = compress2(state);
-						break;
+				if (PRVT->strategy && PRVT->level) {
+					/* the strategy replaces the parser of the level */
+					r = compress4(state);
+				}
+				else {
+					switch (PRVT->level) {
+						case 0:
+							/* flush is handled by this function */
+							r = compress0(state);
+							if (r == 0) {
+								SETSTATE(2);
+								continue;
+							}
+							return r;
+						case 1:
+						case 2:
+						case 3:
+						case 4:
+							r = compress1(state);
+							break;
+						case 10:
+						case 11:
+						case 12:
+							r = compress3(state);
+							break;
+						default:  /* 5 6 7 8 9 */
+							r = compress2(state);
+							break;
+					}
 				}
 
 				if (r) {
@@ -700,6 +1222,54 @@ L_ERROR:
 	return DEFLT_ERROR;
 }
 
+uintxx
+deflator_getstats(TDeflator* state, TDEFLTStats* stats)
+{
+	CTB_ASSERT(state && stats);
+
+#if defined(JDEFLATE_STATS)
+	stats[0] = PRVT->stats;
+	return 1;
+#else
+	stats[0] = (struct TDEFLTStats) {0};
+	return 0;
+#endif
+}
+
+uintxx
+deflator_bound(TDeflator* state, uintxx size)
+{
+	uintxx blocks;
+	(void) state;
+
+	/* stored blocks take 5 bytes every 32KB, the other blocks can take up to
+	 * 9 bits per byte (a dynamic block is only used if it is smaller than the
+	 * static one, the trees are less than 300 bytes every 8KB here) */
+	blocks = (size >> 13) + 1;
+	return size + (size >> 3) + (size >> 6) + (blocks * 300) + 16;
+}
+
+eDEFLTResult
+deflator_compressbuffer(TDeflator* state, const uint8* source, uintxx ssize,
+	uint8* target, uintxx tsize)
+{
+	eDEFLTResult r;
+	CTB_ASSERT(state);
+
+	deflator_reset(state, PRVT->level);
+	if (state->error) {
+		return DEFLT_ERROR;
+	}
+
+	deflator_setsrc(state, (uint8*) source, ssize);
+	deflator_settgt(state, target, tsize);
+	r = deflator_deflate(state, DEFLT_END);
+	if (r == DEFLT_TGTEXHSTD) {
+		SETSTATE(DEFLT_BADSTATE);
+	}
+	return r;
+}
+
 /* block types */
 #define BLOCKSTRD 0
 #define BLOCKSTTC 1
@@ -753,6 +1323,7 @@ L_LOOP:
 	}
 
 	PRVT->blockinit = 0;
+	STATSADD(blocks[BLOCKSTRD], 1);
 
 L_STATE1:
 	if (PRVT->blockinit == 0) {
@@ -931,7 +1502,7 @@ limitlengths(uintxx* lengths, intxx size, intxx mlen)
 
 	i--;
 	for (; i >= 0; i--) {
-		while (k + ktable[lengths[i]] <= ktable[0]) {
+		while (lengths[i] > 1 && k + ktable[lengths[i]] <= ktable[0]) {
 			k += ktable[lengths[i]--];
 		}
 	}
@@ -1258,11 +1829,12 @@ buildtables(struct TDEFLTExtra* extra)
 		extra->cfrqs[i] = 0;
 	}
 
-	/* extra->lfrqs and extra->dfrqs are modified in place like in the
-	 * function setuptable above, after this it will containt the symbols for
-	 * precodes and will end with 0xffff */
-	countprecodes(extra->lfrqs, lmax, extra->cfrqs);
-	countprecodes(extra->dfrqs, dmax, extra->cfrqs);
+	/* extra->lfrqs and extra->dfrqs have the lengths now (see setuptable
+	 * above), the trees get the symbols for precodes and end with 0xffff */
+	ctb_memcpy(extra->ltree, extra->lfrqs, sizeof(extra->ltree));
+	ctb_memcpy(extra->dtree, extra->dfrqs, sizeof(extra->dtree));
+	countprecodes(extra->ltree, lmax, extra->cfrqs);
+	countprecodes(extra->dtree, dmax, extra->cfrqs);
 
 	setuptable(extra, CTABLEMODE, extra->cfrqs);
 
@@ -1308,8 +1880,10 @@ buildtables(struct TDEFLTExtra* extra)
 #define EMIT(BB, BC, BITS, N) BB |= (BBTYPE) (BITS) << (BC); BC += (N);
 
 
-static uintxx
-emitlzfast(struct TDeflator* state)
+/* if checked is zero the caller must ensure that the target buffer can hold
+ * the whole block */
+CTB_FORCEINLINE uintxx
+emitlzloop(struct TDeflator* state, uintxx checked, uintxx isstatic)
 {
 	BBTYPE bb;
 	uintxx bc;
@@ -1327,6 +1901,10 @@ emitlzfast(struct TDeflator* state)
 	littable = PRVT->extra->littable;
 	lnstable = PRVT->extra->lnstable;
 	dsttable = PRVT->extra->dsttable;
+	if (isstatic) {
+		littable = (struct THCode1*) slitcodes;
+		dsttable = (struct THCode2*) sdstcodes;
+	}
 
 	/* load the state */
 	bb = PRVT->bbuffer;
@@ -1335,7 +1913,8 @@ emitlzfast(struct TDeflator* state)
 	target = state->target;
 
 	r = 1;
-	while ((uintxx) (state->tend - target) >= (8 + (sizeof(BBTYPE) << 1))) {
+	while (checked == 0 ||
+		(uintxx) (state->tend - target) >= (8 + (sizeof(BBTYPE) << 1))) {
 		if (CTB_LIKELY(lzlist[0] < 0x8000)) {
 			code1 = littable[lzlist[0]];
 
@@ -1352,6 +1931,26 @@ emitlzfast(struct TDeflator* state)
 			continue;
 		}
 
+#if defined(CTB_ENV64)
+		if (isstatic) {
+			uint64 bits;
+
+			/* the length and the distance with their extra bits take 31
+			 * bits at most, a single emit */
+			code1 = sfusedlns[lzlist[0] - (0x8000 + MINMATCH)];
+			dcode = dsttable[(uint8) (lzlist[2] >> 0x00)];
+
+			bits = (uint64) (lzlist[1] - dcode.base) << dcode.bitlen;
+			bits = (bits | dcode.code) << code1.bitlen;
+
+			ENSURE4ON64(target, bb, bc);
+			EMIT(bb, bc,
+				bits | code1.code, code1.bitlen + dcode.bitlen + dcode.bextra);
+			lzlist += 3;
+			continue;
+		}
+#endif
+
 		lcode = lnstable[(uint8) (lzlist[2] >> 0x08)];
 		dcode = dsttable[(uint8) (lzlist[2] >> 0x00)];
 
@@ -1390,44 +1989,338 @@ L_DONE:
 	return r;
 }
 
-#undef W1
-#undef W2
-#undef W3
-#undef W4
-#undef W5
-#undef W6
-#undef EMIT
+#if defined(CPUINFO_X86) && defined(CPUINFO_HASTARGET)
+	#define DEFLT_BMI2
+#endif
 
 static uintxx
-emitlz(struct TDeflator* state)
+emitlzfastgeneric(struct TDeflator* state)
 {
-	uintxx extra;
-	uintxx r;
-	uintxx fastcheck;
-	struct THCode1* littable;
-	struct THCode2* lnstable;
-	struct THCode2* dsttable;
-	struct THCode1 code1;
-	struct THCode2 code2;
+	return emitlzloop(state, 1, 0);
+}
 
-	littable = PRVT->extra->littable;
-	lnstable = PRVT->extra->lnstable;
-	dsttable = PRVT->extra->dsttable;
+static uintxx
+emitlzuncheckedgeneric(struct TDeflator* state)
+{
+	return emitlzloop(state, 0, 0);
+}
 
-	fastcheck = 1;
-	switch (PRVT->aux1) {
-		case 0:
-			break;
-		case 1: goto L_STATE1;
-		case 2: goto L_STATE2;
-		case 3: goto L_STATE2;
-	}
+/* static blocks, the tables are known and the matches use fused codes */
+static uintxx
+emitstfastgeneric(struct TDeflator* state)
+{
+	return emitlzloop(state, 1, 1);
+}
+
+static uintxx
+emitstuncheckedgeneric(struct TDeflator* state)
+{
+	return emitlzloop(state, 0, 1);
+}
+
+#if defined(DEFLT_BMI2)
+
+/* the same loops, the variable shifts become shlx and shrx */
+CPUINFO_TARGET("bmi2")
+static uintxx
+emitlzfastbmi2(struct TDeflator* state)
+{
+	return emitlzloop(state, 1, 0);
+}
+
+CPUINFO_TARGET("bmi2")
+static uintxx
+emitlzuncheckedbmi2(struct TDeflator* state)
+{
+	return emitlzloop(state, 0, 0);
+}
+
+CPUINFO_TARGET("bmi2")
+static uintxx
+emitstfastbmi2(struct TDeflator* state)
+{
+	return emitlzloop(state, 1, 1);
+}
+
+CPUINFO_TARGET("bmi2")
+static uintxx
+emitstuncheckedbmi2(struct TDeflator* state)
+{
+	return emitlzloop(state, 0, 1);
+}
+
+#endif
+
+/* the emit loops are selected at runtime (the second entry is used by the
+ * static blocks) */
+typedef uintxx (*TEmitLZFn)(struct TDeflator*);
+
+static uintxx emitlzfastselect(struct TDeflator*);
+static uintxx emitlzuncheckedselect(struct TDeflator*);
+
+static TEmitLZFn emitlzfast[2] = {
+	emitlzfastselect, emitlzfastselect
+};
+static TEmitLZFn emitlzunchecked[2] = {
+	emitlzuncheckedselect, emitlzuncheckedselect
+};
+
+
+static void
+selectemitlz(void)
+{
+	TEmitLZFn fn1;
+	TEmitLZFn fn2;
+	TEmitLZFn fn3;
+	TEmitLZFn fn4;
+
+	fn1 = emitlzfastgeneric;
+	fn2 = emitlzuncheckedgeneric;
+	fn3 = emitstfastgeneric;
+	fn4 = emitstuncheckedgeneric;
+#if defined(DEFLT_BMI2)
+	if (cpuinfo_getfeatures() & CPU_BMI2) {
+		fn1 = emitlzfastbmi2;
+		fn2 = emitlzuncheckedbmi2;
+		fn3 = emitstfastbmi2;
+		fn4 = emitstuncheckedbmi2;
+	}
+#endif
+
+	emitlzfast[0]      = fn1;
+	emitlzunchecked[0] = fn2;
+	emitlzfast[1]      = fn3;
+	emitlzunchecked[1] = fn4;
+}
+
+static uintxx
+emitlzfastselect(struct TDeflator* state)
+{
+	selectemitlz();
+	return emitlzfast[PRVT->blocktype == BLOCKSTTC](state);
+}
+
+static uintxx
+emitlzuncheckedselect(struct TDeflator* state)
+{
+	selectemitlz();
+	return emitlzunchecked[PRVT->blocktype == BLOCKSTTC](state);
+}
+
+
+CTB_FORCEINLINE bool hasrun(uint8*);
+CTB_FORCEINLINE uintxx getrun(uint8*, uint8*);
+CTB_FORCEINLINE uintxx getlsymbol(uintxx);
+
+/* huffman only and run length blocks (see compress4) */
+#define ISRAWBLOCK(S) \
+	((S)->strategy == DEFLT_SHUFFMAN || (S)->strategy == DEFLT_SRLE)
+
+/* emits the symbols of the window bytes from p to cend (the last run can go
+ * up to end), the caller ensures that the target can hold them */
+CTB_FORCEINLINE uint8*
+emitrawloop(struct TDeflator* state, uint8* p, uint8* cend, uint8* end,
+	uintxx isrle)
+{
+	BBTYPE bb;
+	uintxx bc;
+	uintxx n;
+	uint8* target;
+	uint8* window;
+	struct THCode1* littable;
+	struct THCode2* lnstable;
+	struct THCode1 code1;
+	struct THCode2 lcode;
+	struct THCode2 dcode;
+
+	littable = PRVT->extra->littable;
+	lnstable = PRVT->extra->lnstable;
+	dcode = PRVT->extra->dsttable[0];
+	window = PRVT->window;
+
+	/* load the state */
+	bb = PRVT->bbuffer;
+	bc = PRVT->bcount;
+	target = state->target;
+
+	if (isrle && p == window && p < cend) {
+		/* the position zero has no run */
+		code1 = littable[*p++];
+		ENSURE2ON64(target, bb, bc);
+		ENSURE2ON32(target, bb, bc);
+		EMIT(bb, bc, code1.code, code1.bitlen);
+	}
+	while (p < cend) {
+		if (isrle && hasrun(p)) {
+			n = getrun(p, end);
+			if (n) {
+				lcode = lnstable[getlsymbol(n)];
+
+				/* length 15 + 5 */
+				ENSURE3ON64(target, bb, bc);
+				ENSURE2ON32(target, bb, bc);
+				EMIT(bb, bc, lcode.code, lcode.bitlen);
+				if (lcode.bextra) {
+					ENSURE2ON32(target, bb, bc);
+					EMIT(bb, bc, n - lcode.base, lcode.bextra);
+				}
+
+				/* distance one */
+				ENSURE4ON64(target, bb, bc);
+				ENSURE2ON32(target, bb, bc);
+				EMIT(bb, bc, dcode.code, dcode.bitlen);
+				p += n;
+				continue;
+			}
+		}
+
+		code1 = littable[p[0]];
+		ENSURE2ON64(target, bb, bc);
+		ENSURE2ON32(target, bb, bc);
+		EMIT(bb, bc, code1.code, code1.bitlen);
+		p++;
+	}
+
+	/* restore the state */
+	PRVT->bbuffer = bb;
+	PRVT->bcount  = bc;
+	state->target = target;
+	return p;
+}
+
+/* appends the tokens of the window bytes from p to end (the same parse that
+ * counted them) to the lz buffer */
+static void
+moveraw(struct TDeflator* state, uint8* p, uint8* end)
+{
+	uintxx n;
+	uint16* zend;
+
+	zend = PRVT->zend;
+	if (PRVT->strategy == DEFLT_SRLE) {
+		if (p == PRVT->window && p < end) {
+			*zend++ = *p++;
+		}
+		while (p < end) {
+			if (hasrun(p) && (n = getrun(p, end)) != 0) {
+				zend[0] = (uint16) (n | 0x8000);
+				zend[1] = 1;
+				zend[2] = (uint16) (getlsymbol(n) << 0x08);
+				zend += 3;
+				p += n;
+				continue;
+			}
+			*zend++ = *p++;
+		}
+	}
+	else {
+		while (p < end) {
+			*zend++ = *p++;
+		}
+	}
+	PRVT->zend = zend;
+}
+
+/* writes the symbols of a huffman only or run length block that are not in
+ * the lz buffer straight from the window. A symbol never takes more than two
+ * bytes per input byte, when the target gets short the remaining symbols
+ * are moved to the lz buffer (before the end of block symbol) and emitlz
+ * writes them */
+static void
+emitraw(struct TDeflator* state)
+{
+	uintxx n;
+	uint8* p;
+	uint8* end;
+	uint8* cend;
+
+	p   = PRVT->window + PRVT->rstart;
+	end = PRVT->window + PRVT->cursor;
+	while (p < end) {
+		n = (uintxx) (state->tend - state->target);
+		if (n < 8 + (sizeof(BBTYPE) << 1) + 2) {
+			break;
+		}
+		n = (n - (8 + (sizeof(BBTYPE) << 1))) >> 1;
+
+		cend = end;
+		if (n < (uintxx) (end - p)) {
+			cend = p + n;
+		}
+		if (PRVT->strategy == DEFLT_SRLE) {
+			p = emitrawloop(state, p, cend, end, 1);
+		}
+		else {
+			p = emitrawloop(state, p, cend, end, 0);
+		}
+	}
+
+	if (p < end) {
+		PRVT->zend = PRVT->lzlist;
+		moveraw(state, p, end);
+		*PRVT->zend++ = BLOCKENDSYMBOL;
+	}
+}
+
+#if defined(DEFLT_BMI2)
+	#undef DEFLT_BMI2
+#endif
+
+#undef W1
+#undef W2
+#undef W3
+#undef W4
+#undef W5
+#undef W6
+#undef EMIT
+
+static uintxx
+emitlz(struct TDeflator* state)
+{
+	uintxx extra;
+	uintxx r;
+	uintxx fastcheck;
+	struct THCode1* littable;
+	struct THCode2* lnstable;
+	struct THCode2* dsttable;
+	struct THCode1 code1;
+	struct THCode2 code2;
+
+	littable = PRVT->extra->littable;
+	lnstable = PRVT->extra->lnstable;
+	dsttable = PRVT->extra->dsttable;
+
+	fastcheck = 1;
+	switch (PRVT->aux1) {
+		case 0:
+			break;
+		case 1: goto L_STATE1;
+		case 2: goto L_STATE2;
+		case 3: goto L_STATE2;
+	}
 
 L_LOOP:
 	if (CTB_UNLIKELY(fastcheck)) {
 		uintxx remaining = (uintxx) (state->tend - state->target);
+		uintxx worstcase;
+
+		/* a code plus its extra bits never takes more than 16 bits per
+		 * token entry (12 using the static codes), if the whole block fits
+		 * we can skip the bounds checks */
+		worstcase = (uintxx) (PRVT->zend - PRVT->zptr);
+		if (PRVT->blocktype == BLOCKDNMC) {
+			worstcase = worstcase << 1;
+		}
+		else {
+			worstcase = worstcase + (worstcase >> 1);
+		}
+		if (remaining >= worstcase + (sizeof(BBTYPE) << 1)) {
+			emitlzunchecked[PRVT->blocktype == BLOCKSTTC](state);
+			goto L_DONE;
+		}
+
 		if (remaining >= ((sizeof(BBTYPE) << 1) << 2)) {
-			r = emitlzfast(state);
+			r = emitlzfast[PRVT->blocktype == BLOCKSTTC](state);
 			if (r == 0) {
 				goto L_DONE;
 			}
@@ -1560,10 +2453,10 @@ L_STATE1:
 L_STATE2:
 	/* trees */
 	if (PRVT->aux1 == 2) {
-		slist = PRVT->extra->lfrqs;
+		slist = PRVT->extra->ltree;
 	}
 	else {
-		slist = PRVT->extra->dfrqs;
+		slist = PRVT->extra->dtree;
 	}
 
 	while ((symbol = slist[PRVT->aux2]) ^ 0xffff) {
@@ -1610,593 +2503,2917 @@ L_STATE2:
 	return 0;
 }
 
+/* writes the encoded trees of the custom codes */
 static uintxx
-flushblck(struct TDeflator* state)
+emitheader(struct TDeflator* state)
 {
-	uintxx total;
-	uintxx r;
-
-	switch (PRVT->substate) {
-		case 0:
-			break;
-		case 1: goto L_STATE1;
-		case 2: goto L_STATE2;
-		case 3: goto L_STATE3;
-	}
-
-	total = (uintxx) (PRVT->zend - PRVT->zptr);
-	if (total == 0) {
-		SETSTATE(0);
-		PRVT->substate  = 0;
-		PRVT->blockinit = 0;
-		return 0;
-	}
+	uintxx n;
+	const struct TDEFLTCodes* codes;
 
-	/* append the end-of-block symbol */
-	PRVT->extra->lfrqs[BLOCKENDSYMBOL]++;
-	PRVT->zend[0] = BLOCKENDSYMBOL;
-	PRVT->zend++;
+	codes = PRVT->codes;
+	for (; PRVT->aux2 < codes->hbits; PRVT->aux2 += n) {
+		n = codes->hbits - PRVT->aux2;
+		if (n > 8)
+			n = 8;
 
-	if (total < 0x400) {
-		/* force an static block for small blocks */
-		PRVT->blocktype = BLOCKSTTC;
-	}
-	else {
-		if (PRVT->level == 1) {
-			PRVT->blocktype = BLOCKSTTC;
+		if (tryemitbits(state, n)) {
+			putbits(state, codes->header[PRVT->aux2 >> 3] & SETMASK(n), n);
 		}
 		else {
-			PRVT->blocktype = BLOCKDNMC;
+			return 1;
 		}
 	}
 
-	if (PRVT->blocktype == BLOCKDNMC) {
-		PRVT->extra->littable = PRVT->extra->litcodes;
-		PRVT->extra->lnstable = PRVT->extra->lnscodes;
-		PRVT->extra->dsttable = PRVT->extra->dstcodes;
-		buildtables(PRVT->extra);
-	}
-	else {
-		PRVT->extra->littable = (void*) slitcodes;
-		PRVT->extra->lnstable = (void*) slnscodes;
-		PRVT->extra->dsttable = (void*) sdstcodes;
-	}
+	PRVT->aux2 = 0;
+	return 0;
+}
 
-L_STATE1:
-	/* block header */
-	if (tryemitbits(state, 3)) {
-		putbits(state, 0, 1);
-		putbits(state, PRVT->blocktype, 2);
+/* size in bits of the block symbols without the extra bits (they are the
+ * same for any code), or zero if a symbol has no code */
+static uintxx
+getblockcost(const uintxx* lfrqs, const uintxx* dfrqs,
+	const struct THCode1* littable, const struct THCode2* lnstable,
+	const struct THCode2* dsttable)
+{
+	uintxx i;
+	uintxx total;
+	uintxx missing;
+
+	total = missing = 0;
+	for (i = 0; i < MAXLTCODES; i++) {
+		total += lfrqs[i] * littable[i].bitlen;
+		missing |= lfrqs[i] && littable[i].bitlen == 0;
 	}
-	else {
-		PRVT->substate = 1;
-		return DEFLT_TGTEXHSTD;
+	for (i = 0; i < 29; i++) {
+		total += lfrqs[MAXLTCODES + i] * lnstable[i].bitlen;
+		missing |= lfrqs[MAXLTCODES + i] && lnstable[i].bitlen == 0;
 	}
-
-L_STATE2:
-	if (PRVT->blocktype == BLOCKDNMC) {
-		r = emittrees(state);
-		if (r) {
-			PRVT->substate = 2;
-			return DEFLT_TGTEXHSTD;
-		}
+	for (i = 0; i < 30; i++) {
+		total += dfrqs[i] * dsttable[i].bitlen;
+		missing |= dfrqs[i] && dsttable[i].bitlen == 0;
 	}
 
-L_STATE3:
-	r = emitlz(state);
-	if (r) {
-		PRVT->substate = 3;
-		return DEFLT_TGTEXHSTD;
+	if (missing) {
+		return 0;
 	}
-
-	SETSTATE(0);
-	PRVT->substate  = 0;
-	PRVT->blockinit = 0;
-	return 0;
+	return total;
 }
 
-
-CTB_INLINE void
-insert(struct TDeflator* state, uint16 offset, uint16 hhash)
+/* size in bits of the trees (see emittrees) */
+static uintxx
+gettreescost(struct TDEFLTExtra* extra)
 {
-	uintxx hindex;
+	uintxx i;
+	uintxx j;
+	uintxx total;
+	uintxx symbol;
+	uintxx* slist;
 
-	hindex = hhash & HMASK;
+	total = 14 + extra->cmax * 3;
+	for (j = 0; j < 2; j++) {
+		slist = extra->ltree;
+		if (j) {
+			slist = extra->dtree;
+		}
 
-	PRVT->chain[offset & SMASK] = PRVT->hlist[hindex];
-	PRVT->hlist[hindex] = offset;
+		for (i = 0; (symbol = slist[i]) ^ 0xffff; i++) {
+			total += extra->precodes[symbol].bitlen;
+			switch (symbol) {
+				case 16: total += 2; i++; break;
+				case 17: total += 3; i++; break;
+				case 18: total += 7; i++; break;
+			}
+		}
+	}
+	return total;
 }
 
+/* stored blocks can't hold more than this */
+#define MAXSTRDBLOCK 0xffff
 
-#if !defined(CTB_STRICTALIGNMENT) && defined(CTB_FASTUNALIGNED)
-	#define GETSHEAD3(B, N) ((*((uint32*) ((B) + (N)))) & 0xffffffL)
-	#define GETSHEAD4(B, N) ((*((uint32*) ((B) + (N)))))
-#else
-	#define GETSHEAD3(B, N) \
-	    ((B)[(N) + 0] << 0x00) | \
-	    ((B)[(N) + 1] << 0x08) | \
-	    ((B)[(N) + 2] << 0x10)
-
-	#define GETSHEAD4(B, N) GETSHEAD3(B, N) | ((B)[(N) + 3] << 0x18)
-#endif
-
-#define GETHHASH(H) (((H) * 0x9e3779b1) >> 16)
+/* the last codes are kept with up to 1/32 more bits per symbol */
+#define REUSESHIFT 5
 
+/* the custom codes are taken without building the codes of the block with
+ * up to 1/128 more bits per symbol than the sample */
+#define CODESSHIFT 7
 
-void
-deflator_setdctnr(TDeflator* state, uint8* dict, uintxx size)
+/* chooses the encoding that takes less bits (stored if the block bytes are
+ * still in the window, static, custom or dynamic), level 1 doesn't try the
+ * dynamic codes (unless a strategy is set), neither does a block that fits
+ * the custom codes, and the dynamic codes of the last block are used again
+ * while they fit the symbols */
+static uintxx
+selectblock(struct TDeflator* state)
 {
 	uintxx i;
-	CTB_ASSERT(state && dict);
+	uintxx c;
+	uintxx n;
+	uintxx bits;
+	uintxx ebits;
+	uintxx built;
+	uintxx blocktype;
+	uintxx trydynamic;
+	struct TDEFLTExtra* extra;
+	const struct TDEFLTCodes* codes;
+	uintxx lfrqs[DEFLT_LMAXSYMBOL];
+	uintxx dfrqs[DEFLT_DMAXSYMBOL];
 
-	if (PRVT->used) {
-		SETERROR(DEFLT_EINCORRECTUSE);
-		SETSTATE(DEFLT_BADSTATE);
-		return;
+	extra = PRVT->extra;
+
+	/* extra bits, they don't depend on the codes */
+	ebits = 0;
+	for (i = 0; i < 29; i++) {
+		ebits += extra->lfrqs[MAXLTCODES + i] * slnscodes[i].bextra;
 	}
-	if (PRVT->level == 0) {
-		return;
+	for (i = 0; i < 30; i++) {
+		ebits += extra->dfrqs[i] * sdstcodes[i].bextra;
 	}
 
-	if (size > WNDWSIZE)
-		size = WNDWSIZE;
+	blocktype = BLOCKSTTC;
+	PRVT->usecodes = 0;
+	bits = getblockcost(
+		extra->lfrqs, extra->dfrqs, slitcodes, slnscodes, sdstcodes);
 
-	if (PRVT->level <= 4) {
-		for (i = 0; i < size - 2; i++) {
-			insert(state, (uint16) i, GETHHASH(GETSHEAD3(dict, i)));
-		}
+	n = 0;
+	for (i = 0; i < DEFLT_LMAXSYMBOL; i++) {
+		n += extra->lfrqs[i];
 	}
-	else {
-		for (i = 0; i < size - 2; i++) {
-			insert(state, (uint16) i, GETHHASH(GETSHEAD4(dict, i)));
+
+	trydynamic = PRVT->level != 1 || PRVT->strategy;
+
+	codes = PRVT->codes;
+	if (codes) {
+		c = getblockcost(extra->lfrqs, extra->dfrqs,
+			codes->litcodes, codes->lnscodes, codes->dstcodes);
+		if (c && c + codes->hbits < bits) {
+			uint64 limit;
+
+			blocktype = BLOCKDNMC;
+			bits = c + codes->hbits;
+			PRVT->usecodes = 1;
+
+			/* the codes of the block are not built if the custom codes take
+			 * about as many bits per symbol as in the sample (the slower
+			 * levels always build them) */
+			limit = (uint64) codes->sbits * n;
+			limit = limit + (limit >> CODESSHIFT);
+			if ((uint64) c * codes->scount <= limit) {
+				if (PRVT->level < 9 || PRVT->strategy) {
+					trydynamic = 0;
+				}
+			}
 		}
 	}
-	ctb_memcpy(PRVT->window, dict, size);
-	PRVT->wend  += size;
-	PRVT->cursor = size;
 
-	PRVT->used = 1;
-}
+	built = 0;
+	if (trydynamic) {
+		c = 0;
+		if (extra->reuseok) {
+			uint64 limit;
+
+			/* the last codes are kept if they take about as many bits per
+			 * symbol as in the block they were built for */
+			c = getblockcost(extra->lfrqs, extra->dfrqs,
+				extra->litcodes, extra->lnscodes, extra->dstcodes);
+
+			limit = (uint64) extra->rbits * n;
+			limit = limit + (limit >> REUSESHIFT);
+			if ((uint64) c * extra->rcount > limit) {
+				c = 0;
+			}
+		}
 
-static uintxx
-slidewindow(struct TDeflator* state)
-{
-	uintxx r;
-	uint8* b;
-	uint8* w;
-	uint8* end;
+		if (c == 0) {
+			/* the frequencies are replaced by the lengths */
+			for (i = 0; i < DEFLT_LMAXSYMBOL; i++) {
+				lfrqs[i] = extra->lfrqs[i];
+			}
+			for (i = 0; i < DEFLT_DMAXSYMBOL; i++) {
+				dfrqs[i] = extra->dfrqs[i];
+			}
+			buildtables(extra);
+			built = 1;
 
-	b = PRVT->window + (PRVT->cursor - WNDWSIZE);
-	w = PRVT->window;
-#if defined(CTB_ENV64)
-	r = ((uintxx) b) & (8 - 1);
-#else
-	r = ((uintxx) b) & (4 - 1);
-#endif
-	b = b - r;
+			c = getblockcost(lfrqs, dfrqs,
+				extra->litcodes, extra->lnscodes, extra->dstcodes);
+			extra->tbits = gettreescost(extra);
+			extra->rbits  = c;
+			extra->rcount = n;
 
-	/* move the window lower part of the buffer */
-	end = PRVT->wend;
-#if defined(CTB_ENV64)
-	while (end - b >= 32) {
-		((uint64*) w)[0] = ((uint64*) b)[0];
-		((uint64*) w)[1] = ((uint64*) b)[1];
-		((uint64*) w)[2] = ((uint64*) b)[2];
-		((uint64*) w)[3] = ((uint64*) b)[3];
-		b += 32;
-		w += 32;
+			/* the slower levels always build the codes */
+			extra->reuseok = PRVT->level < 9 || PRVT->strategy;
+		}
+
+		c += extra->tbits;
+		if (c < bits) {
+			blocktype = BLOCKDNMC;
+			bits = c;
+			PRVT->usecodes = 0;
+		}
 	}
-#else
-	while (end - b >= 16) {
-		((uint32*) w)[0] = ((uint32*) b)[0];
-		((uint32*) w)[1] = ((uint32*) b)[1];
-		((uint32*) w)[2] = ((uint32*) b)[2];
-		((uint32*) w)[3] = ((uint32*) b)[3];
-		b += 16;
-		w += 16;
+	bits += ebits + 3;
+
+	/* the cursor is at the end of the last token */
+	PRVT->bsize = (uintxx) ((intxx) PRVT->cursor - PRVT->bstart);
+	if (PRVT->bstart >= 0) {
+		/* each stored block takes 3 bits, the padding and 4 bytes */
+		c = PRVT->bsize / MAXSTRDBLOCK + 1;
+		if ((PRVT->bsize << 3) + c * (3 + 7 + 32) < bits) {
+			blocktype = BLOCKSTRD;
+			PRVT->usecodes = 0;
+		}
 	}
-#endif
-	while (end > b) {
-		*w++ = *b++;
+	if (blocktype == BLOCKDNMC && PRVT->usecodes == 0 && built == 0) {
+		STATSADD(reusedcodes, 1);
 	}
 
-	PRVT->wend   = w;
-	PRVT->cursor = WNDWSIZE + r;
-	return (uintxx) (b - w);
+	if (PRVT->usecodes) {
+		extra->littable = (void*) codes->litcodes;
+		extra->lnstable = (void*) codes->lnscodes;
+		extra->dsttable = (void*) codes->dstcodes;
+	}
+	else {
+		if (blocktype == BLOCKDNMC) {
+			extra->littable = extra->litcodes;
+			extra->lnstable = extra->lnscodes;
+			extra->dsttable = extra->dstcodes;
+		}
+		else {
+			extra->littable = (void*) slitcodes;
+			extra->lnstable = (void*) slnscodes;
+			extra->dsttable = (void*) sdstcodes;
+		}
+	}
+	return blocktype;
 }
 
+/* writes the bytes of the block as stored blocks (aux2 is the offset of the
+ * current stored block and aux3 the number of bytes written) */
 static uintxx
-fillwindow(struct TDeflator* state)
+emitstored(struct TDeflator* state)
 {
-	uintxx total;
-	uintxx wleft;
-
-	wleft = (uintxx) (PRVT->windowend - PRVT->wend);
-	total = (uintxx) (state->send - state->source);
-
-	if (CTB_LIKELY(total > wleft) && (CTB_LIKELY(wleft < 0x400))) {
-		uintxx slide;
-
-		/* we use this to get the offset in the window
-		 * cursor - base := relative position
-		 * offset        := relative position - hash index */
-		slide = slidewindow(state);
-		PRVT->base -= slide & 0xffff;
+	uintxx n;
+	uintxx length;
+	uint8* source;
 
-		wleft = (uintxx) (PRVT->windowend - PRVT->wend);
+	switch (PRVT->aux1) {
+		case 0:
+			break;
+		case 1:
+			goto L_STATE1;
+		case 2:
+		case 3:
+		case 4:
+		case 5:
+			goto L_STATE2;
+		case 6:
+			goto L_STATE3;
 	}
 
-	if (total > wleft) {
-		total = wleft;
+L_LOOP:
+	if (tryemitbits(state, 3)) {
+		putbits(state, 0, 1);
+		putbits(state, BLOCKSTRD, 2);
 	}
-	if (total) {
-		ctb_memcpy(PRVT->wend, state->source, total);
-		state->source += total;
-		PRVT->wend    += total;
+	else {
+		PRVT->aux1 = 0;
+		return 1;
 	}
-	return total;
-}
-
-
-#if !defined(CTB_STRICTALIGNMENT) && defined(CTB_FASTUNALIGNED)
-
-#if defined(__GNUC__)
-	#if defined(CTB_ENV64)
-		#define CTZERO(X) __builtin_ctzll(X)
-	#else
-		#define CTZERO(X) __builtin_ctzl(X)
-	#endif
-#else
-	#if defined(__has_builtin)
-		#if defined(CTB_ENV64)
-			#if __has_builtin(__builtin_ctzll)
-				#define CTZERO(X) __builtin_ctzll(X)
-			#endif
-		#else
-			#if __has_builtin(__builtin_ctzl)
-				#define CTZERO(X) __builtin_ctzl(X)
-			#endif
-		#endif
-	#endif
-#endif
-
-#if CTB_IS_BIGENDIAN
-	#undef CTZERO
-#endif
 
+L_STATE1:
+	if (tryflushbits(state) == 0) {
+		PRVT->aux1 = 1;
+		return 1;
+	}
+	PRVT->aux1 = 2;
 
-CTB_FORCEINLINE uintxx
-getmatchlength(uint8* p1, uint8* p2, uint8* end)
-{
-	uint8* pp;
-
-#if defined(CTB_ENV64)
-	uint64* c1;
-	uint64* c2;
-#if defined(CTZERO)
-	uint64 xor;
-#endif
-#else
-	uint32* c1;
-	uint32* c2;
-#if defined(CTZERO)
-	uint32 xor;
-#endif
-#endif
+L_STATE2:
+	length = PRVT->bsize - PRVT->aux2;
+	if (length > MAXSTRDBLOCK)
+		length = MAXSTRDBLOCK;
 
-	pp = p1;
-	c1 = (void*) p1;
-	c2 = (void*) p2;
-#if defined(CTZERO)
-	xor = 0;
+	for (; PRVT->aux1 < 6; PRVT->aux1++) {
+		if (state->target >= state->tend) {
+			return 1;
+		}
 
-	do {
-		if ((uint8*) c1 >= end) {
-			return (uintxx) (end - pp);
+		n = length;
+		if (PRVT->aux1 >= 4) {
+			n = ~n;
 		}
-	} while (
-		((xor = *c1++ ^ *c2++) == 0) &&
-		((xor = *c1++ ^ *c2++) == 0) &&
-		((xor = *c1++ ^ *c2++) == 0) &&
-		((xor = *c1++ ^ *c2++) == 0));
+		*state->target++ = (uint8) (n >> ((PRVT->aux1 & 1) << 3));
+	}
+	PRVT->aux3 = 0;
 
-	p1 = ((uint8*) (c1 - 1)) + (CTZERO(xor) >> 3);
-	if (p1 >= end) {
-		return (uintxx) (end - pp);
+L_STATE3:
+	length = PRVT->bsize - PRVT->aux2;
+	if (length > MAXSTRDBLOCK)
+		length = MAXSTRDBLOCK;
+
+	n = length - PRVT->aux3;
+	if (n > (uintxx) (state->tend - state->target)) {
+		n = (uintxx) (state->tend - state->target);
 	}
+	source = PRVT->window + PRVT->bstart + PRVT->aux2 + PRVT->aux3;
+	ctb_memcpy(state->target, source, n);
+	state->target += n;
 
-	return (uintxx) (p1 - pp);
-#else
+	PRVT->aux3 += n;
+	if (PRVT->aux3 < length) {
+		PRVT->aux1 = 6;
+		return 1;
+	}
 
-	do {
-		if ((uint8*) c1 >= end) {
-			return (uintxx) (end - pp);
-		}
-	} while (
-		(*c1++ == *c2++) &&
-		(*c1++ == *c2++) &&
-		(*c1++ == *c2++) &&
-		(*c1++ == *c2++));
+	PRVT->aux2 += length;
+	if (PRVT->aux2 < PRVT->bsize) {
+		goto L_LOOP;
+	}
 
-	p1 = (void*) (c1 - 1);
-	p2 = (void*) (c2 - 1);
+	PRVT->aux1 = 0;
+	PRVT->aux2 = 0;
+	PRVT->aux3 = 0;
+	PRVT->zptr = PRVT->lzlist;
+	PRVT->zend = PRVT->lzlist;
+	return 0;
+}
 
-	if (p1[0] ^ p2[0]) { p1 += 0; goto L1; }
-	if (p1[1] ^ p2[1]) { p1 += 1; goto L1; }
-	if (p1[2] ^ p2[2]) { p1 += 2; goto L1; }
-	if (p1[3] ^ p2[3]) { p1 += 3; goto L1; }
-#if defined(CTB_ENV64)
-	if (p1[4] ^ p2[4]) { p1 += 4; goto L1; }
-	if (p1[5] ^ p2[5]) { p1 += 5; goto L1; }
-	if (p1[6] ^ p2[6]) { p1 += 6; goto L1; }
-	if (p1[7] ^ p2[7]) { p1 += 7; goto L1; }
-#endif
+static void
+addsample(struct TDeflator* state)
+{
+	uintxx i;
 
-L1:
-	if (p1 >= end) {
-		return (uintxx) (end - pp);
+	for (i = 0; i < DEFLT_LMAXSYMBOL; i++) {
+		PRVT->sampling->lfrqs[i] += PRVT->extra->lfrqs[i];
+	}
+	for (i = 0; i < DEFLT_DMAXSYMBOL; i++) {
+		PRVT->sampling->dfrqs[i] += PRVT->extra->dfrqs[i];
 	}
-	return (uintxx) (p1 - pp);
-#endif
 }
 
-#if defined(CTZERO)
-	#undef CTZERO
-#endif
-
-#else
+#if defined(JDEFLATE_STATS)
 
-CTB_FORCEINLINE uintxx
-getmatchlength(uint8* p1, uint8* p2, uint8* end)
+static void
+updatestats(struct TDeflator* state)
 {
-	uint8* pp;
-
-	pp = p1;
-	do {
-		if (p1 >= end) {
-			return (uintxx) (end - pp);
-		}
-	} while (
-		(*p1++ == *p2++) &&
-		(*p1++ == *p2++) &&
-		(*p1++ == *p2++) &&
-		(*p1++ == *p2++));
+	uintxx i;
+	uintxx literals;
+	uintxx matches;
 
-	p1--;
-	if (p1 >= end) {
-		return (uintxx) (end - pp);
+	/* the frequencies are replaced by the trees in selectblock */
+	literals = 0;
+	for (i = 0; i < 256; i++) {
+		literals += PRVT->extra->lfrqs[i];
 	}
-	return (uintxx) (p1 - pp);
+	matches = 0;
+	for (i = MAXLTCODES; i < DEFLT_LMAXSYMBOL; i++) {
+		matches += PRVT->extra->lfrqs[i];
+	}
+
+	PRVT->stats.literals   += literals;
+	PRVT->stats.matches    += matches;
+	PRVT->stats.matchbytes += (uintxx) ((intxx) PRVT->cursor - PRVT->bstart);
+	PRVT->stats.matchbytes -= literals;
 }
 
 #endif
 
+static uintxx
+flushblck(struct TDeflator* state)
+{
+	uintxx total;
+	uintxx r;
 
-struct TMatch {
-	uintxx length;
-	uintxx offset;
-};
-
-CTB_INLINE struct TMatch
-findmatch(struct TDeflator* state, uint16 hhash, uintxx minlength)
+	switch (PRVT->substate) {
+		case 0:
+			break;
+		case 1: goto L_STATE1;
+		case 2: goto L_STATE2;
+		case 3: goto L_STATE3;
+		case 4: goto L_STATE4;
+	}
+
+	total = (uintxx) (PRVT->zend - PRVT->zptr);
+	if (ISRAWBLOCK(PRVT)) {
+		if (total) {
+			/* a part of the block was moved to the lz buffer */
+			moveraw(state,
+				PRVT->window + PRVT->rstart, PRVT->window + PRVT->cursor);
+			PRVT->rstart = PRVT->cursor;
+		}
+		total += PRVT->cursor - PRVT->rstart;
+	}
+	if (total == 0) {
+		SETSTATE(0);
+		PRVT->substate  = 0;
+		PRVT->blockinit = 0;
+		return 0;
+	}
+
+	/* append the end-of-block symbol */
+	PRVT->extra->lfrqs[BLOCKENDSYMBOL]++;
+	PRVT->zend[0] = BLOCKENDSYMBOL;
+	PRVT->zend++;
+
+	if (CTB_UNLIKELY(PRVT->sampling != NULL)) {
+		addsample(state);
+	}
+
+#if defined(JDEFLATE_STATS)
+	updatestats(state);
+#endif
+
+	PRVT->blocktype = selectblock(state);
+#if defined(JDEFLATE_STATS)
+	if (PRVT->blocktype == BLOCKDNMC && PRVT->usecodes) {
+		PRVT->stats.blocks[3]++;
+	}
+	else {
+		PRVT->stats.blocks[PRVT->blocktype]++;
+	}
+#endif
+	if (PRVT->blocktype == BLOCKSTRD) {
+		goto L_STATE4;
+	}
+
+L_STATE1:
+	/* block header */
+	if (tryemitbits(state, 3)) {
+		putbits(state, 0, 1);
+		putbits(state, PRVT->blocktype, 2);
+	}
+	else {
+		PRVT->substate = 1;
+		return DEFLT_TGTEXHSTD;
+	}
+
+L_STATE2:
+	if (PRVT->blocktype == BLOCKDNMC) {
+		if (PRVT->usecodes) {
+			r = emitheader(state);
+		}
+		else {
+			r = emittrees(state);
+		}
+		if (r) {
+			PRVT->substate = 2;
+			return DEFLT_TGTEXHSTD;
+		}
+	}
+	if (ISRAWBLOCK(PRVT) && PRVT->rstart < PRVT->cursor) {
+		emitraw(state);
+	}
+
+L_STATE3:
+	r = emitlz(state);
+	if (r) {
+		PRVT->substate = 3;
+		return DEFLT_TGTEXHSTD;
+	}
+	goto L_DONE;
+
+L_STATE4:
+	r = emitstored(state);
+	if (r) {
+		PRVT->substate = 4;
+		return DEFLT_TGTEXHSTD;
+	}
+
+L_DONE:
+	PRVT->bstart += (intxx) PRVT->bsize;
+
+	SETSTATE(0);
+	PRVT->substate  = 0;
+	PRVT->blockinit = 0;
+	return 0;
+}
+
+TDEFLTCodes*
+deflator_codescreate(uintxx level, const uint8* sample, uintxx size,
+	TAllocator* allocator)
 {
-	intxx  i;
-	uintxx next;
-	uint8* strbgn;
-	uint8* strend;
-	uintxx length;
-	uintxx offset;
-	uintxx rpos;
-	uintxx noffset;
+	uintxx i;
+	uintxx r;
+	struct TDEFLTCodes* codes;
+	struct TDEFLTExtra* extra;
+	struct TDeflator* state;
+	uint8 buffer[4096];
 
-	length = minlength;
-	offset = 0;
+	if (level == 0) {
+		return NULL;
+	}
+	state = deflator_create(level, allocator);
+	if (state == NULL) {
+		return NULL;
+	}
 
-	strbgn = PRVT->window + PRVT->cursor;
-	strend = strbgn + MAXMATCH;
-	if (strend > PRVT->wend) {
-		strend = PRVT->wend;
+	if (allocator) {
+		codes = allocator->reserve(allocator->user, sizeof(struct TDEFLTCodes));
+	}
+	else {
+		codes = CTB_RESERVE(sizeof(struct TDEFLTCodes));
 	}
+	if (codes == NULL) {
+		deflator_destroy(state);
+		return NULL;
+	}
+	codes->allocator = allocator;
 
-	/* base offset */
+	for (i = 0; i < DEFLT_LMAXSYMBOL; i++) {
+		codes->lfrqs[i] = 0;
+	}
+	for (i = 0; i < DEFLT_DMAXSYMBOL; i++) {
+		codes->dfrqs[i] = 0;
+	}
+
+	/* compress the sample to get its frequencies */
+	PRVT->sampling = codes;
+	deflator_setsrc(state, (uint8*) sample, size);
+	do {
+		deflator_settgt(state, buffer, sizeof(buffer));
+		r = deflator_deflate(state, DEFLT_END);
+	} while (r == DEFLT_TGTEXHSTD);
+	PRVT->sampling = NULL;
+
+	if (r != DEFLT_OK) {
+		deflator_destroy(state);
+		deflator_codesdestroy(codes);
+		return NULL;
+	}
+
+	/* the symbols that are not in the sample get a long code, otherwise a
+	 * block with any of them could not use the codes */
+	extra = PRVT->extra;
+	for (i = 0; i < DEFLT_LMAXSYMBOL; i++) {
+		extra->lfrqs[i] = codes->lfrqs[i];
+		if (i < MAXLTCODES + 29 && extra->lfrqs[i] == 0) {
+			extra->lfrqs[i] = 1;
+		}
+	}
+	for (i = 0; i < DEFLT_DMAXSYMBOL; i++) {
+		extra->dfrqs[i] = codes->dfrqs[i];
+		if (i < 30 && extra->dfrqs[i] == 0) {
+			extra->dfrqs[i] = 1;
+		}
+	}
+	buildtables(extra);
+
+	ctb_memcpy(codes->litcodes, extra->litcodes, sizeof(codes->litcodes));
+	ctb_memcpy(codes->lnscodes, extra->lnscodes, sizeof(codes->lnscodes));
+	ctb_memcpy(codes->dstcodes, extra->dstcodes, sizeof(codes->dstcodes));
+
+	codes->sbits = getblockcost(codes->lfrqs, codes->dfrqs,
+		codes->litcodes, codes->lnscodes, codes->dstcodes);
+	codes->scount = 0;
+	for (i = 0; i < DEFLT_LMAXSYMBOL; i++) {
+		codes->scount += codes->lfrqs[i];
+	}
+
+	/* encode the trees once */
+	PRVT->bbuffer = 0;
+	PRVT->bcount  = 0;
+	PRVT->aux1 = 0;
+	PRVT->aux2 = 0;
+	deflator_settgt(state, codes->header, sizeof(codes->header));
+	if (emittrees(state)) {
+		deflator_destroy(state);
+		deflator_codesdestroy(codes);
+		return NULL;
+	}
+
+	codes->hbits = (uintxx) (state->target - codes->header) * 8 + PRVT->bcount;
+	tryflushbits(state);
+
+	deflator_destroy(state);
+	return codes;
+}
+
+void
+deflator_codesdestroy(TDEFLTCodes* codes)
+{
+	if (codes == NULL) {
+		return;
+	}
+
+	if (codes->allocator) {
+		codes->allocator->release(codes->allocator->user, codes);
+		return;
+	}
+	CTB_RELEASE(codes);
+}
+
+void
+deflator_setcodes(TDeflator* state, const TDEFLTCodes* codes)
+{
+	CTB_ASSERT(state);
+
+	if (PRVT->used) {
+		SETERROR(DEFLT_EINCORRECTUSE);
+		SETSTATE(DEFLT_BADSTATE);
+		return;
+	}
+	if (PRVT->level == 0) {
+		/* they are not used, but the ones of a previous level are removed */
+		PRVT->codes = NULL;
+		return;
+	}
+	PRVT->codes = codes;
+}
+
+void
+deflator_setstrategy(TDeflator* state, uintxx strategy)
+{
+	CTB_ASSERT(state);
+
+	if (PRVT->used || strategy > DEFLT_SFAST) {
+		SETERROR(DEFLT_EINCORRECTUSE);
+		SETSTATE(DEFLT_BADSTATE);
+		return;
+	}
+	if (PRVT->strategy == strategy) {
+		return;
+	}
+	PRVT->strategy = strategy;
+
+	/* the fast parser hashes 4 bytes at any level */
+	PRVT->cacheok = 0;
+}
+
+void
+deflator_setmatchfinder(TDeflator* state, uintxx finder)
+{
+	uintxx usetree;
+	CTB_ASSERT(state);
+
+	if (PRVT->used || finder > DEFLT_MFTREE) {
+		SETERROR(DEFLT_EINCORRECTUSE);
+		SETSTATE(DEFLT_BADSTATE);
+		return;
+	}
+	if (PRVT->mfinder == finder) {
+		return;
+	}
+	PRVT->mfinder = finder;
+
+	usetree = PRVT->usetree;
+	setparameters(state, PRVT->level);
+	if (PRVT->usetree == usetree) {
+		return;
+	}
+
+	/* the tree nodes are not cleared by the last reset */
+	if (allocatemem(state, getmeminfo(PRVT->level, PRVT->wndwbits)) == 0) {
+		SETERROR(DEFLT_EOOM);
+		SETSTATE(DEFLT_BADSTATE);
+		return;
+	}
+	if (PRVT->dctnrkept) {
+		dropdctnr(state);
+	}
+	else {
+		resetcache(state);
+	}
+}
+
+
+CTB_FORCEINLINE void
+insertex(struct TDeflator* state, uint16 offset, uint16 hhash, uintxx hmask,
+	uintxx smask)
+{
+	uintxx hindex;
+
+	hindex = hhash & hmask;
+
+	PRVT->chain[offset & smask] = PRVT->hlist[hindex];
+	PRVT->hlist[hindex] = offset;
+}
+
+/* with the default window and hash bits the masks are constants that the
+ * compiler drops (the offsets and hashes take 16 bits) */
+CTB_INLINE void
+insert(struct TDeflator* state, uint16 offset, uint16 hhash)
+{
+	if ((PRVT->hmask & PRVT->smask) == 0xffff) {
+		insertex(state, offset, hhash, 0xffff, 0xffff);
+		return;
+	}
+	insertex(state, offset, hhash, PRVT->hmask, PRVT->smask);
+}
+
+
+#if !defined(CTB_STRICTALIGNMENT) && defined(CTB_FASTUNALIGNED)
+	#define GETSHEAD3(B, N) ((*((uint32*) ((B) + (N)))) & 0xffffffL)
+	#define GETSHEAD4(B, N) ((*((uint32*) ((B) + (N)))))
+#else
+	#define GETSHEAD3(B, N) \
+	    (((B)[(N) + 0] << 0x00) | \
+	     ((B)[(N) + 1] << 0x08) | \
+	     ((B)[(N) + 2] << 0x10))
+
+	#define GETSHEAD4(B, N) (GETSHEAD3(B, N) | ((B)[(N) + 3] << 0x18))
+#endif
+
+#define GETHHASH(H) (((H) * 0x9e3779b1) >> 16)
+
+
+/* inserts the next n positions (the head is masked to 3 or 4 bytes), with a
+ * single load for each four positions if we can */
+CTB_INLINE void
+insertrun(struct TDeflator* state, uintxx n, uint32 mask)
+{
+	uint8* p;
+	uintxx rpos;
+#if defined(CTB_ENV64) && !CTB_IS_BIGENDIAN
+#if !defined(CTB_STRICTALIGNMENT) && defined(CTB_FASTUNALIGNED)
+	uint64 v;
+	uint32 h;
+#endif
+#endif
+
+	p = PRVT->window + PRVT->cursor;
 	rpos = PRVT->cursor - PRVT->base;
+	PRVT->cursor += n;
+
+#if defined(CTB_ENV64) && !CTB_IS_BIGENDIAN
+#if !defined(CTB_STRICTALIGNMENT) && defined(CTB_FASTUNALIGNED)
+	for (; n >= 4; n -= 4) {
+		v = *((uint64*) p);
+
+		h = (uint32) (v >> 0x00) & mask;
+		insert(state, (uint16) (rpos + 0), GETHHASH(h));
+		h = (uint32) (v >> 0x08) & mask;
+		insert(state, (uint16) (rpos + 1), GETHHASH(h));
+		h = (uint32) (v >> 0x10) & mask;
+		insert(state, (uint16) (rpos + 2), GETHHASH(h));
+		h = (uint32) (v >> 0x18) & mask;
+		insert(state, (uint16) (rpos + 3), GETHHASH(h));
+		rpos += 4;
+		p += 4;
+	}
+#endif
+#endif
+
+	for (; n; n--) {
+		insert(state, (uint16) rpos++, GETHHASH(GETSHEAD4(p, 0) & mask));
+		p++;
+	}
+}
+
+
+CTB_INLINE uintxx updatetree(struct TDeflator*, uint16, struct TOPMatch*,
+	uintxx);
+CTB_INLINE uintxx hash3match(struct TDeflator*, struct TOPMatch*);
+
+
+/* clears the entries of the positions in the window, the hashes are the
+ * same the compressor of the level uses */
+static void
+resetwindowcache(struct TDeflator* state)
+{
+	uintxx i;
+	uintxx n;
+	uintxx smask;
+	uint8* w;
+
+	w = PRVT->window;
+	n = (uintxx) (PRVT->wend - w);
+
+	/* the window buffer can be larger than the chain with small windows */
+	smask = PRVT->smask;
+	if (PRVT->level <= 4 && PRVT->strategy != DEFLT_SFAST) {
+		for (i = 0; i < n; i++) {
+			PRVT->hlist[GETHHASH(GETSHEAD3(w, i)) & PRVT->hmask] = 0;
+			PRVT->chain[i & smask] = 0;
+		}
+	}
+	else {
+		for (i = 0; i < n; i++) {
+			PRVT->hlist[GETHHASH(GETSHEAD4(w, i)) & PRVT->hmask] = 0;
+			PRVT->chain[i & smask] = 0;
+		}
+	}
+
+	if (PRVT->usetree) {
+		for (i = 0; i < n; i++) {
+			PRVT->btree->hlist3[GETHHASH(GETSHEAD3(w, i)) & H3MASK] = 0;
+			PRVT->btree->rnodes[i & smask] = 0;
+		}
+	}
+}
+
+/* takes back the insertions of the positions in the window from start, from
+ * the last one, so the heads get the values they had before (the window was
+ * not moved and the chain was not wrapped) */
+static void
+undowindowcache(struct TDeflator* state, uintxx start)
+{
+	uintxx i;
+	uintxx h;
+	uint8* w;
+
+	w = PRVT->window;
+	for (i = (uintxx) (PRVT->wend - w); i > start; i--) {
+		if (PRVT->level <= 4) {
+			h = GETHHASH(GETSHEAD3(w, i - 1)) & PRVT->hmask;
+		}
+		else {
+			h = GETHHASH(GETSHEAD4(w, i - 1)) & PRVT->hmask;
+		}
+
+		/* positions that were not inserted keep their head */
+		if (PRVT->hlist[h] == (uint16) (i - 1)) {
+			PRVT->hlist[h] = PRVT->chain[i - 1];
+		}
+		PRVT->chain[i - 1] = 0;
+	}
+}
+
+
+void
+deflator_setdctnr(TDeflator* state, uint8* dict, uintxx size)
+{
+	uintxx i;
+	uint8* w;
+	CTB_ASSERT(state && dict);
+
+	if (PRVT->used) {
+		SETERROR(DEFLT_EINCORRECTUSE);
+		SETSTATE(DEFLT_BADSTATE);
+		return;
+	}
+	if (PRVT->level == 0) {
+		return;
+	}
+	if (PRVT->dctnrkept) {
+		dropdctnr(state);
+	}
+
+	if (size > PRVT->wndwsize) {
+		/* only the last part can be reached */
+		dict += size - PRVT->wndwsize;
+		size  = PRVT->wndwsize;
+	}
+
+	/* only the strings that are whole in the dictionary are hashed, so a
+	 * reset can still clear the entries of the window alone */
+	ctb_memcpy(PRVT->window, dict, size);
+	PRVT->wend += size;
+
+	w = PRVT->window;
+	if (PRVT->usetree) {
+		for (i = 0; i < size; i++) {
+			PRVT->cursor = i;
+			if (i + 3 <= size) {
+				hash3match(state, NULL);
+			}
+			updatetree(state, GETHHASH(GETSHEAD4(w, i)), NULL, MAXMATCH);
+		}
+		PRVT->cursor = size;
+		PRVT->bstart = (intxx) size;
+
+		PRVT->used = 1;
+		return;
+	}
+
+	if (PRVT->level <= 4) {
+		for (i = 0; i + 3 <= size; i++) {
+			insert(state, (uint16) i, GETHHASH(GETSHEAD3(w, i)));
+		}
+	}
+	else {
+		for (i = 0; i + 4 <= size; i++) {
+			insert(state, (uint16) i, GETHHASH(GETSHEAD4(w, i)));
+		}
+	}
+	PRVT->cursor = size;
+	PRVT->bstart = (intxx) size;
+
+	PRVT->used = 1;
+}
+
+TDEFLTDctnr*
+deflator_dctnrcreate(uintxx level, uintxx wbits, uintxx hbits,
+	const uint8* dict, uintxx size, TAllocator* allocator)
+{
+	uintxx i;
+	uintxx n;
+	uintxx h;
+	uint8* w;
+	struct TDEFLTDctnr* dctnr;
+	struct TDeflator* state;
+
+	if (level == 0 || checkbits(&wbits, &hbits) == 0) {
+		return NULL;
+	}
+	if (size > ((uintxx) 1 << wbits)) {
+		dict += size - ((uintxx) 1 << wbits);
+		size  = ((uintxx) 1 << wbits);
+	}
+
+	/* we let a deflator take the dictionary and record its cache */
+	state = deflator_createex(level, wbits, hbits, allocator);
+	if (state == NULL) {
+		return NULL;
+	}
+	deflator_setdctnr(state, (uint8*) dict, size);
+
+	n = 3;
+	if (PRVT->usetree) {
+		n = 6;
+	}
+	n = sizeof(struct TDEFLTDctnr) + (n * sizeof(uint16) + 1) * size;
+	if (allocator) {
+		dctnr = allocator->reserve(allocator->user, n);
+	}
+	else {
+		dctnr = CTB_RESERVE(n);
+	}
+	if (dctnr == NULL) {
+		deflator_destroy(state);
+		return NULL;
+	}
+	dctnr->allocator = allocator;
+
+	dctnr->level    = level;
+	dctnr->wndwbits = wbits;
+	dctnr->hmask    = PRVT->hmask;
+	dctnr->size     = size;
+	dctnr->tpending = PRVT->tpending;
+
+	dctnr->hindex = (uint16*) (dctnr + 1);
+	dctnr->hvalue = dctnr->hindex + size;
+	dctnr->chain  = dctnr->hvalue + size;
+	dctnr->rnodes  = NULL;
+	dctnr->h3index = NULL;
+	dctnr->h3value = NULL;
+	dctnr->data = (uint8*) (dctnr->chain + size);
+	if (PRVT->usetree) {
+		dctnr->rnodes  = dctnr->chain   + size;
+		dctnr->h3index = dctnr->rnodes  + size;
+		dctnr->h3value = dctnr->h3index + size;
+		dctnr->data = (uint8*) (dctnr->h3value + size);
+	}
+
+	/* the entries of the last positions are recorded too (they hash the
+	 * padding), the values are the final ones so setting them is harmless */
+	w = PRVT->window;
+	for (i = 0; i < size; i++) {
+		if (PRVT->level <= 4) {
+			h = GETHHASH(GETSHEAD3(w, i)) & PRVT->hmask;
+		}
+		else {
+			h = GETHHASH(GETSHEAD4(w, i)) & PRVT->hmask;
+		}
+		dctnr->hindex[i] = (uint16) h;
+		dctnr->hvalue[i] = PRVT->hlist[h];
+		dctnr->chain[i]  = PRVT->chain[i];
+
+		if (PRVT->usetree) {
+			h = GETHHASH(GETSHEAD3(w, i)) & H3MASK;
+			dctnr->h3index[i] = (uint16) h;
+			dctnr->h3value[i] = PRVT->btree->hlist3[h];
+			dctnr->rnodes[i]  = PRVT->btree->rnodes[i];
+		}
+	}
+	if (size) {
+		ctb_memcpy(dctnr->data, w, size);
+	}
+
+	deflator_destroy(state);
+	return dctnr;
+}
+
+void
+deflator_dctnrdestroy(TDEFLTDctnr* dctnr)
+{
+	if (dctnr == NULL) {
+		return;
+	}
+
+	if (dctnr->allocator) {
+		dctnr->allocator->release(dctnr->allocator->user, dctnr);
+		return;
+	}
+	CTB_RELEASE(dctnr);
+}
+
+/* checks if the bytes at the start of the window are the dictionary */
+static bool
+samedctnr(struct TDeflator* state, const TDEFLTDctnr* dctnr)
+{
+	uintxx i;
+	uint8* w;
+	uint8* d;
+
+	w = PRVT->window;
+	d = dctnr->data;
+	for (i = 0; i + 4 <= dctnr->size; i += 4) {
+		if (GETSHEAD4(w, i) != GETSHEAD4(d, i)) {
+			return 0;
+		}
+	}
+	for (; i < dctnr->size; i++) {
+		if (w[i] != d[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void
+deflator_setpdctnr(TDeflator* state, const TDEFLTDctnr* dctnr)
+{
+	uintxx i;
+	uintxx size;
+	CTB_ASSERT(state && dctnr);
+
+	if (PRVT->used || PRVT->level != dctnr->level ||
+		PRVT->wndwbits != dctnr->wndwbits || PRVT->hmask != dctnr->hmask ||
+		(PRVT->usetree != 0) != (dctnr->rnodes != NULL)) {
+		SETERROR(DEFLT_EINCORRECTUSE);
+		SETSTATE(DEFLT_BADSTATE);
+		return;
+	}
+
+	size = dctnr->size;
+	if (PRVT->dctnrkept) {
+		if (PRVT->dctnrkept == size && samedctnr(state, dctnr)) {
+			/* the reset has undone the last stream */
+			PRVT->dctnrkept = 0;
+			goto L_DONE;
+		}
+		dropdctnr(state);
+	}
+
+	if (size) {
+		ctb_memcpy(PRVT->window, dctnr->data, size);
+		ctb_memcpy(PRVT->chain, dctnr->chain, size * sizeof(uint16));
+	}
+	for (i = 0; i < size; i++) {
+		PRVT->hlist[dctnr->hindex[i]] = dctnr->hvalue[i];
+	}
+
+	if (PRVT->usetree) {
+		if (size) {
+			ctb_memcpy(
+				PRVT->btree->rnodes, dctnr->rnodes, size * sizeof(uint16));
+		}
+		for (i = 0; i < size; i++) {
+			PRVT->btree->hlist3[dctnr->h3index[i]] = dctnr->h3value[i];
+		}
+		PRVT->tpending = dctnr->tpending;
+	}
+
+L_DONE:
+	PRVT->wend  += size;
+	PRVT->cursor = size;
+	PRVT->bstart = (intxx) size;
+	PRVT->dctnrsize = size;
+
+	PRVT->used = 1;
+}
+
+static uintxx
+slidewindow(struct TDeflator* state)
+{
+	uintxx r;
+	uint8* b;
+	uint8* w;
+	uint8* end;
+
+	/* the positions that are not in the tree yet keep their window */
+	b = PRVT->window + (PRVT->cursor - PRVT->tpending - PRVT->wndwsize);
+	w = PRVT->window;
+#if defined(CTB_ENV64)
+	r = ((uintxx) b) & (8 - 1);
+#else
+	r = ((uintxx) b) & (4 - 1);
+#endif
+	b = b - r;
+
+	/* move the window lower part of the buffer */
+	end = PRVT->wend;
+#if defined(CTB_ENV64)
+	while (end - b >= 32) {
+		((uint64*) w)[0] = ((uint64*) b)[0];
+		((uint64*) w)[1] = ((uint64*) b)[1];
+		((uint64*) w)[2] = ((uint64*) b)[2];
+		((uint64*) w)[3] = ((uint64*) b)[3];
+		b += 32;
+		w += 32;
+	}
+#else
+	while (end - b >= 16) {
+		((uint32*) w)[0] = ((uint32*) b)[0];
+		((uint32*) w)[1] = ((uint32*) b)[1];
+		((uint32*) w)[2] = ((uint32*) b)[2];
+		((uint32*) w)[3] = ((uint32*) b)[3];
+		b += 16;
+		w += 16;
+	}
+#endif
+	while (end > b) {
+		*w++ = *b++;
+	}
+
+	PRVT->wend   = w;
+	PRVT->cursor = PRVT->wndwsize + r + PRVT->tpending;
+	return (uintxx) (b - w);
+}
+
+/* checks if fillwindow will move the window */
+CTB_INLINE bool
+mustslide(struct TDeflator* state)
+{
+	uintxx total;
+	uintxx wleft;
+
+	wleft = (uintxx) (PRVT->windowend - PRVT->wend);
+	total = (uintxx) (state->send - state->source);
+	return CTB_LIKELY(total > wleft) && CTB_LIKELY(wleft < 0x400);
+}
+
+static uintxx
+fillwindow(struct TDeflator* state)
+{
+	uintxx total;
+	uintxx wleft;
+
+	if (mustslide(state)) {
+		uintxx slide;
+
+		/* we use this to get the offset in the window
+		 * cursor - base := relative position
+		 * offset        := relative position - hash index */
+		slide = slidewindow(state);
+		PRVT->base -= slide & 0xffff;
+		PRVT->bstart -= (intxx) slide;
+		PRVT->rstart -= slide;
+		PRVT->cacheok = 0;
+	}
+
+	wleft = (uintxx) (PRVT->windowend - PRVT->wend);
+	total = (uintxx) (state->send - state->source);
+	if (total > wleft) {
+		total = wleft;
+	}
+	if (total) {
+		ctb_memcpy(PRVT->wend, state->source, total);
+		state->source += total;
+		PRVT->wend    += total;
+	}
+	return total;
+}
+
+
+#if defined(DEFLT_SSE2) || defined(DEFLT_NEON)
+
+/* index of the first different byte of the 16 bytes blocks (16 if they are
+ * equal) */
+CTB_FORCEINLINE uintxx
+cmpblock(uint8* p1, uint8* p2)
+{
+#if defined(DEFLT_SSE2)
+	uint32 mask;
+
+	mask = (uint32) _mm_movemask_epi8(_mm_cmpeq_epi8(
+		_mm_loadu_si128((void*) p1),
+		_mm_loadu_si128((void*) p2))) ^ 0xffff;
+	if (mask == 0) {
+		return 16;
+	}
+#if defined(__MSVC__)
+	{
+		unsigned long r;
+
+		_BitScanForward(&r, mask);
+		return (uintxx) r;
+	}
+#else
+	return (uintxx) __builtin_ctz(mask);
+#endif
+#else
+	uint64 mask;
+	uint8x16_t eq;
+
+	/* each byte of the result becomes a nibble of the mask */
+	eq = vceqq_u8(vld1q_u8(p1), vld1q_u8(p2));
+	mask = vget_lane_u64(vreinterpret_u64_u8(
+		vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+	mask = ~mask;
+	if (mask == 0) {
+		return 16;
+	}
+#if defined(__MSVC__)
+	{
+		unsigned long r;
+
+		_BitScanForward64(&r, mask);
+		return (uintxx) (r >> 2);
+	}
+#else
+	return (uintxx) (__builtin_ctzll(mask) >> 2);
+#endif
+#endif
+}
+
+CTB_FORCEINLINE uintxx
+getmatchlength(uint8* p1, uint8* p2, uint8* end)
+{
+	uintxx n;
+	uint8* pp;
+
+	/* the window guard covers 32 bytes after the end */
+	pp = p1;
+	for (;;) {
+		if (p1 >= end) {
+			return (uintxx) (end - pp);
+		}
+
+		n = cmpblock(p1, p2);
+		if (n != 16) {
+			break;
+		}
+		n = cmpblock(p1 + 16, p2 + 16);
+		if (n != 16) {
+			n += 16;
+			break;
+		}
+		p1 += 32;
+		p2 += 32;
+	}
+
+	p1 += n;
+	if (p1 >= end) {
+		return (uintxx) (end - pp);
+	}
+	return (uintxx) (p1 - pp);
+}
+
+#elif !defined(CTB_STRICTALIGNMENT) && defined(CTB_FASTUNALIGNED)
+
+#if defined(__GNUC__)
+	#if defined(CTB_ENV64)
+		#define CTZERO(X) __builtin_ctzll(X)
+	#else
+		#define CTZERO(X) __builtin_ctzl(X)
+	#endif
+#else
+	#if defined(__has_builtin)
+		#if defined(CTB_ENV64)
+			#if __has_builtin(__builtin_ctzll)
+				#define CTZERO(X) __builtin_ctzll(X)
+			#endif
+		#else
+			#if __has_builtin(__builtin_ctzl)
+				#define CTZERO(X) __builtin_ctzl(X)
+			#endif
+		#endif
+	#endif
+#endif
+
+#if CTB_IS_BIGENDIAN
+	#undef CTZERO
+#endif
+
+
+CTB_FORCEINLINE uintxx
+getmatchlength(uint8* p1, uint8* p2, uint8* end)
+{
+	uint8* pp;
+
+#if defined(CTB_ENV64)
+	uint64* c1;
+	uint64* c2;
+#if defined(CTZERO)
+	uint64 xor;
+#endif
+#else
+	uint32* c1;
+	uint32* c2;
+#if defined(CTZERO)
+	uint32 xor;
+#endif
+#endif
+
+	pp = p1;
+	c1 = (void*) p1;
+	c2 = (void*) p2;
+#if defined(CTZERO)
+	xor = 0;
+
+	do {
+		if ((uint8*) c1 >= end) {
+			return (uintxx) (end - pp);
+		}
+	} while (
+		((xor = *c1++ ^ *c2++) == 0) &&
+		((xor = *c1++ ^ *c2++) == 0) &&
+		((xor = *c1++ ^ *c2++) == 0) &&
+		((xor = *c1++ ^ *c2++) == 0));
+
+	p1 = ((uint8*) (c1 - 1)) + (CTZERO(xor) >> 3);
+	if (p1 >= end) {
+		return (uintxx) (end - pp);
+	}
+
+	return (uintxx) (p1 - pp);
+#else
+
+	do {
+		if ((uint8*) c1 >= end) {
+			return (uintxx) (end - pp);
+		}
+	} while (
+		(*c1++ == *c2++) &&
+		(*c1++ == *c2++) &&
+		(*c1++ == *c2++) &&
+		(*c1++ == *c2++));
+
+	p1 = (void*) (c1 - 1);
+	p2 = (void*) (c2 - 1);
+
+	if (p1[0] ^ p2[0]) { p1 += 0; goto L1; }
+	if (p1[1] ^ p2[1]) { p1 += 1; goto L1; }
+	if (p1[2] ^ p2[2]) { p1 += 2; goto L1; }
+	if (p1[3] ^ p2[3]) { p1 += 3; goto L1; }
+#if defined(CTB_ENV64)
+	if (p1[4] ^ p2[4]) { p1 += 4; goto L1; }
+	if (p1[5] ^ p2[5]) { p1 += 5; goto L1; }
+	if (p1[6] ^ p2[6]) { p1 += 6; goto L1; }
+	if (p1[7] ^ p2[7]) { p1 += 7; goto L1; }
+#endif
+
+L1:
+	if (p1 >= end) {
+		return (uintxx) (end - pp);
+	}
+	return (uintxx) (p1 - pp);
+#endif
+}
+
+#if defined(CTZERO)
+	#undef CTZERO
+#endif
+
+#else
+
+CTB_FORCEINLINE uintxx
+getmatchlength(uint8* p1, uint8* p2, uint8* end)
+{
+	uint8* pp;
+
+	pp = p1;
+	do {
+		if (p1 >= end) {
+			return (uintxx) (end - pp);
+		}
+	} while (
+		(*p1++ == *p2++) &&
+		(*p1++ == *p2++) &&
+		(*p1++ == *p2++) &&
+		(*p1++ == *p2++));
+
+	p1--;
+	if (p1 >= end) {
+		return (uintxx) (end - pp);
+	}
+	return (uintxx) (p1 - pp);
+}
+
+#endif
+
+
+struct TMatch {
+	uintxx length;
+	uintxx offset;
+};
+
+CTB_FORCEINLINE struct TMatch
+findmatchex(struct TDeflator* state, uint16 hhash, uintxx minlength,
+	uintxx hmask, uintxx smask)
+{
+	intxx  i;
+	uintxx next;
+	uint8* strbgn;
+	uint8* strend;
+	uintxx length;
+	uintxx offset;
+	uintxx rpos;
+	uintxx noffset;
+	uintxx wsize;
+	uint16* chain;
+
+	length = minlength;
+	offset = 0;
+
+	strbgn = PRVT->window + PRVT->cursor;
+	strend = strbgn + MAXMATCH;
+	if (strend > PRVT->wend) {
+		strend = PRVT->wend;
+	}
+
+	chain = PRVT->chain;
+	wsize = PRVT->wndwsize;
+
+	/* base offset */
+	rpos = PRVT->cursor - PRVT->base;
+
+	next = PRVT->hlist[hhash & hmask];
+	for (i = PRVT->maxchain; i > 0; i--) {
+		uintxx nlength;
+		uint8* pmatch;
+
+		STATSADD(chainsteps, 1);
+		/* we use modular arithmetic here, so there is no need to shift
+		 * the cache table entries each time we slide the window */
+		noffset = (uint16) (rpos - next);
+		if (CTB_UNLIKELY(noffset > wsize || noffset == 0)) {
+			break;
+		}
+		pmatch = strbgn - noffset;
+		if (CTB_LIKELY(strbgn[length] == pmatch[length])) {
+
+			nlength = getmatchlength(strbgn, pmatch, strend);
+			if (nlength > length) {
+				length = nlength;
+				offset = noffset;
+
+				if (length >= PRVT->nicematch) {
+					if (length >= PRVT->goodmatch) {
+						break;
+					}
+					i = i >> 2;
+				}
+			}
+		}
+
+		/* a cleared entry links to itself */
+		if (CTB_UNLIKELY(chain[next & smask] == next)) {
+			break;
+		}
+		next = chain[next & smask];
+	}
+
+	return (struct TMatch) {length, offset};
+}
+
+/* see insert */
+CTB_INLINE struct TMatch
+findmatch(struct TDeflator* state, uint16 hhash, uintxx minlength)
+{
+	if ((PRVT->hmask & PRVT->smask) == 0xffff) {
+		return findmatchex(state, hhash, minlength, 0xffff, 0xffff);
+	}
+	return findmatchex(state, hhash, minlength, PRVT->hmask, PRVT->smask);
+}
+
+/* finds the matches without changing the tree */
+static uintxx
+searchtree(struct TDeflator* state, uint16 hhash, struct TOPMatch* matches,
+	uintxx minlength)
+{
+	intxx  i;
+	uintxx node;
+	uintxx rpos;
+	uintxx noffset;
+	uintxx length;
+	uintxx ltlength;
+	uintxx gtlength;
+	uintxx count;
+	uint8* strbgn;
+	uint8* strend;
+	uint8* pmatch;
+
+	strbgn = PRVT->window + PRVT->cursor;
+	strend = PRVT->wend;
+
+	rpos = PRVT->cursor - PRVT->base;
+	node = PRVT->hlist[hhash & PRVT->hmask];
+
+	count = 0;
+	length = ltlength = gtlength = 0;
+	for (i = PRVT->maxchain; i > 0; i--) {
+		STATSADD(chainsteps, 1);
+
+		noffset = (uint16) (rpos - node);
+		if (CTB_UNLIKELY(noffset >= PRVT->wndwsize || noffset == 0)) {
+			break;
+		}
+
+		pmatch = strbgn - noffset;
+		if (pmatch[length] == strbgn[length]) {
+			length++;
+			length += getmatchlength(strbgn + length, pmatch + length, strend);
+
+			if (length > minlength) {
+				minlength = length;
+				if (matches) {
+					if (count == OPMAXMATCHES) {
+						count--;
+					}
+					matches[count].length = (uint16) length;
+					matches[count].offset = (uint16) noffset;
+					count++;
+				}
+			}
+			if (strbgn + length >= strend) {
+				break;
+			}
+		}
+
+		if (pmatch[length] < strbgn[length]) {
+			node = PRVT->btree->rnodes[node & PRVT->smask];
+			ltlength = length;
+		}
+		else {
+			node = PRVT->chain[node & PRVT->smask];
+			gtlength = length;
+		}
+
+		/* a cleared entry links to itself */
+		if (CTB_UNLIKELY(node == (uint16) (rpos - noffset))) {
+			break;
+		}
+
+		if (ltlength < gtlength) {
+			length = ltlength;
+		}
+		else {
+			length = gtlength;
+		}
+	}
+	return count;
+}
+
+/* inserts the pending positions that have the whole string in the window */
+static void
+inserttpending(struct TDeflator* state)
+{
+	uintxx cursor;
+
+	cursor = PRVT->cursor;
+	PRVT->cursor  -= PRVT->tpending;
+	PRVT->tpending = 0;
+	for (; cursor > PRVT->cursor; PRVT->cursor++) {
+		if (PRVT->window + PRVT->cursor + MAXMATCH > PRVT->wend) {
+			if (state->flush != DEFLT_END) {
+				break;
+			}
+		}
+		updatetree(state,
+			GETHHASH(GETSHEAD4(PRVT->window, PRVT->cursor)), NULL, MAXMATCH);
+	}
+	PRVT->tpending = cursor - PRVT->cursor;
+	PRVT->cursor   = cursor;
+}
+
+/* binary tree match finder, inserts the string at the cursor position in the
+ * tree (rebuilding it along the search path) and stores the matches that are
+ * longer than the previous one if matches is not NULL */
+CTB_INLINE uintxx
+updatetree(struct TDeflator* state, uint16 hhash, struct TOPMatch* matches,
+	uintxx minlength)
+{
+	intxx  i;
+	uintxx node;
+	uintxx rpos;
+	uintxx noffset;
+	uintxx length;
+	uintxx ltlength;
+	uintxx gtlength;
+	uintxx nice;
+	uintxx count;
+	uintxx smask;
+	uintxx wsize;
+	uint8* strbgn;
+	uint8* strend;
+	uint8* pmatch;
+	uint16* ltnode;
+	uint16* gtnode;
+	uint16* rnodes;
+
+	strbgn = PRVT->window + PRVT->cursor;
+	strend = strbgn + MAXMATCH;
+	if (CTB_UNLIKELY(strend > PRVT->wend)) {
+		strend = PRVT->wend;
+
+		/* the nodes are sorted by the whole string, so a short one can't be
+		 * inserted until the rest of it is in the window (unless this is the
+		 * end of the stream) */
+		if (state->flush != DEFLT_END) {
+			if (PRVT->tpending) {
+				inserttpending(state);
+			}
+			PRVT->tpending++;
+			return searchtree(state, hhash, matches, minlength);
+		}
+	}
+	if (CTB_UNLIKELY(PRVT->tpending)) {
+		inserttpending(state);
+	}
+
+	nice = PRVT->nicematch;
+	if (nice > (uintxx) (strend - strbgn)) {
+		nice = (uintxx) (strend - strbgn);
+	}
+
+	/* base offset */
+	rpos = PRVT->cursor - PRVT->base;
+
+	node = PRVT->hlist[hhash & PRVT->hmask];
+	PRVT->hlist[hhash & PRVT->hmask] = (uint16) rpos;
+
+	smask  = PRVT->smask;
+	wsize  = PRVT->wndwsize;
+	rnodes = PRVT->btree->rnodes;
+	ltnode = PRVT->chain + (rpos & smask);
+	gtnode = rnodes + (rpos & smask);
+
+	/* the nodes are wsize - 1 bytes behind at most, so if the owner of a
+	 * link is in the window the linked node is less than two windows behind
+	 * (the size of the chain) and the modular offset is exact */
+	count = 0;
+	length = ltlength = gtlength = 0;
+	for (i = PRVT->maxchain; i > 0; i--) {
+		STATSADD(chainsteps, 1);
+
+		noffset = (uint16) (rpos - node);
+		if (CTB_UNLIKELY(noffset >= wsize || noffset == 0)) {
+			break;
+		}
+
+		pmatch = strbgn - noffset;
+		if (pmatch[length] == strbgn[length]) {
+			length++;
+			length += getmatchlength(strbgn + length, pmatch + length, strend);
+
+			if (length > minlength) {
+				minlength = length;
+				if (matches) {
+					/* the list is full, keep the longest */
+					if (count == OPMAXMATCHES) {
+						count--;
+					}
+					matches[count].length = (uint16) length;
+					matches[count].offset = (uint16) noffset;
+					count++;
+				}
+			}
+
+			if (length >= nice) {
+				/* the node is replaced by the new one */
+				ltnode[0] = PRVT->chain[node & smask];
+				gtnode[0] = rnodes[node & smask];
+
+				if ((uint16) (rpos - ltnode[0]) >= wsize) {
+					ltnode[0] = (uint16) (rpos - wsize);
+				}
+				if ((uint16) (rpos - gtnode[0]) >= wsize) {
+					gtnode[0] = (uint16) (rpos - wsize);
+				}
+				return count;
+			}
+		}
+
+		if (pmatch[length] < strbgn[length]) {
+			ltnode[0] = (uint16) node;
+			ltnode = rnodes + (node & smask);
+			node   = ltnode[0];
+			ltlength = length;
+		}
+		else {
+			gtnode[0] = (uint16) node;
+			gtnode = PRVT->chain + (node & smask);
+			node   = gtnode[0];
+			gtlength = length;
+		}
+
+		if (CTB_UNLIKELY(node == (uint16) (rpos - noffset))) {
+			break;
+		}
+
+		/* both sides share at least this prefix */
+		if (ltlength < gtlength) {
+			length = ltlength;
+		}
+		else {
+			length = gtlength;
+		}
+	}
+
+	/* out of the window for as long as the owner is in it */
+	ltnode[0] = gtnode[0] = (uint16) (rpos - wsize);
+	return count;
+}
+
+/* match of the lazy parser with the tree (see deflator_setmatchfinder) */
+CTB_INLINE struct TMatch
+treematch(struct TDeflator* state, uint16 hhash, uintxx minlength)
+{
+	uintxx n;
+	struct TOPMatch matches[OPMAXMATCHES];
+
+	n = updatetree(state, hhash, matches, minlength);
+	if (n) {
+		n--;
+		return (struct TMatch) {matches[n].length, matches[n].offset};
+	}
+	return (struct TMatch) {minlength, 0};
+}
+
+/* the 4 bytes hash misses the 3 bytes matches, we keep the last position of
+ * each 3 bytes hash to find the closest one */
+CTB_INLINE uintxx
+hash3match(struct TDeflator* state, struct TOPMatch* matches)
+{
+	uintxx hindex;
+	uintxx rpos;
+	uintxx noffset;
+	uint8* strbgn;
+	uint8* pmatch;
+
+	strbgn = PRVT->window + PRVT->cursor;
+	hindex = GETHHASH(GETSHEAD3(PRVT->window, PRVT->cursor)) & H3MASK;
+
+	rpos = PRVT->cursor - PRVT->base;
+	noffset = (uint16) (rpos - PRVT->btree->hlist3[hindex]);
+	PRVT->btree->hlist3[hindex] = (uint16) rpos;
+	if (matches == NULL || PRVT->wend - strbgn < MINMATCH) {
+		return 0;
+	}
+
+	if (CTB_UNLIKELY(noffset > PRVT->wndwsize || noffset == 0)) {
+		return 0;
+	}
+	pmatch = strbgn - noffset;
+	if (pmatch[0] == strbgn[0] &&
+	    pmatch[1] == strbgn[1] &&
+	    pmatch[2] == strbgn[2]) {
+		matches[0].length = MINMATCH;
+		matches[0].offset = (uint16) noffset;
+		return 1;
+	}
+	return 0;
+}
+
+static const uint8 dsymbols[] = {
+	0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x04, 0x05,
+	0x05, 0x06, 0x06, 0x06, 0x06, 0x07, 0x07, 0x07,
+	0x07, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,
+	0x08, 0x09, 0x09, 0x09, 0x09, 0x09, 0x09, 0x09,
+	0x09, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a,
+	0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a,
+	0x0a, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b,
+	0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b,
+	0x0b, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c,
+	0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c,
+	0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c,
+	0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c,
+	0x0c, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d,
+	0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d,
+	0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d,
+	0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d,
+	0x0d, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e,
+	0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e,
+	0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e,
+	0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e,
+	0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e,
+	0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e,
+	0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e,
+	0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e,
+	0x0e, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x00, 0x0f, 0x10, 0x11, 0x12, 0x12, 0x13, 0x13,
+	0x14, 0x14, 0x14, 0x14, 0x15, 0x15, 0x15, 0x15,
+	0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16,
+	0x17, 0x17, 0x17, 0x17, 0x17, 0x17, 0x17, 0x17,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+	0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,
+	0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,
+	0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,
+	0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,
+	0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,
+	0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,
+	0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b,
+	0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b,
+	0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b,
+	0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b,
+	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c,
+	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c,
+	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c,
+	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c,
+	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c,
+	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c,
+	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c,
+	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c,
+	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d,
+	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d,
+	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d,
+	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d,
+	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d,
+	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d,
+	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d,
+	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d
+};
+
+CTB_FORCEINLINE uintxx
+getdsymbol(uintxx n)
+{
+	if (n < 256) {
+		return dsymbols[n];
+	}
+	return dsymbols[256 + ((n - 1) >> 7)];
+}
+
+static const uint8 lsymbols[] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x08, 0x09, 0x09, 0x0a, 0x0a, 0x0b, 0x0b,
+	0x0c, 0x0c, 0x0c, 0x0c, 0x0d, 0x0d, 0x0d, 0x0d,
+	0x0e, 0x0e, 0x0e, 0x0e, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12,
+	0x13, 0x13, 0x13, 0x13, 0x13, 0x13, 0x13, 0x13,
+	0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
+	0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
+	0x15, 0x15, 0x15, 0x15, 0x15, 0x15, 0x15, 0x15,
+	0x15, 0x15, 0x15, 0x15, 0x15, 0x15, 0x15, 0x15,
+	0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16,
+	0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16,
+	0x17, 0x17, 0x17, 0x17, 0x17, 0x17, 0x17, 0x17,
+	0x17, 0x17, 0x17, 0x17, 0x17, 0x17, 0x17, 0x17,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+	0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,
+	0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,
+	0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,
+	0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,
+	0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,
+	0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,
+	0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,
+	0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,
+	0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b,
+	0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b,
+	0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b,
+	0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1c
+};
+
+CTB_FORCEINLINE uintxx
+getlsymbol(uintxx n)
+{
+	return lsymbols[n - 3];
+}
+
+
+CTB_FORCEINLINE void
+appendz(struct TDeflator* state, struct TMatch match, uintxx ls, uintxx ds)
+{
+	/* token layout:
+	 *        length       distance            length symbol and distance
+	 * 1------a aaaaaaaa | bbbbbbbb bbbbbbbb | cccccccc dddddddd */
+	PRVT->zend[0] = (uint16) (match.length | 0x8000);
+	PRVT->zend[1] = (uint16) (match.offset);
+
+	PRVT->zend[2] = (uint16) ((ls << 0x08) | (ds << 0x00));
+	PRVT->zend += 3;
+}
+
+#define APPENDL(B, L) (*(B)++ = (uint16) (L))
+
+
+#define MINLOOKAHEAD (MINMATCH + MAXMATCH)
+
+
+/* lz buffer entries between block split checks */
+#define SPLITSTEP 0x800
+
+CTB_INLINE void
+setzcheck(struct TDeflator* state)
+{
+	PRVT->zcheck = PRVT->zend + SPLITSTEP;
+	if (PRVT->zcheck > PRVT->lzlistend - 5) {
+		PRVT->zcheck = PRVT->lzlistend - 5;
+	}
+}
+
+CTB_INLINE void
+resetsplit(struct TDeflator* state)
+{
+	uintxx i;
+
+	for (i = 0; i < SPLITNOBS; i++) {
+		PRVT->extra->sobs[i] = 0;
+	}
+	for (i = 0; i < DEFLT_LMAXSYMBOL; i++) {
+		PRVT->extra->slfrqs[i] = 0;
+	}
+	for (i = 0; i < DEFLT_DMAXSYMBOL; i++) {
+		PRVT->extra->sdfrqs[i] = 0;
+	}
+	PRVT->extra->scost = 0;
+	setzcheck(state);
+}
+
+/* round(16 * log2(n)) */
+static const uint8 log2table[] = {
+	0x00, 0x00, 0x10, 0x19, 0x20, 0x25, 0x29, 0x2d,
+	0x30, 0x33, 0x35, 0x37, 0x39, 0x3b, 0x3d, 0x3f,
+	0x40, 0x41, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f, 0x4f,
+	0x50, 0x51, 0x51, 0x52, 0x53, 0x53, 0x54, 0x55,
+	0x55, 0x56, 0x56, 0x57, 0x57, 0x58, 0x58, 0x59,
+	0x59, 0x5a, 0x5a, 0x5b, 0x5b, 0x5c, 0x5c, 0x5d,
+	0x5d, 0x5d, 0x5e, 0x5e, 0x5f, 0x5f, 0x5f, 0x60,
+	0x60, 0x60, 0x61, 0x61, 0x61, 0x62, 0x62, 0x62,
+	0x63, 0x63, 0x63, 0x64, 0x64, 0x64, 0x65, 0x65,
+	0x65, 0x65, 0x66, 0x66, 0x66, 0x67, 0x67, 0x67,
+	0x67, 0x68, 0x68, 0x68, 0x68, 0x69, 0x69, 0x69,
+	0x69, 0x6a, 0x6a, 0x6a, 0x6a, 0x6b, 0x6b, 0x6b,
+	0x6b, 0x6b, 0x6c, 0x6c, 0x6c, 0x6c, 0x6d, 0x6d,
+	0x6d, 0x6d, 0x6d, 0x6e, 0x6e, 0x6e, 0x6e, 0x6e,
+	0x6f, 0x6f, 0x6f, 0x6f, 0x6f, 0x6f, 0x70, 0x70,
+	0x70, 0x70, 0x70, 0x71, 0x71, 0x71, 0x71, 0x71,
+	0x71, 0x72, 0x72, 0x72, 0x72, 0x72, 0x72, 0x73,
+	0x73, 0x73, 0x73, 0x73, 0x73, 0x74, 0x74, 0x74,
+	0x74, 0x74, 0x74, 0x74, 0x75, 0x75, 0x75, 0x75,
+	0x75, 0x75, 0x75, 0x76, 0x76, 0x76, 0x76, 0x76,
+	0x76, 0x76, 0x77, 0x77, 0x77, 0x77, 0x77, 0x77,
+	0x77, 0x77, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78,
+	0x78, 0x79, 0x79, 0x79, 0x79, 0x79, 0x79, 0x79,
+	0x79, 0x79, 0x7a, 0x7a, 0x7a, 0x7a, 0x7a, 0x7a,
+	0x7a, 0x7a, 0x7b, 0x7b, 0x7b, 0x7b, 0x7b, 0x7b,
+	0x7b, 0x7b, 0x7b, 0x7c, 0x7c, 0x7c, 0x7c, 0x7c,
+	0x7c, 0x7c, 0x7c, 0x7c, 0x7d, 0x7d, 0x7d, 0x7d,
+	0x7d, 0x7d, 0x7d, 0x7d, 0x7d, 0x7d, 0x7e, 0x7e,
+	0x7e, 0x7e, 0x7e, 0x7e, 0x7e, 0x7e, 0x7e, 0x7e,
+	0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f,
+	0x7f, 0x7f, 0x7f, 0x80, 0x80, 0x80, 0x80, 0x80
+};
+
+/* log2 of n in 1/16 bits */
+CTB_INLINE uintxx
+getlog2(uintxx n)
+{
+	uintxx r;
+
+	r = 0;
+	while (n >= 0x100) {
+		n >>= 2;
+		r += 2 * 16;
+	}
+	return r + log2table[n];
+}
+
+/* fixed size of the dynamic block header (the block type, the counts and
+ * the precode lengths) */
+#define ESTIMATEDHEADER (3 + 14 + 19 * 3)
+
+/* estimated size in bits of a dynamic block with the given frequencies,
+ * the entropy of the symbols (at least one bit each), their extra bits and
+ * about 4 bits for each used symbol in the header */
+static uintxx
+estimatecost(const uintxx* lfrqs, const uintxx* dfrqs)
+{
+	uintxx i;
+	uintxx j;
+	uintxx f;
+	uintxx n;
+	uintxx s;
+	uintxx u;
+	uintxx m;
+	uintxx bits;
+	uintxx total;
+	const uintxx* frqs;
+
+	total = ESTIMATEDHEADER;
+	for (j = 0; j < 2; j++) {
+		frqs = lfrqs;
+		m = MAXLTCODES + 29;
+		if (j) {
+			frqs = dfrqs;
+			m = 30;
+		}
+
+		n = s = u = 0;
+		for (i = 0; i < m; i++) {
+			f = frqs[i];
+			n += f;
+			s += f * getlog2(f);
+			u += f != 0;
+		}
+		total += u * 4;
+		bits = (n * getlog2(n) - s) >> 4;
+		if (bits < n) {
+			bits = n;
+		}
+		total += bits;
+	}
+
+	for (i = 0; i < 29; i++) {
+		total += lfrqs[MAXLTCODES + i] * slnscodes[i].bextra;
+	}
+	for (i = 0; i < 30; i++) {
+		total += dfrqs[i] * sdstcodes[i].bextra;
+	}
+	return total;
+}
+
+/* ends the block when its first byte would leave the window (so it can
+ * still be stored) if the symbols take more bits than the bytes */
+static uintxx
+checkstored(struct TDeflator* state)
+{
+	uintxx length;
+	uintxx entries;
+
+	if (PRVT->bstart < 0) {
+		return 0;
+	}
+	length  = (uintxx) ((intxx) PRVT->cursor - PRVT->bstart);
+	entries = (uintxx) (PRVT->zend - PRVT->lzlist);
+	if (length + (SPLITSTEP << 1) < PRVT->wndwsize) {
+		return 0;
+	}
+
+	/* almost all the entries must be literals */
+	if ((entries << 3) < length * 7) {
+		return 0;
+	}
+	return estimatecost(PRVT->extra->lfrqs, PRVT->extra->dfrqs) >= length << 3;
+}
+
+/* checks if the symbols since the last check are different enough from the
+ * ones of the block to start a new one, the literals are grouped in 8 types
+ * and the matches in 2 (short and long), and then if the estimated cost of
+ * both parts in their own blocks is lower than the one of the whole block */
+static uintxx
+checksplit(struct TDeflator* state)
+{
+	uintxx i;
+	uintxx j;
+	uintxx nobs;
+	uintxx nnew;
+	uintxx delta;
+	uintxx cutoff;
+	uintxx length;
+	uintxx mcost;
+	uintxx* lfrqs;
+	uintxx* dfrqs;
+	struct TDEFLTExtra* extra;
+	uintxx cobs[SPLITNOBS];
+
+	extra = PRVT->extra;
+	lfrqs = extra->lfrqs;
+	dfrqs = extra->dfrqs;
+	/* the even and odd literals of each quarter */
+	for (j = 0; j < 8; j += 2) {
+		uintxx a;
+		uintxx b;
+
+		a = b = 0;
+		for (i = j << 5; i < (j + 2) << 5; i += 2) {
+			a += lfrqs[i + 0];
+			b += lfrqs[i + 1];
+		}
+		cobs[j + 0] = a;
+		cobs[j + 1] = b;
+	}
+	cobs[8] = cobs[9] = 0;
+	for (i = 0; i < 29; i++) {
+		cobs[8 + (i >= 6)] += lfrqs[MAXLTCODES + i];
+	}
+
+	mcost = 0;
+	nobs = 0;
+	nnew = 0;
+	for (i = 0; i < SPLITNOBS; i++) {
+		nobs += extra->sobs[i];
+		nnew += cobs[i] - extra->sobs[i];
+	}
+
+	if (nobs) {
+		delta = 0;
+		for (i = 0; i < SPLITNOBS; i++) {
+			uintxx a;
+			uintxx b;
+
+			a = (cobs[i] - extra->sobs[i]) * nobs;
+			b = extra->sobs[i] * nnew;
+			delta += (a > b) ? a - b : b - a;
+		}
+
+		/* short blocks need a larger difference */
+		length = (uintxx) ((intxx) PRVT->cursor - PRVT->bstart);
+		cutoff = ((nnew * 200) >> 9) * nobs;
+		if (length < 10000 && nobs + nnew < 8192) {
+			cutoff += (cutoff >> 13) * (8192 - (nobs + nnew));
+		}
+		if (delta + (length >> 12) * nobs >= cutoff) {
+			uintxx c;
+			uintxx nlfrqs[DEFLT_LMAXSYMBOL];
+			uintxx ndfrqs[DEFLT_DMAXSYMBOL];
+
+			for (i = 0; i < DEFLT_LMAXSYMBOL; i++) {
+				nlfrqs[i] = lfrqs[i] - extra->slfrqs[i];
+			}
+			for (i = 0; i < DEFLT_DMAXSYMBOL; i++) {
+				ndfrqs[i] = dfrqs[i] - extra->sdfrqs[i];
+			}
+
+			c = extra->scost;
+			if (c == 0) {
+				c = estimatecost(extra->slfrqs, extra->sdfrqs);
+			}
+			c += estimatecost(nlfrqs, ndfrqs);
+
+			/* the split must save at least 1/256 of the block */
+			mcost = estimatecost(lfrqs, dfrqs);
+			if (c + (mcost >> 8) < mcost) {
+				return 1;
+			}
+		}
+	}
+
+	if (checkstored(state)) {
+		return 1;
+	}
+
+	for (i = 0; i < SPLITNOBS; i++) {
+		extra->sobs[i] = cobs[i];
+	}
+	for (i = 0; i < DEFLT_LMAXSYMBOL; i++) {
+		extra->slfrqs[i] = lfrqs[i];
+	}
+	for (i = 0; i < DEFLT_DMAXSYMBOL; i++) {
+		extra->sdfrqs[i] = dfrqs[i];
+	}
+	extra->scost = mcost;
+	return 0;
+}
+
+/* checks if the block must end (the lz buffer is full or the symbols have
+ * changed) */
+CTB_INLINE uintxx
+endblock(struct TDeflator* state)
+{
+	if (PRVT->zend + 5 > PRVT->lzlistend) {
+		return 1;
+	}
+	if (checksplit(state)) {
+		return 1;
+	}
+
+	setzcheck(state);
+	return 0;
+}
+
+/* greedy parser */
+static uintxx
+compress1(struct TDeflator* state)
+{
+	uintxx limit;
+	uintxx srcleft;
+	uintxx r;
+	uintxx c;
+	uintxx* lnsfrqs;
+	uintxx* dstfrqs;
+	uintxx* litfrqs;
+	struct TMatch match;
+
+	litfrqs = PRVT->extra->lfrqs;
+	dstfrqs = PRVT->extra->dfrqs;
+	lnsfrqs = PRVT->extra->lfrqs + MAXLTCODES;
+	if (PRVT->blockinit == 0) {
+		resetfreqs(state);
+		resetsplit(state);
+		PRVT->blockinit = 1;
+	}
+
+L_LOOP:
+	limit = (uintxx) (PRVT->wend - PRVT->window);
+	if (limit - PRVT->cursor > MINLOOKAHEAD) {
+		if (state->flush == 0 || state->source < state->send) {
+			limit -= MINLOOKAHEAD - 1;
+		}
+	}
+	else {
+		srcleft = (uintxx) (state->send - state->source);
+		if (srcleft) {
+			limit = PRVT->cursor;
+		}
+		else {
+			if (state->flush == 0) {
+				return DEFLT_SRCEXHSTD;
+			}
+		}
+	}
+
+	while (CTB_LIKELY(limit > PRVT->cursor)) {
+		uintxx lsymbol;
+		uintxx dsymbol;
+		uint16 hash;
+		uint32 head;
+
+		head = GETSHEAD3(PRVT->window, PRVT->cursor);
+		hash = GETHHASH(head);
+
+		match = findmatch(state, hash, MINMATCH - 1);
+
+		insert(state, (uint16) (PRVT->cursor - PRVT->base), hash);
+		if (CTB_LIKELY(match.length >= MINMATCH)) {
+			lsymbol = getlsymbol(match.length);
+			dsymbol = getdsymbol(match.offset);
+
+			lnsfrqs[lsymbol]++;
+			dstfrqs[dsymbol]++;
+			appendz(state, match, lsymbol, dsymbol);
+			if (CTB_LIKELY(match.length <= PRVT->mininsert)) {
+				PRVT->cursor++;
+				insertrun(state, match.length - 1, 0x00ffffffUL);
+			}
+			else {
+				PRVT->cursor += match.length;
+			}
+		}
+		else {
+			c = PRVT->window[PRVT->cursor];
+			APPENDL(PRVT->zend, c);
+			litfrqs[c]++;
+
+			PRVT->cursor++;
+		}
+
+		if (CTB_UNLIKELY(PRVT->zend >= PRVT->zcheck)) {
+			if (endblock(state)) {
+				SETSTATE(1);
+				PRVT->hasinput = 1;
+				return 0;
+			}
+		}
+	}
+
+	r = fillwindow(state);
+	if (CTB_LIKELY(r)) {
+		goto L_LOOP;
+	}
+
+	if (CTB_UNLIKELY(state->flush)) {
+		SETSTATE(1);
+		PRVT->hasinput = 0;
+		/* no more input */
+		return 0;
+	}
+
+	return DEFLT_SRCEXHSTD;
+}
+
+/* lazy parser */
+CTB_FORCEINLINE uintxx
+compress2ex(struct TDeflator* state, uintxx usetree)
+{
+	uintxx limit;
+	uintxx srcleft;
+	uintxx minlength;
+	uintxx hasmatch;
+	uintxx skip;
+	uintxx r;
+	uintxx c;
+	uintxx* lnsfrqs;
+	uintxx* dstfrqs;
+	uintxx* litfrqs;
+	struct TMatch prevm;
+	struct TMatch match;
+
+	if (PRVT->blockinit == 0) {
+		resetfreqs(state);
+		resetsplit(state);
+		PRVT->blockinit = 1;
+	}
+	litfrqs = PRVT->extra->lfrqs;
+	dstfrqs = PRVT->extra->dfrqs;
+	lnsfrqs = PRVT->extra->lfrqs + MAXLTCODES;
+
+	/* added because GCC warnings */
+	skip = 1;
+	prevm.length = 0;
+	prevm.offset = 0;
+
+	hasmatch  = 0;
+	minlength = MINMATCH;
+
+L_LOOP:
+	limit = (uintxx) (PRVT->wend - PRVT->window);
+	if (limit - PRVT->cursor > MINLOOKAHEAD + 1) {
+		if (state->flush == 0 || state->source < state->send) {
+			limit -= MINLOOKAHEAD;
+		}
+	}
+	else {
+		srcleft = (uintxx) (state->send - state->source);
+		if (srcleft) {
+			limit = PRVT->cursor;
+		}
+		else {
+			if (state->flush == 0) {
+				return DEFLT_SRCEXHSTD;
+			}
+		}
+	}
+
+	while (CTB_LIKELY(limit > PRVT->cursor)) {
+		uint16 hash;
+		uint32 head;
+
+		for (;;) {
+			head = GETSHEAD4(PRVT->window, PRVT->cursor);
+			hash = GETHHASH(head);
+
+			if (usetree) {
+				match = treematch(state, hash, minlength);
+			}
+			else {
+				match = findmatch(state, hash, minlength);
+
+				insert(state, (uint16) (PRVT->cursor - PRVT->base), hash);
+			}
+			PRVT->cursor++;
+			if (CTB_LIKELY(hasmatch)) {
+				if (CTB_LIKELY(minlength >= match.length)) {
+					match = prevm;
+					skip++;
+				}
+				else {
+					c = PRVT->window[PRVT->cursor - 2];
+					litfrqs[c]++;
+					APPENDL(PRVT->zend, c);
+				}
+			}
+			else {
+				if (CTB_LIKELY(match.length > MINMATCH)) {
+					hasmatch = 1;
+					skip = 1;
+					if (CTB_LIKELY(match.length < PRVT->nicematch)) {
+						/* try at the next position */
+						prevm     = match;
+						minlength = prevm.length;
+						continue;
+					}
+				}
+			}
+
+			break;
+		}
+
+		if (CTB_LIKELY(hasmatch)) {
+			uintxx lsymbol;
+			uintxx dsymbol;
+
+			lsymbol = getlsymbol(match.length);
+			dsymbol = getdsymbol(match.offset);
+
+			lnsfrqs[lsymbol]++;
+			dstfrqs[dsymbol]++;
+			appendz(state, match, lsymbol, dsymbol);
+			if (usetree) {
+				for (; match.length > skip; skip++) {
+					head = GETSHEAD4(PRVT->window, PRVT->cursor);
+					hash = GETHHASH(head);
+
+					updatetree(state, hash, NULL, MAXMATCH);
+					PRVT->cursor++;
+				}
+			}
+			else {
+				insertrun(state, match.length - skip, 0xffffffffUL);
+			}
+
+			hasmatch = 0;
+			minlength = MINMATCH;
+		}
+		else {
+			c = PRVT->window[PRVT->cursor - 1];
+			litfrqs[c]++;
+
+			APPENDL(PRVT->zend, c);
+		}
+
+		if (CTB_UNLIKELY(PRVT->zend >= PRVT->zcheck)) {
+			if (endblock(state)) {
+				SETSTATE(1);
+				PRVT->hasinput = 1;
+
+				return 0;
+			}
+		}
+	}
+
+	r = fillwindow(state);
+	if (CTB_LIKELY(r)) {
+		goto L_LOOP;
+	}
+
+	if (CTB_UNLIKELY(state->flush)) {
+		SETSTATE(1);
+		PRVT->hasinput = 0;
+		/* no more input */
+		return 0;
+	}
+
+	return DEFLT_SRCEXHSTD;
+}
+
+static uintxx
+compress2(struct TDeflator* state)
+{
+	if (PRVT->usetree) {
+		return compress2ex(state, 1);
+	}
+	return compress2ex(state, 0);
+}
+
+static void
+setcosts(struct TDEFLTExtra* extra, uintxx* frqs, uintxx size, uint8* costs)
+{
+	uintxx i;
+	uintxx j;
+
+	j = computelengths(extra, frqs, size);
+	if (j) {
+		limitlengths(extra->clns, j, NMAXBITS);
+	}
+
+	/* unused symbols get the maximum length */
+	for (i = 0; i < size; i++) {
+		costs[i] = NMAXBITS;
+	}
+	for (i = 0; i < j; i++) {
+		costs[extra->smap[i]] = (uint8) extra->clns[i];
+	}
+}
+
+/* sets the cost model using the frequencies of the parser (or the lengths of
+ * the static codes) */
+static void
+setcostmodel(struct TDeflator* state, uintxx usestatic)
+{
+	uintxx i;
+	struct TDEFLTOParser* op;
+	uint8 dcosts[DEFLT_DMAXSYMBOL];
+
+	op = PRVT->oparser;
+	if (usestatic) {
+		for (i = 0; i < MAXLTCODES; i++) {
+			op->lcosts[i] = slitcodes[i].bitlen;
+		}
+		for (; i < DEFLT_LMAXSYMBOL; i++) {
+			op->lcosts[i] = slnscodes[i - MAXLTCODES].bitlen;
+		}
+		for (i = 0; i < DEFLT_DMAXSYMBOL; i++) {
+			dcosts[i] = sdstcodes[i].bitlen;
+		}
+	}
+	else {
+		setcosts(PRVT->extra, op->lfrqs, DEFLT_LMAXSYMBOL, op->lcosts);
+		setcosts(PRVT->extra, op->dfrqs, DEFLT_DMAXSYMBOL, dcosts);
+	}
+
+	for (i = 0; i < DEFLT_DMAXSYMBOL; i++) {
+		op->dcosts[i] = dcosts[i] + sdstcodes[i].bextra;
+	}
+	for (i = MINMATCH; i <= MAXMATCH; i++) {
+		uintxx lsymbol;
+
+		lsymbol = getlsymbol(i);
+		op->mcosts[i] = (uint16) (op->lcosts[MAXLTCODES + lsymbol]);
+		op->mcosts[i] = (uint16) (op->mcosts[i] + slnscodes[lsymbol].bextra);
+	}
+}
+
+/* finds the cheapest path over the chunk, the steps are stored in reverse
+ * order in the costs array (length | offset << 16) */
+static uintxx
+findpath(struct TDeflator* state, uint8* chunk, uintxx n)
+{
+	uintxx i;
+	uintxx j;
+	uintxx count;
+	struct TDEFLTOParser* op;
+
+	op = PRVT->oparser;
+	op->costs[0] = 0;
+	for (i = 1; i <= n; i++) {
+		op->costs[i] = 0xffffffffUL;
+	}
 
-	next = PRVT->hlist[hhash & HMASK];
-	for (i = PRVT->maxchain; i > 0; i--) {
-		uintxx nlength;
-		uint8* pmatch;
+	for (i = 0; i < n; i++) {
+		uint32 cost;
+		uint32 c;
+		uintxx length;
+		uintxx mlength;
 
-		/* we use modular arithmetic here, so there is no need to shift
-		 * the cache table entries each time we slide the window */
-		noffset = (uint16) (rpos - next);
-		if (CTB_UNLIKELY(noffset > WNDWSIZE || noffset == 0)) {
-			break;
+		cost = op->costs[i];
+
+		/* literal */
+		c = cost + op->lcosts[chunk[i]];
+		if (c < op->costs[i + 1]) {
+			op->costs[i + 1]   = c;
+			op->lengths[i + 1] = 1;
 		}
-		pmatch = strbgn - noffset;
-		if (CTB_LIKELY(strbgn[length] == pmatch[length])) {
 
-			nlength = getmatchlength(strbgn, pmatch, strend);
-			if (nlength > length) {
-				length = nlength;
-				offset = noffset;
+		/* every length of each match (up to the next match length) */
+		length = MINMATCH;
+		for (j = op->mindex[i]; j < op->mindex[i + 1]; j++) {
+			uint32 dcost;
+			uintxx offset;
 
-				if (length >= PRVT->nicematch) {
-					if (length >= PRVT->goodmatch) {
-						break;
-					}
-					i = i >> 2;
+			mlength = op->matches[j].length;
+			if (mlength > n - i) {
+				mlength = n - i;
+			}
+			offset = op->matches[j].offset;
+
+			dcost = cost + op->dcosts[getdsymbol(offset)];
+			for (; length <= mlength; length++) {
+				c = dcost + op->mcosts[length];
+				if (c < op->costs[i + length]) {
+					op->costs[i + length]   = c;
+					op->lengths[i + length] = (uint16) length;
+					op->offsets[i + length] = (uint16) offset;
 				}
 			}
 		}
-		next = PRVT->chain[next & SMASK];
 	}
 
-	return (struct TMatch) {length, offset};
+	count = 0;
+	for (i = n; i; i -= op->lengths[i]) {
+		op->costs[count++] = op->lengths[i] | ((uint32) op->offsets[i] << 16);
+	}
+	return count;
 }
 
-static const uint8 dsymbols[] = {
-	0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x04, 0x05,
-	0x05, 0x06, 0x06, 0x06, 0x06, 0x07, 0x07, 0x07,
-	0x07, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,
-	0x08, 0x09, 0x09, 0x09, 0x09, 0x09, 0x09, 0x09,
-	0x09, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a,
-	0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a,
-	0x0a, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b,
-	0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b,
-	0x0b, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c,
-	0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c,
-	0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c,
-	0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c,
-	0x0c, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d,
-	0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d,
-	0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d,
-	0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d, 0x0d,
-	0x0d, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e,
-	0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e,
-	0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e,
-	0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e,
-	0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e,
-	0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e,
-	0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e,
-	0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e,
-	0x0e, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
-	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
-	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
-	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
-	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
-	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
-	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
-	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
-	0x00, 0x0f, 0x10, 0x11, 0x12, 0x12, 0x13, 0x13,
-	0x14, 0x14, 0x14, 0x14, 0x15, 0x15, 0x15, 0x15,
-	0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16,
-	0x17, 0x17, 0x17, 0x17, 0x17, 0x17, 0x17, 0x17,
-	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
-	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
-	0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,
-	0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,
-	0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,
-	0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,
-	0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,
-	0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,
-	0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b,
-	0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b,
-	0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b,
-	0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b,
-	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c,
-	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c,
-	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c,
-	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c,
-	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c,
-	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c,
-	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c,
-	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c,
-	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d,
-	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d,
-	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d,
-	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d,
-	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d,
-	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d,
-	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d,
-	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d
-};
+/* sets the frequencies of the parser to the ones of the block plus the ones
+ * of the path, returns the number of extra bits used by the path and stores
+ * the number of token slots */
+static uintxx
+countpath(struct TDeflator* state, uint8* chunk, uintxx count, uintxx* slots)
+{
+	uintxx i;
+	uintxx bits;
+	struct TDEFLTOParser* op;
 
-CTB_FORCEINLINE uintxx
-getdsymbol(uintxx n)
+	op = PRVT->oparser;
+	for (i = 0; i < DEFLT_LMAXSYMBOL; i++) {
+		op->lfrqs[i] = PRVT->extra->lfrqs[i];
+	}
+	for (i = 0; i < DEFLT_DMAXSYMBOL; i++) {
+		op->dfrqs[i] = PRVT->extra->dfrqs[i];
+	}
+	op->lfrqs[BLOCKENDSYMBOL]++;
+
+	bits = 0;
+	slots[0] = count;
+	for (i = count; i--;) {
+		uintxx length;
+		uintxx lsymbol;
+		uintxx dsymbol;
+
+		length = (uint16) op->costs[i];
+		if (length == 1) {
+			op->lfrqs[chunk[0]]++;
+		}
+		else {
+			slots[0] += 2;
+			lsymbol = getlsymbol(length);
+			dsymbol = getdsymbol(op->costs[i] >> 16);
+			op->lfrqs[MAXLTCODES + lsymbol]++;
+			op->dfrqs[dsymbol]++;
+
+			bits += slnscodes[lsymbol].bextra + sdstcodes[dsymbol].bextra;
+		}
+		chunk += length;
+	}
+	return bits;
+}
+
+/* estimated size in bits of the block using the current model */
+static uintxx
+getcost(struct TDeflator* state, uintxx bits, uintxx usestatic)
 {
-	if (n < 256) {
-		return dsymbols[n];
+	uintxx i;
+	struct TDEFLTOParser* op;
+
+	op = PRVT->oparser;
+	if (usestatic) {
+		for (i = 0; i < DEFLT_LMAXSYMBOL; i++) {
+			bits += op->lfrqs[i] * op->lcosts[i];
+		}
+		for (i = 0; i < DEFLT_DMAXSYMBOL; i++) {
+			bits += op->dfrqs[i] * sdstcodes[i].bitlen;
+		}
+		return bits;
 	}
-	return dsymbols[256 + ((n - 1) >> 7)];
+
+	/* the code lengths of the used symbols take about 4 bits each in the
+	 * block header */
+	for (i = 0; i < DEFLT_LMAXSYMBOL; i++) {
+		if (op->lfrqs[i]) {
+			bits += op->lfrqs[i] * op->lcosts[i] + 4;
+		}
+	}
+	for (i = 0; i < DEFLT_DMAXSYMBOL; i++) {
+		if (op->dfrqs[i]) {
+			bits += op->dfrqs[i] * (op->dcosts[i] - sdstcodes[i].bextra) + 4;
+		}
+	}
+	return bits;
 }
 
-static const uint8 lsymbols[] = {
-	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-	0x08, 0x08, 0x09, 0x09, 0x0a, 0x0a, 0x0b, 0x0b,
-	0x0c, 0x0c, 0x0c, 0x0c, 0x0d, 0x0d, 0x0d, 0x0d,
-	0x0e, 0x0e, 0x0e, 0x0e, 0x0f, 0x0f, 0x0f, 0x0f,
-	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
-	0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
-	0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12,
-	0x13, 0x13, 0x13, 0x13, 0x13, 0x13, 0x13, 0x13,
-	0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-	0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-	0x15, 0x15, 0x15, 0x15, 0x15, 0x15, 0x15, 0x15,
-	0x15, 0x15, 0x15, 0x15, 0x15, 0x15, 0x15, 0x15,
-	0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16,
-	0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16,
-	0x17, 0x17, 0x17, 0x17, 0x17, 0x17, 0x17, 0x17,
-	0x17, 0x17, 0x17, 0x17, 0x17, 0x17, 0x17, 0x17,
-	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
-	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
-	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
-	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
-	0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,
-	0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,
-	0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,
-	0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19, 0x19,
-	0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,
-	0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,
-	0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,
-	0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a, 0x1a,
-	0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b,
-	0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b,
-	0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b,
-	0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1c
-};
+/* sets the model to the frequencies of the path and returns its estimated
+ * size in bits (small blocks are static, see flushblck) */
+static uintxx
+getpathcost(struct TDeflator* state, uint8* chunk, uintxx count,
+	uintxx total)
+{
+	uintxx bits;
+	uintxx slots;
 
-CTB_FORCEINLINE uintxx
-getlsymbol(uintxx n)
+	bits = countpath(state, chunk, count, &slots);
+	if (total + slots < 0x400) {
+		setcostmodel(state, 1);
+		return getcost(state, bits, 1);
+	}
+	setcostmodel(state, 0);
+	return getcost(state, bits, 0);
+}
+
+/* longest match at the position (clipped to the chunk end) as a step */
+CTB_INLINE uint32
+getlongest(struct TDEFLTOParser* op, uintxx i, uintxx n)
 {
-	return lsymbols[n - 3];
+	uintxx j;
+	uintxx length;
+
+	j = op->mindex[i + 1];
+	if (j == op->mindex[i]) {
+		return 1;
+	}
+	length = op->matches[j - 1].length;
+	if (length > n - i) {
+		length = n - i;
+		if (length < MINMATCH)
+			return 1;
+	}
+	return (uint32) length | ((uint32) op->matches[j - 1].offset << 16);
 }
 
+/* the path the lazy parser (level 9) takes over the chunk, in the same
+ * format as findpath */
+static uintxx
+findlazypath(struct TDeflator* state, uintxx n)
+{
+	uintxx i;
+	uintxx count;
+	uint32 step;
+	uint32 next;
+	struct TDEFLTOParser* op;
+
+	op = PRVT->oparser;
+	count = 0;
+	for (i = 0; i < n; i += (uint16) step) {
+		/* it doesn't take matches of 3 bytes */
+		step = getlongest(op, i, n);
+		if ((uint16) step <= MINMATCH) {
+			step = 1;
+		}
+		if (step != 1 && i + 1 < n) {
+			/* a longer match at the next position */
+			next = getlongest(op, i + 1, n);
+			if ((uint16) next > (uint16) step) {
+				step = 1;
+			}
+		}
+		op->costs[count++] = step;
+	}
+
+	/* reverse it */
+	for (i = 0; i < count >> 1; i++) {
+		step = op->costs[i];
+		op->costs[i] = op->costs[count - 1 - i];
+		op->costs[count - 1 - i] = step;
+	}
+	return count;
+}
 
-CTB_FORCEINLINE void
-appendz(struct TDeflator* state, struct TMatch match, uintxx ls, uintxx ds)
+/* keeps the path in the costs array if it's the cheapest so far */
+CTB_INLINE void
+keeppath(struct TDeflator* state, uintxx cost, uintxx count, uintxx* best,
+	uintxx* bestcount)
 {
-	/* token layout:
-	 *        length       distance            length symbol and distance
-	 * 1------a aaaaaaaa | bbbbbbbb bbbbbbbb | cccccccc dddddddd */
-	PRVT->zend[0] = (uint16) (match.length | 0x8000);
-	PRVT->zend[1] = (uint16) (match.offset);
+	uintxx i;
+	struct TDEFLTOParser* op;
 
-	PRVT->zend[2] = (uint16) ((ls << 0x08) | (ds << 0x00));
-	PRVT->zend += 3;
+	op = PRVT->oparser;
+	if (cost < best[0]) {
+		for (i = 0; i < count; i++) {
+			op->steps[i] = op->costs[i];
+		}
+		best[0] = cost;
+		bestcount[0] = count;
+	}
 }
 
-#define APPENDL(B, L) (*(B)++ = (uint16) (L))
+/* parses the next n bytes (there must be space for n tokens) */
+static void
+parsechunk(struct TDeflator* state, uintxx n)
+{
+	uintxx i;
+	uintxx j;
+	uintxx skip;
+	uintxx count;
+	uintxx total;
+	uintxx pass;
+	uintxx best;
+	uintxx bestcount;
+	uintxx slots;
+	uint8* chunk;
+	uint32* path;
+	uintxx* lnsfrqs;
+	uintxx* dstfrqs;
+	uintxx* litfrqs;
+	struct TDEFLTOParser* op;
 
+	op = PRVT->oparser;
+	chunk = PRVT->window + PRVT->cursor;
 
-#define MINLOOKAHEAD (MINMATCH + MAXMATCH)
+	/* collect the matches at each position */
+	count = 0;
+	skip  = 0;
+	for (i = 0; i < n; i++) {
+		uint16 hash;
+		uint32 head;
+
+		op->mindex[i] = (uint32) count;
+		head = GETSHEAD4(PRVT->window, PRVT->cursor);
+		hash = GETHHASH(head);
+
+		if (skip) {
+			skip--;
+			hash3match(state, NULL);
+			updatetree(state, hash, NULL, MAXMATCH);
+		}
+		else {
+			struct TOPMatch* matches;
+
+			if (count + OPMAXMATCHES + 1 > OPMATCHESSZ) {
+				/* the match list is full, shorten the chunk */
+				n = i;
+				break;
+			}
+
+			/* the 3 bytes match (if any) goes first */
+			matches = op->matches + count;
+			j  = hash3match(state, matches);
+			j += updatetree(state, hash, matches + j, MINMATCH + j - 1);
+			if (j) {
+				count += j;
+
+				/* don't search inside long matches */
+				if (op->matches[count - 1].length >= PRVT->nicematch) {
+					skip = op->matches[count - 1].length - 1;
+				}
+			}
+		}
+		PRVT->cursor++;
+	}
+	op->mindex[n] = (uint32) count;
+
+	litfrqs = PRVT->extra->lfrqs;
+	dstfrqs = PRVT->extra->dfrqs;
+	lnsfrqs = PRVT->extra->lfrqs + MAXLTCODES;
+
+	/* the block will be static if it's small, otherwise we start with the
+	 * frequencies of the block (if there are enough of them) and refine the
+	 * model with the path found on each pass, keeping the cheapest one */
+	total = (uintxx) (PRVT->zend - PRVT->lzlist);
+	pass = PRVT->oppasses;
+	if (total + n < 0x400) {
+		pass = 1;
+	}
+	if (total < 0x400) {
+		setcostmodel(state, 1);
+	}
+	else {
+		countpath(state, chunk, 0, &slots);
+		setcostmodel(state, 0);
+	}
+
+	best = 0xffffffffUL;
+	bestcount = 0;
+	for (; pass; pass--) {
+		count = findpath(state, chunk, n);
+		keeppath(state, getpathcost(state, chunk, count, total), count,
+			&best, &bestcount);
+	}
+
+	/* the model can get stuck taking too many short matches, so one more
+	 * pass uses the model of the path the lazy parser (level 9) takes */
+	count = findlazypath(state, n);
+	getpathcost(state, chunk, count, total);
+	count = findpath(state, chunk, n);
+	keeppath(state, getpathcost(state, chunk, count, total), count,
+		&best, &bestcount);
+
+	path  = op->steps;
+	count = bestcount;
+
+	/* the last match is cut at the chunk end, so it takes the longest match
+	 * of its position and the next chunk starts after it */
+	skip = 0;
+	if (count && (uint16) path[0] != 1) {
+		uint32 step;
+
+		j = n - (uint16) path[0];
+		step = getlongest(op, j, j + MAXMATCH);
+		if ((uint16) step > (uint16) path[0]) {
+			skip = (uint16) step - (uint16) path[0];
+			path[0] = step;
+		}
+	}
+
+	/* emit the tokens */
+	for (i = count; i--;) {
+		struct TMatch match;
+
+		match.length = (uint16) path[i];
+		if (match.length == 1) {
+			litfrqs[chunk[0]]++;
+			APPENDL(PRVT->zend, chunk[0]);
+		}
+		else {
+			uintxx lsymbol;
+			uintxx dsymbol;
+
+			match.offset = path[i] >> 16;
+			lsymbol = getlsymbol(match.length);
+			dsymbol = getdsymbol(match.offset);
+
+			lnsfrqs[lsymbol]++;
+			dstfrqs[dsymbol]++;
+			appendz(state, match, lsymbol, dsymbol);
+		}
+		chunk += match.length;
+	}
+
+	for (; skip; skip--) {
+		uint32 head;
+
+		head = GETSHEAD4(PRVT->window, PRVT->cursor);
+		hash3match(state, NULL);
+		updatetree(state, GETHHASH(head), NULL, MAXMATCH);
+		PRVT->cursor++;
+	}
+}
 
-/* greedy parser */
+/* optimal parser */
 static uintxx
-compress1(struct TDeflator* state)
+compress3(struct TDeflator* state)
 {
 	uintxx limit;
 	uintxx srcleft;
+	uintxx total;
 	uintxx r;
-	uintxx c;
-	uintxx skip;
-	uintxx* lnsfrqs;
-	uintxx* dstfrqs;
-	uintxx* litfrqs;
-	struct TMatch match;
 
-	litfrqs = PRVT->extra->lfrqs;
-	dstfrqs = PRVT->extra->dfrqs;
-	lnsfrqs = PRVT->extra->lfrqs + MAXLTCODES;
 	if (PRVT->blockinit == 0) {
 		resetfreqs(state);
+		resetsplit(state);
 		PRVT->blockinit = 1;
 	}
 
 L_LOOP:
+	/* wait for a full chunk unless we are flushing */
 	limit = (uintxx) (PRVT->wend - PRVT->window);
-	if (limit - PRVT->cursor > MINLOOKAHEAD) {
+	if (limit - PRVT->cursor < OPCHUNKSZ + MINLOOKAHEAD) {
+		if (fillwindow(state)) {
+			goto L_LOOP;
+		}
 		if (state->flush == 0) {
-			limit -= MINLOOKAHEAD - 1;
+			return DEFLT_SRCEXHSTD;
+		}
+	}
+
+	if (limit - PRVT->cursor > MINLOOKAHEAD + 1) {
+		if (state->flush == 0 || state->source < state->send) {
+			limit -= MINLOOKAHEAD;
 		}
 	}
 	else {
@@ -2212,50 +5429,24 @@ L_LOOP:
 	}
 
 	while (CTB_LIKELY(limit > PRVT->cursor)) {
-		uintxx lsymbol;
-		uintxx dsymbol;
-		uint16 hash;
-		uint32 head;
-
-		head = GETSHEAD3(PRVT->window, PRVT->cursor);
-		hash = GETHHASH(head);
-
-		match = findmatch(state, hash, MINMATCH - 1);
-
-		insert(state, (uint16) (PRVT->cursor - PRVT->base), hash);
-		if (CTB_LIKELY(match.length >= MINMATCH)) {
-			lsymbol = getlsymbol(match.length);
-			dsymbol = getdsymbol(match.offset);
-
-			lnsfrqs[lsymbol]++;
-			dstfrqs[dsymbol]++;
-			appendz(state, match, lsymbol, dsymbol);
-			if (CTB_LIKELY(match.length <= PRVT->mininsert)) {
-				PRVT->cursor++;
-				for (skip = 1; match.length > skip; skip++) {
-					head = GETSHEAD3(PRVT->window, PRVT->cursor);
-					hash = GETHHASH(head);
-
-					insert(state, (uint16) (PRVT->cursor - PRVT->base), hash);
-					PRVT->cursor++;
-				}
-			}
-			else {
-				PRVT->cursor += match.length;
-			}
+		total = limit - PRVT->cursor;
+		if (total > OPCHUNKSZ) {
+			total = OPCHUNKSZ;
 		}
-		else {
-			c = PRVT->window[PRVT->cursor];
-			APPENDL(PRVT->zend, c);
-			litfrqs[c]++;
 
-			PRVT->cursor++;
+		/* each byte takes one slot at most */
+		r = (uintxx) (PRVT->lzlistend - PRVT->zend) - 5;
+		if (total > r) {
+			total = r;
 		}
+		parsechunk(state, total);
 
-		if (CTB_UNLIKELY(PRVT->zend + 4 > PRVT->lzlistend)) {
+		if (CTB_UNLIKELY(PRVT->zend + 5 + 0x400 > PRVT->lzlistend) ||
+			(PRVT->zend >= PRVT->zcheck && endblock(state))) {
 			/* flush */
 			SETSTATE(1);
 			PRVT->hasinput = 1;
+
 			return 0;
 		}
 	}
@@ -2275,131 +5466,296 @@ L_LOOP:
 	return DEFLT_SRCEXHSTD;
 }
 
-/* lazy parser */
-static uintxx
-compress2(struct TDeflator* state)
+/* checks if the byte at p and the next two are the same as the previous one
+ * (the bytes after the end give a length smaller than MINMATCH anyway) */
+CTB_FORCEINLINE bool
+hasrun(uint8* p)
+{
+	return GETSHEAD4(p, -1) == (uint32) p[0] * 0x01010101UL;
+}
+
+/* length of the run at p (a match at distance one) up to end, zero if it's
+ * shorter than MINMATCH */
+CTB_FORCEINLINE uintxx
+getrun(uint8* p, uint8* end)
+{
+	uintxx n;
+	uint8* strend;
+
+	if (hasrun(p) == 0) {
+		return 0;
+	}
+	strend = p + MAXMATCH;
+	if (strend > end) {
+		strend = end;
+	}
+
+	n = getmatchlength(p, p - 1, strend);
+	if (n < MINMATCH) {
+		return 0;
+	}
+	return n;
+}
+
+/* the huffman only and run length parsers only count the symbols, they are
+ * taken again from the window when the block is written (see emitraw) and
+ * there is no block split check, the blocks end when the lz buffer could
+ * not hold their tokens */
+#define RAWENTRIES(S) \
+	((uintxx) ((S)->lzlistend - (S)->zend) - 5)
+
+/* huffman only parser, returns 1 if the block must end */
+CTB_INLINE uintxx
+parsehuffman(struct TDeflator* state, uintxx limit)
 {
-	uintxx limit;
-	uintxx srcleft;
-	uintxx minlength;
-	uintxx hasmatch;
-	uintxx skip;
 	uintxx r;
-	uintxx c;
+	uintxx n;
+	uint8* p;
+	uint8* end;
+	uintxx* litfrqs;
+
+	if (limit <= PRVT->cursor) {
+		return 0;
+	}
+
+	r = 0;
+	n = RAWENTRIES(PRVT) - PRVT->rentries;
+	if (limit - PRVT->cursor >= n) {
+		limit = PRVT->cursor + n;
+		r = 1;
+	}
+	PRVT->rentries += limit - PRVT->cursor;
+
+	litfrqs = PRVT->extra->lfrqs;
+	p   = PRVT->window + PRVT->cursor;
+	end = PRVT->window + limit;
+	for (; p < end; p++) {
+		litfrqs[p[0]]++;
+	}
+	PRVT->cursor = limit;
+	return r;
+}
+
+/* run length parser, only matches at distance one */
+CTB_INLINE uintxx
+parserle(struct TDeflator* state, uintxx limit)
+{
+	uintxx n;
+	intxx left;
+	uint8* p;
+	uint8* q;
+	uint8* end;
+	uint8* wend;
+	uint8* window;
 	uintxx* lnsfrqs;
 	uintxx* dstfrqs;
 	uintxx* litfrqs;
-	struct TMatch prevm;
-	struct TMatch match;
 
-	if (PRVT->blockinit == 0) {
-		resetfreqs(state);
-		PRVT->blockinit = 1;
+	if (limit <= PRVT->cursor) {
+		return 0;
 	}
 	litfrqs = PRVT->extra->lfrqs;
 	dstfrqs = PRVT->extra->dfrqs;
 	lnsfrqs = PRVT->extra->lfrqs + MAXLTCODES;
 
-	/* added because GCC warnings */
-	skip = 1;
-	prevm.length = 0;
-	prevm.offset = 0;
-
-	hasmatch  = 0;
-	minlength = MINMATCH;
-
-L_LOOP:
-	limit = (uintxx) (PRVT->wend - PRVT->window);
-	if (limit - PRVT->cursor > MINLOOKAHEAD + 1) {
-		if (state->flush == 0) {
-			limit -= MINLOOKAHEAD;
-		}
+	/* the frequencies could alias the state */
+	window = PRVT->window;
+	wend   = PRVT->wend;
+	left = (intxx) (RAWENTRIES(PRVT) - PRVT->rentries);
+
+	p   = window + PRVT->cursor;
+	end = window + limit;
+	if (p == window) {
+		/* the position zero has no run */
+		litfrqs[*p++]++;
+		left--;
 	}
-	else {
-		srcleft = (uintxx) (state->send - state->source);
-		if (srcleft) {
-			limit = PRVT->cursor;
+	while (CTB_LIKELY(end > p) && CTB_LIKELY(left > 0)) {
+		/* the literals take an entry each */
+		q = end;
+		if (q - p > left) {
+			q = p + left;
+		}
+		for (; p < q && hasrun(p) == 0; p++) {
+			litfrqs[p[0]]++;
+			left--;
+		}
+		if (p == q) {
+			continue;
+		}
+
+		if ((n = getrun(p, wend)) != 0) {
+			lnsfrqs[getlsymbol(n)]++;
+			dstfrqs[0]++;
+			p += n;
+			left -= 3;
 		}
 		else {
-			if (state->flush == 0) {
-				return DEFLT_SRCEXHSTD;
-			}
+			litfrqs[p[0]]++;
+			p++;
+			left--;
 		}
 	}
 
-	while (CTB_LIKELY(limit > PRVT->cursor)) {
-		uint16 hash;
-		uint32 head;
-
-		for (;;) {
-			head = GETSHEAD4(PRVT->window, PRVT->cursor);
-			hash = GETHHASH(head);
+	PRVT->cursor   = (uintxx) (p - window);
+	PRVT->rentries = RAWENTRIES(PRVT) - (uintxx) left;
+	return left <= 0;
+}
 
-			match = findmatch(state, hash, minlength);
+/* greedy parser with a single probe of the hash table (the positions inside
+ * the matches are not inserted) */
+CTB_FORCEINLINE uintxx
+parsefastex(struct TDeflator* state, uintxx limit, uintxx hmask)
+{
+	uintxx c;
+	uint8* p;
+	uint8* end;
+	uint8* wend;
+	uint8* window;
+	uint8* strend;
+	uint16* hlist;
+	uint32 head;
+	uintxx hindex;
+	uintxx rpos;
+	uintxx wsize;
+	uintxx noffset;
+	uintxx* lnsfrqs;
+	uintxx* dstfrqs;
+	uintxx* litfrqs;
+	struct TMatch match;
 
-			insert(state, (uint16) (PRVT->cursor - PRVT->base), hash);
-			PRVT->cursor++;
-			if (CTB_LIKELY(hasmatch)) {
-				if (CTB_LIKELY(minlength >= match.length)) {
-					match = prevm;
-					skip++;
-				}
-				else {
-					c = PRVT->window[PRVT->cursor - 2];
-					litfrqs[c]++;
-					APPENDL(PRVT->zend, c);
-				}
-			}
-			else {
-				if (CTB_LIKELY(match.length > MINMATCH)) {
-					hasmatch = 1;
-					skip = 1;
-					if (CTB_LIKELY(match.length < PRVT->nicematch)) {
-						/* try at the next position */
-						prevm     = match;
-						minlength = prevm.length;
-						continue;
-					}
-				}
-			}
+	litfrqs = PRVT->extra->lfrqs;
+	dstfrqs = PRVT->extra->dfrqs;
+	lnsfrqs = PRVT->extra->lfrqs + MAXLTCODES;
+	hlist = PRVT->hlist;
 
-			break;
-		}
+	/* the frequencies could alias the state */
+	window = PRVT->window;
+	wend   = PRVT->wend;
+	wsize  = PRVT->wndwsize;
+	rpos = PRVT->cursor - PRVT->base;
 
-		if (CTB_LIKELY(hasmatch)) {
-			uintxx lsymbol;
-			uintxx dsymbol;
+	p   = window + PRVT->cursor;
+	end = window + limit;
+	while (CTB_LIKELY(end > p)) {
+		head = GETSHEAD4(p, 0);
+		hindex = GETHHASH(head) & hmask;
 
-			lsymbol = getlsymbol(match.length);
-			dsymbol = getdsymbol(match.offset);
+		noffset = (uint16) (rpos - hlist[hindex]);
+		hlist[hindex] = (uint16) rpos;
 
-			lnsfrqs[lsymbol]++;
-			dstfrqs[dsymbol]++;
-			appendz(state, match, lsymbol, dsymbol);
-			for (; match.length > skip; skip++) {
-				head = GETSHEAD4(PRVT->window, PRVT->cursor);
-				hash = GETHHASH(head);
+		STATSADD(chainsteps, 1);
+		if (noffset - 1 < wsize && GETSHEAD4(p - noffset, 0) == head) {
+			strend = p + MAXMATCH;
+			if (strend > wend) {
+				strend = wend;
+			}
 
-				insert(state, (uint16) (PRVT->cursor - PRVT->base), hash);
-				PRVT->cursor++;
+			match.length = getmatchlength(p, p - noffset, strend);
+			if (CTB_LIKELY(match.length >= MINMATCH)) {
+				uintxx lsymbol;
+				uintxx dsymbol;
+
+				match.offset = noffset;
+				lsymbol = getlsymbol(match.length);
+				dsymbol = getdsymbol(match.offset);
+				lnsfrqs[lsymbol]++;
+				dstfrqs[dsymbol]++;
+				appendz(state, match, lsymbol, dsymbol);
+
+				p    += match.length;
+				rpos += match.length;
+				goto L_CHECK;
 			}
+		}
+		c = p[0];
+		APPENDL(PRVT->zend, c);
+		litfrqs[c]++;
+		p++;
+		rpos++;
+
+L_CHECK:
+		if (CTB_UNLIKELY(PRVT->zend >= PRVT->zcheck)) {
+			PRVT->cursor = (uintxx) (p - window);
+			if (endblock(state)) {
+				return 1;
+			}
+		}
+	}
+	PRVT->cursor = (uintxx) (p - window);
+	return 0;
+}
 
-			hasmatch = 0;
-			minlength = MINMATCH;
+/* see insert */
+CTB_INLINE uintxx
+parsefast(struct TDeflator* state, uintxx limit)
+{
+	if (PRVT->hmask == 0xffff) {
+		return parsefastex(state, limit, 0xffff);
+	}
+	return parsefastex(state, limit, PRVT->hmask);
+}
+
+/* parsers of the strategies (see deflator_setstrategy) */
+static uintxx
+compress4(struct TDeflator* state)
+{
+	uintxx limit;
+	uintxx srcleft;
+	uintxx r;
+
+	if (PRVT->blockinit == 0) {
+		resetfreqs(state);
+		if (ISRAWBLOCK(PRVT)) {
+			PRVT->rstart   = PRVT->cursor;
+			PRVT->rentries = 0;
 		}
 		else {
-			c = PRVT->window[PRVT->cursor - 1];
-			litfrqs[c]++;
+			resetsplit(state);
+		}
+		PRVT->blockinit = 1;
+	}
 
-			APPENDL(PRVT->zend, c);
+L_LOOP:
+	limit = (uintxx) (PRVT->wend - PRVT->window);
+	if (limit - PRVT->cursor > MINLOOKAHEAD) {
+		if (state->flush == 0 || state->source < state->send) {
+			limit -= MINLOOKAHEAD - 1;
+		}
+	}
+	else {
+		srcleft = (uintxx) (state->send - state->source);
+		if (srcleft) {
+			limit = PRVT->cursor;
+		}
+		else {
+			if (state->flush == 0) {
+				return DEFLT_SRCEXHSTD;
+			}
 		}
+	}
 
-		if (CTB_UNLIKELY(PRVT->zend + 5 > PRVT->lzlistend)) {
-			/* flush */
-			SETSTATE(1);
-			PRVT->hasinput = 1;
+	switch (PRVT->strategy) {
+		case DEFLT_SHUFFMAN: r = parsehuffman(state, limit); break;
+		case DEFLT_SRLE:     r = parserle(state, limit);     break;
+		default:             r = parsefast(state, limit);    break;
+	}
+	if (r) {
+		SETSTATE(1);
+		PRVT->hasinput = 1;
+		return 0;
+	}
 
-			return 0;
+	if (ISRAWBLOCK(PRVT)) {
+		/* the bytes that the window would move out (or to the position zero,
+		 * which has no run) go to the lz buffer */
+		if (PRVT->cursor - PRVT->rstart >= PRVT->wndwsize) {
+			if (mustslide(state)) {
+				moveraw(state,
+					PRVT->window + PRVT->rstart, PRVT->window + PRVT->cursor);
+				PRVT->rstart   = PRVT->cursor;
+				PRVT->rentries = 0;
+			}
 		}
 	}
 
@@ -2537,6 +5893,96 @@ static const struct THCode2 slnscodes[MAXLZCODES] = {
 	{0x08, 0x00, 0x00a3, 0x0102}, {0x08, 0x00, 0x0063, 0x0102}
 };
 
+/* static length codes with their extra bits (by length - 3) */
+static const struct THCode1 sfusedlns[256] = {
+	{0x07, 0x0040}, {0x07, 0x0020}, {0x07, 0x0060},
+	{0x07, 0x0010}, {0x07, 0x0050}, {0x07, 0x0030},
+	{0x07, 0x0070}, {0x07, 0x0008}, {0x08, 0x0048},
+	{0x08, 0x00c8}, {0x08, 0x0028}, {0x08, 0x00a8},
+	{0x08, 0x0068}, {0x08, 0x00e8}, {0x08, 0x0018},
+	{0x08, 0x0098}, {0x09, 0x0058}, {0x09, 0x00d8},
+	{0x09, 0x0158}, {0x09, 0x01d8}, {0x09, 0x0038},
+	{0x09, 0x00b8}, {0x09, 0x0138}, {0x09, 0x01b8},
+	{0x09, 0x0078}, {0x09, 0x00f8}, {0x09, 0x0178},
+	{0x09, 0x01f8}, {0x09, 0x0004}, {0x09, 0x0084},
+	{0x09, 0x0104}, {0x09, 0x0184}, {0x0a, 0x0044},
+	{0x0a, 0x00c4}, {0x0a, 0x0144}, {0x0a, 0x01c4},
+	{0x0a, 0x0244}, {0x0a, 0x02c4}, {0x0a, 0x0344},
+	{0x0a, 0x03c4}, {0x0a, 0x0024}, {0x0a, 0x00a4},
+	{0x0a, 0x0124}, {0x0a, 0x01a4}, {0x0a, 0x0224},
+	{0x0a, 0x02a4}, {0x0a, 0x0324}, {0x0a, 0x03a4},
+	{0x0a, 0x0064}, {0x0a, 0x00e4}, {0x0a, 0x0164},
+	{0x0a, 0x01e4}, {0x0a, 0x0264}, {0x0a, 0x02e4},
+	{0x0a, 0x0364}, {0x0a, 0x03e4}, {0x0a, 0x0014},
+	{0x0a, 0x0094}, {0x0a, 0x0114}, {0x0a, 0x0194},
+	{0x0a, 0x0214}, {0x0a, 0x0294}, {0x0a, 0x0314},
+	{0x0a, 0x0394}, {0x0b, 0x0054}, {0x0b, 0x00d4},
+	{0x0b, 0x0154}, {0x0b, 0x01d4}, {0x0b, 0x0254},
+	{0x0b, 0x02d4}, {0x0b, 0x0354}, {0x0b, 0x03d4},
+	{0x0b, 0x0454}, {0x0b, 0x04d4}, {0x0b, 0x0554},
+	{0x0b, 0x05d4}, {0x0b, 0x0654}, {0x0b, 0x06d4},
+	{0x0b, 0x0754}, {0x0b, 0x07d4}, {0x0b, 0x0034},
+	{0x0b, 0x00b4}, {0x0b, 0x0134}, {0x0b, 0x01b4},
+	{0x0b, 0x0234}, {0x0b, 0x02b4}, {0x0b, 0x0334},
+	{0x0b, 0x03b4}, {0x0b, 0x0434}, {0x0b, 0x04b4},
+	{0x0b, 0x0534}, {0x0b, 0x05b4}, {0x0b, 0x0634},
+	{0x0b, 0x06b4}, {0x0b, 0x0734}, {0x0b, 0x07b4},
+	{0x0b, 0x0074}, {0x0b, 0x00f4}, {0x0b, 0x0174},
+	{0x0b, 0x01f4}, {0x0b, 0x0274}, {0x0b, 0x02f4},
+	{0x0b, 0x0374}, {0x0b, 0x03f4}, {0x0b, 0x0474},
+	{0x0b, 0x04f4}, {0x0b, 0x0574}, {0x0b, 0x05f4},
+	{0x0b, 0x0674}, {0x0b, 0x06f4}, {0x0b, 0x0774},
+	{0x0b, 0x07f4}, {0x0c, 0x0003}, {0x0c, 0x0103},
+	{0x0c, 0x0203}, {0x0c, 0x0303}, {0x0c, 0x0403},
+	{0x0c, 0x0503}, {0x0c, 0x0603}, {0x0c, 0x0703},
+	{0x0c, 0x0803}, {0x0c, 0x0903}, {0x0c, 0x0a03},
+	{0x0c, 0x0b03}, {0x0c, 0x0c03}, {0x0c, 0x0d03},
+	{0x0c, 0x0e03}, {0x0c, 0x0f03}, {0x0d, 0x0083},
+	{0x0d, 0x0183}, {0x0d, 0x0283}, {0x0d, 0x0383},
+	{0x0d, 0x0483}, {0x0d, 0x0583}, {0x0d, 0x0683},
+	{0x0d, 0x0783}, {0x0d, 0x0883}, {0x0d, 0x0983},
+	{0x0d, 0x0a83}, {0x0d, 0x0b83}, {0x0d, 0x0c83},
+	{0x0d, 0x0d83}, {0x0d, 0x0e83}, {0x0d, 0x0f83},
+	{0x0d, 0x1083}, {0x0d, 0x1183}, {0x0d, 0x1283},
+	{0x0d, 0x1383}, {0x0d, 0x1483}, {0x0d, 0x1583},
+	{0x0d, 0x1683}, {0x0d, 0x1783}, {0x0d, 0x1883},
+	{0x0d, 0x1983}, {0x0d, 0x1a83}, {0x0d, 0x1b83},
+	{0x0d, 0x1c83}, {0x0d, 0x1d83}, {0x0d, 0x1e83},
+	{0x0d, 0x1f83}, {0x0d, 0x0043}, {0x0d, 0x0143},
+	{0x0d, 0x0243}, {0x0d, 0x0343}, {0x0d, 0x0443},
+	{0x0d, 0x0543}, {0x0d, 0x0643}, {0x0d, 0x0743},
+	{0x0d, 0x0843}, {0x0d, 0x0943}, {0x0d, 0x0a43},
+	{0x0d, 0x0b43}, {0x0d, 0x0c43}, {0x0d, 0x0d43},
+	{0x0d, 0x0e43}, {0x0d, 0x0f43}, {0x0d, 0x1043},
+	{0x0d, 0x1143}, {0x0d, 0x1243}, {0x0d, 0x1343},
+	{0x0d, 0x1443}, {0x0d, 0x1543}, {0x0d, 0x1643},
+	{0x0d, 0x1743}, {0x0d, 0x1843}, {0x0d, 0x1943},
+	{0x0d, 0x1a43}, {0x0d, 0x1b43}, {0x0d, 0x1c43},
+	{0x0d, 0x1d43}, {0x0d, 0x1e43}, {0x0d, 0x1f43},
+	{0x0d, 0x00c3}, {0x0d, 0x01c3}, {0x0d, 0x02c3},
+	{0x0d, 0x03c3}, {0x0d, 0x04c3}, {0x0d, 0x05c3},
+	{0x0d, 0x06c3}, {0x0d, 0x07c3}, {0x0d, 0x08c3},
+	{0x0d, 0x09c3}, {0x0d, 0x0ac3}, {0x0d, 0x0bc3},
+	{0x0d, 0x0cc3}, {0x0d, 0x0dc3}, {0x0d, 0x0ec3},
+	{0x0d, 0x0fc3}, {0x0d, 0x10c3}, {0x0d, 0x11c3},
+	{0x0d, 0x12c3}, {0x0d, 0x13c3}, {0x0d, 0x14c3},
+	{0x0d, 0x15c3}, {0x0d, 0x16c3}, {0x0d, 0x17c3},
+	{0x0d, 0x18c3}, {0x0d, 0x19c3}, {0x0d, 0x1ac3},
+	{0x0d, 0x1bc3}, {0x0d, 0x1cc3}, {0x0d, 0x1dc3},
+	{0x0d, 0x1ec3}, {0x0d, 0x1fc3}, {0x0d, 0x0023},
+	{0x0d, 0x0123}, {0x0d, 0x0223}, {0x0d, 0x0323},
+	{0x0d, 0x0423}, {0x0d, 0x0523}, {0x0d, 0x0623},
+	{0x0d, 0x0723}, {0x0d, 0x0823}, {0x0d, 0x0923},
+	{0x0d, 0x0a23}, {0x0d, 0x0b23}, {0x0d, 0x0c23},
+	{0x0d, 0x0d23}, {0x0d, 0x0e23}, {0x0d, 0x0f23},
+	{0x0d, 0x1023}, {0x0d, 0x1123}, {0x0d, 0x1223},
+	{0x0d, 0x1323}, {0x0d, 0x1423}, {0x0d, 0x1523},
+	{0x0d, 0x1623}, {0x0d, 0x1723}, {0x0d, 0x1823},
+	{0x0d, 0x1923}, {0x0d, 0x1a23}, {0x0d, 0x1b23},
+	{0x0d, 0x1c23}, {0x0d, 0x1d23}, {0x0d, 0x1e23},
+	{0x08, 0x00a3}
+};
+
 static const struct THCode2 sdstcodes[MAXLZCODES] = {
 	{0x05, 0x00, 0x0000, 0x0001}, {0x05, 0x00, 0x0010, 0x0002},
 	{0x05, 0x00, 0x0008, 0x0003}, {0x05, 0x00, 0x0018, 0x0004},
@@ -16,6 +16,8 @@
 
 #include <jdeflate/inflator.h>
 #include <ctoolbox/memory.h>
+#include "cpuinfo.h"
+#include "arena.h"
 
 
 #if defined(AUTOINCLUDE_1)
@@ -24,7 +26,9 @@
 #define DEFLT_MAXBITS    15
 #define DEFLT_WINDOWSZ   32768
 
-#define WNDWSIZE DEFLT_WINDOWSZ
+/* window size range (in bits) */
+#define WNDWBITS    15
+#define MINWNDWBITS 9
 
 
 #else
@@ -45,6 +49,35 @@
 #define ENOUGHD 402  /* enough  32 7 15 */
 
 
+/* word copies for the matches (the vector ones are part of the baseline of
+ * the 64 bit targets) */
+#if !defined(CTB_STRICTALIGNMENT) && defined(CTB_FASTUNALIGNED)
+	#if defined(CTB_ENV64)
+		#define INFLT_WIDECOPY
+	#endif
+#endif
+
+#if defined(INFLT_WIDECOPY)
+	#if defined(__SSE2__) || defined(_M_X64)
+		#define INFLT_SSE2
+		#include <emmintrin.h>
+	#endif
+
+	#if defined(__ARM_NEON) && (defined(__aarch64__) || defined(_M_ARM64))
+		#define INFLT_NEON
+		#include <arm_neon.h>
+	#endif
+#endif
+
+
+/* hot path counters (see inflator_getstats) */
+#if defined(JDEFLATE_STATS)
+	#define STATSADD(FIELD, N) (PRVT->stats.FIELD += (N))
+#else
+	#define STATSADD(FIELD, N) ((void) 0)
+#endif
+
+
 /* private stuff */
 struct TINFLTPrvt {
 	/* public fields */
@@ -54,6 +87,8 @@ struct TINFLTPrvt {
 	uintxx substate;
 	uintxx final;
 	uintxx used;
+	uintxx oneshot;
+	uintxx blockstop;
 
 	/* auxiliar fields */
 	uintxx aux0;
@@ -70,11 +105,16 @@ struct TINFLTPrvt {
 #endif
 	uintxx bcount;
 
-	/* window buffer */
+	/* window buffer (reserved on first use) and its size (set at creation) */
 	uint8* window;
+	uintxx wnsize;
 	uintxx count;          /* bytes avaible in the window buffer + target */
 	uintxx end;            /* window buffer end */
 
+#if defined(JDEFLATE_STATS)
+	struct TINFLTStats stats;
+#endif
+
 	/* decoding tables */
 	struct TINFLTTEntry* ltable;
 	struct TINFLTTEntry* dtable;
@@ -97,7 +137,17 @@ struct TINFLTPrvt {
 			ENOUGHD
 		];
 
+		/* precodes table (their lengths are below CROOTBITS) */
+		struct TINFLTTEntry ctable[1 << CROOTBITS];
+
 		uint16 lengths[DEFLT_LMAXSYMBOL + DEFLT_DMAXSYMBOL];
+
+		/* lengths of the codes in symbols, a block header with the same
+		 * lengths doesn't build the tables again (the counts are zero if
+		 * the tables are not valid) */
+		uint16 clengths[DEFLT_LMAXSYMBOL + DEFLT_DMAXSYMBOL];
+		uintxx clcount;
+		uintxx cdcount;
 	}
 	*tables;
 
@@ -114,9 +164,22 @@ struct TINFLTPrvt {
 
 TInflator*
 inflator_create(TAllocator* allocator)
+{
+	return inflator_createex(0, allocator);
+}
+
+TInflator*
+inflator_createex(uintxx wbits, TAllocator* allocator)
 {
 	struct TInflator* state;
 
+	if (wbits == 0) {
+		wbits = WNDWBITS;
+	}
+	if (wbits < MINWNDWBITS || wbits > WNDWBITS) {
+		return NULL;
+	}
+
 	if (allocator) {
 		state = allocator->reserve(allocator->user, sizeof(struct TINFLTPrvt));
 	}
@@ -129,6 +192,7 @@ inflator_create(TAllocator* allocator)
 	PRVT->allocator = allocator;
 
 	PRVT->window = NULL;
+	PRVT->wnsize = (uintxx) 1 << wbits;
 	PRVT->tables = NULL;
 	inflator_reset(state);
 	if (state->error) {
@@ -138,6 +202,43 @@ inflator_create(TAllocator* allocator)
 	return state;
 }
 
+uintxx
+inflator_memsize(uintxx wbits)
+{
+	uintxx total;
+
+	if (wbits == 0) {
+		wbits = WNDWBITS;
+	}
+	if (wbits < MINWNDWBITS || wbits > WNDWBITS) {
+		return 0;
+	}
+
+	total = arena_overhead() + ARENA_ROUNDUP(sizeof(struct TINFLTPrvt));
+	total += ARENA_ROUNDUP((uintxx) 1 << wbits);
+	total += ARENA_ROUNDUP(sizeof(struct TTINFLTTables));
+	return total;
+}
+
+TInflator*
+inflator_createinplace(uintxx wbits, void* memory, uintxx size)
+{
+	TAllocator* allocator;
+	uintxx n;
+
+	/* see deflator_createinplace */
+	n = inflator_memsize(wbits);
+	if (n == 0 || size < n) {
+		return NULL;
+	}
+
+	allocator = arena_create(memory, size);
+	if (allocator == NULL) {
+		return NULL;
+	}
+	return inflator_createex(wbits, allocator);
+}
+
 CTB_INLINE void*
 _reserve(struct TINFLTPrvt* p, uintxx amount)
 {
@@ -183,6 +284,8 @@ inflator_reset(TInflator* state)
 	PRVT->substate = 0;
 
 	PRVT->used = 0;
+	PRVT->oneshot = 0;
+	PRVT->blockstop = 0;
 	PRVT->aux0 = 0;
 	PRVT->aux1 = 0;
 	PRVT->aux2 = 0;
@@ -195,18 +298,18 @@ inflator_reset(TInflator* state)
 	PRVT->count = 0;
 	PRVT->end   = 0;
 
-	/* */
-	if (PRVT->window == NULL) {
-		PRVT->window = _reserve(PRVT, WNDWSIZE);
-		if (PRVT->window == NULL) {
-			goto L_ERROR;
-		}
-	}
+#if defined(JDEFLATE_STATS)
+	PRVT->stats = (struct TINFLTStats) {0};
+#endif
+
+	/* the window is reserved when the output is first copied to it */
 	if (PRVT->tables == NULL) {
 		PRVT->tables = _reserve(PRVT, sizeof(struct TTINFLTTables));
 		if (PRVT->tables == NULL) {
 			goto L_ERROR;
 		}
+		PRVT->tables->clcount = 0;
+		PRVT->tables->cdcount = 0;
 	}
 	return;
 
@@ -341,6 +444,10 @@ reverseinc(uint16 n, uintxx length)
 #define SUBTABLEENTRY 0x12
 #define INVALIDCODE   0x13
 
+/* two literals in the same root entry, the length of the first code goes in
+ * the low bits of the tag (literal-length tables only) */
+#define DOUBLELITERAL 0x20
+
 
 /* symbol info */
 struct TSInfo {
@@ -391,6 +498,33 @@ static const struct TSInfo dstinfo[] = {
 #define DTABLEMODE 1
 #define CTABLEMODE 2
 
+/* joins the root entries of a literal followed by another one when both
+ * codes fit in the root bits, the second one is the entry of the remaining
+ * bits, so we go backwards to read it before it gets joined too */
+static void
+joinliterals(struct TINFLTTEntry* table)
+{
+	intxx i;
+	struct TINFLTTEntry e1;
+	struct TINFLTTEntry e2;
+
+	for (i = (1L << LROOTBITS) - 1; i >= 0; i--) {
+		e1 = table[i];
+		if (e1.etag != LITERALSYMBOL || e1.length >= LROOTBITS) {
+			continue;
+		}
+
+		e2 = table[i >> e1.length];
+		if (e2.etag != LITERALSYMBOL || e1.length + e2.length > LROOTBITS) {
+			continue;
+		}
+
+		table[i].info   = (uint16) (e1.info | (e2.info << 8));
+		table[i].etag   = (uint8) (DOUBLELITERAL | e1.length);
+		table[i].length = (uint8) (e1.length + e2.length);
+	}
+}
+
 static uintxx
 buildtable(uint16* lengths, uintxx n, struct TINFLTTEntry* table, uintxx mode)
 {
@@ -571,6 +705,10 @@ buildtable(uint16* lengths, uintxx n, struct TINFLTTEntry* table, uintxx mode)
 		}
 	}
 
+	if (mode == LTABLEMODE) {
+		joinliterals(table);
+	}
+
 	/* RFC:
 	 * If only one distance code is used, it is encoded using one bit, not
 	 * zero bits; in this case there is a single code length of one, with one
@@ -640,27 +778,38 @@ updatewindow(struct TInflator* state)
 {
 	uintxx total;
 	uintxx maxrun;
+	uintxx wnsize;
 	uint8* begin;
 
 	total = (uintxx) (state->target - state->tbgn);
-	if (total == 0) {
+	if (total == 0 || PRVT->oneshot) {
 		return 0;
 	}
 
-	if (total > WNDWSIZE) {
-		total = WNDWSIZE;
+	if (CTB_UNLIKELY(PRVT->window == NULL)) {
+		PRVT->window = _reserve(PRVT, PRVT->wnsize);
+		if (PRVT->window == NULL) {
+			SETERROR(INFLT_EOOM);
+			state->state = INFLT_BADSTATE;
+			return 1;
+		}
+	}
+
+	wnsize = PRVT->wnsize;
+	if (total > wnsize) {
+		total = wnsize;
 	}
 	begin = state->target - total;
-	if (PRVT->count < WNDWSIZE) {
+	if (PRVT->count < wnsize) {
 		uintxx bytes;
 
 		bytes = PRVT->count + total;
-		if (bytes > WNDWSIZE)
-			bytes = WNDWSIZE;
+		if (bytes > wnsize)
+			bytes = wnsize;
 		PRVT->count = bytes;
 	}
 
-	maxrun = WNDWSIZE - PRVT->end;
+	maxrun = wnsize - PRVT->end;
 	if (total < maxrun)
 		maxrun = total;
 	ctb_memcpy(PRVT->window + PRVT->end, begin, maxrun);
@@ -686,6 +835,9 @@ eINFLTResult
 inflator_inflate(TInflator* state, uintxx final)
 {
 	uintxx r;
+#if defined(JDEFLATE_STATS)
+	uint8* target;
+#endif
 
 	if (CTB_UNLIKELY(state->finalinput == 0 && final)) {
 		state->finalinput = 1;
@@ -694,7 +846,14 @@ inflator_inflate(TInflator* state, uintxx final)
 	PRVT->used = 1;
 	if (CTB_LIKELY(state->state == 5)) {
 L_DECODE:
-		if (CTB_LIKELY((r = decodeblck(state)) != 0)) {
+#if defined(JDEFLATE_STATS)
+		target = state->target;
+		r = decodeblck(state);
+		PRVT->stats.slowbytes += (uintxx) (state->target - target);
+#else
+		r = decodeblck(state);
+#endif
+		if (CTB_LIKELY(r != 0)) {
 			if (state->finalinput && r == INFLT_SRCEXHSTD) {
 				SETERROR(INFLT_EINPUTEND);
 				return INFLT_ERROR;
@@ -702,6 +861,9 @@ L_DECODE:
 			return r;
 		}
 		state->state = 0;
+		if (PRVT->blockstop && PRVT->final == 0) {
+			goto L_BLOCKEND;
+		}
 	}
 
 	for (;;) {
@@ -732,14 +894,26 @@ L_DECODE:
 
 			/* stored */
 			case 1: {
-				if (CTB_LIKELY((r = decodestrd(state)) != 0)) {
+#if defined(JDEFLATE_STATS)
+				target = state->target;
+				r = decodestrd(state);
+				PRVT->stats.storedbytes += (uintxx) (state->target - target);
+#else
+				r = decodestrd(state);
+#endif
+				if (CTB_LIKELY(r != 0)) {
 					if (state->finalinput && r == INFLT_SRCEXHSTD) {
 						SETERROR(INFLT_EINPUTEND);
 						return INFLT_ERROR;
 					}
 					return r;
 				}
+				STATSADD(blocks[0], 1);
+
 				state->state = 0;
+				if (PRVT->blockstop && PRVT->final == 0) {
+					goto L_BLOCKEND;
+				}
 				continue;
 			}
 
@@ -747,6 +921,7 @@ L_DECODE:
 			case 2: {
 				PRVT->ltable = (void*) lsttctable;
 				PRVT->dtable = (void*) dsttctable;
+				STATSADD(blocks[1], 1);
 
 				state->state = 5;
 				goto L_DECODE;
@@ -761,6 +936,8 @@ L_DECODE:
 					}
 					return r;
 				}
+				STATSADD(blocks[2], 1);
+
 				state->state = 5;
 				goto L_DECODE;
 			}
@@ -774,6 +951,12 @@ L_DECODE:
 		}
 	}
 
+L_BLOCKEND:
+	if (updatewindow(state)) {
+		return INFLT_ERROR;
+	}
+	return INFLT_BLOCKEND;
+
 L_ERROR:
 	if (state->error == 0) {
 		SETERROR(INFLT_EBADSTATE);
@@ -781,6 +964,111 @@ L_ERROR:
 	return INFLT_ERROR;
 }
 
+eINFLTResult
+inflator_inflateblock(TInflator* state, uintxx final)
+{
+	eINFLTResult r;
+	CTB_ASSERT(state);
+
+	PRVT->blockstop = 1;
+	r = inflator_inflate(state, final);
+	PRVT->blockstop = 0;
+	return r;
+}
+
+uintxx
+inflator_getstats(TInflator* state, TINFLTStats* stats)
+{
+	CTB_ASSERT(state && stats);
+
+#if defined(JDEFLATE_STATS)
+	/* slowbytes counts the output of both decoders */
+	stats[0] = PRVT->stats;
+	stats->slowbytes -= stats->fastbytes;
+	return 1;
+#else
+	stats[0] = (struct TINFLTStats) {0};
+	return 0;
+#endif
+}
+
+uintxx
+inflator_getbits(TInflator* state, uintxx* value)
+{
+	CTB_ASSERT(state);
+
+	if (value) {
+		value[0] = (uintxx) getbits(state, PRVT->bcount);
+	}
+	return PRVT->bcount;
+}
+
+void
+inflator_setbits(TInflator* state, uintxx count, uintxx value)
+{
+	CTB_ASSERT(state);
+
+	if (state->state || PRVT->final || PRVT->bcount || count > 24) {
+		SETERROR(INFLT_EINCORRECTUSE);
+		state->state = INFLT_BADSTATE;
+		return;
+	}
+	PRVT->bbuffer = value & ((((BBTYPE) 1) << count) - 1);
+	PRVT->bcount  = count;
+}
+
+bool
+inflator_atblockend(TInflator* state)
+{
+	CTB_ASSERT(state);
+
+	if (state->state || PRVT->final || PRVT->substate) {
+		return 0;
+	}
+	return PRVT->bcount == 0 && state->source == state->send;
+}
+
+eINFLTResult
+inflator_decompressbuffer(TInflator* state, const uint8* source, uintxx ssize,
+	uint8* target, uintxx tsize)
+{
+	eINFLTResult r;
+	CTB_ASSERT(state);
+
+	inflator_reset(state);
+	if (state->error) {
+		return INFLT_ERROR;
+	}
+
+	/* the whole output is in the target buffer, so we don't need to keep the
+	 * window updated */
+	PRVT->oneshot = 1;
+
+	inflator_setsrc(state, (uint8*) source, ssize);
+	inflator_settgt(state, target, tsize);
+	r = inflator_inflate(state, 1);
+	if (r == INFLT_TGTEXHSTD) {
+		state->state = INFLT_BADSTATE;
+	}
+	return r;
+}
+
+void
+inflator_setnowindow(TInflator* state)
+{
+	CTB_ASSERT(state);
+
+	if (PRVT->used) {
+		SETERROR(INFLT_EINCORRECTUSE);
+		state->state = INFLT_BADSTATE;
+		return;
+	}
+
+	/* back references are resolved in the target (or in the dictionary
+	 * if there is one, it stays in the window as it is) */
+	PRVT->oneshot = 1;
+}
+
 void
 inflator_setdctnr(TInflator* state, uint8* dict, uintxx size)
 {
@@ -795,7 +1083,7 @@ inflator_setdctnr(TInflator* state, uint8* dict, uintxx size)
 	if (PRVT->window == NULL) {
 		uint8* buffer;
 
-		buffer = _reserve(PRVT, WNDWSIZE);
+		buffer = _reserve(PRVT, PRVT->wnsize);
 		if (buffer == NULL) {
 			SETERROR(INFLT_EOOM);
 			state->state = INFLT_BADSTATE;
@@ -804,8 +1092,11 @@ inflator_setdctnr(TInflator* state, uint8* dict, uintxx size)
 		PRVT->window = buffer;
 	}
 
-	if (size > WNDWSIZE)
-		size = WNDWSIZE;
+	if (size > PRVT->wnsize) {
+		/* only the last part can be reached */
+		dict += size - PRVT->wnsize;
+		size  = PRVT->wnsize;
+	}
 	ctb_memcpy(PRVT->window, dict, size);
 	PRVT->count = size;
 	PRVT->end   = size;
@@ -997,6 +1288,18 @@ readlengths(struct TInflator* state, uintxx n, uint16* lengths)
 	return 0;
 }
 
+CTB_INLINE bool
+samelengths(const uint16* a, const uint16* b, uintxx n)
+{
+	uintxx i;
+
+	for (i = 0; i < n; i++) {
+		if (a[i] ^ b[i])
+			return 0;
+	}
+	return 1;
+}
+
 static uintxx
 decodednmc(struct TInflator* state)
 {
@@ -1013,9 +1316,6 @@ decodednmc(struct TInflator* state)
 		case 2: goto L_STATE2;
 	}
 
-	PRVT->ltable = PRVT->tables->symbols;
-	PRVT->dtable = PRVT->tables->symbols + ENOUGHL;
-
 	if (tryreadbits(state, 14)) {
 		slcount = getbits(state, 5) + 257; dropbits(state, 5);
 		sdcount = getbits(state, 5) +   1; dropbits(state, 5);
@@ -1055,11 +1355,14 @@ L_STATE1:
 	for (; sccount > scindex; scindex++)
 		lengths[lcorder[scindex]] = 0;
 
-	r = buildtable(lengths, DEFLT_CMAXSYMBOL, PRVT->ltable, CTABLEMODE);
+	/* the precodes have their own table, so the last tables are kept */
+	r = buildtable(
+		lengths, DEFLT_CMAXSYMBOL, PRVT->tables->ctable, CTABLEMODE);
 	if (r) {
 		SETERROR(INFLT_EBADTREE);
 		return r;
 	}
+	PRVT->ltable = PRVT->tables->ctable;
 
 	PRVT->substate++;
 	scindex = 0;
@@ -1076,18 +1379,35 @@ L_STATE2:
 		return INFLT_ERROR;
 	}
 
+	PRVT->ltable = PRVT->tables->symbols;
+	PRVT->dtable = PRVT->tables->symbols + ENOUGHL;
+	if (slcount == PRVT->tables->clcount &&
+		sdcount == PRVT->tables->cdcount) {
+		if (samelengths(lengths, PRVT->tables->clengths, slcount + sdcount)) {
+			STATSADD(reusedtables, 1);
+			PRVT->substate = 0;
+			return 0;
+		}
+	}
+	PRVT->tables->clcount = 0;
+	PRVT->tables->cdcount = 0;
+
 	r = buildtable(lengths, slcount, PRVT->ltable, LTABLEMODE);
 	if (r) {
 		SETERROR(INFLT_EBADTREE);
 		return INFLT_ERROR;
 	}
-	lengths = lengths + slcount;
-	r = buildtable(lengths, sdcount, PRVT->dtable, DTABLEMODE);
+	r = buildtable(lengths + slcount, sdcount, PRVT->dtable, DTABLEMODE);
 	if (r) {
 		SETERROR(INFLT_EBADTREE);
 		return INFLT_ERROR;
 	}
 
+	ctb_memcpy(PRVT->tables->clengths, lengths,
+		(slcount + sdcount) * sizeof(lengths[0]));
+	PRVT->tables->clcount = slcount;
+	PRVT->tables->cdcount = sdcount;
+
 	PRVT->substate = 0;
 	return 0;
 }
@@ -1102,6 +1422,82 @@ L_STATE2:
 #define sbextra   PRVT->aux1
 #define sdistance PRVT->aux2
 
+/* room needed after the end of a wide copy */
+#define WIDECOPYROOM 16
+
+#if defined(INFLT_WIDECOPY)
+
+/* multiple of the distance used to replicate a short pattern by words */
+static const uint8 patternstep[] = {0, 0, 8, 6, 8, 5, 6, 7};
+
+/* copies a match from the target using words, it writes up to WIDECOPYROOM
+ * bytes after the end */
+CTB_INLINE void
+widecopy(uint8* target, uintxx distance, uintxx length)
+{
+	uint8* buffer;
+	uint8* end;
+	uint64 v;
+
+	buffer = target - distance;
+	end = target + length;
+	if (CTB_LIKELY(distance >= 16)) {
+		do {
+#if defined(INFLT_SSE2)
+			_mm_storeu_si128((void*) target, _mm_loadu_si128((void*) buffer));
+#elif defined(INFLT_NEON)
+			vst1q_u8(target, vld1q_u8(buffer));
+#else
+			((uint64*) target)[0] = ((uint64*) buffer)[0];
+			((uint64*) target)[1] = ((uint64*) buffer)[1];
+#endif
+			target += 16;
+			buffer += 16;
+		} while (target < end);
+		return;
+	}
+
+	if (distance >= 8) {
+		do {
+			((uint64*) target)[0] = ((uint64*) buffer)[0];
+			target += 8;
+			buffer += 8;
+		} while (target < end);
+		return;
+	}
+
+	if (distance == 1) {
+		v = buffer[0] * 0x0101010101010101ULL;
+		do {
+			((uint64*) target)[0] = v;
+			((uint64*) target)[1] = v;
+			target += 16;
+		} while (target < end);
+		return;
+	}
+
+	/* the first word one by one, then the pattern repeats every step */
+	target[0] = buffer[0];
+	target[1] = buffer[1];
+	target[2] = buffer[2];
+	target[3] = buffer[3];
+	target[4] = buffer[4];
+	target[5] = buffer[5];
+	target[6] = buffer[6];
+	target[7] = buffer[7];
+
+	distance = patternstep[distance];
+	buffer = target;
+	target += distance;
+	while (target < end) {
+		((uint64*) target)[0] = ((uint64*) buffer)[0];
+		target += distance;
+		buffer += distance;
+	}
+}
+
+#endif
+
 CTB_INLINE uintxx
 copybytes(struct TInflator* state, uintxx distance, uintxx length)
 {
@@ -1137,7 +1533,7 @@ copybytes(struct TInflator* state, uintxx distance, uintxx length)
 			if (maxrun > PRVT->end) {
 				maxrun -= PRVT->end;
 
-				offset =  WNDWSIZE - maxrun;
+				offset = PRVT->wnsize - maxrun;
 			}
 			else {
 				offset = PRVT->end - maxrun;
@@ -1158,6 +1554,21 @@ copybytes(struct TInflator* state, uintxx distance, uintxx length)
 		length  -= maxrun;
 		avaible -= maxrun;
 
+		if (distance > (uintxx) (state->target - state->tbgn)) {
+			/* from the window */
+			ctb_memcpy(state->target, buffer, maxrun);
+			state->target += maxrun;
+			continue;
+		}
+
+#if defined(INFLT_WIDECOPY)
+		if (avaible >= WIDECOPYROOM) {
+			widecopy(state->target, distance, maxrun);
+			state->target += maxrun;
+			continue;
+		}
+#endif
+
 		do {
 			*state->target++ = *buffer++;
 		} while (--maxrun);
@@ -1175,7 +1586,12 @@ copybytes(struct TInflator* state, uintxx distance, uintxx length)
 	#define FASTTGTLEFT 266
 #endif
 
-static uintxx decodefast(struct TInflator* state);
+/* the fast loop is selected at runtime */
+typedef uintxx (*TDecodeFastFn)(struct TInflator*);
+
+static uintxx decodefastselect(struct TInflator*);
+
+static TDecodeFastFn decodefast = decodefastselect;
 
 
 #if defined(__MSVC__)
@@ -1216,6 +1632,7 @@ L_LOOP:
 		sourceleft = state->send - state->source;
 		if (targetleft >= FASTTGTLEFT && sourceleft >= FASTSRCLEFT) {
 			r = decodefast(state);
+			STATSADD(fastbytes, targetleft - (state->tend - state->target));
 			if (r == ENDOFBLOCK) {
 				PRVT->substate = 0;
 				return 0;
@@ -1231,6 +1648,12 @@ L_LOOP:
 
 	for (;;) {
 		e = PRVT->ltable[getbits(state, LROOTBITS)];
+		if (CTB_UNLIKELY(e.etag > INVALIDCODE)) {
+			/* one literal at a time here */
+			e.info  &= 0xff;
+			e.length = e.etag & 0x0f;
+			e.etag   = LITERALSYMBOL;
+		}
 		if (CTB_LIKELY(e.length <= PRVT->bcount)) {
 			break;
 		}
@@ -1424,6 +1847,12 @@ L_STATE4:
 #if !defined(CTB_STRICTALIGNMENT) && defined(CTB_FASTUNALIGNED)
 	#define FILLBBUFFER() \
 		n = BBSWAP(((BBTYPE*) source)[0]) & BBMASK;
+
+	/* branchless refill, a length and a distance with their extra bits take
+	 * 48 bits at most */
+	#if defined(CTB_ENV64)
+		#define REFILL56
+	#endif
 #else
 	#if defined(CTB_ENV64)
 		#define FILLBBUFFER() \
@@ -1441,8 +1870,8 @@ L_STATE4:
 #endif
 
 
-static uintxx
-decodefast(struct TInflator* state)
+CTB_FORCEINLINE uintxx
+decodefastloop(struct TInflator* state)
 {
 	uint8* source;
 	uint8* target;
@@ -1472,6 +1901,13 @@ L_LOOP:
 	if (tend - target < FASTTGTLEFT || send - source < FASTSRCLEFT)
 		goto L_DONE;
 
+#if defined(REFILL56)
+	/* the bits above bc are the next ones of the stream (or zero), so
+	 * we can load the whole word and count only the complete bytes */
+	bb |= BBSWAP(((BBTYPE*) source)[0]) << bc;
+	source += (63 - bc) >> 3;
+	bc |= 56;
+#else
 	if (CTB_LIKELY(bc < 15)) {
 		FILLBBUFFER();
 
@@ -1479,6 +1915,7 @@ L_LOOP:
 		bc +=     (sizeof(BBTYPE) - 2) << 3;
 		source += (sizeof(BBTYPE) - 2);
 	}
+#endif
 
 	/* decode literal or length */
 	e = PRVT->ltable[GETBITS(bb, LROOTBITS)];
@@ -1492,6 +1929,13 @@ L_LOOP:
 		goto L_LOOP;
 	}
 
+	if (CTB_LIKELY(e.etag > INVALIDCODE)) {
+		target[0] = (uint8) (e.info >> 0);
+		target[1] = (uint8) (e.info >> 8);
+		target += 2;
+		goto L_LOOP;
+	}
+
 	if (CTB_UNLIKELY(e.etag == ENDOFBLOCK)) {
 		r = ENDOFBLOCK;
 		goto L_DONE;
@@ -1503,6 +1947,7 @@ L_LOOP:
 	}
 
 	/* length */
+#if !defined(REFILL56)
 	if (CTB_UNLIKELY(e.etag > bc)) {
 		FILLBBUFFER();
 
@@ -1510,10 +1955,12 @@ L_LOOP:
 		bc +=     (sizeof(BBTYPE) - 2) << 3;
 		source += (sizeof(BBTYPE) - 2);
 	}
+#endif
 
 	length = e.info + GETBITS(bb, e.etag);
 	DROPBITS(bb, bc, e.etag);
 
+#if !defined(REFILL56)
 	if (CTB_UNLIKELY(bc < 15)) {
 		FILLBBUFFER();
 
@@ -1521,6 +1968,7 @@ L_LOOP:
 		bc +=     (sizeof(BBTYPE) - 2) << 3;
 		source += (sizeof(BBTYPE) - 2);
 	}
+#endif
 
 	/* decode distance */
 	e = PRVT->dtable[GETBITS(bb, DROOTBITS)];
@@ -1534,6 +1982,7 @@ L_LOOP:
 		return INFLT_ERROR;
 	}
 
+#if !defined(REFILL56)
 	if (CTB_UNLIKELY(e.etag > bc)) {
 		FILLBBUFFER();
 
@@ -1541,12 +1990,18 @@ L_LOOP:
 		bc +=     (sizeof(BBTYPE) - 2) << 3;
 		source += (sizeof(BBTYPE) - 2);
 	}
+#endif
 
 	distance = e.info + GETBITS(bb, e.etag);
 	DROPBITS(bb, bc, e.etag);
 
 	targetsz = (uintxx) (target - state->tbgn);
 	if (CTB_LIKELY(distance < targetsz)) {
+#if defined(INFLT_WIDECOPY)
+		/* FASTTGTLEFT leaves the room for the words after the match */
+		widecopy(target, distance, length);
+		target += length;
+#else
 		uint8* end;
 
 		buffer = target - distance;
@@ -1603,6 +2058,7 @@ L_LOOP:
 				*target++ = *buffer++;
 			} while (target < end);
 		}
+#endif
 	}
 	else {
 		do {
@@ -1621,7 +2077,7 @@ L_LOOP:
 				if (maxrun > PRVT->end) {
 					maxrun -= PRVT->end;
 
-					offset = WNDWSIZE  - maxrun;
+					offset = PRVT->wnsize - maxrun;
 				}
 				else {
 					offset = PRVT->end - maxrun;
@@ -1630,16 +2086,26 @@ L_LOOP:
 
 				if (maxrun > length)
 					maxrun = length;
+
+				ctb_memcpy(target, buffer, maxrun);
+				target += maxrun;
+				length -= maxrun;
+				continue;
 			}
-			else {
-				buffer = target - distance;
-				maxrun = length;
-			}
+
+#if defined(INFLT_WIDECOPY)
+			widecopy(target, distance, length);
+			target += length;
+			break;
+#else
+			buffer = target - distance;
+			maxrun = length;
 
 			length -= maxrun;
 			do {
 				*target++ = *buffer++;
 			} while (--maxrun);
+#endif
 		} while (length);
 	}
 	goto L_LOOP;
@@ -1656,6 +2122,48 @@ L_DONE:
 }
 
 
+#if defined(CPUINFO_X86) && defined(CPUINFO_HASTARGET)
+	#define INFLT_BMI2
+#endif
+
+static uintxx
+decodefastgeneric(struct TInflator* state)
+{
+	return decodefastloop(state);
+}
+
+#if defined(INFLT_BMI2)
+
+/* the same loop, the variable shifts and masks become shrx and bzhi */
+CPUINFO_TARGET("bmi2")
+static uintxx
+decodefastbmi2(struct TInflator* state)
+{
+	return decodefastloop(state);
+}
+
+#endif
+
+static uintxx
+decodefastselect(struct TInflator* state)
+{
+	TDecodeFastFn fn;
+
+	fn = decodefastgeneric;
+#if defined(INFLT_BMI2)
+	if (cpuinfo_getfeatures() & CPU_BMI2)
+		fn = decodefastbmi2;
+#endif
+
+	decodefast = fn;
+	return fn(state);
+}
+
+#if defined(INFLT_BMI2)
+	#undef INFLT_BMI2
+#endif
+
+
 #undef slength
 #undef sbextra
 #undef sdistance
@@ -1702,7 +2210,7 @@ static const struct TINFLTTEntry lsttctable[1L << LROOTBITS] = {
 	{0x002a, 0x10, 0x08}, {0x00b4, 0x10, 0x09}, {0x000a, 0x10, 0x08},
 	{0x008a, 0x10, 0x08}, {0x004a, 0x10, 0x08}, {0x00f4, 0x10, 0x09},
 	{0x0005, 0x00, 0x07}, {0x0056, 0x10, 0x08}, {0x0016, 0x10, 0x08},
-	{0x0000, 0x00, 0x08}, {0x0033, 0x03, 0x07}, {0x0076, 0x10, 0x08},
+	{0x0000, 0x13, 0x08}, {0x0033, 0x03, 0x07}, {0x0076, 0x10, 0x08},
 	{0x0036, 0x10, 0x08}, {0x00cc, 0x10, 0x09}, {0x000f, 0x01, 0x07},
 	{0x0066, 0x10, 0x08}, {0x0026, 0x10, 0x08}, {0x00ac, 0x10, 0x09},
 	{0x0006, 0x10, 0x08}, {0x0086, 0x10, 0x08}, {0x0046, 0x10, 0x08},
@@ -1744,7 +2252,7 @@ static const struct TINFLTTEntry lsttctable[1L << LROOTBITS] = {
 	{0x0013, 0x02, 0x07}, {0x006b, 0x10, 0x08}, {0x002b, 0x10, 0x08},
 	{0x00b6, 0x10, 0x09}, {0x000b, 0x10, 0x08}, {0x008b, 0x10, 0x08},
 	{0x004b, 0x10, 0x08}, {0x00f6, 0x10, 0x09}, {0x0005, 0x00, 0x07},
-	{0x0057, 0x10, 0x08}, {0x0017, 0x10, 0x08}, {0x0000, 0x00, 0x08},
+	{0x0057, 0x10, 0x08}, {0x0017, 0x10, 0x08}, {0x0000, 0x13, 0x08},
 	{0x0033, 0x03, 0x07}, {0x0077, 0x10, 0x08}, {0x0037, 0x10, 0x08},
 	{0x00ce, 0x10, 0x09}, {0x000f, 0x01, 0x07}, {0x0067, 0x10, 0x08},
 	{0x0027, 0x10, 0x08}, {0x00ae, 0x10, 0x09}, {0x0007, 0x10, 0x08},
@@ -1787,7 +2295,7 @@ static const struct TINFLTTEntry lsttctable[1L << LROOTBITS] = {
 	{0x006a, 0x10, 0x08}, {0x002a, 0x10, 0x08}, {0x00b5, 0x10, 0x09},
 	{0x000a, 0x10, 0x08}, {0x008a, 0x10, 0x08}, {0x004a, 0x10, 0x08},
 	{0x00f5, 0x10, 0x09}, {0x0005, 0x00, 0x07}, {0x0056, 0x10, 0x08},
-	{0x0016, 0x10, 0x08}, {0x0000, 0x00, 0x08}, {0x0033, 0x03, 0x07},
+	{0x0016, 0x10, 0x08}, {0x0000, 0x13, 0x08}, {0x0033, 0x03, 0x07},
 	{0x0076, 0x10, 0x08}, {0x0036, 0x10, 0x08}, {0x00cd, 0x10, 0x09},
 	{0x000f, 0x01, 0x07}, {0x0066, 0x10, 0x08}, {0x0026, 0x10, 0x08},
 	{0x00ad, 0x10, 0x09}, {0x0006, 0x10, 0x08}, {0x0086, 0x10, 0x08},
@@ -1830,7 +2338,7 @@ static const struct TINFLTTEntry lsttctable[1L << LROOTBITS] = {
 	{0x002b, 0x10, 0x08}, {0x00b7, 0x10, 0x09}, {0x000b, 0x10, 0x08},
 	{0x008b, 0x10, 0x08}, {0x004b, 0x10, 0x08}, {0x00f7, 0x10, 0x09},
 	{0x0005, 0x00, 0x07}, {0x0057, 0x10, 0x08}, {0x0017, 0x10, 0x08},
-	{0x0000, 0x00, 0x08}, {0x0033, 0x03, 0x07}, {0x0077, 0x10, 0x08},
+	{0x0000, 0x13, 0x08}, {0x0033, 0x03, 0x07}, {0x0077, 0x10, 0x08},
 	{0x0037, 0x10, 0x08}, {0x00cf, 0x10, 0x09}, {0x000f, 0x01, 0x07},
 	{0x0067, 0x10, 0x08}, {0x0027, 0x10, 0x08}, {0x00af, 0x10, 0x09},
 	{0x0007, 0x10, 0x08}, {0x0087, 0x10, 0x08}, {0x0047, 0x10, 0x08},
@@ -1848,44 +2356,44 @@ static const struct TINFLTTEntry dsttctable[1L << DROOTBITS] = {
 	{0x0041, 0x05, 0x05}, {0x4001, 0x0d, 0x05}, {0x0003, 0x00, 0x05},
 	{0x0201, 0x08, 0x05}, {0x0021, 0x04, 0x05}, {0x2001, 0x0c, 0x05},
 	{0x0009, 0x02, 0x05}, {0x0801, 0x0a, 0x05}, {0x0081, 0x06, 0x05},
-	{0x0000, 0x00, 0x05}, {0x0002, 0x00, 0x05}, {0x0181, 0x07, 0x05},
+	{0x0000, 0x13, 0x05}, {0x0002, 0x00, 0x05}, {0x0181, 0x07, 0x05},
 	{0x0019, 0x03, 0x05}, {0x1801, 0x0b, 0x05}, {0x0007, 0x01, 0x05},
 	{0x0601, 0x09, 0x05}, {0x0061, 0x05, 0x05}, {0x6001, 0x0d, 0x05},
 	{0x0004, 0x00, 0x05}, {0x0301, 0x08, 0x05}, {0x0031, 0x04, 0x05},
 	{0x3001, 0x0c, 0x05}, {0x000d, 0x02, 0x05}, {0x0c01, 0x0a, 0x05},
-	{0x00c1, 0x06, 0x05}, {0x0000, 0x00, 0x05}, {0x0001, 0x00, 0x05},
+	{0x00c1, 0x06, 0x05}, {0x0000, 0x13, 0x05}, {0x0001, 0x00, 0x05},
 	{0x0101, 0x07, 0x05}, {0x0011, 0x03, 0x05}, {0x1001, 0x0b, 0x05},
 	{0x0005, 0x01, 0x05}, {0x0401, 0x09, 0x05}, {0x0041, 0x05, 0x05},
 	{0x4001, 0x0d, 0x05}, {0x0003, 0x00, 0x05}, {0x0201, 0x08, 0x05},
 	{0x0021, 0x04, 0x05}, {0x2001, 0x0c, 0x05}, {0x0009, 0x02, 0x05},
-	{0x0801, 0x0a, 0x05}, {0x0081, 0x06, 0x05}, {0x0000, 0x00, 0x05},
+	{0x0801, 0x0a, 0x05}, {0x0081, 0x06, 0x05}, {0x0000, 0x13, 0x05},
 	{0x0002, 0x00, 0x05}, {0x0181, 0x07, 0x05}, {0x0019, 0x03, 0x05},
 	{0x1801, 0x0b, 0x05}, {0x0007, 0x01, 0x05}, {0x0601, 0x09, 0x05},
 	{0x0061, 0x05, 0x05}, {0x6001, 0x0d, 0x05}, {0x0004, 0x00, 0x05},
 	{0x0301, 0x08, 0x05}, {0x0031, 0x04, 0x05}, {0x3001, 0x0c, 0x05},
 	{0x000d, 0x02, 0x05}, {0x0c01, 0x0a, 0x05}, {0x00c1, 0x06, 0x05},
-	{0x0000, 0x00, 0x05}, {0x0001, 0x00, 0x05}, {0x0101, 0x07, 0x05},
+	{0x0000, 0x13, 0x05}, {0x0001, 0x00, 0x05}, {0x0101, 0x07, 0x05},
 	{0x0011, 0x03, 0x05}, {0x1001, 0x0b, 0x05}, {0x0005, 0x01, 0x05},
 	{0x0401, 0x09, 0x05}, {0x0041, 0x05, 0x05}, {0x4001, 0x0d, 0x05},
 	{0x0003, 0x00, 0x05}, {0x0201, 0x08, 0x05}, {0x0021, 0x04, 0x05},
 	{0x2001, 0x0c, 0x05}, {0x0009, 0x02, 0x05}, {0x0801, 0x0a, 0x05},
-	{0x0081, 0x06, 0x05}, {0x0000, 0x00, 0x05}, {0x0002, 0x00, 0x05},
+	{0x0081, 0x06, 0x05}, {0x0000, 0x13, 0x05}, {0x0002, 0x00, 0x05},
 	{0x0181, 0x07, 0x05}, {0x0019, 0x03, 0x05}, {0x1801, 0x0b, 0x05},
 	{0x0007, 0x01, 0x05}, {0x0601, 0x09, 0x05}, {0x0061, 0x05, 0x05},
 	{0x6001, 0x0d, 0x05}, {0x0004, 0x00, 0x05}, {0x0301, 0x08, 0x05},
 	{0x0031, 0x04, 0x05}, {0x3001, 0x0c, 0x05}, {0x000d, 0x02, 0x05},
-	{0x0c01, 0x0a, 0x05}, {0x00c1, 0x06, 0x05}, {0x0000, 0x00, 0x05},
+	{0x0c01, 0x0a, 0x05}, {0x00c1, 0x06, 0x05}, {0x0000, 0x13, 0x05},
 	{0x0001, 0x00, 0x05}, {0x0101, 0x07, 0x05}, {0x0011, 0x03, 0x05},
 	{0x1001, 0x0b, 0x05}, {0x0005, 0x01, 0x05}, {0x0401, 0x09, 0x05},
 	{0x0041, 0x05, 0x05}, {0x4001, 0x0d, 0x05}, {0x0003, 0x00, 0x05},
 	{0x0201, 0x08, 0x05}, {0x0021, 0x04, 0x05}, {0x2001, 0x0c, 0x05},
 	{0x0009, 0x02, 0x05}, {0x0801, 0x0a, 0x05}, {0x0081, 0x06, 0x05},
-	{0x0000, 0x00, 0x05}, {0x0002, 0x00, 0x05}, {0x0181, 0x07, 0x05},
+	{0x0000, 0x13, 0x05}, {0x0002, 0x00, 0x05}, {0x0181, 0x07, 0x05},
 	{0x0019, 0x03, 0x05}, {0x1801, 0x0b, 0x05}, {0x0007, 0x01, 0x05},
 	{0x0601, 0x09, 0x05}, {0x0061, 0x05, 0x05}, {0x6001, 0x0d, 0x05},
 	{0x0004, 0x00, 0x05}, {0x0301, 0x08, 0x05}, {0x0031, 0x04, 0x05},
 	{0x3001, 0x0c, 0x05}, {0x000d, 0x02, 0x05}, {0x0c01, 0x0a, 0x05},
-	{0x00c1, 0x06, 0x05}, {0x0000, 0x00, 0x05}
+	{0x00c1, 0x06, 0x05}, {0x0000, 0x13, 0x05}
 };
 
 
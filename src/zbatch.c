@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2023, jpn
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <jdeflate/zbatch.h>
+#include <ctoolbox/memory.h>
+
+
+/* */
+struct TZBatchTask {
+	/* deflator or inflator */
+	void* state;
+
+	struct TZBatchItem* items;
+	uintxx count;
+
+	uintxx level;
+	const TDEFLTDctnr* pdctnr;
+	const uint8* dict;
+	uintxx dsize;
+
+	/* number of items that failed */
+	uintxx failed;
+};
+
+
+#define ZBMAXTASKS 256
+
+CTB_INLINE void*
+_reserve(TAllocator* allocator, uintxx amount)
+{
+	if (allocator) {
+		return allocator->reserve(allocator->user, amount);
+	}
+	return CTB_RESERVE(amount);
+}
+
+CTB_INLINE void
+_release(TAllocator* allocator, void* memory)
+{
+	if (allocator) {
+		allocator->release(allocator->user, memory);
+		return;
+	}
+	CTB_RELEASE(memory);
+}
+
+
+static void
+runctask(void* task)
+{
+	struct TZBatchTask* t;
+	struct TZBatchItem* item;
+	TDeflator* state;
+	uintxx i;
+	eDEFLTResult r;
+
+	t = task;
+	state = t->state;
+	for (i = 0; i < t->count; i++) {
+		item = t->items + i;
+
+		/* after a small item the reset only takes back what it has used and
+		 * the dictionary stays in place */
+		deflator_reset(state, t->level);
+		if (t->pdctnr) {
+			deflator_setpdctnr(state, t->pdctnr);
+		}
+		if (state->error) {
+			item->size  = 0;
+			item->error = ZSTRM_EINCORRECTUSE;
+			if (state->error == DEFLT_EOOM)
+				item->error = ZSTRM_EOOM;
+			t->failed++;
+			continue;
+		}
+
+		deflator_setsrc(state, (uint8*) item->source, item->ssize);
+		deflator_settgt(state, item->target, item->tsize);
+		r = deflator_deflate(state, DEFLT_END);
+
+		item->size  = deflator_tgtend(state);
+		item->error = ZSTRM_OK;
+		if (r != DEFLT_OK) {
+			item->error = ZSTRM_EDEFLATE;
+			if (r == DEFLT_TGTEXHSTD)
+				item->error = ZSTRM_EBUFFERFULL;
+			t->failed++;
+		}
+	}
+}
+
+static void
+rundtask(void* task)
+{
+	struct TZBatchTask* t;
+	struct TZBatchItem* item;
+	TInflator* state;
+	uintxx i;
+	eINFLTResult r;
+
+	t = task;
+	state = t->state;
+	for (i = 0; i < t->count; i++) {
+		item = t->items + i;
+
+		inflator_reset(state);
+		inflator_setnowindow(state);
+		if (t->dsize) {
+			inflator_setdctnr(state, (uint8*) t->dict, t->dsize);
+		}
+
+		inflator_setsrc(state, (uint8*) item->source, item->ssize);
+		inflator_settgt(state, item->target, item->tsize);
+		r = inflator_inflate(state, 1);
+
+		item->size  = inflator_tgtend(state);
+		item->error = ZSTRM_OK;
+		if (r != INFLT_OK) {
+			item->error = ZSTRM_EBADDATA;
+			if (r == INFLT_TGTEXHSTD)
+				item->error = ZSTRM_EBUFFERFULL;
+			if (r == INFLT_ERROR && state->error == INFLT_EOOM)
+				item->error = ZSTRM_EOOM;
+			t->failed++;
+		}
+	}
+}
+
+
+/* Splits the items in up to n slices with a similar amount of input (each
+ * item also counts as one byte), returns the number of slices */
+static uintxx
+splititems(struct TZBatchItem* items, uintxx count, uintxx n,
+	struct TZBatchTask* tasks)
+{
+	uintxx i;
+	uintxx j;
+	uintxx m;
+	uintxx total;
+	uintxx limit;
+	uintxx amount;
+
+	total = 0;
+	for (j = 0; j < count; j++) {
+		total += items[j].ssize + 1;
+	}
+
+	amount = 0;
+	j = 0;
+	m = 0;
+	for (i = 0; i < n && j < count; i++) {
+		tasks[m].items = items + j;
+
+		limit = total;
+		if (i + 1 < n) {
+			limit = (total / n) * (i + 1);
+		}
+		do {
+			amount += items[j++].ssize + 1;
+		} while (j < count && amount < limit);
+
+		tasks[m].count = (uintxx) ((items + j) - tasks[m].items);
+		m++;
+	}
+	return m;
+}
+
+static uintxx
+runbatch(struct TZBatchItem* items, uintxx count, uintxx level,
+	const struct TZBatchOptions* options, TAllocator* allocator, bool compress)
+{
+	struct TZBatchTask* tasks;
+	TDEFLTDctnr* dctnr;
+	void** tlist;
+	uintxx failed;
+	uintxx i;
+	uintxx j;
+	uintxx n;
+
+	if (count == 0) {
+		return 0;
+	}
+
+	n = 1;
+	if (options && options->taskfn && options->ntasks > 1) {
+		n = options->ntasks;
+		if (n > ZBMAXTASKS)
+			n = ZBMAXTASKS;
+		if (n > count)
+			n = count;
+	}
+
+	tasks = _reserve(allocator, n * sizeof(struct TZBatchTask));
+	tlist = _reserve(allocator, n * sizeof(void*));
+	dctnr = NULL;
+	if (tasks == NULL || tlist == NULL) {
+		goto L_ERROR;
+	}
+	n = splititems(items, count, n, tasks);
+
+	for (i = 0; i < n; i++) {
+		tasks[i].state  = NULL;
+		tasks[i].level  = level;
+		tasks[i].pdctnr = NULL;
+		tasks[i].dict   = NULL;
+		tasks[i].dsize  = 0;
+		tasks[i].failed = 0;
+		tlist[i] = tasks + i;
+	}
+
+	if (options && (options->dsize || options->pdctnr)) {
+		if (compress && level) {
+			const TDEFLTDctnr* pdctnr;
+
+			pdctnr = options->pdctnr;
+			if (pdctnr == NULL) {
+				dctnr = deflator_dctnrcreate(
+					level, 0, 0, options->dict, options->dsize, allocator);
+				if (dctnr == NULL) {
+					goto L_ERROR;
+				}
+				pdctnr = dctnr;
+			}
+			for (i = 0; i < n; i++)
+				tasks[i].pdctnr = pdctnr;
+		}
+		if (compress == 0) {
+			for (i = 0; i < n; i++) {
+				tasks[i].dict  = options->dict;
+				tasks[i].dsize = options->dsize;
+			}
+		}
+	}
+
+	/* the states are created here, so the tasks don't use the allocator */
+	for (i = 0; i < n; i++) {
+		if (compress) {
+			tasks[i].state = deflator_create(level, allocator);
+			if (tasks[i].state == NULL) {
+				break;
+			}
+			continue;
+		}
+
+		tasks[i].state = inflator_create(allocator);
+		if (tasks[i].state == NULL) {
+			break;
+		}
+		if (tasks[i].dsize) {
+			/* this reserves the window */
+			inflator_setdctnr(tasks[i].state, (uint8*) tasks[i].dict,
+				tasks[i].dsize);
+			if (((TInflator*) tasks[i].state)->error) {
+				inflator_destroy(tasks[i].state);
+				tasks[i].state = NULL;
+				break;
+			}
+		}
+	}
+	if (i != n) {
+		for (j = 0; j < i; j++) {
+			if (compress)
+				deflator_destroy(tasks[j].state);
+			else
+				inflator_destroy(tasks[j].state);
+		}
+		goto L_ERROR;
+	}
+
+	if (options && options->taskfn && n > 1) {
+		options->taskfn(
+			compress ? runctask : rundtask, tlist, n, options->payload);
+	}
+	else {
+		for (i = 0; i < n; i++) {
+			if (compress)
+				runctask(tasks + i);
+			else
+				rundtask(tasks + i);
+		}
+	}
+
+	failed = 0;
+	for (i = 0; i < n; i++) {
+		failed += tasks[i].failed;
+		if (compress)
+			deflator_destroy(tasks[i].state);
+		else
+			inflator_destroy(tasks[i].state);
+	}
+
+	if (dctnr) {
+		deflator_dctnrdestroy(dctnr);
+	}
+	_release(allocator, tlist);
+	_release(allocator, tasks);
+	return failed;
+
+L_ERROR:
+	for (i = 0; i < count; i++) {
+		items[i].size  = 0;
+		items[i].error = ZSTRM_EOOM;
+	}
+	if (dctnr) {
+		deflator_dctnrdestroy(dctnr);
+	}
+	if (tlist) {
+		_release(allocator, tlist);
+	}
+	if (tasks) {
+		_release(allocator, tasks);
+	}
+	return count;
+}
+
+
+uintxx
+zbatch_compress(struct TZBatchItem* items, uintxx count, uintxx level,
+	const struct TZBatchOptions* options, TAllocator* allocator)
+{
+	CTB_ASSERT(items || count == 0);
+
+	if (level > 12) {
+		uintxx i;
+
+		for (i = 0; i < count; i++) {
+			items[i].size  = 0;
+			items[i].error = ZSTRM_EINCORRECTUSE;
+		}
+		return count;
+	}
+	return runbatch(items, count, level, options, allocator, 1);
+}
+
+uintxx
+zbatch_decompress(struct TZBatchItem* items, uintxx count,
+	const struct TZBatchOptions* options, TAllocator* allocator)
+{
+	CTB_ASSERT(items || count == 0);
+
+	return runbatch(items, count, 0, options, allocator, 0);
+}
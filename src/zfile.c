@@ -0,0 +1,516 @@
+/*
+ * Copyright (C) 2023, jpn
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#if !defined(_POSIX_C_SOURCE)
+	#define _POSIX_C_SOURCE 200809L
+#endif
+#if !defined(_FILE_OFFSET_BITS)
+	#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <jdeflate/zfile.h>
+
+/* mmap and ftruncate are needed, elsewhere the functions are stubs that
+ * return ZSTRM_EINCORRECTUSE */
+#if defined(__unix__) || defined(__APPLE__)
+	#define ZFILE_POSIX
+#endif
+
+#if defined(ZFILE_POSIX)
+	#include <sys/types.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <errno.h>
+#endif
+
+
+#if defined(ZFILE_POSIX)
+
+/* */
+struct TMapping {
+	uint8* buffer;
+	uintxx size;
+};
+
+
+/* Returns the size of a regular file at offset zero or -1 */
+static int64
+mappablesize(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == -1 || S_ISREG(st.st_mode) == 0) {
+		return -1;
+	}
+	if (lseek(fd, 0, SEEK_CUR) != 0) {
+		return -1;
+	}
+	if ((uint64) st.st_size > (uintxx) -1 / 2) {
+		return -1;
+	}
+	return (int64) st.st_size;
+}
+
+static bool
+mapsource(int fd, struct TMapping* m)
+{
+	int64 size;
+	void* p;
+
+	m->buffer = NULL;
+	m->size   = 0;
+	if ((size = mappablesize(fd)) == -1) {
+		return 0;
+	}
+	if (size == 0) {
+		return 1;
+	}
+
+	p = mmap(NULL, (size_t) size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		return 0;
+	}
+	posix_madvise(p, (size_t) size, POSIX_MADV_SEQUENTIAL);
+
+	m->buffer = p;
+	m->size   = (uintxx) size;
+	return 1;
+}
+
+static bool
+maptarget(int fd, uintxx size, struct TMapping* m)
+{
+	void* p;
+
+	m->buffer = NULL;
+	m->size   = 0;
+	if (size == 0 || mappablesize(fd) == -1) {
+		return 0;
+	}
+	if (ftruncate(fd, (off_t) size) == -1) {
+		return 0;
+	}
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		if (ftruncate(fd, 0)) {
+			/* the streaming write fails too */
+		}
+		return 0;
+	}
+	posix_madvise(p, size, POSIX_MADV_SEQUENTIAL);
+
+	m->buffer = p;
+	m->size   = size;
+	return 1;
+}
+
+CTB_INLINE void
+unmap(struct TMapping* m)
+{
+	if (m->size) {
+		munmap(m->buffer, m->size);
+	}
+}
+
+
+static bool
+writeall(int fd, const uint8* buffer, uintxx size)
+{
+	ssize_t r;
+
+	while (size) {
+		r = write(fd, buffer, size);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		buffer += r;
+		size   -= (uintxx) r;
+	}
+	return 1;
+}
+
+static intxx
+readfn(uint8* buffer, uintxx size, void* payload)
+{
+	ssize_t r;
+
+	do {
+		r = read(*((int*) payload), buffer, size);
+	} while (r == -1 && errno == EINTR);
+	return (intxx) r;
+}
+
+static intxx
+writefn(uint8* buffer, uintxx size, void* payload)
+{
+	if (writeall(*((int*) payload), buffer, size) == 0) {
+		return -1;
+	}
+	return (intxx) size;
+}
+
+
+/* Drops the output written from the offset the target had before an error
+ * (only regular files can be truncated) */
+static void
+droptarget(int fd, int64 offset)
+{
+	if (offset == -1) {
+		return;
+	}
+	if (ftruncate(fd, (off_t) offset) == 0) {
+		lseek(fd, (off_t) offset, SEEK_SET);
+	}
+}
+
+/* Truncates a mapped target to the output size and moves the offset to its
+ * end, as if the output had been written */
+static uintxx
+endtarget(int fd, uintxx size)
+{
+	if (ftruncate(fd, (off_t) size) == -1) {
+		return ZSTRM_EIOERROR;
+	}
+	if (lseek(fd, (off_t) size, SEEK_SET) == -1) {
+		return ZSTRM_EIOERROR;
+	}
+	return ZSTRM_OK;
+}
+
+CTB_INLINE uintxx
+geterror(TZStrm* z)
+{
+	uintxx error;
+
+	zstrm_getstate(z, &error);
+	return error;
+}
+
+uintxx
+zfile_compressfd(int sfd, int tfd, uintxx flags, uintxx level,
+	TAllocator* allocator)
+{
+	TZStrm* z;
+	struct TMapping source;
+	struct TMapping target;
+	uintxx error;
+	int64 offset;
+
+	z = zstrm_create(ZSTRM_WMODE | flags, level, allocator);
+	if (z == NULL) {
+		return ZSTRM_EOOM;
+	}
+	offset = (int64) lseek(tfd, 0, SEEK_CUR);
+
+	if (mapsource(sfd, &source)) {
+		uintxx n;
+
+		if (maptarget(tfd, zstrm_bound(z, source.size), &target)) {
+			n = zstrm_compressbuffer(
+				z, source.buffer, source.size, target.buffer, target.size);
+			unmap(&target);
+			unmap(&source);
+
+			if ((error = geterror(z)) == ZSTRM_OK) {
+				error = endtarget(tfd, n);
+			}
+			if (error != ZSTRM_OK) {
+				droptarget(tfd, offset);
+			}
+			zstrm_destroy(z);
+			return error;
+		}
+
+		/* the output goes through the stream buffer */
+		zstrm_setiofn(z, writefn, &tfd);
+		zstrm_w(z, source.buffer, source.size);
+		unmap(&source);
+	}
+	else {
+		zstrm_setiofn(z, writefn, &tfd);
+		for (;;) {
+			uint8* buffer;
+			uintxx size;
+			intxx r;
+
+			buffer = zstrm_wpeek(z, &size);
+			if (buffer == NULL) {
+				break;
+			}
+			r = readfn(buffer, size, &sfd);
+			if (r <= 0) {
+				if (r == -1) {
+					droptarget(tfd, offset);
+					zstrm_destroy(z);
+					return ZSTRM_EIOERROR;
+				}
+				break;
+			}
+			zstrm_wcommit(z, (uintxx) r);
+		}
+	}
+
+	if (geterror(z) == ZSTRM_OK) {
+		zstrm_flush(z, 1);
+	}
+	error = geterror(z);
+	if (error != ZSTRM_OK) {
+		droptarget(tfd, offset);
+	}
+	zstrm_destroy(z);
+	return error;
+}
+
+
+/* deflate can't expand the data more than this */
+#define MAXRATIO 1032
+
+/* Returns the uncompressed size stored in the tail of a gzip stream (the one
+ * of the last member) or zero, a size that the source can't hold is not
+ * trusted */
+static uintxx
+gzipsize(const struct TMapping* m, uintxx flags)
+{
+	const uint8* tail;
+	uintxx size;
+
+	if ((flags & ZSTRM_GZIP) == 0 || m->size < 18) {
+		return 0;
+	}
+	if (m->buffer[0] != 0x1f || m->buffer[1] != 0x8b) {
+		return 0;
+	}
+
+	tail = m->buffer + m->size - 4;
+	size = ((uintxx) tail[0] <<  0) |
+	       ((uintxx) tail[1] <<  8) |
+	       ((uintxx) tail[2] << 16) |
+	       ((uintxx) tail[3] << 24);
+	if (m->size < (uintxx) -1 / MAXRATIO && size > m->size * MAXRATIO) {
+		return 0;
+	}
+	return size;
+}
+
+uintxx
+zfile_decompressfd(int sfd, int tfd, uintxx flags, TAllocator* allocator)
+{
+	TZStrm* z;
+	struct TMapping source;
+	struct TMapping target;
+	uintxx error;
+	int64 offset;
+	bool mapped;
+
+	z = zstrm_create(ZSTRM_RMODE | flags, 0, allocator);
+	if (z == NULL) {
+		return ZSTRM_EOOM;
+	}
+	offset = (int64) lseek(tfd, 0, SEEK_CUR);
+
+	mapped = mapsource(sfd, &source);
+	if (mapped) {
+		if (maptarget(tfd, gzipsize(&source, flags), &target)) {
+			uintxx n;
+
+			n = zstrm_decompressbuffer(
+				z, source.buffer, source.size, target.buffer, target.size);
+			unmap(&target);
+
+			error = geterror(z);
+			if (error != ZSTRM_EBUFFERFULL) {
+				unmap(&source);
+				if (error == ZSTRM_OK) {
+					error = endtarget(tfd, n);
+				}
+				if (error != ZSTRM_OK) {
+					droptarget(tfd, offset);
+				}
+				zstrm_destroy(z);
+				return error;
+			}
+
+			/* the size was wrong, start again */
+			if (ftruncate(tfd, 0) == -1) {
+				unmap(&source);
+				droptarget(tfd, offset);
+				zstrm_destroy(z);
+				return ZSTRM_EIOERROR;
+			}
+			zstrm_reset(z);
+		}
+
+		/* the whole mapping is the only input buffer */
+		zstrm_setasync(z);
+		if (source.size) {
+			zstrm_push(z, source.buffer, source.size);
+		}
+		zstrm_push(z, NULL, 0);
+	}
+	else {
+		zstrm_setiofn(z, readfn, &sfd);
+	}
+
+	for (;;) {
+		const uint8* buffer;
+		uintxx size;
+
+		buffer = zstrm_rpeek(z, &size);
+		if (size == 0) {
+			break;
+		}
+		if (writeall(tfd, buffer, size) == 0) {
+			if (mapped)
+				unmap(&source);
+			droptarget(tfd, offset);
+			zstrm_destroy(z);
+			return ZSTRM_EIOERROR;
+		}
+		zstrm_rcommit(z, size);
+	}
+
+	error = geterror(z);
+	if (error == ZSTRM_OK && zstrm_getstate(z, NULL) != ZSTRM_END) {
+		/* the input ended before the stream */
+		error = ZSTRM_EBADDATA;
+	}
+	if (error != ZSTRM_OK) {
+		droptarget(tfd, offset);
+	}
+	if (mapped) {
+		unmap(&source);
+	}
+	zstrm_destroy(z);
+	return error;
+}
+
+
+static uintxx
+openfiles(const char* spath, const char* tpath, int* sfd, int* tfd)
+{
+	do {
+		*sfd = open(spath, O_RDONLY);
+	} while (*sfd == -1 && errno == EINTR);
+	if (*sfd == -1) {
+		return 0;
+	}
+
+	do {
+		/* the target is mapped read and write */
+		*tfd = open(tpath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	} while (*tfd == -1 && errno == EINTR);
+	if (*tfd == -1) {
+		close(*sfd);
+		return 0;
+	}
+	return 1;
+}
+
+static uintxx
+closefiles(int sfd, int tfd, uintxx error)
+{
+	close(sfd);
+	if (close(tfd) == -1 && error == ZSTRM_OK) {
+		return ZSTRM_EIOERROR;
+	}
+	return error;
+}
+
+uintxx
+zfile_compress(const char* spath, const char* tpath, uintxx flags,
+	uintxx level, TAllocator* allocator)
+{
+	int sfd;
+	int tfd;
+	uintxx error;
+	CTB_ASSERT(spath && tpath);
+
+	if (openfiles(spath, tpath, &sfd, &tfd) == 0) {
+		return ZSTRM_EIOERROR;
+	}
+	error = zfile_compressfd(sfd, tfd, flags, level, allocator);
+	return closefiles(sfd, tfd, error);
+}
+
+uintxx
+zfile_decompress(const char* spath, const char* tpath, uintxx flags,
+	TAllocator* allocator)
+{
+	int sfd;
+	int tfd;
+	uintxx error;
+	CTB_ASSERT(spath && tpath);
+
+	if (openfiles(spath, tpath, &sfd, &tfd) == 0) {
+		return ZSTRM_EIOERROR;
+	}
+	error = zfile_decompressfd(sfd, tfd, flags, allocator);
+	return closefiles(sfd, tfd, error);
+}
+
+#else
+
+uintxx
+zfile_compressfd(int sfd, int tfd, uintxx flags, uintxx level,
+	TAllocator* allocator)
+{
+	(void) sfd;
+	(void) tfd;
+	(void) flags;
+	(void) level;
+	(void) allocator;
+	return ZSTRM_EINCORRECTUSE;
+}
+
+uintxx
+zfile_decompressfd(int sfd, int tfd, uintxx flags, TAllocator* allocator)
+{
+	(void) sfd;
+	(void) tfd;
+	(void) flags;
+	(void) allocator;
+	return ZSTRM_EINCORRECTUSE;
+}
+
+uintxx
+zfile_compress(const char* spath, const char* tpath, uintxx flags,
+	uintxx level, TAllocator* allocator)
+{
+	(void) spath;
+	(void) tpath;
+	(void) flags;
+	(void) level;
+	(void) allocator;
+	return ZSTRM_EINCORRECTUSE;
+}
+
+uintxx
+zfile_decompress(const char* spath, const char* tpath, uintxx flags,
+	TAllocator* allocator)
+{
+	(void) spath;
+	(void) tpath;
+	(void) flags;
+	(void) allocator;
+	return ZSTRM_EINCORRECTUSE;
+}
+
+#endif
@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) 2023, jpn
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <jdeflate/zpool.h>
+#include <ctoolbox/memory.h>
+
+#if defined(__MSVC__)
+	#include <intrin.h>
+	#include <windows.h>
+#else
+	#include <sched.h>
+#endif
+
+
+/* private stuff */
+struct TZPoolPrvt {
+	/* public fields */
+	struct TZPool hidden;
+
+	/* parameters of the objects */
+	uintxx flags;
+	uintxx level;
+	uintxx hasoptions;
+	struct TZStrmOptions options;
+
+	/* idle objects (a stack) */
+	void** objects;
+
+	/* spin lock, it's only held to push or pop an object */
+	volatile long lock;
+
+	/* custom allocator */
+	struct TAllocator* allocator;
+};
+
+
+#define PRVT ((struct TZPoolPrvt*) pool)
+
+CTB_INLINE void*
+_reserve(struct TZPoolPrvt* p, uintxx amount)
+{
+	if (p->allocator) {
+		return p->allocator->reserve(p->allocator->user, amount);
+	}
+	return CTB_RESERVE(amount);
+}
+
+CTB_INLINE void
+_release(struct TZPoolPrvt* p, void* memory)
+{
+	if (p->allocator) {
+		p->allocator->release(p->allocator->user, memory);
+		return;
+	}
+	CTB_RELEASE(memory);
+}
+
+
+/* number of spins before a waiting thread yields the processor */
+#define MAXSPINS 64
+
+CTB_INLINE void
+backoff(uintxx* spins)
+{
+	if (spins[0] < MAXSPINS) {
+		spins[0]++;
+#if defined(__MSVC__)
+	#if defined(_M_IX86) || defined(_M_X64)
+		_mm_pause();
+	#else
+		__yield();
+	#endif
+#elif defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__)
+		__asm__ __volatile__("yield");
+#endif
+		return;
+	}
+
+	/* the owner may not be running */
+#if defined(__MSVC__)
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+CTB_INLINE void
+lockpool(struct TZPool* pool)
+{
+	uintxx spins;
+
+	spins = 0;
+#if defined(__MSVC__)
+	while (_InterlockedExchange(&PRVT->lock, 1)) {
+		while (PRVT->lock)
+			backoff(&spins);
+	}
+#else
+	while (__atomic_exchange_n(&PRVT->lock, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&PRVT->lock, __ATOMIC_RELAXED))
+			backoff(&spins);
+	}
+#endif
+}
+
+CTB_INLINE void
+unlockpool(struct TZPool* pool)
+{
+#if defined(__MSVC__)
+	_InterlockedExchange(&PRVT->lock, 0);
+#else
+	__atomic_store_n(&PRVT->lock, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+
+TZPool*
+zpool_create(eZPoolType otype, uintxx flags, uintxx level,
+	const TZStrmOptions* options, uintxx capacity, TAllocator* allocator)
+{
+	struct TZPool* pool;
+
+	switch (otype) {
+		case ZPOOL_DEFLATOR:
+		case ZPOOL_ZSTRM:
+			if (level > 12) {
+				/* invalid level */
+				return NULL;
+			}
+			break;
+		case ZPOOL_INFLATOR:
+			break;
+		default:
+			return NULL;
+	}
+
+	if (allocator) {
+		pool = allocator->reserve(allocator->user, sizeof(struct TZPoolPrvt));
+	}
+	else {
+		pool = CTB_RESERVE(sizeof(struct TZPoolPrvt));
+	}
+	if (pool == NULL) {
+		return NULL;
+	}
+	PRVT->allocator = allocator;
+
+	pool->otype = otype;
+	pool->capacity = capacity;
+	pool->count = 0;
+
+	PRVT->flags = flags;
+	PRVT->level = level;
+	PRVT->hasoptions = 0;
+	if (options) {
+		PRVT->options = options[0];
+		PRVT->hasoptions = 1;
+	}
+	PRVT->lock = 0;
+
+	PRVT->objects = NULL;
+	if (capacity) {
+		PRVT->objects = _reserve(PRVT, capacity * sizeof(void*));
+		if (PRVT->objects == NULL) {
+			_release(PRVT, pool);
+			return NULL;
+		}
+	}
+	return pool;
+}
+
+static void*
+createobject(struct TZPool* pool)
+{
+	const TZStrmOptions* options;
+
+	switch (pool->otype) {
+		case ZPOOL_DEFLATOR:
+			return deflator_create(PRVT->level, PRVT->allocator);
+		case ZPOOL_INFLATOR:
+			return inflator_create(PRVT->allocator);
+	}
+
+	options = NULL;
+	if (PRVT->hasoptions) {
+		options = &PRVT->options;
+	}
+	return zstrm_createex(PRVT->flags, PRVT->level, options, PRVT->allocator);
+}
+
+static void
+destroyobject(struct TZPool* pool, void* object)
+{
+	switch (pool->otype) {
+		case ZPOOL_DEFLATOR: deflator_destroy(object); return;
+		case ZPOOL_INFLATOR: inflator_destroy(object); return;
+	}
+	zstrm_destroy(object);
+}
+
+void
+zpool_destroy(TZPool* pool)
+{
+	uintxx i;
+
+	if (pool == NULL) {
+		return;
+	}
+
+	for (i = 0; i < pool->count; i++) {
+		destroyobject(pool, PRVT->objects[i]);
+	}
+	if (PRVT->objects) {
+		_release(PRVT, PRVT->objects);
+	}
+	_release(PRVT, pool);
+}
+
+/* pushes the object if there is room */
+static bool
+pushobject(struct TZPool* pool, void* object)
+{
+	bool r;
+
+	r = 0;
+	lockpool(pool);
+	if (pool->count < pool->capacity) {
+		PRVT->objects[pool->count++] = object;
+		r = 1;
+	}
+	unlockpool(pool);
+	return r;
+}
+
+bool
+zpool_prewarm(TZPool* pool, uintxx count)
+{
+	void* object;
+	uintxx n;
+	CTB_ASSERT(pool);
+
+	if (count > pool->capacity) {
+		count = pool->capacity;
+	}
+
+	for (;;) {
+		/* other threads can take or return objects */
+		lockpool(pool);
+		n = pool->count;
+		unlockpool(pool);
+		if (n >= count) {
+			break;
+		}
+
+		object = createobject(pool);
+		if (object == NULL) {
+			return 0;
+		}
+
+		if (pushobject(pool, object) == 0) {
+			/* filled by other threads */
+			destroyobject(pool, object);
+			break;
+		}
+	}
+	return 1;
+}
+
+void*
+zpool_acquire(TZPool* pool)
+{
+	void* object;
+	CTB_ASSERT(pool);
+
+	object = NULL;
+	lockpool(pool);
+	if (pool->count) {
+		object = PRVT->objects[--pool->count];
+	}
+	unlockpool(pool);
+
+	if (object == NULL) {
+		object = createobject(pool);
+	}
+	return object;
+}
+
+void
+zpool_release(TZPool* pool, void* object)
+{
+	CTB_ASSERT(pool);
+
+	if (object == NULL) {
+		return;
+	}
+
+	switch (pool->otype) {
+		case ZPOOL_DEFLATOR:
+			deflator_reset(object, PRVT->level);
+			deflator_setcodes(object, NULL);
+			deflator_setstrategy(object, DEFLT_SDEFAULT);
+			deflator_setmatchfinder(object, DEFLT_MFDEFAULT);
+			if (((TDeflator*) object)->error) {
+				destroyobject(pool, object);
+				return;
+			}
+			break;
+		case ZPOOL_INFLATOR:
+			inflator_reset(object);
+			if (((TInflator*) object)->error) {
+				destroyobject(pool, object);
+				return;
+			}
+			break;
+		default:
+			zstrm_reset(object);
+			break;
+	}
+
+	if (pushobject(pool, object) == 0) {
+		destroyobject(pool, object);
+	}
+}
+
+#undef PRVT
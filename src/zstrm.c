@@ -15,12 +15,22 @@
  */
 
 #include <jdeflate/zstrm.h>
-#include <ctoolbox/crypto/crc32.h>
-#include <ctoolbox/crypto/adler32.h>
+#include <jdeflate/checksum.h>
 #include <ctoolbox/memory.h>
+#include "arena.h"
 
 
+/* default, minimum and maximum size of the IO buffers */
 #define ZIOBFFRSZ 8192
+#define ZIOMINBFFRSZ 0x00000400L
+#define ZIOMAXBFFRSZ 0x04000000L
+
+/* default window size (in bits) */
+#define ZWNDWBITS 15
+
+/* maximum uncompressed and compressed size of a BGZF block */
+#define ZBGZFBLOCKSZ 0xff00
+#define ZBGZFMAXSZ   0x10000
 
 
 CTB_INLINE void*
@@ -43,14 +53,169 @@ _release(struct TZStrm* p, void* memory)
 }
 
 
+/* calls the IO callback, counting the calls and the bytes transferred */
+CTB_INLINE intxx
+callio(struct TZStrm* state, uint8* buffer, uintxx size)
+{
+	intxx r;
+
+	r = state->iofn(buffer, size, state->payload);
+#if defined(JDEFLATE_STATS)
+	state->iocalls++;
+	if (r > 0) {
+		state->iobytes += (uintxx) r;
+	}
+#endif
+	return r;
+}
+
+
+/* async mode, number of buffers in the queue (a power of two) */
+#define ZASYNCBFFRS 16
+
+struct TZStrmABuffer {
+	uint8* buffer;
+	uintxx size;
+	uintxx used;
+};
+
+struct TZStrmAsync {
+	/* pushed buffers, the ones in [head, cur) are done (zstrm_pop) and the
+	 * one at cur is the current one (in read mode only if loaded is set) */
+	struct TZStrmABuffer queue[ZASYNCBFFRS];
+	uintxx head;
+	uintxx cur;
+	uintxx end;
+	uintxx loaded;
+
+	/* read mode, end of the input and the last call stopped for input */
+	uintxx eof;
+	uintxx needinput;
+
+	/* write mode, offset of the output not copied yet (in the target
+	 * buffer), paused flush (1 deflating, 2 draining) and its flush mode */
+	uintxx soffset;
+	uintxx wstate;
+	uintxx flush;
+
+	/* source buffer of the stream (in read mode sbgn points to the current
+	 * pushed buffer) */
+	uint8* sbuffer;
+};
+
+/* read-ahead mode, jobs of a round */
+#define ZRADECODE   0
+#define ZRAREAD     1
+#define ZRACHECKSUM 2
+
+struct TZStrmRAJob {
+	uintxx kind;
+	struct TZStrm* owner;
+};
+
+struct TZStrmRAhead {
+	TZStrmTaskFn taskfn;
+	void* payload;
+
+	/* spare source buffer, the result of the read and if it's done (the
+	 * read after the end of the input is not repeated) */
+	uint8* sspare;
+	intxx  sresult;
+	uintxx sready;
+	uintxx eof;
+
+	/* spare target buffer and the chunk decoded by the previous round (its
+	 * checksums are computed by the next one) */
+	uint8* tspare;
+	uint8* cbuffer;
+	uintxx csize;
+
+	struct TZStrmRAJob jobs[3];
+	void* jlist[3];
+};
+
+/* IO function of the async mode, it's never called */
+static intxx
+asyncio(uint8* buffer, uintxx size, void* payload)
+{
+	(void) buffer;
+	(void) size;
+	(void) payload;
+	return -1;
+}
+
+#define ISASYNC(S) ((S)->iofn == asyncio)
+
+static void
+resetasync(struct TZStrm* state)
+{
+	struct TZStrmAsync* as;
+
+	as = state->async;
+	as->head = 0;
+	as->cur  = 0;
+	as->end  = 0;
+	as->loaded = 0;
+
+	as->eof = 0;
+	as->needinput = 0;
+
+	as->soffset = 0;
+	as->wstate  = 0;
+	as->flush   = 0;
+	state->sbgn = as->sbuffer;
+}
+
+
 #define ZSTRM_MODEMASK 0x03
-#define ZSTRM_TYPEMASK 0x1c
+#define ZSTRM_TYPEMASK 0x5c
 
 TZStrm*
 zstrm_create(uintxx flags, uintxx level, TAllocator* allocator)
+{
+	return zstrm_createex(flags, level, NULL, allocator);
+}
+
+CTB_INLINE uintxx
+clampbffrsz(uintxx size)
+{
+	if (size == 0) {
+		return ZIOBFFRSZ;
+	}
+	if (size < ZIOMINBFFRSZ) {
+		return ZIOMINBFFRSZ;
+	}
+	if (size > ZIOMAXBFFRSZ) {
+		return ZIOMAXBFFRSZ;
+	}
+	return size;
+}
+
+static void
+getbffrsizes(uintxx mode, uintxx type, const TZStrmOptions* options,
+	uintxx* sbsize, uintxx* tbsize)
+{
+	sbsize[0] = ZIOBFFRSZ;
+	tbsize[0] = ZIOBFFRSZ;
+	if (options) {
+		sbsize[0] = clampbffrsz(options->sbsize);
+		tbsize[0] = clampbffrsz(options->tbsize);
+	}
+	if (mode == ZSTRM_WMODE && type == ZSTRM_BGZF) {
+		/* the source buffer holds a block */
+		sbsize[0] = ZBGZFBLOCKSZ;
+		tbsize[0] = ZBGZFMAXSZ;
+	}
+}
+
+TZStrm*
+zstrm_createex(uintxx flags, uintxx level, const TZStrmOptions* options,
+	TAllocator* allocator)
 {
 	uintxx mode;
 	uintxx type;
+	uintxx sbsize;
+	uintxx tbsize;
 	struct TZStrm* state;
 
 	mode = flags & ZSTRM_MODEMASK;
@@ -68,7 +233,7 @@ zstrm_create(uintxx flags, uintxx level, TAllocator* allocator)
 	}
 
 	if (mode == ZSTRM_WMODE) {
-		if (level > 9) {
+		if (level > 12) {
 			/* invalid compression level */
 			return NULL;
 		}
@@ -82,6 +247,15 @@ zstrm_create(uintxx flags, uintxx level, TAllocator* allocator)
 		if ((type & ZSTRM_GZIP) && (type & ~ZSTRM_GZIP)) {
 			return NULL;
 		}
+		if ((type & ZSTRM_BGZF) && (type & ~ZSTRM_BGZF)) {
+			return NULL;
+		}
+	}
+	else {
+		/* BGZF is read as a multi-member gzip stream */
+		if (type & ZSTRM_BGZF) {
+			type = (type & ~ZSTRM_BGZF) | ZSTRM_GZIP;
+		}
 	}
 
 	if (allocator) {
@@ -94,9 +268,17 @@ zstrm_create(uintxx flags, uintxx level, TAllocator* allocator)
 		return NULL;
 	}
 	state->allocator = allocator;
+	state->pmode = NULL;
+	state->async = NULL;
+	state->rahead = NULL;
+	state->index = NULL;
+
+	getbffrsizes(mode, type, options, &sbsize, &tbsize);
+	state->sbsize = sbsize;
+	state->tbsize = tbsize;
 
-	state->sbgn = _reserve(state, ZIOBFFRSZ);
-	state->tbgn = _reserve(state, ZIOBFFRSZ);
+	state->sbgn = _reserve(state, sbsize);
+	state->tbgn = _reserve(state, tbsize);
 	if (state->sbgn == NULL || state->tbgn == NULL) {
 		if (state->sbgn) {
 			_release(state, state->sbgn);
@@ -110,31 +292,57 @@ zstrm_create(uintxx flags, uintxx level, TAllocator* allocator)
 	state->infltr = NULL;
 	state->defltr = NULL;
 
+	state->wbits = 0;
+	state->hbits = 0;
+	state->strategy = 0;
+	if (options) {
+		state->wbits = options->wbits;
+		state->hbits = options->hbits;
+		state->strategy = options->strategy;
+	}
+
 	if (mode == ZSTRM_RMODE) {
-		state->infltr = inflator_create(allocator);
+		state->infltr = inflator_createex(state->wbits, allocator);
 		if (state->infltr == NULL) {
 			zstrm_destroy(state);
 			return NULL;
 		}
 	}
 	else {
-		state->defltr = deflator_create((state->level = level), allocator);
+		state->level  = level;
+		state->defltr = deflator_createex(
+			level, state->wbits, state->hbits, allocator);
 		if (state->defltr == NULL) {
 			zstrm_destroy(state);
 			return NULL;
 		}
+
+		if (state->strategy) {
+			deflator_setstrategy(state->defltr, state->strategy);
+			if (state->defltr->error) {
+				zstrm_destroy(state);
+				return NULL;
+			}
+		}
+	}
+
+	if (state->wbits == 0) {
+		state->wbits = ZWNDWBITS;
 	}
 
 	state->smode = mode;
 	state->mtype = type;
 	if (mode == ZSTRM_WMODE) {
 		state->stype = type;
+		state->docrc32 = 0;
+		state->doadler = 0;
 		if (flags & ZSTRM_DOCRC32) state->docrc32 = 1;
 		if (flags & ZSTRM_DOADLER) state->doadler = 1;
 
 		if (type ^ ZSTRM_DFLT) {
 			if (type & ZSTRM_GZIP) state->docrc32 = 1;
 			if (type & ZSTRM_ZLIB) state->doadler = 1;
+			if (type & ZSTRM_BGZF) state->docrc32 = 1;
 		}
 	}
 	state->flags = flags;
@@ -142,6 +350,68 @@ zstrm_create(uintxx flags, uintxx level, TAllocator* allocator)
 	return state;
 }
 
+uintxx
+zstrm_memsize(uintxx flags, uintxx level, const TZStrmOptions* options)
+{
+	uintxx mode;
+	uintxx total;
+	uintxx sbsize;
+	uintxx tbsize;
+	uintxx wbits;
+	uintxx hbits;
+
+	mode = flags & ZSTRM_MODEMASK;
+	if (mode != ZSTRM_RMODE && mode != ZSTRM_WMODE) {
+		return 0;
+	}
+	getbffrsizes(mode, flags & ZSTRM_TYPEMASK, options, &sbsize, &tbsize);
+
+	wbits = 0;
+	hbits = 0;
+	if (options) {
+		wbits = options->wbits;
+		hbits = options->hbits;
+	}
+
+	/* the inflator or deflator shares the arena */
+	if (mode == ZSTRM_RMODE) {
+		total = inflator_memsize(wbits);
+	}
+	else {
+		total = deflator_memsize(level, wbits, hbits);
+	}
+	if (total == 0) {
+		return 0;
+	}
+	total += ARENA_ROUNDUP(sizeof(struct TZStrm));
+	total += ARENA_ROUNDUP(sbsize);
+	total += ARENA_ROUNDUP(tbsize);
+	return total;
+}
+
+TZStrm*
+zstrm_createinplace(uintxx flags, uintxx level, const TZStrmOptions* options,
+	void* memory, uintxx size)
+{
+	TAllocator* allocator;
+	uintxx n;
+
+	/* see deflator_createinplace */
+	n = zstrm_memsize(flags, level, options);
+	if (n == 0 || size < n) {
+		return NULL;
+	}
+
+	allocator = arena_create(memory, size);
+	if (allocator == NULL) {
+		return NULL;
+	}
+	return zstrm_createex(flags, level, options, allocator);
+}
+
+static void releasepmode(TZStrm* state);
+static void releaserahead(TZStrm* state);
+
 void
 zstrm_destroy(TZStrm* state)
 {
@@ -149,6 +419,17 @@ zstrm_destroy(TZStrm* state)
 		return;
 	}
 
+	if (state->pmode) {
+		releasepmode(state);
+	}
+	if (state->rahead) {
+		releaserahead(state);
+	}
+	if (state->async) {
+		state->sbgn = state->async->sbuffer;
+		_release(state, state->async);
+	}
+
 	_release(state, state->sbgn);
 	_release(state, state->tbgn);
 
@@ -161,11 +442,18 @@ zstrm_destroy(TZStrm* state)
 	_release(state, state);
 }
 
+static void resetpmode(TZStrm* state);
+static void resetrahead(TZStrm* state);
+
 void
 zstrm_reset(TZStrm* state)
 {
 	CTB_ASSERT(state);
 
+	if (state->async) {
+		resetasync(state);
+	}
+
 	state->state  = 0;
 	state->error  = 0;
 	if (state->smode == ZSTRM_RMODE) {
@@ -183,10 +471,16 @@ zstrm_reset(TZStrm* state)
 	state->crc32 = 0xffffffff;
 	state->adler = 1;
 	state->total = 0;
+	state->member = 0;
 
 	state->result = 0;
 	state->iofn    = NULL;
 	state->payload = NULL;
+	state->iocalls = 0;
+	state->iobytes = 0;
+	state->index   = NULL;
+	state->sbase   = 0;
+	state->mbase   = 0;
 
 	state->source = state->sbgn;
 	state->send   = state->sbgn;
@@ -196,11 +490,22 @@ zstrm_reset(TZStrm* state)
 	state->tbgn[0] = 0x00;
 	if (state->infltr) {
 		inflator_reset(state->infltr);
+
+		if (state->pmode) {
+			resetpmode(state);
+		}
+		if (state->rahead) {
+			resetrahead(state);
+		}
 	}
 	if (state->defltr) {
-		state->send += ZIOBFFRSZ;
-		state->tend += ZIOBFFRSZ;
+		state->send += state->sbsize;
+		state->tend += state->tbsize;
 		deflator_reset(state->defltr, state->level);
+
+		if (state->pmode) {
+			resetpmode(state);
+		}
 	}
 }
 
@@ -226,156 +531,575 @@ zstrm_setiofn(TZStrm* state, TZStrmIOFn fn, void* payload)
 	state->payload = payload;
 }
 
-
-static uintxx parsehead(TZStrm* state);
-
 void
-zstrm_setdctn(TZStrm* state, uint8* dict, uintxx size)
+zstrm_setasync(TZStrm* state)
 {
-	uint32 adler;
 	CTB_ASSERT(state);
 
-	if (state->state == 0 || state->state == 4) {
-		if (state->state == 4) {
-			return;
+	if (state->state || state->pmode || state->rahead) {
+		SETSTATE(4);
+		if (state->error == 0) {
+			SETERROR(ZSTRM_EINCORRECTUSE);
 		}
-		goto L_ERROR;
+		return;
+	}
+	if (state->defltr && state->stype == ZSTRM_BGZF) {
+		SETERROR(ZSTRM_EINCORRECTUSE);
+		SETSTATE(4);
+		return;
 	}
 
-	if (state->smode == ZSTRM_RMODE) {
-		if (state->state == 1) {
-			if (parsehead(state) == 0) {
-				goto L_ERROR;
-			}
+	if (state->async == NULL) {
+		state->async = _reserve(state, sizeof(struct TZStrmAsync));
+		if (state->async == NULL) {
+			SETERROR(ZSTRM_EOOM);
+			SETSTATE(4);
+			return;
 		}
+		state->async->sbuffer = state->sbgn;
+		resetasync(state);
+	}
+	SETSTATE(1);
 
-		if (state->stype == ZSTRM_GZIP) {
-			goto L_ERROR;
+	state->iofn    = asyncio;
+	state->payload = NULL;
+}
+
+/* copies the pending output to the queued buffers, returns 1 if there is
+ * nothing left */
+static uintxx
+adrain(struct TZStrm* state)
+{
+	uintxx n;
+	uintxx pending;
+	struct TZStrmAsync* as;
+	struct TZStrmABuffer* b;
+
+	as = state->async;
+	for (;;) {
+		pending = (uintxx) (state->target - state->tbgn) - as->soffset;
+		if (pending == 0) {
+			break;
 		}
-		adler = adler32_update(1, dict, size);
-		if (state->state == 2) {
-			if (adler ^ state->dictid) {
-				SETERROR(ZSTRM_EINCORRECTDICT);
-				goto L_ERROR;
-			}
+		if (as->cur == as->end) {
+			return 0;
 		}
-		else {
-			state->dictid = adler;
+
+		b = as->queue + (as->cur & (ZASYNCBFFRS - 1));
+		n = b->size - b->used;
+		if (n > pending)
+			n = pending;
+		ctb_memcpy(b->buffer + b->used, state->tbgn + as->soffset, n);
+		b->used     += n;
+		as->soffset += n;
+		if (b->used == b->size) {
+			as->cur++;
 		}
-		SETSTATE(3);
-		inflator_setdctnr(state->infltr, dict, size);
 	}
+	state->target = state->tbgn;
+	as->soffset = 0;
 
-	if (state->smode == ZSTRM_WMODE) {
-		if (state->state ^ 1) {
-			if (state->state == 4) {
-				return;
-			}
-			goto L_ERROR;
+	/* the stream is complete, the last buffer is done too */
+	if (state->state == 4 && as->cur != as->end) {
+		if (as->queue[as->cur & (ZASYNCBFFRS - 1)].used) {
+			as->cur++;
 		}
-		if (state->stype & ZSTRM_GZIP || state->dict == 1) {
-			goto L_ERROR;
+	}
+	return 1;
+}
+
+static uintxx aresume(TZStrm* state);
+
+bool
+zstrm_push(TZStrm* state, void* buffer, uintxx size)
+{
+	struct TZStrmAsync* as;
+	struct TZStrmABuffer* b;
+	CTB_ASSERT(state);
+
+	if (CTB_UNLIKELY(ISASYNC(state) == 0)) {
+		SETSTATE(4);
+		if (state->error == 0) {
+			SETERROR(ZSTRM_EINCORRECTUSE);
 		}
+		return 0;
+	}
+	as = state->async;
 
-		state->dictid = adler32_update(1, dict, size);;
-		state->dict   = 1;
-		deflator_setdctnr(state->defltr, dict, size);
+	if (state->infltr && size == 0) {
+		as->eof = 1;
+		as->needinput = 0;
+		return 1;
 	}
-	return;
+	if (size == 0 || as->end - as->head == ZASYNCBFFRS) {
+		return 0;
+	}
+	as->needinput = 0;
+
+	b = as->queue + (as->end & (ZASYNCBFFRS - 1));
+	b->buffer = buffer;
+	b->size   = size;
+	b->used   = 0;
+	as->end++;
+#if defined(JDEFLATE_STATS)
+	state->iocalls++;
+	if (state->infltr) {
+		state->iobytes += size;
+	}
+#endif
 
-	L_ERROR:
-	if (state->error == 0)
-		SETERROR(ZSTRM_EINCORRECTUSE);
-	SETSTATE(4);
+	if (state->defltr) {
+		if (adrain(state) && as->wstate) {
+			aresume(state);
+		}
+	}
+	return 1;
 }
 
-uintxx
-zstrm_getstate(TZStrm* state, uintxx* error)
+void*
+zstrm_pop(TZStrm* state, uintxx* size)
 {
-	CTB_ASSERT(state);
+	struct TZStrmAsync* as;
+	struct TZStrmABuffer* b;
+	CTB_ASSERT(state && size);
 
-	if (state->state == 1) {
-		if (state->smode == ZSTRM_RMODE) {
-			if (parsehead(state) == 0) {
-				SETSTATE(4);
-				goto L_ERROR;
-			}
+	size[0] = 0;
+	if (ISASYNC(state) == 0) {
+		return NULL;
+	}
+	as = state->async;
 
-			if (state->state == 2) {
-				return state->state;
-			}
-			SETSTATE(3);
+	if (as->head == as->cur) {
+		/* at the end of the stream the input is not needed anymore */
+		if (state->defltr || state->state != 4 || as->head == as->end) {
+			return NULL;
 		}
+		as->cur++;
+		as->loaded = 0;
 	}
 
-L_ERROR:
-	if (error)
-		error[0] = state->error;
-	return state->state;
+	b = as->queue + (as->head & (ZASYNCBFFRS - 1));
+	as->head++;
+	if (state->infltr) {
+		size[0] = b->size;
+	}
+	else {
+		size[0] = b->used;
+#if defined(JDEFLATE_STATS)
+		state->iobytes += b->used;
+#endif
+	}
+	return b->buffer;
 }
 
-
-CTB_INLINE uint8
-fetchbyte(struct TZStrm* state)
+uintxx
+zstrm_iostate(TZStrm* state)
 {
-	intxx r;
+	struct TZStrmAsync* as;
+	CTB_ASSERT(state);
 
-	if (CTB_LIKELY(state->source < state->send)) {
-		return *state->source++;
+	if (ISASYNC(state) == 0) {
+		return ZSTRM_IOREADY;
 	}
+	as = state->async;
 
-	if (state->error == 0) {
-		r = state->iofn(state->sbgn, ZIOBFFRSZ, state->payload);
-		if (CTB_LIKELY(r)) {
-			if ((uintxx) r > ZIOBFFRSZ) {
-				SETERROR(ZSTRM_EIOERROR);
-				return 0;
-			}
-			state->source = state->sbgn;
-			state->send   = state->sbgn + r;
-			return *state->source++;
+	if (state->infltr) {
+		if (as->needinput) {
+			return ZSTRM_IOINPUT;
 		}
+		return ZSTRM_IOREADY;
 	}
-	else {
-		return 0;
+	if (as->wstate || state->target != state->tbgn) {
+		return ZSTRM_IOOUTPUT;
 	}
-	SETERROR(ZSTRM_EBADDATA);
-	return 0;
+	return ZSTRM_IOREADY;
 }
 
+/* loads the next pushed buffer (the current one was consumed), returns its
+ * size or zero if there is none */
 static uintxx
-parsegziphead(struct TZStrm* state)
+anext(struct TZStrm* state)
 {
-	uint8 id1;
-	uint8 id2;
-	uint8 flags;
+	struct TZStrmAsync* as;
+	struct TZStrmABuffer* b;
 
-	id1 = fetchbyte(state);
-	id2 = fetchbyte(state);
-	if (id1 != 0x1f || id2 != 0x8b) {
-		if (state->error == 0)
-			SETERROR(ZSTRM_EBADDATA);
+	as = state->async;
+	if (as->loaded) {
+		as->cur++;
+		as->loaded = 0;
+	}
+	if (as->cur == as->end) {
+		if (as->eof == 0) {
+			as->needinput = 1;
+		}
 		return 0;
 	}
 
-	/* compression method (deflate only) */
-	if (fetchbyte(state) != 0x08) {
-		if (state->error == 0)
-			SETERROR(ZSTRM_EBADDATA);
-		return 0;
+	b = as->queue + (as->cur & (ZASYNCBFFRS - 1));
+	as->loaded = 1;
+
+	state->sbase += (uintxx) (state->send - state->sbgn);
+	state->sbgn   = b->buffer;
+	state->source = b->buffer;
+	state->send   = b->buffer + b->size;
+	return b->size;
+}
+
+/* returns the byte at the given offset from the input position or -1 if it
+ * was not pushed yet */
+static intxx
+apeek(struct TZStrm* state, uintxx offset)
+{
+	uintxx i;
+	uintxx n;
+	struct TZStrmAsync* as;
+	struct TZStrmABuffer* b;
+
+	as = state->async;
+	if (as->loaded) {
+		n = (uintxx) (state->send - state->source);
+		if (offset < n) {
+			return state->source[offset];
+		}
+		offset -= n;
+	}
+	for (i = as->cur + as->loaded; i != as->end; i++) {
+		b = as->queue + (i & (ZASYNCBFFRS - 1));
+		if (offset < b->size) {
+			return b->buffer[offset];
+		}
+		offset -= b->size;
 	}
+	return -1;
+}
 
-	flags = fetchbyte(state);
-	fetchbyte(state);
-	fetchbyte(state);
-	fetchbyte(state);
-	fetchbyte(state);
-	fetchbyte(state);
-	fetchbyte(state);
+/* checks if the whole gzip header at the given offset was pushed */
+static bool
+agziphead(struct TZStrm* state, uintxx offset)
+{
+	intxx a;
+	intxx b;
+	intxx flags;
+
+	flags = apeek(state, offset + 3);
+	if (flags < 0 || apeek(state, offset + 9) < 0) {
+		return 0;
+	}
+	offset += 10;
 
 	/* extra */
 	if (flags & 0x04) {
-		uint8 a;
+		a = apeek(state, offset + 0);
+		b = apeek(state, offset + 1);
+		if (a < 0 || b < 0) {
+			return 0;
+		}
+		offset += 2 + (uintxx) (a | (b << 0x08));
+	}
+
+	/* name, comment */
+	if (flags & 0x08) {
+		do {
+			if ((a = apeek(state, offset++)) < 0)
+				return 0;
+		} while (a);
+	}
+	if (flags & 0x10) {
+		do {
+			if ((a = apeek(state, offset++)) < 0)
+				return 0;
+		} while (a);
+	}
+
+	/* header crc16 */
+	if (flags & 0x02) {
+		offset += 2;
+	}
+	return apeek(state, offset - 1) >= 0;
+}
+
+/* the blocking parsers are used once the input has the whole header (or
+ * there is no more input), it must fit in the queued buffers */
+static uintxx
+awaitinput(struct TZStrm* state)
+{
+	struct TZStrmAsync* as;
+
+	as = state->async;
+	if (as->eof) {
+		return 1;
+	}
+	if (as->end - as->cur == ZASYNCBFFRS) {
+		SETERROR(ZSTRM_EBUFFERFULL);
+		SETSTATE(4);
+		return 0;
+	}
+	as->needinput = 1;
+	return 0;
+}
+
+static uintxx
+aheadready(struct TZStrm* state)
+{
+	intxx a;
+	intxx b;
+
+	a = apeek(state, 0);
+	if (a >= 0) {
+		if (a == 0x1f) {
+			if (agziphead(state, 0)) {
+				return 1;
+			}
+		}
+		else {
+			if ((a & 0x0f) ^ 0x08) {
+				return 1;
+			}
+
+			/* zlib, the dictionary id follows if FDICT is set */
+			b = apeek(state, 1);
+			if (b >= 0 && ((b & 0x20) == 0 || apeek(state, 5) >= 0)) {
+				return 1;
+			}
+		}
+	}
+	return awaitinput(state);
+}
+
+/* checks the tail of the stream and the header of the next gzip member */
+static uintxx
+atailready(struct TZStrm* state)
+{
+	uintxx offset;
+	intxx a;
+
+	offset = inflator_srcend(state->infltr);
+	switch (state->stype) {
+		case ZSTRM_GZIP:
+			a = apeek(state, offset + 8);
+			if (a >= 0) {
+				if (a ^ 0x1f || agziphead(state, offset + 8)) {
+					return 1;
+				}
+			}
+			break;
+		case ZSTRM_ZLIB:
+			if (apeek(state, offset + 3) >= 0) {
+				return 1;
+			}
+			break;
+		default:
+			return 1;
+	}
+	return awaitinput(state);
+}
+
+
+static uintxx parsehead(TZStrm* state);
+
+static void setpmodedctn(TZStrm* state, uint8* dict, uintxx size);
+
+void
+zstrm_setdctn(TZStrm* state, uint8* dict, uintxx size)
+{
+	uint32 adler;
+	CTB_ASSERT(state);
+
+	if (state->state == 0 || state->state == 4) {
+		if (state->state == 4) {
+			return;
+		}
+		goto L_ERROR;
+	}
+
+	if (state->smode == ZSTRM_RMODE) {
+		if (state->pmode) {
+			/* not supported in the parallel mode */
+			goto L_ERROR;
+		}
+
+		if (state->state == 1) {
+			if (parsehead(state) == 0) {
+				goto L_ERROR;
+			}
+		}
+
+		if (state->stype == ZSTRM_GZIP) {
+			goto L_ERROR;
+		}
+		adler = checksum_adler32(1, dict, size);
+		if (state->state == 2) {
+			if (adler ^ state->dictid) {
+				SETERROR(ZSTRM_EINCORRECTDICT);
+				goto L_ERROR;
+			}
+		}
+		else {
+			state->dictid = adler;
+		}
+		SETSTATE(3);
+		inflator_setdctnr(state->infltr, dict, size);
+	}
+
+	if (state->smode == ZSTRM_WMODE) {
+		if (state->state ^ 1) {
+			if (state->state == 4) {
+				return;
+			}
+			goto L_ERROR;
+		}
+		if (state->stype & (ZSTRM_GZIP | ZSTRM_BGZF) || state->dict == 1) {
+			goto L_ERROR;
+		}
+
+		state->dictid = checksum_adler32(1, dict, size);
+		state->dict   = 1;
+		if (state->pmode) {
+			setpmodedctn(state, dict, size);
+			return;
+		}
+		deflator_setdctnr(state->defltr, dict, size);
+	}
+	return;
+
+	L_ERROR:
+	if (state->error == 0)
+		SETERROR(ZSTRM_EINCORRECTUSE);
+	SETSTATE(4);
+}
+
+uintxx
+zstrm_getstats(TZStrm* state, TZStrmStats* stats)
+{
+	CTB_ASSERT(state && stats);
+
+	stats[0] = (struct TZStrmStats) {0};
+#if defined(JDEFLATE_STATS)
+	stats->iocalls = state->iocalls;
+	stats->iobytes = state->iobytes;
+	if (state->pmode == NULL) {
+		if (state->defltr) {
+			deflator_getstats(state->defltr, &stats->deflator);
+		}
+		if (state->infltr) {
+			inflator_getstats(state->infltr, &stats->inflator);
+		}
+	}
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+uintxx
+zstrm_getstate(TZStrm* state, uintxx* error)
+{
+	CTB_ASSERT(state);
+
+	if (state->state == 1) {
+		if (state->smode == ZSTRM_RMODE && state->pmode == NULL) {
+			if (ISASYNC(state) && aheadready(state) == 0) {
+				goto L_ERROR;
+			}
+			if (parsehead(state) == 0) {
+				SETSTATE(4);
+				goto L_ERROR;
+			}
+
+			if (state->state == 2) {
+				return state->state;
+			}
+			SETSTATE(3);
+		}
+	}
+
+L_ERROR:
+	if (error)
+		error[0] = state->error;
+	return state->state;
+}
+
+
+static uintxx raswap(struct TZStrm* state);
+
+/* refills the source buffer, returns the number of bytes read (zero at the
+ * end of the input or on error) */
+static uintxx
+readsource(struct TZStrm* state)
+{
+	intxx r;
+
+	if (ISASYNC(state)) {
+		return anext(state);
+	}
+	if (state->rahead && state->rahead->sready) {
+		return raswap(state);
+	}
+
+	r = callio(state, state->sbgn, state->sbsize);
+	if (CTB_LIKELY(r)) {
+		if ((uintxx) r > state->sbsize) {
+			SETERROR(ZSTRM_EIOERROR);
+			return 0;
+		}
+		state->sbase += (uintxx) (state->send - state->sbgn);
+		state->source = state->sbgn;
+		state->send   = state->sbgn + r;
+	}
+	return (uintxx) r;
+}
+
+CTB_INLINE uint8
+fetchbyte(struct TZStrm* state)
+{
+	if (CTB_LIKELY(state->source < state->send)) {
+		return *state->source++;
+	}
+
+	if (state->error == 0) {
+		if (CTB_LIKELY(readsource(state))) {
+			return *state->source++;
+		}
+		if (state->error == 0) {
+			SETERROR(ZSTRM_EBADDATA);
+		}
+	}
+	return 0;
+}
+
+static uintxx
+parsegziphead(struct TZStrm* state)
+{
+	uint8 id1;
+	uint8 id2;
+	uint8 flags;
+
+	id1 = fetchbyte(state);
+	id2 = fetchbyte(state);
+	if (id1 != 0x1f || id2 != 0x8b) {
+		if (state->error == 0)
+			SETERROR(ZSTRM_EBADDATA);
+		return 0;
+	}
+
+	/* compression method (deflate only) */
+	if (fetchbyte(state) != 0x08) {
+		if (state->error == 0)
+			SETERROR(ZSTRM_EBADDATA);
+		return 0;
+	}
+
+	flags = fetchbyte(state);
+	fetchbyte(state);
+	fetchbyte(state);
+	fetchbyte(state);
+	fetchbyte(state);
+	fetchbyte(state);
+	fetchbyte(state);
+
+	/* extra */
+	if (flags & 0x04) {
+		uint8 a;
 		uint8 b;
 		uint16 length;
 
@@ -420,7 +1144,7 @@ parsezlibhead(struct TZStrm* state)
 		/* CM and CINFO */
 		cm = (a >> 0) & 0x0f;
 		ci = (a >> 4) & 0x0f;
-		if (cm == 8 && ci <= 7) {
+		if (cm == 8 && ci + 8 <= state->wbits) {
 			uintxx fchck;
 			uintxx fdict;
 
@@ -497,6 +1221,7 @@ parsehead(struct TZStrm* state)
 	}
 
 	state->source--;
+	state->mbase = state->sbase + (uintxx) (state->source - state->sbgn);
 	switch (state->stype) {
 		case ZSTRM_GZIP: state->docrc32 = 1; parsegziphead(state); break;
 		case ZSTRM_ZLIB: state->doadler = 1; parsezlibhead(state); break;
@@ -532,8 +1257,11 @@ checkgziptail(struct TZStrm* state)
 
 	if (state->error == 0) {
 		if (crc32 != state->crc32) {
-			SETERROR(ZSTRM_ECHECKSUM);
-			return;
+			/* the checks are disabled after a seek */
+			if (state->docrc32) {
+				SETERROR(ZSTRM_ECHECKSUM);
+				return;
+			}
 		}
 	}
 	else {
@@ -547,7 +1275,7 @@ checkgziptail(struct TZStrm* state)
 	d = fetchbyte(state);
 	total = TOI32(a, b, c, d);
 
-	if (total != state->total) {
+	if (total != state->total && state->docrc32) {
 		if (state->error) {
 			return;
 		}
@@ -555,6 +1283,35 @@ checkgziptail(struct TZStrm* state)
 	}
 }
 
+/* checks if another gzip member follows and parses its header, the data
+ * after the last member is ignored */
+static bool
+nextmember(struct TZStrm* state)
+{
+	if (state->source == state->send) {
+		if (readsource(state) == 0) {
+			return 0;
+		}
+	}
+	if (state->source[0] != 0x1f) {
+		return 0;
+	}
+
+	state->mbase = state->sbase + (uintxx) (state->source - state->sbgn);
+	if (parsegziphead(state) == 0) {
+		return 0;
+	}
+	inflator_reset(state->infltr);
+	inflator_setsrc(state->infltr, state->source, state->send - state->source);
+
+	state->docrc32 = 1;
+	state->crc32 = CHECKSUM_CRC32INIT;
+	state->total = 0;
+	state->result = INFLT_TGTEXHSTD;
+	state->member++;
+	return 1;
+}
+
 CTB_INLINE void
 checkzlibtail(struct TZStrm* state)
 {
@@ -570,7 +1327,7 @@ checkzlibtail(struct TZStrm* state)
 	b = fetchbyte(state);
 	a = fetchbyte(state);
 	adler = TOI32(a, b, c, d);
-	if (adler != state->adler) {
+	if (state->doadler && adler != state->adler) {
 		if (state->error == 0)
 			SETERROR(ZSTRM_ECHECKSUM);
 		return;
@@ -580,16 +1337,134 @@ checkzlibtail(struct TZStrm* state)
 #undef TOI32
 
 
+static uintxx pinflatenext(struct TZStrm* state);
+
+static uintxx raround(struct TZStrm* state);
+static void rachecksum(struct TZStrm* state);
+
+static bool indexupdate(struct TZStrm* state, uintxx n);
+
+/* decodes the next run of data into the target buffer */
 static uintxx
-inflate(struct TZStrm* state, uint8* buffer, uintxx size)
+inflatenext(struct TZStrm* state)
 {
 	uintxx n;
-	uintxx maxrun;
-	uint8* bbegin;
-	uint8* target;
-	uint8* tend;
 
-	target = state->target;
+	if (state->pmode) {
+		return pinflatenext(state);
+	}
+
+	for (;;) {
+		if (CTB_LIKELY(state->result == INFLT_SRCEXHSTD)) {
+			uintxx r;
+
+			r = readsource(state);
+			if (CTB_LIKELY(r)) {
+				inflator_setsrc(state->infltr, state->sbgn, r);
+			}
+			else {
+				if (ISASYNC(state) && state->async->needinput) {
+					return 0;
+				}
+				if (state->error == 0) {
+					SETERROR(ZSTRM_EBADDATA);
+				}
+				SETSTATE(4);
+				return 0;
+			}
+		}
+		else {
+			if (CTB_UNLIKELY(state->result == INFLT_OK)) {
+				if (ISASYNC(state) && atailready(state) == 0) {
+					return 0;
+				}
+
+				/* end of the stream */
+				state->source += inflator_srcend(state->infltr);
+
+				if (state->rahead) {
+					rachecksum(state);
+				}
+				if (state->docrc32)
+					CHECKSUM_CRC32FINALIZE(state->crc32);
+
+				switch (state->stype) {
+					case ZSTRM_GZIP:
+						checkgziptail(state);
+						if (state->error == 0 && nextmember(state)) {
+							continue;
+						}
+						break;
+					case ZSTRM_ZLIB:
+						checkzlibtail(state);
+						break;
+				}
+				SETSTATE(4);
+				return 0;
+			}
+		}
+
+		if (state->rahead) {
+			n = raround(state);
+			if (CTB_UNLIKELY(state->error)) {
+				return 0;
+			}
+			state->total += n;
+
+			if (CTB_LIKELY(n)) {
+				return n;
+			}
+			continue;
+		}
+
+		inflator_settgt(state->infltr, state->tbgn, state->tbsize);
+		if (CTB_UNLIKELY(state->index != NULL)) {
+			state->result = inflator_inflateblock(state->infltr, 0);
+		}
+		else {
+			state->result = inflator_inflate(state->infltr, 0);
+		}
+		if (CTB_UNLIKELY(state->result == INFLT_ERROR)) {
+			SETERROR(ZSTRM_EDEFLATE);
+			SETSTATE(4);
+			return 0;
+		}
+
+		n = inflator_tgtend(state->infltr);
+		state->target = state->tbgn;
+		state->tend   = state->tbgn + n;
+
+		/* update the checksums */
+		if (CTB_LIKELY(state->docrc32))
+			state->crc32 = checksum_crc32(state->crc32, state->tbgn, n);
+		if (CTB_LIKELY(state->doadler)) {
+			state->adler = checksum_adler32(state->adler, state->tbgn, n);
+		}
+		state->total += n;
+
+		if (CTB_UNLIKELY(state->index != NULL)) {
+			if (indexupdate(state, n) == 0) {
+				SETERROR(ZSTRM_EOOM);
+				SETSTATE(4);
+				return 0;
+			}
+		}
+
+		if (CTB_LIKELY(n)) {
+			return n;
+		}
+	}
+}
+
+static uintxx
+inflate(struct TZStrm* state, uint8* buffer, uintxx size)
+{
+	uintxx maxrun;
+	uint8* bbegin;
+	uint8* target;
+	uint8* tend;
+
+	target = state->target;
 	tend   = state->tend;
 	bbegin = buffer;
 
@@ -641,70 +1516,15 @@ inflate(struct TZStrm* state, uint8* buffer, uintxx size)
 			continue;
 		}
 
-		if (CTB_LIKELY(state->result == INFLT_SRCEXHSTD)) {
-			intxx r;
-
-			r = state->iofn(state->sbgn, ZIOBFFRSZ, state->payload);
-			if (CTB_LIKELY(r)) {
-				if (CTB_UNLIKELY((uintxx) r > ZIOBFFRSZ)) {
-					SETERROR(ZSTRM_EIOERROR);
-					SETSTATE(4);
-					return 0;
-				}
-
-				state->source = state->sbgn;
-				state->send   = state->send + r;
-				inflator_setsrc(state->infltr, state->sbgn, r);
-			}
-			else {
-				SETERROR(ZSTRM_EBADDATA);
-				SETSTATE(4);
+		state->target = target;
+		if (inflatenext(state) == 0) {
+			if (state->error) {
 				return 0;
 			}
+			break;
 		}
-		else {
-			if (CTB_UNLIKELY(state->result == INFLT_OK)) {
-				/* end of the stream */
-				state->source += inflator_srcend(state->infltr);
-
-				if (state->docrc32)
-					CRC32_FINALIZE(state->crc32);
-
-				switch (state->stype) {
-					case ZSTRM_GZIP:
-						checkgziptail(state);
-						break;
-					case ZSTRM_ZLIB:
-						checkzlibtail(state);
-						break;
-				}
-				SETSTATE(4);
-				if (state->error) {
-					return 0;
-				}
-				break;
-			}
-		}
-
-		inflator_settgt(state->infltr, state->tbgn, ZIOBFFRSZ);
-		state->result = inflator_inflate(state->infltr, 0);
-		if (CTB_UNLIKELY(state->result == INFLT_ERROR)) {
-			SETERROR(ZSTRM_EDEFLATE);
-			SETSTATE(4);
-			return 0;
-		}
-
-		n = inflator_tgtend(state->infltr);
-		target = state->tbgn;
-		tend   = state->tbgn + n;
-
-		/* update the checksums */
-		if (CTB_LIKELY(state->docrc32))
-			state->crc32 =   crc32_update(state->crc32, target, n);
-		if (CTB_LIKELY(state->doadler)) {
-			state->adler = adler32_update(state->adler, target, n);
-		}
-		state->total += n;
+		target = state->target;
+		tend   = state->tend;
 	}
 
 	state->target = target;
@@ -712,11 +1532,10 @@ inflate(struct TZStrm* state, uint8* buffer, uintxx size)
 	return (uintxx) (buffer - bbegin);
 }
 
-uintxx
-zstrm_r(TZStrm* state, void* buffer, uintxx size)
+/* checks the stream mode and parses the header on the first call */
+static uintxx
+rbegin(TZStrm* state)
 {
-	CTB_ASSERT(state);
-
 	/* check the stream mode */
 	if (CTB_UNLIKELY(state->infltr == NULL)) {
 		SETSTATE(4);
@@ -726,7 +1545,7 @@ zstrm_r(TZStrm* state, void* buffer, uintxx size)
 		return 0;
 	}
 	if (CTB_LIKELY(state->state == 3)) {
-		return inflate(state, (uint8*) buffer, size);
+		return 1;
 	}
 
 	if (state->state == 1) {
@@ -736,6 +1555,15 @@ zstrm_r(TZStrm* state, void* buffer, uintxx size)
 			return 0;
 		}
 
+		if (state->pmode) {
+			/* the header is parsed by the first decoding round */
+			SETSTATE(3);
+			return 1;
+		}
+		if (ISASYNC(state) && aheadready(state) == 0) {
+			return 0;
+		}
+
 		if (parsehead(state) == 0) {
 			SETSTATE(4);
 		}
@@ -750,7 +1578,7 @@ zstrm_r(TZStrm* state, void* buffer, uintxx size)
 			return 0;
 		}
 		SETSTATE(3);
-		return inflate(state, (uint8*) buffer, size);
+		return 1;
 	}
 
 	if (state->state == 2) {
@@ -760,16 +1588,71 @@ zstrm_r(TZStrm* state, void* buffer, uintxx size)
 	return 0;
 }
 
+uintxx
+zstrm_r(TZStrm* state, void* buffer, uintxx size)
+{
+	CTB_ASSERT(state);
+
+	if (CTB_UNLIKELY(rbegin(state) == 0)) {
+		return 0;
+	}
+	return inflate(state, (uint8*) buffer, size);
+}
+
+const uint8*
+zstrm_rpeek(TZStrm* state, uintxx* size)
+{
+	CTB_ASSERT(state && size);
+
+	size[0] = 0;
+	if (CTB_UNLIKELY(rbegin(state) == 0)) {
+		return NULL;
+	}
+
+	if (state->target == state->tend) {
+		if (inflatenext(state) == 0) {
+			return NULL;
+		}
+	}
+	size[0] = (uintxx) (state->tend - state->target);
+	return state->target;
+}
+
+void
+zstrm_rcommit(TZStrm* state, uintxx size)
+{
+	CTB_ASSERT(state);
+
+	if (CTB_UNLIKELY(state->infltr == NULL)) {
+		SETSTATE(4);
+		if (state->error == 0) {
+			SETERROR(ZSTRM_EINCORRECTUSE);
+		}
+		return;
+	}
+
+	if (CTB_UNLIKELY(size > (uintxx) (state->tend - state->target))) {
+		size = (uintxx) (state->tend - state->target);
+	}
+	state->target += size;
+}
+
 
 CTB_INLINE void
 emittarget(struct TZStrm* state, uintxx count)
 {
 	intxx r;
 
+	if (CTB_UNLIKELY(ISASYNC(state))) {
+		state->target = state->tbgn + count;
+		adrain(state);
+		return;
+	}
+
 	if (CTB_UNLIKELY(count == 0)) {
 		return;
 	}
-	r = state->iofn(state->tbgn, count, state->payload);
+	r = callio(state, state->tbgn, count);
 	if (CTB_LIKELY(r)) {
 		if ((uintxx) r > count) {
 			SETERROR(ZSTRM_EIOERROR);
@@ -824,14 +1707,14 @@ emitzlibhead(struct TZStrm* state)
 	uintxx b;
 
 	/* compression method + log(window size) - 8 */
-	a = 0x78;
+	a = ((state->wbits - 8) << 4) | 0x08;
 	b = 0;
 	if (state->dict) {
 		b |= 1 << 5;
 	}
 
 	/* fcheck */
-	b = b + (31 - ((a << 8) | b % 31));
+	b = b + (31 - (((a << 8) | b) % 31));
 
 	emitbyte(state, (uint8) a);
 	emitbyte(state, (uint8) b);
@@ -848,19 +1731,18 @@ emitzlibhead(struct TZStrm* state)
 }
 
 
+static void flush(TZStrm* state, uintxx flush);
+
 static uintxx
 deflate(TZStrm* state, const uint8* buffer, uintxx size)
 {
 	uintxx maxrun;
-	uintxx r;
 	const uint8* bbegin;
 	uint8* source;
 	uint8* send;
-	uint8* sbgn;
 
 	source = state->source;
 	send   = state->send;
-	sbgn   = state->sbgn;
 	bbegin = buffer;
 	while (CTB_LIKELY(size)) {
 		maxrun = (uintxx) (send - source);
@@ -910,39 +1792,29 @@ deflate(TZStrm* state, const uint8* buffer, uintxx size)
 			continue;
 		}
 
-		deflator_setsrc(state->defltr, sbgn, ZIOBFFRSZ);
-
-		/* update the checksums */
-		if (CTB_LIKELY(state->docrc32))
-			state->crc32 =   crc32_update(state->crc32, sbgn, ZIOBFFRSZ);
-		if (CTB_LIKELY(state->doadler)) {
-			state->adler = adler32_update(state->adler, sbgn, ZIOBFFRSZ);
+		/* the source buffer is full */
+		state->source = source;
+		flush(state, DEFLT_NOFLUSH);
+		if (CTB_UNLIKELY(state->error)) {
+			return 0;
 		}
-		state->total += ZIOBFFRSZ;
-
-		do {
-			deflator_settgt(state->defltr, state->tbgn, ZIOBFFRSZ);
-			r = deflator_deflate(state->defltr, 0);
-
-			emittarget(state, deflator_tgtend(state->defltr));
-			if (CTB_UNLIKELY(state->error)) {
-				SETSTATE(4);
-				return 0;
-			}
-		} while (r == DEFLT_TGTEXHSTD);
 
-		source = state->sbgn;
+		source = state->source;
+		send   = state->send;
+		if (CTB_UNLIKELY(source == send)) {
+			/* async mode, the output is pending */
+			break;
+		}
 	}
 
 	state->source = source;
 	return (uintxx) (buffer - bbegin);
 }
 
-uintxx
-zstrm_w(TZStrm* state, const void* buffer, uintxx size)
+/* checks the stream mode and emits the header on the first call */
+static uintxx
+wbegin(TZStrm* state)
 {
-	CTB_ASSERT(state);
-
 	/* check the stream mode */
 	if (CTB_UNLIKELY(state->defltr == NULL)) {
 		SETSTATE(4);
@@ -953,7 +1825,7 @@ zstrm_w(TZStrm* state, const void* buffer, uintxx size)
 	}
 
 	if (CTB_LIKELY(state->state == 3)) {
-		return deflate(state, (const uint8*) buffer, size);
+		return 1;
 	}
 	if (CTB_LIKELY(state->state == 1 || state->state == 2)) {
 		if (CTB_UNLIKELY(state->iofn == NULL)) {
@@ -971,17 +1843,71 @@ zstrm_w(TZStrm* state, const void* buffer, uintxx size)
 			return 0;
 		}
 		SETSTATE(3);
-
-		return deflate(state, (const uint8*) buffer, size);
+		return 1;
 	}
 	return 0;
 }
 
+uintxx
+zstrm_w(TZStrm* state, const void* buffer, uintxx size)
+{
+	CTB_ASSERT(state);
+
+	if (CTB_UNLIKELY(wbegin(state) == 0)) {
+		return 0;
+	}
+	return deflate(state, (const uint8*) buffer, size);
+}
+
+uint8*
+zstrm_wpeek(TZStrm* state, uintxx* size)
+{
+	CTB_ASSERT(state && size);
+
+	size[0] = 0;
+	if (CTB_UNLIKELY(wbegin(state) == 0)) {
+		return NULL;
+	}
+
+	if (state->source == state->send) {
+		/* the source buffer is full */
+		flush(state, DEFLT_NOFLUSH);
+		if (CTB_UNLIKELY(state->error)) {
+			return NULL;
+		}
+	}
+	size[0] = (uintxx) (state->send - state->source);
+	return state->source;
+}
+
+void
+zstrm_wcommit(TZStrm* state, uintxx size)
+{
+	CTB_ASSERT(state);
+
+	if (CTB_UNLIKELY(state->defltr == NULL || state->state ^ 3)) {
+		SETSTATE(4);
+		if (state->error == 0) {
+			SETERROR(ZSTRM_EINCORRECTUSE);
+		}
+		return;
+	}
+
+	if (CTB_UNLIKELY(size > (uintxx) (state->send - state->source))) {
+		size = (uintxx) (state->send - state->source);
+	}
+	state->source += size;
+}
+
+static void pflush(TZStrm* state, uintxx flush);
+
+static void bgzfflush(TZStrm* state);
+
+/* passes the source buffer to the deflator */
 static void
-flush(TZStrm* state, uintxx flush)
+setdeflatorsrc(TZStrm* state)
 {
 	uintxx total;
-	uintxx r;
 
 	total = (uintxx) (state->source - state->sbgn);
 	if (total) {
@@ -989,15 +1915,37 @@ flush(TZStrm* state, uintxx flush)
 
 		/* update the checksums */
 		if (CTB_LIKELY(state->docrc32))
-			state->crc32 =   crc32_update(state->crc32, state->sbgn, total);
+			state->crc32 = checksum_crc32(state->crc32, state->sbgn, total);
 		if (CTB_LIKELY(state->doadler)) {
-			state->adler = adler32_update(state->adler, state->sbgn, total);
+			state->adler = checksum_adler32(state->adler, state->sbgn, total);
 		}
 		state->total += total;
 	}
+}
+
+static void aflush(TZStrm* state, uintxx flush);
+
+static void
+flush(TZStrm* state, uintxx flush)
+{
+	uintxx r;
+
+	if (state->pmode) {
+		pflush(state, flush);
+		return;
+	}
+	if (state->stype == ZSTRM_BGZF) {
+		bgzfflush(state);
+		return;
+	}
+	if (ISASYNC(state)) {
+		aflush(state, flush);
+		return;
+	}
 
+	setdeflatorsrc(state);
 	do {
-		deflator_settgt(state->defltr, state->tbgn, ZIOBFFRSZ);
+		deflator_settgt(state->defltr, state->tbgn, state->tbsize);
 		r = deflator_deflate(state->defltr, flush);
 
 		emittarget(state, deflator_tgtend(state->defltr));
@@ -1006,6 +1954,69 @@ flush(TZStrm* state, uintxx flush)
 			return;
 		}
 	} while (r == DEFLT_TGTEXHSTD);
+
+	state->source = state->sbgn;
+}
+
+/* continues a paused flush, returns 1 once it's done */
+static uintxx
+aresume(TZStrm* state)
+{
+	uintxx r;
+	struct TZStrmAsync* as;
+
+	as = state->async;
+	for (;;) {
+		if (adrain(state) == 0) {
+			return 0;
+		}
+		if (as->wstate == 2) {
+			break;
+		}
+
+		deflator_settgt(state->defltr, state->tbgn, state->tbsize);
+		r = deflator_deflate(state->defltr, as->flush);
+		state->target = state->tbgn + deflator_tgtend(state->defltr);
+		if (r != DEFLT_TGTEXHSTD) {
+			as->wstate = 2;
+		}
+	}
+	as->wstate = 0;
+	state->source = state->sbgn;
+
+	/* a sync point, the last buffer is done */
+	if (as->flush == DEFLT_FLUSH && as->cur != as->end) {
+		if (as->queue[as->cur & (ZASYNCBFFRS - 1)].used) {
+			as->cur++;
+		}
+	}
+	return 1;
+}
+
+/* the async mode stops when the output can't be copied, the next call with
+ * the same flush mode (or without flush) continues it */
+static void
+aflush(TZStrm* state, uintxx flush)
+{
+	struct TZStrmAsync* as;
+
+	as = state->async;
+	if (as->wstate) {
+		if (aresume(state) == 0) {
+			return;
+		}
+		if (flush == DEFLT_NOFLUSH || flush == as->flush) {
+			return;
+		}
+	}
+
+	setdeflatorsrc(state);
+	as->flush  = flush;
+	as->wstate = 1;
+
+	/* the source buffer can't take more data until it's done */
+	state->source = state->send;
+	aresume(state);
 }
 
 CTB_INLINE void
@@ -1013,7 +2024,7 @@ emitgziptail(struct TZStrm* state)
 {
 	uint32 n;
 
-	CRC32_FINALIZE(state->crc32);
+	CHECKSUM_CRC32FINALIZE(state->crc32);
 	n = state->crc32;
 	emitbyte(state, (uint8) (n >> 0x00));
 	emitbyte(state, (uint8) (n >> 0x08));
@@ -1041,6 +2052,8 @@ emitzlibtail(struct TZStrm* state)
 	emittarget(state, (uintxx) (state->target - state->tbgn));
 }
 
+static void emitbgzfeof(TZStrm* state);
+
 void
 zstrm_flush(TZStrm* state, bool final)
 {
@@ -1059,14 +2072,2497 @@ zstrm_flush(TZStrm* state, bool final)
 		if (state->error) {
 			return;
 		}
+		if (ISASYNC(state) && state->async->wstate) {
+			return;
+		}
 
 		switch (state->stype) {
 			case ZSTRM_GZIP: emitgziptail(state); break;
 			case ZSTRM_ZLIB: emitzlibtail(state); break;
+			case ZSTRM_BGZF: emitbgzfeof(state);  break;
 		}
 		SETSTATE(4);
+		if (ISASYNC(state)) {
+			adrain(state);
+		}
 		return;
 	}
 	flush(state, DEFLT_FLUSH);
 }
 
+
+
+/*
+ * One-shot mode */
+
+CTB_INLINE void
+putle32(uint8* target, uint32 n)
+{
+	target[0] = (uint8) (n >> 0x00);
+	target[1] = (uint8) (n >> 0x08);
+	target[2] = (uint8) (n >> 0x10);
+	target[3] = (uint8) (n >> 0x18);
+}
+
+CTB_INLINE void
+putbe32(uint8* target, uint32 n)
+{
+	target[0] = (uint8) (n >> 0x18);
+	target[1] = (uint8) (n >> 0x10);
+	target[2] = (uint8) (n >> 0x08);
+	target[3] = (uint8) (n >> 0x00);
+}
+
+uintxx
+zstrm_bound(TZStrm* state, uintxx size)
+{
+	CTB_ASSERT(state);
+
+	if (state->stype == ZSTRM_BGZF) {
+		/* each block can be stored, plus the end of file block */
+		return size + (size / ZBGZFBLOCKSZ + 1) * (18 + 5 + 8) + 28;
+	}
+
+	/* gzip uses the largest header and tail (10 + 8) */
+	return deflator_bound(state->defltr, size) + 18;
+}
+
+static uintxx bgzfcompressbuffer(TZStrm* state, const uint8* source,
+	uintxx ssize, uint8* target, uintxx tsize);
+
+uintxx
+zstrm_compressbuffer(TZStrm* state, const uint8* source, uintxx ssize,
+	uint8* target, uintxx tsize)
+{
+	uintxx hsize;
+	uintxx tlsize;
+	uintxx total;
+	uint32 n;
+	eDEFLTResult r;
+	CTB_ASSERT(state);
+
+	if (CTB_UNLIKELY(state->defltr == NULL)) {
+		SETERROR(ZSTRM_EINCORRECTUSE);
+		SETSTATE(4);
+		return 0;
+	}
+	state->error = 0;
+
+	if (state->stype == ZSTRM_BGZF) {
+		return bgzfcompressbuffer(state, source, ssize, target, tsize);
+	}
+
+	hsize  = 0;
+	tlsize = 0;
+	switch (state->stype) {
+		case ZSTRM_GZIP: hsize = 10; tlsize = 8; break;
+		case ZSTRM_ZLIB: hsize =  2; tlsize = 4; break;
+	}
+	if (tsize < hsize + tlsize) {
+		SETERROR(ZSTRM_EBUFFERFULL);
+		SETSTATE(4);
+		return 0;
+	}
+
+	r = deflator_compressbuffer(state->defltr, source, ssize, target + hsize,
+		tsize - (hsize + tlsize));
+	if (r != DEFLT_OK) {
+		if (r == DEFLT_TGTEXHSTD) {
+			SETERROR(ZSTRM_EBUFFERFULL);
+		}
+		else {
+			SETERROR(ZSTRM_EDEFLATE);
+		}
+		SETSTATE(4);
+		return 0;
+	}
+	total = hsize + deflator_tgtend(state->defltr);
+
+	switch (state->stype) {
+		case ZSTRM_GZIP: {
+			target[0] = 0x1f;
+			target[1] = 0x8b;
+			target[2] = 0x08;
+			putle32(target + 3, 0);
+			target[7] = 0x00;
+			target[8] = 0x00;
+			target[9] = 0x00;
+
+			n = checksum_crc32(CHECKSUM_CRC32INIT, source, ssize);
+			CHECKSUM_CRC32FINALIZE(n);
+			putle32(target + total + 0, n);
+			putle32(target + total + 4, (uint32) ssize);
+			break;
+		}
+
+		case ZSTRM_ZLIB: {
+			/* compression method + log(window size) - 8, and fcheck */
+			n = (uint32) (((state->wbits - 8) << 4) | 0x08);
+			target[0] = (uint8) n;
+			target[1] = (uint8) (31 - ((n << 8) % 31));
+
+			n = checksum_adler32(CHECKSUM_ADLERINIT, source, ssize);
+			putbe32(target + total, n);
+			break;
+		}
+	}
+	SETSTATE(4);
+	return total + tlsize;
+}
+
+static intxx
+noinput(uint8* buffer, uintxx size, void* payload)
+{
+	(void) buffer;
+	(void) size;
+	(void) payload;
+	return 0;
+}
+
+uintxx
+zstrm_decompressbuffer(TZStrm* state, const uint8* source, uintxx ssize,
+	uint8* target, uintxx tsize)
+{
+	uintxx total;
+	eINFLTResult r;
+	CTB_ASSERT(state);
+
+	if (CTB_UNLIKELY(state->infltr == NULL)) {
+		SETERROR(ZSTRM_EINCORRECTUSE);
+		SETSTATE(4);
+		return 0;
+	}
+	zstrm_reset(state);
+
+	/* the header and the tail are read from the source buffer directly */
+	state->iofn   = noinput;
+	state->source = (uint8*) source;
+	state->send   = (uint8*) source + ssize;
+	total = 0;
+	if (parsehead(state) == 0) {
+		goto L_DONE;
+	}
+	if (state->state == 2) {
+		SETERROR(ZSTRM_EMISSINGDICT);
+		goto L_DONE;
+	}
+
+	for (;;) {
+		uintxx n;
+
+		r = inflator_decompressbuffer(state->infltr, state->source,
+			(uintxx) (state->send - state->source), target + total,
+			tsize - total);
+		if (r != INFLT_OK) {
+			if (r == INFLT_TGTEXHSTD) {
+				SETERROR(ZSTRM_EBUFFERFULL);
+			}
+			else {
+				SETERROR(ZSTRM_EDEFLATE);
+			}
+			goto L_DONE;
+		}
+		state->source += inflator_srcend(state->infltr);
+		n = inflator_tgtend(state->infltr);
+
+		if (state->docrc32) {
+			state->crc32 = checksum_crc32(state->crc32, target + total, n);
+			CHECKSUM_CRC32FINALIZE(state->crc32);
+		}
+		if (state->doadler)
+			state->adler = checksum_adler32(state->adler, target + total, n);
+		state->total = n;
+		total += n;
+
+		switch (state->stype) {
+			case ZSTRM_GZIP:
+				checkgziptail(state);
+				break;
+			case ZSTRM_ZLIB:
+				checkzlibtail(state);
+				break;
+		}
+		if (state->error || state->stype != ZSTRM_GZIP) {
+			break;
+		}
+
+		/* next member */
+		if (state->source == state->send || state->source[0] != 0x1f) {
+			break;
+		}
+		if (parsegziphead(state) == 0) {
+			break;
+		}
+		state->crc32 = CHECKSUM_CRC32INIT;
+		state->member++;
+	}
+
+L_DONE:
+	state->iofn   = NULL;
+	state->source = state->sbgn;
+	state->send   = state->sbgn;
+	SETSTATE(4);
+	if (state->error) {
+		return 0;
+	}
+	return total;
+}
+
+
+/*
+ * Random access index */
+
+#define ZIWNDWSZ 32768
+
+/* default span */
+#define ZISPAN 0x00100000L
+
+/* serialized sizes of the header and of each checkpoint */
+#define ZIHEADSZ  32
+#define ZIENTRYSZ 28
+
+CTB_INLINE void*
+ireserve(struct TZStrmIndex* p, uintxx amount)
+{
+	if (p->allocator) {
+		return p->allocator->reserve(p->allocator->user, amount);
+	}
+	return CTB_RESERVE(amount);
+}
+
+CTB_INLINE void
+irelease(struct TZStrmIndex* p, void* memory)
+{
+	if (p->allocator) {
+		p->allocator->release(p->allocator->user, memory);
+		return;
+	}
+	CTB_RELEASE(memory);
+}
+
+TZStrmIndex*
+zstrm_indexcreate(uintxx span, TAllocator* allocator)
+{
+	struct TZStrmIndex* index;
+
+	if (allocator) {
+		index = allocator->reserve(allocator->user, sizeof(struct TZStrmIndex));
+	}
+	else {
+		index = CTB_RESERVE(sizeof(struct TZStrmIndex));
+	}
+	if (index == NULL) {
+		return NULL;
+	}
+	index->allocator = allocator;
+
+	if (span == 0) {
+		span = ZISPAN;
+	}
+	index->stype = 0;
+	index->span  = span;
+	index->total = 0;
+
+	index->count    = 0;
+	index->capacity = 0;
+	index->entries  = NULL;
+
+	index->last   = 0;
+	index->wcount = 0;
+	index->wend   = 0;
+	index->window = NULL;
+	return index;
+}
+
+static void
+iclear(struct TZStrmIndex* index)
+{
+	uintxx i;
+
+	for (i = 0; i < index->count; i++) {
+		if (index->entries[i].window) {
+			irelease(index, index->entries[i].window);
+		}
+	}
+	index->count = 0;
+	index->total = 0;
+
+	index->last   = 0;
+	index->wcount = 0;
+	index->wend   = 0;
+}
+
+void
+zstrm_indexdestroy(TZStrmIndex* index)
+{
+	if (index == NULL) {
+		return;
+	}
+
+	iclear(index);
+	if (index->entries) {
+		irelease(index, index->entries);
+	}
+	if (index->window) {
+		irelease(index, index->window);
+	}
+	irelease(index, index);
+}
+
+/* appends an empty checkpoint */
+static struct TZStrmIndexEntry*
+inewentry(struct TZStrmIndex* index)
+{
+	struct TZStrmIndexEntry* entry;
+
+	if (index->count == index->capacity) {
+		struct TZStrmIndexEntry* entries;
+		uintxx capacity;
+
+		capacity = 16;
+		if (index->capacity) {
+			capacity = index->capacity << 1;
+		}
+		entries = ireserve(index, capacity * sizeof(struct TZStrmIndexEntry));
+		if (entries == NULL) {
+			return NULL;
+		}
+		if (index->entries) {
+			ctb_memcpy(entries, index->entries,
+				index->count * sizeof(struct TZStrmIndexEntry));
+			irelease(index, index->entries);
+		}
+		index->entries  = entries;
+		index->capacity = capacity;
+	}
+
+	entry = index->entries + index->count++;
+	entry->coffset = 0;
+	entry->uoffset = 0;
+	entry->bits  = 0;
+	entry->value = 0;
+	entry->wsize  = 0;
+	entry->window = NULL;
+	return entry;
+}
+
+/* adds a checkpoint with the current window */
+static bool
+iaddentry(struct TZStrmIndex* index, uint64 coffset, uintxx bits,
+	uint32 value)
+{
+	struct TZStrmIndexEntry* entry;
+
+	entry = inewentry(index);
+	if (entry == NULL) {
+		return 0;
+	}
+
+	if (index->wcount) {
+		uintxx n;
+
+		entry->window = ireserve(index, index->wcount);
+		if (entry->window == NULL) {
+			return 0;
+		}
+
+		/* once the window is full the oldest byte is at wend */
+		if (index->wcount == ZIWNDWSZ) {
+			n = ZIWNDWSZ - index->wend;
+			ctb_memcpy(entry->window, index->window + index->wend, n);
+			ctb_memcpy(entry->window + n, index->window, index->wend);
+		}
+		else {
+			ctb_memcpy(entry->window, index->window, index->wcount);
+		}
+		entry->wsize = index->wcount;
+	}
+	entry->coffset = coffset;
+	entry->uoffset = index->total;
+	entry->bits  = bits;
+	entry->value = value;
+
+	index->last = index->total;
+	return 1;
+}
+
+static void
+iupdatewindow(struct TZStrmIndex* index, const uint8* data, uintxx size)
+{
+	uintxx maxrun;
+
+	if (size >= ZIWNDWSZ) {
+		ctb_memcpy(index->window, data + size - ZIWNDWSZ, ZIWNDWSZ);
+		index->wcount = ZIWNDWSZ;
+		index->wend   = 0;
+		return;
+	}
+
+	maxrun = ZIWNDWSZ - index->wend;
+	if (maxrun > size)
+		maxrun = size;
+	ctb_memcpy(index->window + index->wend, data, maxrun);
+	if (size - maxrun) {
+		ctb_memcpy(index->window, data + maxrun, size - maxrun);
+		index->wend = size - maxrun;
+	}
+	else {
+		index->wend += maxrun;
+		if (index->wend == ZIWNDWSZ)
+			index->wend = 0;
+	}
+
+	index->wcount += size;
+	if (index->wcount > ZIWNDWSZ)
+		index->wcount = ZIWNDWSZ;
+}
+
+/* called for each decoded run while the index is attached */
+static bool
+indexupdate(struct TZStrm* state, uintxx n)
+{
+	struct TZStrmIndex* index;
+	uintxx bits;
+	uintxx value;
+	uint64 coffset;
+
+	index = state->index;
+	if (n) {
+		iupdatewindow(index, state->tbgn, n);
+		index->total += n;
+	}
+
+	if (state->result != INFLT_BLOCKEND) {
+		return 1;
+	}
+	state->result = INFLT_TGTEXHSTD;
+
+	if (index->total - index->last < index->span) {
+		return 1;
+	}
+	bits = inflator_getbits(state->infltr, &value);
+	coffset = state->sbase + (uintxx) (state->infltr->source - state->sbgn);
+	return iaddentry(index, coffset, bits, (uint32) value);
+}
+
+void
+zstrm_setindex(TZStrm* state, TZStrmIndex* index)
+{
+	CTB_ASSERT(state && index);
+
+	if (state->defltr) {
+		/* one checkpoint per block (at most), without window */
+		if (state->stype == ZSTRM_BGZF && state->state == 1) {
+			iclear(index);
+			index->stype = ZSTRM_GZIP;
+			state->index = index;
+			return;
+		}
+	}
+
+	if (state->infltr == NULL || state->pmode || state->state != 1 ||
+		state->rahead || ISASYNC(state)) {
+		SETSTATE(4);
+		if (state->error == 0) {
+			SETERROR(ZSTRM_EINCORRECTUSE);
+		}
+		return;
+	}
+
+	if (index->window == NULL) {
+		index->window = ireserve(index, ZIWNDWSZ);
+		if (index->window == NULL) {
+			SETERROR(ZSTRM_EOOM);
+			SETSTATE(4);
+			return;
+		}
+	}
+	iclear(index);
+
+	if (parsehead(state) == 0) {
+		SETSTATE(4);
+		return;
+	}
+	if (state->state == 2) {
+		/* streams with a dictionary are not supported */
+		SETERROR(ZSTRM_EFORMAT);
+		SETSTATE(4);
+		return;
+	}
+	SETSTATE(3);
+
+	/* first checkpoint, right after the header */
+	index->stype = state->stype;
+	if (iaddentry(index, state->sbase + (uintxx) (state->source - state->sbgn),
+		0, 0) == 0) {
+		SETERROR(ZSTRM_EOOM);
+		SETSTATE(4);
+		return;
+	}
+	state->index = index;
+}
+
+/* decodes and discards the next size bytes */
+static void
+skipdata(struct TZStrm* state, uint64 size)
+{
+	uintxx n;
+
+	while (size) {
+		if (state->target == state->tend) {
+			if (inflatenext(state) == 0) {
+				break;
+			}
+		}
+
+		n = (uintxx) (state->tend - state->target);
+		if (n > size)
+			n = (uintxx) size;
+		state->target += n;
+		size -= n;
+	}
+}
+
+bool
+zstrm_seek(TZStrm* state, const TZStrmIndex* index, uint64 offset,
+	TZStrmSeekFn fn)
+{
+	const struct TZStrmIndexEntry* entry;
+	uintxx lo;
+	uintxx hi;
+	CTB_ASSERT(state && index && fn);
+
+	if (state->infltr == NULL || state->pmode || state->state == 0 ||
+		state->rahead || ISASYNC(state)) {
+		SETSTATE(4);
+		if (state->error == 0) {
+			SETERROR(ZSTRM_EINCORRECTUSE);
+		}
+		return 0;
+	}
+	state->index = NULL;
+	state->error = 0;
+	if (index->count == 0) {
+		SETERROR(ZSTRM_EINCORRECTUSE);
+		SETSTATE(4);
+		return 0;
+	}
+
+	/* the last checkpoint at or before the offset */
+	lo = 0;
+	hi = index->count;
+	while (hi - lo > 1) {
+		uintxx m;
+
+		m = (lo + hi) >> 1;
+		if (index->entries[m].uoffset <= offset) {
+			lo = m;
+		}
+		else {
+			hi = m;
+		}
+	}
+	entry = index->entries + lo;
+
+	if (fn(entry->coffset, state->payload)) {
+		SETERROR(ZSTRM_EIOERROR);
+		SETSTATE(4);
+		return 0;
+	}
+
+	inflator_reset(state->infltr);
+	if (entry->wsize) {
+		inflator_setdctnr(state->infltr, entry->window, entry->wsize);
+	}
+	inflator_setbits(state->infltr, entry->bits, entry->value);
+	if (state->infltr->error) {
+		SETERROR(ZSTRM_EDEFLATE);
+		SETSTATE(4);
+		return 0;
+	}
+
+	/* the checksums can't be verified from here */
+	state->stype   = index->stype;
+	state->docrc32 = 0;
+	state->doadler = 0;
+	state->dict    = 0;
+	state->total   = (uintxx) entry->uoffset;
+
+	state->result = INFLT_SRCEXHSTD;
+	state->sbase  = entry->coffset;
+	state->source = state->sbgn;
+	state->send   = state->sbgn;
+	state->target = state->tbgn;
+	state->tend   = state->tbgn;
+	SETSTATE(3);
+
+	skipdata(state, offset - entry->uoffset);
+	return state->error == 0;
+}
+
+CTB_INLINE void
+putle64(uint8* target, uint64 n)
+{
+	putle32(target + 0, (uint32) (n >> 0x00));
+	putle32(target + 4, (uint32) (n >> 0x20));
+}
+
+CTB_INLINE uint32
+getle32(const uint8* source)
+{
+	return ((uint32) source[0] << 0x00) | ((uint32) source[1] << 0x08) |
+	       ((uint32) source[2] << 0x10) | ((uint32) source[3] << 0x18);
+}
+
+CTB_INLINE uint64
+getle64(const uint8* source)
+{
+	return getle32(source) | ((uint64) getle32(source + 4) << 0x20);
+}
+
+static bool
+iwrite(TZStrmIOFn fn, void* payload, uint8* buffer, uintxx size)
+{
+	intxx r;
+
+	r = fn(buffer, size, payload);
+	if (r < 0 || (uintxx) r != size) {
+		return 0;
+	}
+	return 1;
+}
+
+static bool
+iread(TZStrmIOFn fn, void* payload, uint8* buffer, uintxx size)
+{
+	intxx r;
+
+	while (size) {
+		r = fn(buffer, size, payload);
+		if (r <= 0 || (uintxx) r > size) {
+			return 0;
+		}
+		buffer += r;
+		size   -= r;
+	}
+	return 1;
+}
+
+/*
+ * Format (little endian):
+ * header: "JDZI", version (1), stream type, 2 reserved bytes, span (8),
+ * checkpoints (8), uncompressed size (8).
+ * checkpoint: compressed offset (8), uncompressed offset (8), bit count (1),
+ * bits (3), window size (4), compressed window size (4), and the window as a
+ * raw deflate stream. */
+
+bool
+zstrm_indexsave(TZStrmIndex* index, TZStrmIOFn fn, void* payload)
+{
+	uintxx i;
+	uintxx csize;
+	uintxx bsize;
+	uint8* buffer;
+	struct TDeflator* defltr;
+	CTB_ASSERT(index && fn);
+
+	bsize  = ZIENTRYSZ + deflator_bound(NULL, ZIWNDWSZ);
+	buffer = ireserve(index, bsize);
+	defltr = deflator_create(6, index->allocator);
+	if (buffer == NULL || defltr == NULL) {
+		goto L_ERROR;
+	}
+
+	buffer[0] = 'J';
+	buffer[1] = 'D';
+	buffer[2] = 'Z';
+	buffer[3] = 'I';
+	buffer[4] = 1;
+	buffer[5] = (uint8) index->stype;
+	buffer[6] = 0;
+	buffer[7] = 0;
+	putle64(buffer +  8, index->span);
+	putle64(buffer + 16, index->count);
+	putle64(buffer + 24, index->total);
+	if (iwrite(fn, payload, buffer, ZIHEADSZ) == 0) {
+		goto L_ERROR;
+	}
+
+	for (i = 0; i < index->count; i++) {
+		struct TZStrmIndexEntry* entry;
+
+		entry = index->entries + i;
+		csize = 0;
+		if (entry->wsize) {
+			if (deflator_compressbuffer(defltr, entry->window, entry->wsize,
+				buffer + ZIENTRYSZ, bsize - ZIENTRYSZ) != DEFLT_OK) {
+				goto L_ERROR;
+			}
+			csize = deflator_tgtend(defltr);
+		}
+
+		putle64(buffer + 0, entry->coffset);
+		putle64(buffer + 8, entry->uoffset);
+		putle32(buffer + 16, (entry->value << 8) | (uint32) entry->bits);
+		putle32(buffer + 20, (uint32) entry->wsize);
+		putle32(buffer + 24, (uint32) csize);
+		if (iwrite(fn, payload, buffer, ZIENTRYSZ + csize) == 0) {
+			goto L_ERROR;
+		}
+	}
+
+	deflator_destroy(defltr);
+	irelease(index, buffer);
+	return 1;
+
+L_ERROR:
+	if (defltr) {
+		deflator_destroy(defltr);
+	}
+	if (buffer) {
+		irelease(index, buffer);
+	}
+	return 0;
+}
+
+TZStrmIndex*
+zstrm_indexload(TZStrmIOFn fn, void* payload, TAllocator* allocator)
+{
+	uint64 i;
+	uint64 span;
+	uint64 count;
+	uint64 last;
+	uintxx bsize;
+	uint8* buffer;
+	struct TZStrmIndex* index;
+	struct TInflator* infltr;
+	uint8 head[ZIHEADSZ];
+	CTB_ASSERT(fn);
+
+	if (iread(fn, payload, head, ZIHEADSZ) == 0) {
+		return NULL;
+	}
+	if (head[0] != 'J' || head[1] != 'D' || head[2] != 'Z' || head[3] != 'I') {
+		return NULL;
+	}
+	if (head[4] != 1) {
+		return NULL;
+	}
+	switch (head[5]) {
+		case ZSTRM_DFLT:
+		case ZSTRM_ZLIB:
+		case ZSTRM_GZIP:
+			break;
+		default:
+			return NULL;
+	}
+	span = getle64(head + 8);
+	if (span == 0 || (uintxx) span != span) {
+		return NULL;
+	}
+
+	index = zstrm_indexcreate((uintxx) span, allocator);
+	if (index == NULL) {
+		return NULL;
+	}
+	index->stype = head[5];
+	index->total = getle64(head + 24);
+	count = getle64(head + 16);
+
+	bsize  = deflator_bound(NULL, ZIWNDWSZ);
+	buffer = ireserve(index, bsize);
+	infltr = inflator_create(allocator);
+	if (buffer == NULL || infltr == NULL) {
+		goto L_ERROR;
+	}
+
+	last = 0;
+	for (i = 0; i < count; i++) {
+		struct TZStrmIndexEntry* entry;
+		uint8 info[ZIENTRYSZ];
+		uint32 wsize;
+		uint32 csize;
+
+		if (iread(fn, payload, info, ZIENTRYSZ) == 0) {
+			goto L_ERROR;
+		}
+		wsize = getle32(info + 20);
+		csize = getle32(info + 24);
+		if (wsize > ZIWNDWSZ || csize > bsize || (wsize == 0) != (csize == 0)) {
+			goto L_ERROR;
+		}
+		if (info[16] > 24 || getle64(info + 8) < last) {
+			goto L_ERROR;
+		}
+
+		entry = inewentry(index);
+		if (entry == NULL) {
+			goto L_ERROR;
+		}
+		entry->coffset = getle64(info + 0);
+		entry->uoffset = last = getle64(info + 8);
+		entry->bits  = info[16];
+		entry->value = getle32(info + 16) >> 8;
+
+		if (wsize) {
+			entry->window = ireserve(index, wsize);
+			if (entry->window == NULL) {
+				goto L_ERROR;
+			}
+			entry->wsize = wsize;
+
+			if (iread(fn, payload, buffer, csize) == 0) {
+				goto L_ERROR;
+			}
+			if (inflator_decompressbuffer(infltr, buffer, csize, entry->window,
+				wsize) != INFLT_OK || inflator_tgtend(infltr) != wsize) {
+				goto L_ERROR;
+			}
+		}
+	}
+
+	inflator_destroy(infltr);
+	irelease(index, buffer);
+	return index;
+
+L_ERROR:
+	if (infltr) {
+		inflator_destroy(infltr);
+	}
+	if (buffer) {
+		irelease(index, buffer);
+	}
+	zstrm_indexdestroy(index);
+	return NULL;
+}
+
+
+/*
+ * BGZF */
+
+/* header, stored block header and tail sizes */
+#define ZBGZFHEADSZ 18
+#define ZBGZFSTRDSZ 5
+#define ZBGZFTAILSZ 8
+
+static void
+putbgzfhead(uint8* target, uintxx bsize)
+{
+	target[0] = 0x1f;
+	target[1] = 0x8b;
+	target[2] = 0x08;
+	target[3] = 0x04;  /* extra field */
+	putle32(target + 4, 0);
+	target[8] = 0x00;
+	target[9] = 0xff;
+
+	/* extra length and BC subfield with the block size - 1 */
+	target[10] = 0x06;
+	target[11] = 0x00;
+	target[12] = 0x42;
+	target[13] = 0x43;
+	target[14] = 0x02;
+	target[15] = 0x00;
+	target[16] = (uint8) ((bsize - 1) >> 0x00);
+	target[17] = (uint8) ((bsize - 1) >> 0x08);
+}
+
+/* for data that doesn't fit in a block when compressed */
+static void
+putstoredhead(uint8* target, uintxx size)
+{
+	target[0] = 0x01;
+	target[1] = (uint8) ( size >> 0x00);
+	target[2] = (uint8) ( size >> 0x08);
+	target[3] = (uint8) (~size >> 0x00);
+	target[4] = (uint8) (~size >> 0x08);
+}
+
+CTB_INLINE bool
+writeall(struct TZStrm* state, const uint8* buffer, uintxx size)
+{
+	intxx r;
+
+	if (size == 0) {
+		return 1;
+	}
+	r = callio(state, (uint8*) buffer, size);
+	if (r < 0 || (uintxx) r != size) {
+		return 0;
+	}
+	return 1;
+}
+
+/* emits a block, the data is stored if cdata is NULL */
+static void
+emitbgzfblock(struct TZStrm* state, const uint8* cdata, uintxx csize,
+	const uint8* source, uintxx ssize, uint32 crc32)
+{
+	uintxx hsize;
+	uintxx bsize;
+	uint8 head[ZBGZFHEADSZ + ZBGZFSTRDSZ];
+	uint8 tail[ZBGZFTAILSZ];
+
+	hsize = ZBGZFHEADSZ;
+	if (cdata == NULL) {
+		putstoredhead(head + hsize, ssize);
+		hsize += ZBGZFSTRDSZ;
+
+		cdata = source;
+		csize = ssize;
+	}
+	bsize = hsize + csize + ZBGZFTAILSZ;
+	putbgzfhead(head, bsize);
+	putle32(tail + 0, crc32);
+	putle32(tail + 4, (uint32) ssize);
+
+	if (state->index && ssize) {
+		struct TZStrmIndex* index;
+
+		index = state->index;
+		if (index->count == 0 || index->total - index->last >= index->span) {
+			if (iaddentry(index, state->sbase + ZBGZFHEADSZ, 0, 0) == 0) {
+				SETERROR(ZSTRM_EOOM);
+				SETSTATE(4);
+				return;
+			}
+		}
+		index->total += ssize;
+	}
+
+	if (writeall(state, head, hsize)  == 0 ||
+	    writeall(state, cdata, csize) == 0 ||
+	    writeall(state, tail, ZBGZFTAILSZ) == 0) {
+		SETERROR(ZSTRM_EIOERROR);
+		SETSTATE(4);
+		return;
+	}
+	state->sbase += bsize;
+}
+
+static void
+bgzfflush(TZStrm* state)
+{
+	uintxx total;
+	uint32 crc32;
+	eDEFLTResult r;
+
+	total = (uintxx) (state->source - state->sbgn);
+	if (total == 0) {
+		return;
+	}
+
+	crc32 = checksum_crc32(CHECKSUM_CRC32INIT, state->sbgn, total);
+	CHECKSUM_CRC32FINALIZE(crc32);
+
+	/* the data is stored if it doesn't shrink */
+	r = deflator_compressbuffer(state->defltr, state->sbgn, total,
+		state->tbgn, total + ZBGZFSTRDSZ);
+	switch (r) {
+		case DEFLT_OK:
+			emitbgzfblock(state, state->tbgn, deflator_tgtend(state->defltr),
+				state->sbgn, total, crc32);
+			break;
+		case DEFLT_TGTEXHSTD:
+			emitbgzfblock(state, NULL, 0, state->sbgn, total, crc32);
+			break;
+		default:
+			SETERROR(ZSTRM_EDEFLATE);
+			SETSTATE(4);
+			return;
+	}
+	state->total += total;
+	state->source = state->sbgn;
+}
+
+static void
+emitbgzfeof(TZStrm* state)
+{
+	static const uint8 empty[] = {0x03, 0x00};
+
+	emitbgzfblock(state, empty, sizeof(empty), NULL, 0, 0);
+}
+
+static uintxx
+bgzfcompressbuffer(TZStrm* state, const uint8* source, uintxx ssize,
+	uint8* target, uintxx tsize)
+{
+	uintxx total;
+	uintxx offset;
+	uintxx n;
+	uintxx space;
+	uintxx csize;
+	uint32 crc32;
+	eDEFLTResult r;
+
+	total = 0;
+	for (offset = 0; offset < ssize; offset += n) {
+		uint8* block;
+
+		n = ssize - offset;
+		if (n > ZBGZFBLOCKSZ)
+			n = ZBGZFBLOCKSZ;
+
+		block = target + total;
+		space = tsize - total;
+		if (space < ZBGZFHEADSZ + ZBGZFTAILSZ) {
+			goto L_FULL;
+		}
+		space -= ZBGZFHEADSZ + ZBGZFTAILSZ;
+
+		/* no larger than the stored data */
+		if (space > n + ZBGZFSTRDSZ) {
+			space = n + ZBGZFSTRDSZ;
+		}
+
+		r = deflator_compressbuffer(state->defltr, source + offset, n,
+			block + ZBGZFHEADSZ, space);
+		if (r == DEFLT_OK) {
+			csize = deflator_tgtend(state->defltr);
+		}
+		else {
+			if (r != DEFLT_TGTEXHSTD) {
+				SETERROR(ZSTRM_EDEFLATE);
+				SETSTATE(4);
+				return 0;
+			}
+			if (space < n + ZBGZFSTRDSZ) {
+				goto L_FULL;
+			}
+			putstoredhead(block + ZBGZFHEADSZ, n);
+			ctb_memcpy(block + ZBGZFHEADSZ + ZBGZFSTRDSZ, source + offset, n);
+			csize = n + ZBGZFSTRDSZ;
+		}
+		putbgzfhead(block, ZBGZFHEADSZ + csize + ZBGZFTAILSZ);
+
+		crc32 = checksum_crc32(CHECKSUM_CRC32INIT, source + offset, n);
+		CHECKSUM_CRC32FINALIZE(crc32);
+		putle32(block + ZBGZFHEADSZ + csize + 0, crc32);
+		putle32(block + ZBGZFHEADSZ + csize + 4, (uint32) n);
+		total += ZBGZFHEADSZ + csize + ZBGZFTAILSZ;
+	}
+
+	/* end of file block */
+	if (tsize - total < ZBGZFHEADSZ + 2 + ZBGZFTAILSZ) {
+		goto L_FULL;
+	}
+	putbgzfhead(target + total, ZBGZFHEADSZ + 2 + ZBGZFTAILSZ);
+	target[total + ZBGZFHEADSZ + 0] = 0x03;
+	target[total + ZBGZFHEADSZ + 1] = 0x00;
+	putle32(target + total + ZBGZFHEADSZ + 2, 0);
+	putle32(target + total + ZBGZFHEADSZ + 6, 0);
+	total += ZBGZFHEADSZ + 2 + ZBGZFTAILSZ;
+
+	SETSTATE(4);
+	return total;
+
+L_FULL:
+	SETERROR(ZSTRM_EBUFFERFULL);
+	SETSTATE(4);
+	return 0;
+}
+
+uint64
+zstrm_getvoffset(TZStrm* state)
+{
+	CTB_ASSERT(state);
+
+	if (state->infltr == NULL || state->pmode) {
+		return 0;
+	}
+	return (state->mbase << 16) |
+		(uint64) (state->total - (uintxx) (state->tend - state->target));
+}
+
+bool
+zstrm_seekvoffset(TZStrm* state, uint64 voffset, TZStrmSeekFn fn)
+{
+	uint64 coffset;
+	CTB_ASSERT(state && fn);
+
+	if (state->infltr == NULL || state->pmode || state->state == 0 ||
+		state->rahead || ISASYNC(state)) {
+		SETSTATE(4);
+		if (state->error == 0) {
+			SETERROR(ZSTRM_EINCORRECTUSE);
+		}
+		return 0;
+	}
+	state->index = NULL;
+	state->error = 0;
+
+	coffset = voffset >> 16;
+	if (fn(coffset, state->payload)) {
+		SETERROR(ZSTRM_EIOERROR);
+		SETSTATE(4);
+		return 0;
+	}
+
+	state->stype  = ZSTRM_GZIP;
+	state->sbase  = coffset;
+	state->source = state->sbgn;
+	state->send   = state->sbgn;
+	state->target = state->tbgn;
+	state->tend   = state->tbgn;
+	if (nextmember(state) == 0) {
+		if (state->error == 0) {
+			SETERROR(ZSTRM_EBADDATA);
+		}
+		SETSTATE(4);
+		return 0;
+	}
+	SETSTATE(3);
+
+	skipdata(state, voffset & 0xffff);
+	return state->error == 0;
+}
+
+
+/*
+ * Read-ahead mode */
+
+static void
+releaserahead(TZStrm* state)
+{
+	struct TZStrmRAhead* rahead;
+
+	rahead = state->rahead;
+	if (rahead->sspare) {
+		_release(state, rahead->sspare);
+	}
+	if (rahead->tspare) {
+		_release(state, rahead->tspare);
+	}
+	_release(state, rahead);
+	state->rahead = NULL;
+}
+
+static void
+resetrahead(TZStrm* state)
+{
+	struct TZStrmRAhead* rahead;
+
+	rahead = state->rahead;
+	rahead->sready = 0;
+	rahead->eof    = 0;
+	rahead->csize  = 0;
+}
+
+void
+zstrm_setreadahead(TZStrm* state, bool enable, TZStrmTaskFn fn,
+	void* payload)
+{
+	uintxx i;
+	struct TZStrmRAhead* rahead;
+	CTB_ASSERT(state);
+
+	if (state->state || state->infltr == NULL || state->pmode) {
+		SETSTATE(4);
+		if (state->error == 0) {
+			SETERROR(ZSTRM_EINCORRECTUSE);
+		}
+		return;
+	}
+
+	if (state->rahead) {
+		releaserahead(state);
+	}
+	if (enable == 0) {
+		return;
+	}
+
+	rahead = _reserve(state, sizeof(struct TZStrmRAhead));
+	if (rahead == NULL) {
+		goto L_ERROR;
+	}
+	state->rahead = rahead;
+
+	rahead->taskfn  = fn;
+	rahead->payload = payload;
+	rahead->sspare = _reserve(state, state->sbsize);
+	rahead->tspare = _reserve(state, state->tbsize);
+	if (rahead->sspare == NULL || rahead->tspare == NULL) {
+		goto L_ERROR;
+	}
+
+	for (i = 0; i < 3; i++) {
+		rahead->jobs[i].owner = state;
+	}
+	resetrahead(state);
+	return;
+
+L_ERROR:
+	if (state->rahead) {
+		releaserahead(state);
+	}
+	SETERROR(ZSTRM_EOOM);
+	SETSTATE(4);
+}
+
+static void
+runrajob(void* payload)
+{
+	struct TZStrmRAJob* job;
+	struct TZStrmRAhead* rahead;
+	struct TZStrm* state;
+
+	job = payload;
+	state  = job->owner;
+	rahead = state->rahead;
+	switch (job->kind) {
+		case ZRADECODE:
+			inflator_settgt(state->infltr, state->tbgn, state->tbsize);
+			state->result = inflator_inflate(state->infltr, 0);
+			break;
+
+		case ZRAREAD:
+			rahead->sresult = callio(state, rahead->sspare, state->sbsize);
+			rahead->sready  = 1;
+			break;
+
+		case ZRACHECKSUM:
+			if (CTB_LIKELY(state->docrc32)) {
+				state->crc32 = checksum_crc32(
+					state->crc32, rahead->cbuffer, rahead->csize);
+			}
+			if (CTB_LIKELY(state->doadler)) {
+				state->adler = checksum_adler32(
+					state->adler, rahead->cbuffer, rahead->csize);
+			}
+			rahead->csize = 0;
+			break;
+	}
+}
+
+/* uses the source buffer read ahead (see readsource) */
+static uintxx
+raswap(struct TZStrm* state)
+{
+	uint8* buffer;
+	intxx r;
+	struct TZStrmRAhead* rahead;
+
+	rahead = state->rahead;
+	rahead->sready = 0;
+
+	r = rahead->sresult;
+	if (r == 0) {
+		rahead->eof = 1;
+		return 0;
+	}
+	if ((uintxx) r > state->sbsize) {
+		SETERROR(ZSTRM_EIOERROR);
+		return 0;
+	}
+
+	buffer = state->sbgn;
+	state->sbase += (uintxx) (state->send - state->sbgn);
+	state->sbgn   = rahead->sspare;
+	state->source = state->sbgn;
+	state->send   = state->sbgn + r;
+	rahead->sspare = buffer;
+	return (uintxx) r;
+}
+
+/* decodes the next chunk into the spare target buffer while the next source
+ * buffer is read and the checksums of the previous chunk are computed,
+ * returns the size of the chunk */
+static uintxx
+raround(struct TZStrm* state)
+{
+	uint8* buffer;
+	uintxx i;
+	uintxx n;
+	struct TZStrmRAhead* rahead;
+
+	rahead = state->rahead;
+
+	/* the previous chunk stays in the spare buffer */
+	buffer = state->tbgn;
+	state->tbgn    = rahead->tspare;
+	rahead->tspare = buffer;
+
+	n = 0;
+	rahead->jobs[n++].kind = ZRADECODE;
+	if (rahead->sready == 0 && rahead->eof == 0) {
+		rahead->jobs[n++].kind = ZRAREAD;
+	}
+	if (rahead->csize) {
+		rahead->jobs[n++].kind = ZRACHECKSUM;
+	}
+	for (i = 0; i < n; i++) {
+		rahead->jlist[i] = rahead->jobs + i;
+	}
+
+	if (rahead->taskfn && n > 1) {
+		rahead->taskfn(runrajob, rahead->jlist, n, rahead->payload);
+	}
+	else {
+		for (i = 0; i < n; i++) {
+			runrajob(rahead->jlist[i]);
+		}
+	}
+
+	if (CTB_UNLIKELY(state->result == INFLT_ERROR)) {
+		SETERROR(ZSTRM_EDEFLATE);
+		SETSTATE(4);
+		return 0;
+	}
+
+	n = inflator_tgtend(state->infltr);
+	state->target = state->tbgn;
+	state->tend   = state->tbgn + n;
+
+	rahead->cbuffer = state->tbgn;
+	rahead->csize   = n;
+	return n;
+}
+
+/* computes the checksums of the last chunk */
+static void
+rachecksum(struct TZStrm* state)
+{
+	struct TZStrmRAhead* rahead;
+
+	rahead = state->rahead;
+	if (rahead->csize) {
+		rahead->jobs[0].kind = ZRACHECKSUM;
+		runrajob(rahead->jobs + 0);
+	}
+}
+
+
+/*
+ * Parallel mode */
+
+#define ZPWNDWSZ 32768
+
+/* default and minimum chunk size */
+#define ZPCHUNKSZ 0x20000
+#define ZPMINCHUNKSZ 0x1000
+
+#define ZPMAXTASKS 256
+
+/* */
+struct TZStrmPTask {
+	struct TDeflator* defltr;
+	uintxx level;
+	uintxx flush;
+	uintxx error;
+
+	/* input chunk and the previous data */
+	uint8* source;
+	uintxx ssize;
+	uint8* dict;
+	uintxx dsize;
+
+	/* checksums of the chunk (the crc32 is finalized) */
+	uintxx docrc32;
+	uintxx doadler;
+	uint32 crc32;
+	uint32 adler;
+
+	/* output */
+	uint8* obuffer;
+	uintxx osize;
+	uintxx ototal;
+
+	struct TZStrm* owner;
+};
+
+/* where a segment starts or ends (read mode) */
+#define ZPRINBLOCK   0
+#define ZPRSYNC      1
+#define ZPRMEMBER    2
+#define ZPRTRAILER   3
+#define ZPRSTREAMEND 4
+
+/* */
+struct TZStrmRTask {
+	struct TInflator* infltr;
+	uintxx stype;
+	uintxx start;
+	uintxx final;
+	uintxx error;
+
+	/* the task was run for the current segment */
+	uintxx done;
+
+	/* input segment and the previous data */
+	uint8* source;
+	uintxx ssize;
+	uint8* dict;
+	uintxx dsize;
+
+	/* output */
+	uint8* obuffer;
+	uintxx osize;
+	uintxx ototal;
+
+	/* consumed input and where the segment ends */
+	uintxx used;
+	uintxx end;
+
+	/* checksum and size of the data before the first member end and the
+	 * values of its tail, checksum and size of the data after the last
+	 * member end (the crc32 values are finalized) */
+	uintxx nends;
+	uint32 hcheck;
+	uintxx htotal;
+	uint32 hexpected;
+	uint32 hisize;
+	uint32 lcheck;
+	uintxx ltotal;
+
+	struct TZStrm* owner;
+};
+
+struct TZStrmPMode {
+	uintxx ntasks;
+	uintxx chunksz;
+
+	/* task runner */
+	TZStrmTaskFn taskfn;
+	void* payload;
+
+	/* window tail (the last ZPWNDWSZ bytes of previous input) followed by
+	 * the input chunks */
+	uint8* buffer;
+	uint8* chunks;
+	uintxx tail;
+
+	struct TZStrmPTask* tasks;
+	void** tlist;
+
+	/* read mode, in this mode the buffer holds the window (the last
+	 * ZPWNDWSZ bytes of output) followed by the input */
+	struct TZStrmRTask* rtasks;
+	uintxx rcount;
+	uintxx rnext;
+	uintxx ifill;
+	uintxx final;
+	uintxx position;
+	uintxx wcount;
+
+	/* checksum and size of the current member */
+	uint32 mcheck;
+	uintxx mtotal;
+};
+
+
+static void
+releasepmode(TZStrm* state)
+{
+	uintxx i;
+	struct TZStrmPMode* pmode;
+
+	pmode = state->pmode;
+	if (pmode->tasks) {
+		for (i = 0; i < pmode->ntasks; i++) {
+			struct TZStrmPTask* task;
+
+			task = pmode->tasks + i;
+			if (task->defltr && task->defltr != state->defltr) {
+				deflator_destroy(task->defltr);
+			}
+			if (task->obuffer) {
+				_release(state, task->obuffer);
+			}
+		}
+		_release(state, pmode->tasks);
+	}
+	if (pmode->rtasks) {
+		for (i = 0; i < pmode->ntasks; i++) {
+			struct TZStrmRTask* task;
+
+			task = pmode->rtasks + i;
+			if (task->infltr) {
+				inflator_destroy(task->infltr);
+			}
+			if (task->obuffer) {
+				_release(state, task->obuffer);
+			}
+		}
+		_release(state, pmode->rtasks);
+	}
+	if (pmode->tlist) {
+		_release(state, pmode->tlist);
+	}
+	if (pmode->buffer) {
+		_release(state, pmode->buffer);
+	}
+	_release(state, pmode);
+	state->pmode = NULL;
+
+	if (state->smode == ZSTRM_WMODE) {
+		state->source = state->sbgn;
+		state->send   = state->sbgn + state->sbsize;
+	}
+}
+
+static void
+resetpmode(TZStrm* state)
+{
+	struct TZStrmPMode* pmode;
+
+	pmode = state->pmode;
+	pmode->tail = 0;
+
+	if (state->smode == ZSTRM_RMODE) {
+		pmode->rcount = 0;
+		pmode->rnext  = 0;
+		pmode->ifill  = 0;
+		pmode->final  = 0;
+		pmode->position = ZPRMEMBER;
+		pmode->wcount = 0;
+		return;
+	}
+
+	state->source = pmode->chunks;
+	state->send   = pmode->chunks + pmode->ntasks * pmode->chunksz;
+}
+
+void
+zstrm_setparallel(TZStrm* state, uintxx ntasks, uintxx chunksize,
+	TZStrmTaskFn fn, void* payload)
+{
+	uintxx i;
+	struct TZStrmPMode* pmode;
+	CTB_ASSERT(state);
+
+	if (state->state || (state->rahead && ntasks)) {
+		SETSTATE(4);
+		if (state->error == 0) {
+			SETERROR(ZSTRM_EINCORRECTUSE);
+		}
+		return;
+	}
+
+	if (state->pmode) {
+		releasepmode(state);
+	}
+	if (ntasks == 0) {
+		return;
+	}
+
+	if (chunksize == 0) {
+		chunksize = ZPCHUNKSZ;
+	}
+	if (chunksize < ZPMINCHUNKSZ) {
+		chunksize = ZPMINCHUNKSZ;
+	}
+	if (ntasks > ZPMAXTASKS) {
+		ntasks = ZPMAXTASKS;
+	}
+	if (state->smode == ZSTRM_WMODE && state->stype == ZSTRM_BGZF) {
+		/* each chunk is a block */
+		chunksize = ZBGZFBLOCKSZ;
+	}
+
+	pmode = _reserve(state, sizeof(struct TZStrmPMode));
+	if (pmode == NULL) {
+		goto L_ERROR;
+	}
+	state->pmode = pmode;
+
+	pmode->ntasks  = ntasks;
+	pmode->chunksz = chunksize;
+	pmode->taskfn  = fn;
+	pmode->payload = payload;
+	pmode->tlist  = NULL;
+	pmode->tasks  = NULL;
+	pmode->rtasks = NULL;
+
+	pmode->buffer = _reserve(state, ZPWNDWSZ + ntasks * chunksize);
+	if (pmode->buffer == NULL) {
+		goto L_ERROR;
+	}
+	pmode->chunks = pmode->buffer + ZPWNDWSZ;
+
+	pmode->tlist = _reserve(state, ntasks * sizeof(void*));
+	if (pmode->tlist == NULL) {
+		goto L_ERROR;
+	}
+
+	if (state->smode == ZSTRM_RMODE) {
+		pmode->rtasks = _reserve(state, ntasks * sizeof(struct TZStrmRTask));
+		if (pmode->rtasks == NULL) {
+			goto L_ERROR;
+		}
+
+		for (i = 0; i < ntasks; i++) {
+			struct TZStrmRTask* task;
+
+			task = pmode->rtasks + i;
+			task->infltr  = NULL;
+			task->obuffer = NULL;
+			task->osize = 0;
+			task->ototal = 0;
+			task->owner = state;
+			pmode->tlist[i] = task;
+		}
+
+		for (i = 0; i < ntasks; i++) {
+			pmode->rtasks[i].infltr = inflator_create(state->allocator);
+			if (pmode->rtasks[i].infltr == NULL) {
+				goto L_ERROR;
+			}
+		}
+
+		resetpmode(state);
+		return;
+	}
+
+	pmode->tasks = _reserve(state, ntasks * sizeof(struct TZStrmPTask));
+	if (pmode->tasks == NULL) {
+		goto L_ERROR;
+	}
+
+	for (i = 0; i < ntasks; i++) {
+		struct TZStrmPTask* task;
+
+		task = pmode->tasks + i;
+		task->defltr  = NULL;
+		task->obuffer = NULL;
+		task->osize = 0;
+		task->level = state->level;
+		task->owner = state;
+		pmode->tlist[i] = task;
+	}
+
+	/* the first task uses the stream deflator */
+	pmode->tasks[0].defltr = state->defltr;
+	for (i = 1; i < ntasks; i++) {
+		pmode->tasks[i].defltr = deflator_createex(
+			state->level, state->wbits, state->hbits, state->allocator);
+		if (pmode->tasks[i].defltr == NULL) {
+			goto L_ERROR;
+		}
+		if (state->strategy) {
+			deflator_setstrategy(pmode->tasks[i].defltr, state->strategy);
+		}
+	}
+
+	resetpmode(state);
+	return;
+
+L_ERROR:
+	if (state->pmode) {
+		releasepmode(state);
+	}
+	SETERROR(ZSTRM_EOOM);
+	SETSTATE(4);
+}
+
+static void
+setpmodedctn(TZStrm* state, uint8* dict, uintxx size)
+{
+	uint8* buffer;
+	struct TZStrmPMode* pmode;
+
+	pmode = state->pmode;
+	if (size > ZPWNDWSZ) {
+		dict += size - ZPWNDWSZ;
+		size  = ZPWNDWSZ;
+	}
+
+	buffer = pmode->chunks - size;
+	ctb_memcpy(buffer, dict, size);
+	pmode->tail = size;
+}
+
+static void
+runptask(void* payload)
+{
+	uintxx r;
+	struct TZStrmPTask* task;
+	struct TDeflator* defltr;
+
+	task = payload;
+	task->error  = 0;
+	task->ototal = 0;
+
+	defltr = task->defltr;
+	deflator_reset(defltr, task->level);
+	if (defltr->error) {
+		task->error = ZSTRM_EOOM;
+		return;
+	}
+	if (task->dsize > 2) {
+		deflator_setdctnr(defltr, task->dict, task->dsize);
+	}
+	deflator_setsrc(defltr, task->source, task->ssize);
+
+	if (task->docrc32) {
+		task->crc32 = checksum_crc32(
+			CHECKSUM_CRC32INIT, task->source, task->ssize);
+		CHECKSUM_CRC32FINALIZE(task->crc32);
+	}
+	if (task->doadler) {
+		task->adler = checksum_adler32(
+			CHECKSUM_ADLERINIT, task->source, task->ssize);
+	}
+
+	for (;;) {
+		uint8* buffer;
+		uintxx size;
+
+		if (task->ototal == task->osize) {
+			size = task->osize << 1;
+			if (size == 0) {
+				size = task->ssize + (task->ssize >> 3) + 256;
+			}
+
+			buffer = _reserve(task->owner, size);
+			if (buffer == NULL) {
+				task->error = ZSTRM_EOOM;
+				return;
+			}
+			if (task->obuffer) {
+				ctb_memcpy(buffer, task->obuffer, task->ototal);
+				_release(task->owner, task->obuffer);
+			}
+			task->obuffer = buffer;
+			task->osize   = size;
+		}
+
+		size = task->osize - task->ototal;
+		deflator_settgt(defltr, task->obuffer + task->ototal, size);
+		r = deflator_deflate(defltr, task->flush);
+		task->ototal += deflator_tgtend(defltr);
+
+		if (r != DEFLT_TGTEXHSTD) {
+			break;
+		}
+	}
+
+	if (r == DEFLT_ERROR) {
+		task->error = ZSTRM_EDEFLATE;
+	}
+}
+
+static void
+pflush(TZStrm* state, uintxx flush)
+{
+	uintxx total;
+	uintxx i;
+	uintxx n;
+	uint8* source;
+	uint8* target;
+	struct TZStrmPMode* pmode;
+	struct TZStrmPTask* task;
+
+	pmode = state->pmode;
+	total = (uintxx) (state->source - pmode->chunks);
+
+	n = (total + pmode->chunksz - 1) / pmode->chunksz;
+	if (n == 0) {
+		if (flush == DEFLT_NOFLUSH || state->stype == ZSTRM_BGZF) {
+			return;
+		}
+		n = 1;
+	}
+
+	state->total += total;
+
+	for (i = 0; i < n; i++) {
+		uintxx offset;
+
+		task = pmode->tasks + i;
+		offset = i * pmode->chunksz;
+
+		task->source = pmode->chunks + offset;
+		task->ssize  = total - offset;
+		if (task->ssize > pmode->chunksz) {
+			task->ssize = pmode->chunksz;
+		}
+
+		task->dsize = pmode->tail + offset;
+		if (task->dsize > ZPWNDWSZ) {
+			task->dsize = ZPWNDWSZ;
+		}
+		task->dict = task->source - task->dsize;
+
+		task->docrc32 = state->docrc32;
+		task->doadler = state->doadler;
+
+		task->flush = DEFLT_FLUSH;
+		if (flush == DEFLT_END && i + 1 == n) {
+			task->flush = DEFLT_END;
+		}
+
+		if (state->stype == ZSTRM_BGZF) {
+			/* the blocks are independent */
+			task->dsize = 0;
+			task->flush = DEFLT_END;
+		}
+	}
+
+	if (pmode->taskfn && n > 1) {
+		pmode->taskfn(runptask, pmode->tlist, n, pmode->payload);
+	}
+	else {
+		for (i = 0; i < n; i++) {
+			runptask(pmode->tlist[i]);
+		}
+	}
+
+	/* emit the chunks in order */
+	for (i = 0; i < n; i++) {
+		intxx r;
+
+		task = pmode->tasks + i;
+		if (task->error) {
+			SETERROR(task->error);
+			SETSTATE(4);
+			return;
+		}
+
+		/* merge the chunk checksums */
+		if (CTB_LIKELY(state->docrc32)) {
+			CHECKSUM_CRC32FINALIZE(state->crc32);
+			state->crc32 = checksum_crc32combine(
+				state->crc32, task->crc32, task->ssize);
+			CHECKSUM_CRC32FINALIZE(state->crc32);
+		}
+		if (CTB_LIKELY(state->doadler)) {
+			state->adler = checksum_adler32combine(
+				state->adler, task->adler, task->ssize);
+		}
+
+		if (state->stype == ZSTRM_BGZF) {
+			uint8* cdata;
+
+			cdata = task->obuffer;
+			if (task->ototal > task->ssize + ZBGZFSTRDSZ) {
+				cdata = NULL;
+			}
+			emitbgzfblock(state, cdata, task->ototal, task->source,
+				task->ssize, task->crc32);
+			if (state->error) {
+				return;
+			}
+			continue;
+		}
+
+		if (task->ototal == 0) {
+			continue;
+		}
+		r = callio(state, task->obuffer, task->ototal);
+		if ((uintxx) r != task->ototal) {
+			SETERROR(ZSTRM_EIOERROR);
+			SETSTATE(4);
+			return;
+		}
+	}
+
+	/* keep the last ZPWNDWSZ bytes for the next chunks */
+	n = pmode->tail + total;
+	if (n > ZPWNDWSZ) {
+		n = ZPWNDWSZ;
+	}
+	source = pmode->chunks + total - n;
+	target = pmode->chunks - n;
+	if (source != target) {
+		for (i = 0; i < n; i++) {
+			target[i] = source[i];
+		}
+	}
+	pmode->tail = n;
+
+	state->source = pmode->chunks;
+}
+
+
+/* parses a gzip or zlib header, returns its size or zero if the header is
+ * incomplete or invalid */
+static uintxx
+parseheadmem(struct TZStrmRTask* task, const uint8* source, uintxx size)
+{
+	uintxx n;
+	uintxx flags;
+
+	if (task->stype == ZSTRM_ZLIB) {
+		if (size < 2) {
+			return 0;
+		}
+		if ((source[0] & 0x0f) != 0x08 || (source[0] >> 4) > 7) {
+			task->error = ZSTRM_EBADDATA;
+			return 0;
+		}
+		if (source[1] & 0x20) {
+			task->error = ZSTRM_EMISSINGDICT;
+			return 0;
+		}
+		return 2;
+	}
+
+	if (size < 10) {
+		return 0;
+	}
+	if (source[0] != 0x1f || source[1] != 0x8b || source[2] != 0x08) {
+		task->error = ZSTRM_EBADDATA;
+		return 0;
+	}
+	flags = source[3];
+
+	n = 10;
+	if (flags & 0x04) {
+		if (n + 2 > size) {
+			return 0;
+		}
+		n += 2 + (source[n] | (source[n + 1] << 0x08));
+	}
+
+	/* name, comment */
+	if (flags & 0x08) {
+		for (; n < size && source[n]; n++);
+		n++;
+	}
+	if (flags & 0x10) {
+		for (; n < size && source[n]; n++);
+		n++;
+	}
+
+	/* header crc16 */
+	if (flags & 0x02) {
+		n += 2;
+	}
+
+	if (n > size) {
+		return 0;
+	}
+	return n;
+}
+
+CTB_INLINE uint32
+initcheck(uintxx stype)
+{
+	if (stype == ZSTRM_GZIP) {
+		return CHECKSUM_CRC32INIT;
+	}
+	return CHECKSUM_ADLERINIT;
+}
+
+CTB_INLINE uint32
+updatecheck(uintxx stype, uint32 check, const uint8* data, uintxx size)
+{
+	switch (stype) {
+		case ZSTRM_GZIP: return checksum_crc32(check, data, size);
+		case ZSTRM_ZLIB: return checksum_adler32(check, data, size);
+	}
+	return check;
+}
+
+CTB_INLINE uint32
+endcheck(uintxx stype, uint32 check)
+{
+	if (stype == ZSTRM_GZIP) {
+		CHECKSUM_CRC32FINALIZE(check);
+	}
+	return check;
+}
+
+#define TOI32(A, B, C, D)  ((A) | (B << 0x08) | (C << 0x10) | (D << 0x18))
+
+static void
+rundtask(void* payload)
+{
+	uintxx r;
+	uintxx n;
+	uintxx total;
+	uint32 check;
+	uint8* source;
+	uint8* send;
+	struct TZStrmRTask* task;
+	struct TInflator* infltr;
+
+	task = payload;
+	task->error  = 0;
+	task->ototal = 0;
+	task->nends  = 0;
+	task->done   = 1;
+
+	infltr = task->infltr;
+	source = task->source;
+	send   = task->source + task->ssize;
+
+	check = initcheck(task->stype);
+	total = 0;
+	switch (task->start) {
+		case ZPRINBLOCK:
+			goto L_INFLATE;
+		case ZPRSYNC:
+			inflator_reset(infltr);
+			if (task->dsize) {
+				inflator_setdctnr(infltr, task->dict, task->dsize);
+			}
+			goto L_INFLATE;
+		case ZPRTRAILER:
+			goto L_TRAILER;
+		case ZPRSTREAMEND:
+			task->end = ZPRSTREAMEND;
+			goto L_DONE;
+	}
+
+L_HEADER:
+	task->end = ZPRMEMBER;
+	if (source == send) {
+		goto L_DONE;
+	}
+	if (task->stype ^ ZSTRM_DFLT) {
+		n = parseheadmem(task, source, (uintxx) (send - source));
+		if (n == 0) {
+			if (task->final && task->error == 0) {
+				task->error = ZSTRM_EBADDATA;
+			}
+			goto L_DONE;
+		}
+		source += n;
+	}
+	inflator_reset(infltr);
+
+L_INFLATE:
+	inflator_setsrc(infltr, source, (uintxx) (send - source));
+	for (;;) {
+		if (task->ototal == task->osize) {
+			uint8* buffer;
+			uintxx size;
+
+			size = task->osize << 1;
+			if (size == 0) {
+				size = (task->ssize << 2) + 0x1000;
+			}
+
+			buffer = _reserve(task->owner, size);
+			if (buffer == NULL) {
+				task->error = ZSTRM_EOOM;
+				goto L_DONE;
+			}
+			if (task->obuffer) {
+				ctb_memcpy(buffer, task->obuffer, task->ototal);
+				_release(task->owner, task->obuffer);
+			}
+			task->obuffer = buffer;
+			task->osize   = size;
+		}
+
+		n = task->osize - task->ototal;
+		inflator_settgt(infltr, task->obuffer + task->ototal, n);
+		r = inflator_inflate(infltr, 0);
+
+		n = inflator_tgtend(infltr);
+		check = updatecheck(task->stype, check, task->obuffer + task->ototal, n);
+		total += n;
+		task->ototal += n;
+		if (r != INFLT_TGTEXHSTD) {
+			break;
+		}
+	}
+
+	if (r == INFLT_ERROR) {
+		task->error = ZSTRM_EDEFLATE;
+		goto L_DONE;
+	}
+	if (r == INFLT_SRCEXHSTD) {
+		source = send;
+
+		task->end = ZPRINBLOCK;
+		if (inflator_atblockend(infltr)) {
+			task->end = ZPRSYNC;
+		}
+		if (task->final) {
+			task->error = ZSTRM_EBADDATA;
+		}
+		goto L_DONE;
+	}
+	source += inflator_srcend(infltr);
+
+L_TRAILER:
+	task->end = ZPRTRAILER;
+	n = 0;
+	switch (task->stype) {
+		case ZSTRM_GZIP: n = 8; break;
+		case ZSTRM_ZLIB: n = 4; break;
+	}
+	if ((uintxx) (send - source) < n) {
+		if (task->final) {
+			task->error = ZSTRM_EBADDATA;
+		}
+		goto L_DONE;
+	}
+
+	check = endcheck(task->stype, check);
+	if (task->stype ^ ZSTRM_DFLT) {
+		uint32 expected;
+		uint32 isize;
+
+		if (task->stype == ZSTRM_GZIP) {
+			expected = TOI32(source[0], source[1], source[2], source[3]);
+			isize    = TOI32(source[4], source[5], source[6], source[7]);
+		}
+		else {
+			expected = TOI32(source[3], source[2], source[1], source[0]);
+			isize    = (uint32) total;
+		}
+		source += n;
+
+		if (task->nends == 0) {
+			/* the member started in a previous segment */
+			task->hcheck = check;
+			task->htotal = total;
+			task->hexpected = expected;
+			task->hisize = isize;
+		}
+		else {
+			if (check != expected || isize != (uint32) total) {
+				task->error = ZSTRM_ECHECKSUM;
+				goto L_DONE;
+			}
+		}
+		task->nends++;
+	}
+	check = initcheck(task->stype);
+	total = 0;
+
+	if (task->stype == ZSTRM_GZIP) {
+		goto L_HEADER;
+	}
+	task->end = ZPRSTREAMEND;
+
+L_DONE:
+	task->lcheck = endcheck(task->stype, check);
+	task->ltotal = total;
+	task->used = (uintxx) (source - task->source);
+}
+
+#undef TOI32
+
+/* finds the next position where a segment can start */
+static uint8*
+findboundary(uintxx stype, uint8* begin, uint8* end, uintxx* kind)
+{
+	uint8* p;
+
+	for (p = begin; p + 4 < end; p++) {
+		if (p[0] == 0x00) {
+			/* empty stored block (sync flush) */
+			if (p[1] == 0x00 && p[2] == 0xff && p[3] == 0xff) {
+				kind[0] = ZPRSYNC;
+				return p + 4;
+			}
+			continue;
+		}
+
+		if (p[0] == 0x1f && stype == ZSTRM_GZIP) {
+			/* gzip member */
+			if (p[1] == 0x8b && p[2] == 0x08) {
+				kind[0] = ZPRMEMBER;
+				return p;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void
+pupdatewindow(struct TZStrmPMode* pmode, const uint8* data, uintxx size)
+{
+	uintxx i;
+	uintxx n;
+	uint8* window;
+
+	window = pmode->buffer;
+	if (size >= ZPWNDWSZ) {
+		ctb_memcpy(window, data + size - ZPWNDWSZ, ZPWNDWSZ);
+		pmode->wcount = ZPWNDWSZ;
+		return;
+	}
+
+	n = pmode->wcount + size;
+	if (n > ZPWNDWSZ) {
+		n = n - ZPWNDWSZ;
+		for (i = 0; i + n < pmode->wcount; i++) {
+			window[i] = window[i + n];
+		}
+		pmode->wcount -= n;
+	}
+	ctb_memcpy(window + pmode->wcount, data, size);
+	pmode->wcount += size;
+}
+
+/* the window is limited to the data of the current member */
+CTB_INLINE void
+psetdict(struct TZStrmPMode* pmode, struct TZStrmRTask* task)
+{
+	task->dsize = pmode->wcount;
+	if (task->dsize > pmode->mtotal) {
+		task->dsize = pmode->mtotal;
+	}
+	task->dict = pmode->buffer + pmode->wcount - task->dsize;
+}
+
+/* merges the checksums of a decoded segment */
+static void
+pmergecheck(TZStrm* state, struct TZStrmRTask* task)
+{
+	uint32 check;
+	uintxx stype;
+	struct TZStrmPMode* pmode;
+
+	pmode = state->pmode;
+	stype = state->stype;
+	if (task->nends) {
+		check = task->hcheck;
+		if (stype == ZSTRM_GZIP) {
+			check = checksum_crc32combine(pmode->mcheck, check, task->htotal);
+			if (task->hisize != (uint32) (pmode->mtotal + task->htotal)) {
+				SETERROR(ZSTRM_EBADDATA);
+			}
+		}
+		else {
+			check = checksum_adler32combine(pmode->mcheck, check, task->htotal);
+		}
+
+		if (check != task->hexpected && state->error == 0) {
+			SETERROR(ZSTRM_ECHECKSUM);
+		}
+		pmode->mcheck = task->lcheck;
+		pmode->mtotal = task->ltotal;
+		return;
+	}
+
+	switch (stype) {
+		case ZSTRM_GZIP:
+			pmode->mcheck = checksum_crc32combine(
+				pmode->mcheck, task->lcheck, task->ltotal);
+			break;
+		case ZSTRM_ZLIB:
+			pmode->mcheck = checksum_adler32combine(
+				pmode->mcheck, task->lcheck, task->ltotal);
+			break;
+	}
+	pmode->mtotal += task->ltotal;
+}
+
+/* reads the input, splits it in segments and decodes them */
+static void
+pround(TZStrm* state)
+{
+	uintxx i;
+	uintxx n;
+	uintxx kind;
+	uintxx capacity;
+	uint8* begin;
+	uint8* end;
+	uint8* carry;
+	struct TZStrmPMode* pmode;
+	struct TZStrmRTask* task;
+
+	pmode = state->pmode;
+	capacity = pmode->ntasks * pmode->chunksz;
+	while (pmode->final == 0 && pmode->ifill < capacity) {
+		intxx r;
+
+		n = capacity - pmode->ifill;
+		r = callio(state, pmode->chunks + pmode->ifill, n);
+		if (r == 0) {
+			pmode->final = 1;
+			break;
+		}
+		if ((uintxx) r > n) {
+			SETERROR(ZSTRM_EIOERROR);
+			return;
+		}
+		pmode->ifill += r;
+	}
+	begin = pmode->chunks;
+	end   = pmode->chunks + pmode->ifill;
+
+	if (state->stype == 0) {
+		uintxx type;
+
+		if (begin == end) {
+			SETERROR(ZSTRM_EBADDATA);
+			return;
+		}
+
+		/* stream type */
+		type = ZSTRM_DFLT;
+		if (begin[0] == 0x1f) {
+			type = ZSTRM_GZIP;
+		}
+		else {
+			if ((begin[0] & 0x0f) == 0x08) {
+				type = ZSTRM_ZLIB;
+			}
+		}
+		if ((state->mtype & type) == 0) {
+			SETERROR(ZSTRM_EFORMAT);
+			return;
+		}
+		state->stype = type;
+
+		pmode->mcheck = endcheck(type, initcheck(type));
+		pmode->mtotal = 0;
+	}
+
+	/* split the input */
+	kind = pmode->position;
+	for (n = 0; n + 1 < pmode->ntasks; n++) {
+		uintxx next;
+		uint8* p;
+
+		p = findboundary(state->stype, begin + pmode->chunksz, end, &next);
+		if (p == NULL) {
+			break;
+		}
+
+		task = pmode->rtasks + n;
+		task->source = begin;
+		task->ssize  = (uintxx) (p - begin);
+		task->start  = kind;
+		begin = p;
+		kind  = next;
+	}
+	if (pmode->final || n == 0) {
+		task = pmode->rtasks + n++;
+		task->source = begin;
+		task->ssize  = (uintxx) (end - begin);
+		task->start  = kind;
+		begin = end;
+	}
+
+	for (i = 0; i < n; i++) {
+		task = pmode->rtasks + i;
+		task->stype = state->stype;
+		task->final = pmode->final && i + 1 == n;
+		task->done  = 0;
+		task->dict  = NULL;
+		task->dsize = 0;
+	}
+
+	/* the segments are decoded without the previous data, the first one can
+	 * use the window */
+	if (pmode->taskfn && n > 1) {
+		task = pmode->rtasks;
+		i = 0;
+		if (pmode->position != ZPRSYNC && pmode->position != ZPRMEMBER) {
+			i = 1;
+		}
+		if (pmode->position == ZPRSYNC) {
+			psetdict(pmode, task);
+		}
+		pmode->taskfn(rundtask, pmode->tlist + i, n - i, pmode->payload);
+	}
+
+	/* check the segments in order, the ones that can't be used are decoded
+	 * again using the stream inflator */
+	carry = begin;
+	for (i = 0; i < n; i++) {
+		struct TInflator* infltr;
+
+		task = pmode->rtasks + i;
+		if (pmode->position == ZPRSTREAMEND) {
+			/* ignore the data after the end of the stream */
+			n = i;
+			carry = end;
+			break;
+		}
+
+		if (task->done == 0 || task->error || task->start != pmode->position) {
+			task->start = pmode->position;
+			task->dict  = NULL;
+			task->dsize = 0;
+			if (task->start == ZPRSYNC) {
+				psetdict(pmode, task);
+			}
+
+			infltr = task->infltr;
+			task->infltr = state->infltr;
+			rundtask(task);
+			task->infltr = infltr;
+			if (task->error) {
+				SETERROR(task->error);
+				return;
+			}
+		}
+		else {
+			/* the inflator of the task keeps the state of the stream */
+			infltr = task->infltr;
+			task->infltr  = state->infltr;
+			state->infltr = infltr;
+		}
+
+		pmergecheck(state, task);
+		if (state->error) {
+			return;
+		}
+		pupdatewindow(pmode, task->obuffer, task->ototal);
+		pmode->position = task->end;
+
+		if (task->used < task->ssize) {
+			if (i + 1 == n) {
+				carry = task->source + task->used;
+				break;
+			}
+
+			/* the rest of the segment goes to the next one */
+			task[1].source = task->source + task->used;
+			task[1].ssize += task->ssize - task->used;
+			task[1].done = 0;
+		}
+	}
+	pmode->rcount = n;
+	pmode->rnext  = 0;
+
+	/* keep the remaining input for the next round */
+	if (carry == pmode->chunks && pmode->final == 0) {
+		/* the buffer is too small */
+		SETERROR(ZSTRM_EBADDATA);
+		return;
+	}
+	pmode->ifill = (uintxx) (end - carry);
+	for (i = 0; i < pmode->ifill; i++) {
+		pmode->chunks[i] = carry[i];
+	}
+
+	if (pmode->final) {
+		if (pmode->position != ZPRSTREAMEND) {
+			if (pmode->position != ZPRMEMBER || pmode->ifill) {
+				SETERROR(ZSTRM_EBADDATA);
+			}
+		}
+	}
+}
+
+static uintxx
+pinflatenext(struct TZStrm* state)
+{
+	struct TZStrmPMode* pmode;
+	struct TZStrmRTask* task;
+
+	pmode = state->pmode;
+	for (;;) {
+		while (pmode->rnext < pmode->rcount) {
+			task = pmode->rtasks + pmode->rnext++;
+			if (task->ototal) {
+				state->target = task->obuffer;
+				state->tend   = task->obuffer + task->ototal;
+				state->total += task->ototal;
+				return task->ototal;
+			}
+		}
+
+		if (state->error || (pmode->final && pmode->ifill == 0)) {
+			SETSTATE(4);
+			return 0;
+		}
+		pround(state);
+		if (state->error) {
+			SETSTATE(4);
+			pmode->rcount = 0;
+			return 0;
+		}
+	}
+}
@@ -0,0 +1,781 @@
+/*
+ * Copyright (C) 2023, jpn
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * benchmark.c
+ * Measures the speed (MB/s of uncompressed data) and the ratio of the
+ * deflator, the inflator, the zstrm streams and the checksums.
+ *
+ * Usage:
+ * jdeflate-bench [-m mode] [-l first-last] [-b buffer size] [-r runs] files
+ *
+ * The mode is deflate, inflate, zstrm, checksum or all (the default). Without
+ * files it uses three generated corpora (text logs, JSON and binary records).
+ * Each result is printed as a tab separated line:
+ * mode corpus level buffersize insize outsize ratio mbps
+ * */
+
+#include <jdeflate/deflator.h>
+#include <jdeflate/inflator.h>
+#include <jdeflate/zstrm.h>
+#include <jdeflate/checksum.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/* size of each generated corpus */
+#define GENERATEDSZ 0x400000
+
+struct TCorpus {
+	const char* name;
+	uint8* data;
+	uintxx size;
+};
+
+struct TBenchmark {
+	/* modes (bit mask) */
+	uintxx modes;
+
+	/* level range */
+	uintxx lfirst;
+	uintxx llast;
+
+	/* size of the chunks passed to the streams */
+	uintxx bsize;
+
+	/* repetitions of each measurement (the best one is taken) */
+	uintxx runs;
+
+	/* deflator strategy (eDEFLTStrategy) */
+	uintxx strategy;
+
+	/* scratch buffers */
+	uint8* compressed;
+	uint8* decompressed;
+	uintxx csize;
+};
+
+#define MODEDEFLATE  0x01
+#define MODEINFLATE  0x02
+#define MODEZSTRM    0x04
+#define MODECHECKSUM 0x08
+
+
+static double
+getseconds(void)
+{
+	return (double) clock() / CLOCKS_PER_SEC;
+}
+
+static void
+report(const char* mode, const char* name, uintxx level, uintxx bsize,
+	uintxx isize, uintxx osize, double seconds)
+{
+	double ratio;
+	double mbps;
+
+	ratio = 0;
+	if (isize) {
+		ratio = (double) osize / (double) isize;
+	}
+	mbps = 0;
+	if (seconds > 0) {
+		mbps = ((double) isize / (1024.0 * 1024.0)) / seconds;
+	}
+	printf("%s\t%s\t%u\t%u\t%u\t%u\t%.4f\t%.2f\n", mode, name,
+		(unsigned) level, (unsigned) bsize, (unsigned) isize, (unsigned) osize,
+		ratio, mbps);
+	fflush(stdout);
+}
+
+
+/* ****************************************************************************
+ * Corpora
+ *************************************************************************** */
+
+static uint32
+nextrandom(uint32* seed)
+{
+	seed[0] = seed[0] * 1103515245 + 12345;
+	return seed[0] >> 16;
+}
+
+static uintxx
+appendtext(uint8* buffer, uintxx size, uintxx i, const char* text)
+{
+	for (; *text && i < size; text++) {
+		buffer[i++] = (uint8) *text;
+	}
+	return i;
+}
+
+static void
+generatelogs(uint8* buffer, uintxx size)
+{
+	uintxx i;
+	uint32 seed;
+	char line[256];
+	const char* levels[] = {
+		"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"
+	};
+	const char* messages[] = {
+		"request completed", "connection opened", "connection closed",
+		"cache miss", "retrying operation", "timeout waiting for reply"
+	};
+
+	seed = 1;
+	for (i = 0; i < size;) {
+		uint32 r;
+
+		r = nextrandom(&seed);
+		sprintf(line,
+			"2023-%02u-%02u %02u:%02u:%02u.%03u [%s] worker-%u: %s id=%u "
+			"elapsed=%ums\n",
+			(unsigned) (1 + r % 12), (unsigned) (1 + r % 28),
+			(unsigned) (r % 24), (unsigned) (nextrandom(&seed) % 60),
+			(unsigned) (nextrandom(&seed) % 60),
+			(unsigned) (nextrandom(&seed) % 1000), levels[r % 6],
+			(unsigned) (r % 16), messages[nextrandom(&seed) % 6],
+			(unsigned) nextrandom(&seed), (unsigned) (nextrandom(&seed) % 5000));
+		i = appendtext(buffer, size, i, line);
+	}
+}
+
+static void
+generatejson(uint8* buffer, uintxx size)
+{
+	uintxx i;
+	uint32 seed;
+	char line[256];
+	const char* names[] = {
+		"alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi"
+	};
+
+	seed = 2;
+	i = appendtext(buffer, size, 0, "[\n");
+	while (i < size) {
+		uint32 r;
+
+		r = nextrandom(&seed);
+		sprintf(line,
+			"{\"id\": %u, \"name\": \"%s\", \"active\": %s, \"score\": %u.%02u, "
+			"\"tags\": [\"t%u\", \"t%u\"]},\n",
+			(unsigned) nextrandom(&seed), names[r % 8],
+			(r & 0x100) ? "true" : "false", (unsigned) (r % 100),
+			(unsigned) (nextrandom(&seed) % 100),
+			(unsigned) (r % 32), (unsigned) (nextrandom(&seed) % 32));
+		i = appendtext(buffer, size, i, line);
+	}
+}
+
+/* fixed size records with small counters and random fields */
+static void
+generaterecords(uint8* buffer, uintxx size)
+{
+	uintxx i;
+	uint32 seed;
+	uint32 counter;
+
+	seed = 3;
+	counter = 0;
+	for (i = 0; i + 16 <= size; i += 16) {
+		uint32 r;
+
+		r = nextrandom(&seed);
+		counter += r & 0x0f;
+		buffer[i +  0] = (uint8) (counter >> 0x00);
+		buffer[i +  1] = (uint8) (counter >> 0x08);
+		buffer[i +  2] = (uint8) (counter >> 0x10);
+		buffer[i +  3] = (uint8) (counter >> 0x18);
+		buffer[i +  4] = (uint8) (r & 0x03);
+		buffer[i +  5] = 0;
+		buffer[i +  6] = 0;
+		buffer[i +  7] = 0xff;
+		buffer[i +  8] = (uint8) nextrandom(&seed);
+		buffer[i +  9] = (uint8) nextrandom(&seed);
+		buffer[i + 10] = (uint8) (r >> 4);
+		buffer[i + 11] = (uint8) (r >> 12);
+		buffer[i + 12] = 0;
+		buffer[i + 13] = 0;
+		buffer[i + 14] = 0;
+		buffer[i + 15] = 0;
+	}
+	for (; i < size; i++) {
+		buffer[i] = 0;
+	}
+}
+
+static bool
+loadfile(struct TCorpus* corpus, const char* path)
+{
+	FILE* handler;
+	long size;
+
+	handler = fopen(path, "rb");
+	if (handler == NULL) {
+		return 0;
+	}
+
+	corpus->data = NULL;
+	if (fseek(handler, 0, SEEK_END) == 0 && (size = ftell(handler)) >= 0) {
+		rewind(handler);
+
+		corpus->data = malloc((size_t) size + 1);
+		corpus->size = (uintxx) size;
+		if (corpus->data) {
+			if (fread(corpus->data, 1, (size_t) size, handler) != (size_t) size) {
+				free(corpus->data);
+				corpus->data = NULL;
+			}
+		}
+	}
+	fclose(handler);
+
+	corpus->name = path;
+	return corpus->data != NULL;
+}
+
+
+/* ****************************************************************************
+ * Benchmarks
+ *************************************************************************** */
+
+/* compresses the corpus passing it in chunks of bsize bytes */
+static uintxx
+deflatechunks(TDeflator* deflator, struct TBenchmark* bench,
+	struct TCorpus* corpus)
+{
+	uintxx n;
+	uintxx total;
+	uint8* source;
+	uint8* send;
+	eDEFLTResult r;
+
+	source = corpus->data;
+	send = source + corpus->size;
+	deflator_settgt(deflator, bench->compressed, bench->csize);
+	do {
+		n = (uintxx) (send - source);
+		if (n > bench->bsize) {
+			n = bench->bsize;
+		}
+		deflator_setsrc(deflator, source, n);
+		source += n;
+
+		if (source == send) {
+			r = deflator_deflate(deflator, DEFLT_END);
+		}
+		else {
+			r = deflator_deflate(deflator, DEFLT_NOFLUSH);
+		}
+	} while (r == DEFLT_SRCEXHSTD);
+
+	total = 0;
+	if (r == DEFLT_OK) {
+		total = deflator_tgtend(deflator);
+	}
+	return total;
+}
+
+/* decompresses the stream writing chunks of bsize bytes */
+static uintxx
+inflatechunks(TInflator* inflator, struct TBenchmark* bench, uintxx size,
+	uintxx expected)
+{
+	uintxx total;
+	eINFLTResult r;
+
+	inflator_setsrc(inflator, bench->compressed, size);
+	total = 0;
+	do {
+		uintxx n;
+
+		n = expected - total;
+		if (n > bench->bsize) {
+			n = bench->bsize;
+		}
+		inflator_settgt(inflator, bench->decompressed + total, n);
+
+		r = inflator_inflate(inflator, 1);
+		total += inflator_tgtend(inflator);
+	} while (r == INFLT_TGTEXHSTD && total < expected);
+
+	if (r != INFLT_OK) {
+		return 0;
+	}
+	return total;
+}
+
+static bool
+rundeflate(struct TBenchmark* bench, struct TCorpus* corpus, uintxx level,
+	uintxx* csize)
+{
+	uintxx i;
+	uintxx size;
+	double best;
+	double t;
+	TDeflator* deflator;
+
+	deflator = deflator_create(level, NULL);
+	if (deflator == NULL) {
+		return 0;
+	}
+	deflator_setstrategy(deflator, bench->strategy);
+
+	size = 0;
+	best = 0;
+	for (i = 0; i < bench->runs; i++) {
+		deflator_reset(deflator, level);
+
+		t = getseconds();
+		size = deflatechunks(deflator, bench, corpus);
+		t = getseconds() - t;
+		if (size == 0) {
+			deflator_destroy(deflator);
+			return 0;
+		}
+		if (i == 0 || t < best)
+			best = t;
+	}
+	deflator_destroy(deflator);
+
+	if (bench->modes & MODEDEFLATE) {
+		report("deflate", corpus->name, level, bench->bsize, corpus->size,
+			size, best);
+	}
+	csize[0] = size;
+	return 1;
+}
+
+static bool
+runinflate(struct TBenchmark* bench, struct TCorpus* corpus, uintxx level,
+	uintxx csize)
+{
+	uintxx i;
+	uintxx size;
+	double best;
+	double t;
+	TInflator* inflator;
+
+	inflator = inflator_create(NULL);
+	if (inflator == NULL) {
+		return 0;
+	}
+
+	size = 0;
+	best = 0;
+	for (i = 0; i < bench->runs; i++) {
+		inflator_reset(inflator);
+
+		t = getseconds();
+		size = inflatechunks(inflator, bench, csize, corpus->size);
+		t = getseconds() - t;
+		if (size != corpus->size) {
+			inflator_destroy(inflator);
+			return 0;
+		}
+		if (memcmp(bench->decompressed, corpus->data, size)) {
+			inflator_destroy(inflator);
+			return 0;
+		}
+		if (i == 0 || t < best)
+			best = t;
+	}
+	inflator_destroy(inflator);
+
+	report("inflate", corpus->name, level, bench->bsize, corpus->size, csize,
+		best);
+	return 1;
+}
+
+
+/* memory stream for the zstrm io functions */
+struct TMemStream {
+	uint8* buffer;
+	uintxx size;
+	uintxx offset;
+};
+
+static intxx
+rmemory(uint8* buffer, uintxx size, void* payload)
+{
+	struct TMemStream* stream;
+
+	stream = payload;
+	if (size > stream->size - stream->offset) {
+		size = stream->size - stream->offset;
+	}
+	memcpy(buffer, stream->buffer + stream->offset, size);
+	stream->offset += size;
+	return (intxx) size;
+}
+
+static intxx
+wmemory(uint8* buffer, uintxx size, void* payload)
+{
+	struct TMemStream* stream;
+
+	stream = payload;
+	if (size > stream->size - stream->offset) {
+		return -1;
+	}
+	memcpy(stream->buffer + stream->offset, buffer, size);
+	stream->offset += size;
+	return (intxx) size;
+}
+
+static bool
+runzstrm(struct TBenchmark* bench, struct TCorpus* corpus, uintxx level)
+{
+	uintxx i;
+	uintxx j;
+	uintxx n;
+	double wbest;
+	double rbest;
+	double t;
+	TZStrm* z;
+	struct TZStrmOptions options;
+	struct TMemStream stream;
+
+	stream.buffer = bench->compressed;
+	stream.size = bench->csize;
+
+	wbest = rbest = 0;
+	for (i = 0; i < bench->runs; i++) {
+		/* write (gzip) */
+		options = (struct TZStrmOptions) {0};
+		options.strategy = bench->strategy;
+
+		z = zstrm_createex(ZSTRM_WMODE | ZSTRM_GZIP, level, &options, NULL);
+		if (z == NULL) {
+			return 0;
+		}
+		stream.offset = 0;
+		zstrm_setiofn(z, wmemory, &stream);
+
+		t = getseconds();
+		for (j = 0; j < corpus->size; j += n) {
+			n = corpus->size - j;
+			if (n > bench->bsize) {
+				n = bench->bsize;
+			}
+			zstrm_w(z, corpus->data + j, n);
+		}
+		zstrm_flush(z, 1);
+		t = getseconds() - t;
+		if (z->error) {
+			zstrm_destroy(z);
+			return 0;
+		}
+		zstrm_destroy(z);
+		if (i == 0 || t < wbest)
+			wbest = t;
+
+		/* read */
+		z = zstrm_create(ZSTRM_RMODE | ZSTRM_AUTO, 0, NULL);
+		if (z == NULL) {
+			return 0;
+		}
+		stream.size = stream.offset;
+		stream.offset = 0;
+		zstrm_setiofn(z, rmemory, &stream);
+
+		t = getseconds();
+		for (j = 0; j < corpus->size; j += n) {
+			n = corpus->size - j;
+			if (n > bench->bsize) {
+				n = bench->bsize;
+			}
+			n = zstrm_r(z, bench->decompressed + j, n);
+			if (n == 0) {
+				break;
+			}
+		}
+		t = getseconds() - t;
+		if (z->error || j != corpus->size) {
+			zstrm_destroy(z);
+			return 0;
+		}
+		zstrm_destroy(z);
+		if (memcmp(bench->decompressed, corpus->data, j)) {
+			return 0;
+		}
+		if (i == 0 || t < rbest)
+			rbest = t;
+		stream.size = bench->csize;
+	}
+
+	report("zstrm_w", corpus->name, level, bench->bsize, corpus->size,
+		stream.offset, wbest);
+	report("zstrm_r", corpus->name, level, bench->bsize, corpus->size,
+		stream.offset, rbest);
+	return 1;
+}
+
+static void
+runchecksums(struct TBenchmark* bench, struct TCorpus* corpus)
+{
+	uintxx i;
+	uintxx j;
+	uintxx n;
+	double best1;
+	double best2;
+	double t;
+	uint32 crc;
+	uint32 adler;
+	volatile uint32 sink;
+
+	best1 = best2 = 0;
+	for (i = 0; i < bench->runs; i++) {
+		t = getseconds();
+		crc = 0;
+		for (j = 0; j < corpus->size; j += n) {
+			n = corpus->size - j;
+			if (n > bench->bsize) {
+				n = bench->bsize;
+			}
+			crc = checksum_crc32(crc, corpus->data + j, n);
+		}
+		t = getseconds() - t;
+		sink = crc;
+		if (i == 0 || t < best1)
+			best1 = t;
+
+		t = getseconds();
+		adler = 1;
+		for (j = 0; j < corpus->size; j += n) {
+			n = corpus->size - j;
+			if (n > bench->bsize) {
+				n = bench->bsize;
+			}
+			adler = checksum_adler32(adler, corpus->data + j, n);
+		}
+		t = getseconds() - t;
+		sink = adler;
+		if (i == 0 || t < best2)
+			best2 = t;
+	}
+	(void) sink;
+
+	/* the results go to a volatile so the loops are not optimized out, a
+	 * checksum has no output (the size and the ratio are zero) */
+	report("crc32", corpus->name, 0, bench->bsize, corpus->size, 0, best1);
+	report("adler32", corpus->name, 0, bench->bsize, corpus->size, 0, best2);
+}
+
+static bool
+runcorpus(struct TBenchmark* bench, struct TCorpus* corpus)
+{
+	uintxx level;
+	uintxx csize;
+
+	bench->csize = deflator_bound(NULL, corpus->size) + 0x1000;
+	bench->compressed = malloc(bench->csize);
+	bench->decompressed = malloc(corpus->size + 1);
+	if (bench->compressed == NULL || bench->decompressed == NULL) {
+		free(bench->compressed);
+		free(bench->decompressed);
+		return 0;
+	}
+
+	for (level = bench->lfirst; level <= bench->llast; level++) {
+		if (bench->modes & (MODEDEFLATE | MODEINFLATE)) {
+			if (rundeflate(bench, corpus, level, &csize) == 0) {
+				goto L_ERROR;
+			}
+			if (bench->modes & MODEINFLATE) {
+				if (runinflate(bench, corpus, level, csize) == 0) {
+					goto L_ERROR;
+				}
+			}
+		}
+		if (bench->modes & MODEZSTRM) {
+			if (runzstrm(bench, corpus, level) == 0) {
+				goto L_ERROR;
+			}
+		}
+	}
+	if (bench->modes & MODECHECKSUM) {
+		runchecksums(bench, corpus);
+	}
+
+	free(bench->compressed);
+	free(bench->decompressed);
+	return 1;
+
+L_ERROR:
+	fprintf(stderr, "error: %s (level %u)\n", corpus->name, (unsigned) level);
+	free(bench->compressed);
+	free(bench->decompressed);
+	return 0;
+}
+
+
+static bool
+parsemode(const char* mode, uintxx* modes)
+{
+	if (strcmp(mode, "deflate") == 0) {
+		modes[0] = MODEDEFLATE;
+		return 1;
+	}
+	if (strcmp(mode, "inflate") == 0) {
+		modes[0] = MODEINFLATE;
+		return 1;
+	}
+	if (strcmp(mode, "zstrm") == 0) {
+		modes[0] = MODEZSTRM;
+		return 1;
+	}
+	if (strcmp(mode, "checksum") == 0) {
+		modes[0] = MODECHECKSUM;
+		return 1;
+	}
+	if (strcmp(mode, "all") == 0) {
+		modes[0] = MODEDEFLATE | MODEINFLATE | MODEZSTRM | MODECHECKSUM;
+		return 1;
+	}
+	return 0;
+}
+
+static bool
+parsestrategy(const char* strategy, uintxx* result)
+{
+	if (strcmp(strategy, "default") == 0) {
+		result[0] = DEFLT_SDEFAULT;
+		return 1;
+	}
+	if (strcmp(strategy, "huffman") == 0) {
+		result[0] = DEFLT_SHUFFMAN;
+		return 1;
+	}
+	if (strcmp(strategy, "rle") == 0) {
+		result[0] = DEFLT_SRLE;
+		return 1;
+	}
+	if (strcmp(strategy, "fast") == 0) {
+		result[0] = DEFLT_SFAST;
+		return 1;
+	}
+	return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+	int i;
+	int result;
+	unsigned a;
+	unsigned b;
+	struct TBenchmark bench;
+	struct TCorpus corpus;
+
+	bench.modes  = MODEDEFLATE | MODEINFLATE | MODEZSTRM | MODECHECKSUM;
+	bench.lfirst = 0;
+	bench.llast  = 9;
+	bench.bsize  = 0x10000;
+	bench.runs   = 3;
+	bench.strategy = DEFLT_SDEFAULT;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i += 2) {
+		if (i + 1 == argc) {
+			goto L_USAGE;
+		}
+
+		switch (argv[i][1]) {
+			case 'm':
+				if (parsemode(argv[i + 1], &bench.modes) == 0) {
+					goto L_USAGE;
+				}
+				break;
+			case 'l':
+				if (sscanf(argv[i + 1], "%u-%u", &a, &b) != 2) {
+					if (sscanf(argv[i + 1], "%u", &a) != 1) {
+						goto L_USAGE;
+					}
+					b = a;
+				}
+				if (a > b || b > 12) {
+					goto L_USAGE;
+				}
+				bench.lfirst = a;
+				bench.llast  = b;
+				break;
+			case 'b':
+				if (sscanf(argv[i + 1], "%u", &a) != 1 || a == 0) {
+					goto L_USAGE;
+				}
+				bench.bsize = a;
+				break;
+			case 'r':
+				if (sscanf(argv[i + 1], "%u", &a) != 1 || a == 0) {
+					goto L_USAGE;
+				}
+				bench.runs = a;
+				break;
+			case 's':
+				if (parsestrategy(argv[i + 1], &bench.strategy) == 0) {
+					goto L_USAGE;
+				}
+				break;
+			default:
+				goto L_USAGE;
+		}
+	}
+
+	printf("mode\tcorpus\tlevel\tbuffersize\tinsize\toutsize\tratio\tmbps\n");
+	result = 0;
+	if (i == argc) {
+		corpus.size = GENERATEDSZ;
+		corpus.data = malloc(corpus.size);
+		if (corpus.data == NULL) {
+			return 1;
+		}
+
+		corpus.name = "logs";
+		generatelogs(corpus.data, corpus.size);
+		result |= runcorpus(&bench, &corpus) == 0;
+
+		corpus.name = "json";
+		generatejson(corpus.data, corpus.size);
+		result |= runcorpus(&bench, &corpus) == 0;
+
+		corpus.name = "records";
+		generaterecords(corpus.data, corpus.size);
+		result |= runcorpus(&bench, &corpus) == 0;
+		free(corpus.data);
+		return result;
+	}
+
+	for (; i < argc; i++) {
+		if (loadfile(&corpus, argv[i]) == 0) {
+			fprintf(stderr, "error: can't read %s\n", argv[i]);
+			result = 1;
+			continue;
+		}
+		result |= runcorpus(&bench, &corpus) == 0;
+		free(corpus.data);
+	}
+	return result;
+
+L_USAGE:
+	fprintf(stderr,
+		"usage: %s [-m deflate|inflate|zstrm|checksum|all] [-l first-last] "
+		"[-b buffer size] [-r runs] [-s default|huffman|rle|fast] "
+		"[files]\n", argv[0]);
+	return 1;
+}